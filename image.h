@@ -2,7 +2,19 @@
 /* this header file depends loader.h */
 
 enum {
-	MULTIPLER = 1024, /* value for avoid to use float */
+	RESAMPLE_SHIFT   = 22, /* max fixed-point precision of resampling weights */
+	RESAMPLE_PADDING = 16, /* readable bytes after a row for resample_horizontal() */
+	RESAMPLE_ROWS    = 4,  /* rows processed at once by resample_horizontal() */
+	ROTATE_TILE      = 8,  /* pixels transposed in registers at once (rows and columns) */
+	ROTATE_BLOCK     = 64, /* pixels of cache block (rows and columns) for rotation */
+};
+
+/* filter for enlarging image (shrink always uses area average) */
+enum enlarge_t {
+	ENLARGE_NONE = 0, /* shrink only */
+	ENLARGE_NEAREST,  /* integer scale, for pixel art */
+	ENLARGE_BILINEAR,
+	ENLARGE_LANCZOS,  /* lanczos-3 */
 };
 
 /* inline functions:
@@ -14,12 +26,12 @@ static inline int get_frame_count(struct image *img)
 
 static inline uint8_t *get_current_frame(struct image *img)
 {
-	return img->data[img->current_frame];
+	return get_frame(img, img->current_frame);
 }
 
 static inline int get_current_delay(struct image *img)
 {
-	return img->delay[img->current_frame];
+	return (img->delay) ? img->delay[img->current_frame]: 0;
 }
 
 static inline void increment_frame(struct image *img)
@@ -55,60 +67,719 @@ static inline void get_rgb(struct image *img, uint8_t *data, int x, int y, uint8
 	}
 }
 
-static inline void get_average(struct image *img, uint8_t *data, int x_from, int y_from, int x_to, int y_to, uint8_t pixel[])
+/* separable resampling:
+	weight table of one axis, dst pixel i = sum(src[start[i] + k] * weight[i * taps + k]) >> shift */
+struct resample_t {
+	int size;        /* number of dst pixels */
+	int taps;        /* stride of weight (even, unused weights are 0) */
+	int shift;       /* fixed-point precision of weight */
+	int *start;      /* first src pixel of each dst pixel */
+	int *count;      /* number of src pixels of each dst pixel */
+	int16_t *weight;
+};
+
+static inline void free_resample(struct resample_t *rs)
+{
+	free(rs->start);
+	free(rs->count);
+	free(rs->weight);
+	rs->start  = rs->count = NULL;
+	rs->weight = NULL;
+}
+
+/* largest shift that keeps weight (max: num / den) in int16_t with room for rounding error
+	and 255 * (1 << shift) in 32bit accumulator */
+static inline int get_resample_shift(long num, long den)
+{
+	int shift = RESAMPLE_SHIFT;
+
+	while (shift > 1 && ((int64_t) num << shift) > (int64_t) INT16_MAX / 2 * den)
+		shift--;
+	return shift;
+}
+
+/* set weights of dst pixel i (raw weights sum up to total):
+	rounding error is added to the largest weight, so flat areas stay flat */
+static inline void set_resample_weight(struct resample_t *rs, int i, int start, int count, int64_t raw[], int64_t total)
+{
+	int16_t *weight = rs->weight + i * rs->taps;
+	int32_t sum = 0;
+	int max = 0;
+
+	for (int k = 0; k < count; k++) {
+		weight[k] = raw[k] * ((int64_t) 1 << rs->shift) / total;
+		sum += weight[k];
+		if (weight[k] > weight[max])
+			max = k;
+	}
+	weight[max] += (1 << rs->shift) - sum;
+
+	rs->start[i] = start;
+	rs->count[i] = count;
+}
+
+static inline bool alloc_resample(struct resample_t *rs, int dst_size, int taps, int shift)
+{
+	rs->size  = dst_size;
+	rs->taps  = (taps + 1) & ~1;
+	rs->shift = shift;
+
+	rs->start  = (int *) ecalloc(dst_size, sizeof(int));
+	rs->count  = (int *) ecalloc(dst_size, sizeof(int));
+	rs->weight = (int16_t *) ecalloc((size_t) dst_size * rs->taps, sizeof(int16_t));
+
+	if (rs->start == NULL || rs->count == NULL || rs->weight == NULL) {
+		free_resample(rs);
+		return false;
+	}
+	return true;
+}
+
+/* area average (for shrink): dst pixel i covers src [i * src_size / dst_size, (i + 1) * src_size / dst_size)
+	in 1/dst_size src pixel unit, dst pixel covers src_size units and a src pixel has dst_size units */
+bool init_area_resample(struct resample_t *rs, int src_size, int dst_size)
+{
+	int64_t *raw, from, to, left, right;
+	int start, end;
+
+	if (!alloc_resample(rs, dst_size, src_size / dst_size + 2, get_resample_shift(dst_size, src_size)))
+		return false;
+
+	if ((raw = (int64_t *) ecalloc(rs->taps, sizeof(int64_t))) == NULL) {
+		free_resample(rs);
+		return false;
+	}
+
+	for (int i = 0; i < dst_size; i++) {
+		from  = (int64_t) i * src_size;
+		to    = from + src_size;
+		start = from / dst_size;
+		end   = (to + dst_size - 1) / dst_size;
+
+		for (int k = 0; k < end - start; k++) {
+			left   = (int64_t) (start + k) * dst_size;
+			right  = left + dst_size;
+			raw[k] = ((right < to) ? right: to) - ((left > from) ? left: from);
+		}
+		set_resample_weight(rs, i, start, end - start, raw, src_size);
+	}
+	free(raw);
+
+	return true;
+}
+
+/* sin(pi * x) without math.h: reduce x to [-0.5, 0.5] then taylor series */
+static inline double sin_pi(double x)
+{
+	const double pi = 3.14159265358979323846;
+	int n = (x < 0) ? (int) (x - 0.5): (int) (x + 0.5);
+	double r = (x - n) * pi, term = r, sum = r;
+
+	for (int k = 1; k <= 6; k++) {
+		term *= -r * r / ((2 * k) * (2 * k + 1));
+		sum  += term;
+	}
+	return (n & 1) ? -sum: sum;
+}
+
+static inline double bilinear_kernel(double x)
+{
+	x = (x < 0) ? -x: x;
+	return (x < 1.0) ? 1.0 - x: 0.0;
+}
+
+static inline double lanczos_kernel(double x)
+{
+	const double pi = 3.14159265358979323846;
+
+	if (x == 0.0)
+		return 1.0;
+	else if (x <= -3.0 || x >= 3.0)
+		return 0.0;
+	return 3.0 * sin_pi(x) * sin_pi(x / 3.0) / (pi * pi * x * x);
+}
+
+/* convolution (for enlarge): dst pixel i is centered at src (i + 0.5) * src_size / dst_size,
+	the kernel is stretched when shrinking and cut (and normalized) at the edges */
+bool init_filter_resample(struct resample_t *rs, int src_size, int dst_size, enum enlarge_t filter)
+{
+	double (*kernel)(double) = (filter == ENLARGE_LANCZOS) ? lanczos_kernel: bilinear_kernel;
+	double scale, stretch, support, center;
+	int64_t *raw, total;
+	int start, end;
+
+	scale   = (double) src_size / dst_size;
+	stretch = (scale > 1.0) ? scale: 1.0;
+	support = ((filter == ENLARGE_LANCZOS) ? 3.0: 1.0) * stretch;
+
+	/* weight is 1.0 at most (a bit more at the edges) */
+	if (!alloc_resample(rs, dst_size, (int) support * 2 + 3, get_resample_shift(1, 1)))
+		return false;
+
+	if ((raw = (int64_t *) ecalloc(rs->taps, sizeof(int64_t))) == NULL) {
+		free_resample(rs);
+		return false;
+	}
+
+	for (int i = 0; i < dst_size; i++) {
+		center = (i + 0.5) * scale;
+		start  = (int) (center - support + 0.5);
+		end    = (int) (center + support + 0.5);
+		start  = (start < 0) ? 0: start;
+		end    = (end > src_size) ? src_size: end;
+
+		total = 0;
+		for (int k = 0; k < end - start; k++) {
+			raw[k] = kernel((start + k + 0.5 - center) / stretch) * (1 << 24);
+			total += raw[k];
+		}
+
+		if (total > 0) {
+			set_resample_weight(rs, i, start, end - start, raw, total);
+		} else { /* never happens: use the nearest pixel */
+			raw[0] = 1;
+			set_resample_weight(rs, i, (int) center, 1, raw, 1);
+		}
+	}
+	free(raw);
+
+	return true;
+}
+
+/* nearest neighbor (for enlarge by integer scale): dst pixel i is a copy of src pixel i * src_size / dst_size */
+bool init_nearest_resample(struct resample_t *rs, int src_size, int dst_size)
+{
+	int64_t one = 1;
+
+	if (!alloc_resample(rs, dst_size, 1, get_resample_shift(1, 1)))
+		return false;
+
+	for (int i = 0; i < dst_size; i++)
+		set_resample_weight(rs, i, (int64_t) i * src_size / dst_size, 1, &one, 1);
+
+	return true;
+}
+
+/* area average for shrink, filter for enlarge */
+static inline bool init_resample(struct resample_t *rs, int src_size, int dst_size, enum enlarge_t filter)
+{
+	if (dst_size <= src_size)
+		return init_area_resample(rs, src_size, dst_size);
+	else if (filter == ENLARGE_NEAREST)
+		return init_nearest_resample(rs, src_size, dst_size);
+	else
+		return init_filter_resample(rs, src_size, dst_size, filter);
+}
+
+static inline uint8_t clamp_pixel(int32_t sum, int shift)
+{
+	return (sum < 0) ? 0: ((sum >> shift) > UINT8_MAX) ? UINT8_MAX: (sum >> shift);
+}
+
+/* vertical pass: blend count rows (stride bytes apart) of size bytes into dst,
+	channel doesn't matter */
+static inline void resample_vertical(uint8_t *dst, const uint8_t *src, long stride,
+	int count, const int16_t *weight, int shift, int size)
+{
+	int i = 0, k;
+	int32_t sum;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128(), bits = _mm_cvtsi32_si128(shift);
+	__m128i s0, s1, s2, s3, a, b, w, lo, hi;
+	int32_t pair;
+
+	for (; i + 16 <= size; i += 16) {
+		s0 = s1 = s2 = s3 = _mm_set1_epi32(1 << (shift - 1));
+		/* two rows at once: (a0 * w0 + b0 * w1) by pmaddwd */
+		for (k = 0; k + 1 < count; k += 2) {
+			memcpy(&pair, weight + k, sizeof(pair));
+			w  = _mm_set1_epi32(pair);
+			a  = _mm_loadu_si128((const __m128i *) (src + k * stride + i));
+			b  = _mm_loadu_si128((const __m128i *) (src + (k + 1) * stride + i));
+			lo = _mm_unpacklo_epi8(a, b);
+			hi = _mm_unpackhi_epi8(a, b);
+			s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+			s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+			s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+			s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+		}
+		if (k < count) {
+			w  = _mm_set1_epi32((uint16_t) weight[k]);
+			a  = _mm_loadu_si128((const __m128i *) (src + k * stride + i));
+			lo = _mm_unpacklo_epi8(a, zero);
+			hi = _mm_unpackhi_epi8(a, zero);
+			s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, zero), w));
+			s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, zero), w));
+			s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi16(hi, zero), w));
+			s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi16(hi, zero), w));
+		}
+		lo = _mm_packs_epi32(_mm_sra_epi32(s0, bits), _mm_sra_epi32(s1, bits));
+		hi = _mm_packs_epi32(_mm_sra_epi32(s2, bits), _mm_sra_epi32(s3, bits));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+	}
+#elif defined(__ARM_NEON)
+	const int32x4_t bits = vdupq_n_s32(-shift);
+	int32x4_t s0, s1, s2, s3;
+	int16x8_t lo, hi;
+	uint8x16_t a;
+
+	for (; i + 16 <= size; i += 16) {
+		s0 = s1 = s2 = s3 = vdupq_n_s32(1 << (shift - 1));
+		for (k = 0; k < count; k++) {
+			a  = vld1q_u8(src + k * stride + i);
+			lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(a)));
+			hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(a)));
+			s0 = vmlal_n_s16(s0, vget_low_s16(lo), weight[k]);
+			s1 = vmlal_n_s16(s1, vget_high_s16(lo), weight[k]);
+			s2 = vmlal_n_s16(s2, vget_low_s16(hi), weight[k]);
+			s3 = vmlal_n_s16(s3, vget_high_s16(hi), weight[k]);
+		}
+		lo = vcombine_s16(vqmovn_s32(vshlq_s32(s0, bits)), vqmovn_s32(vshlq_s32(s1, bits)));
+		hi = vcombine_s16(vqmovn_s32(vshlq_s32(s2, bits)), vqmovn_s32(vshlq_s32(s3, bits)));
+		vst1q_u8(dst + i, vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi)));
+	}
+#endif
+	for (; i < size; i++) {
+		sum = 1 << (shift - 1);
+		for (k = 0; k < count; k++)
+			sum += src[k * stride + i] * weight[k];
+		dst[i] = clamp_pixel(sum, shift);
+	}
+}
+
+static inline uint32_t load_pixel(const uint8_t *ptr)
+{
+	uint32_t pixel;
+
+	memcpy(&pixel, ptr, sizeof(pixel));
+	return pixel;
+}
+
+/* overrun: write whole 32bit, extra bytes are overwritten by the next pixels
+	(caller must not overrun the end of row) */
+static inline void store_pixel(uint8_t *ptr, uint32_t pixel, int channel, bool overrun)
+{
+	if (overrun)
+		memcpy(ptr, &pixel, sizeof(pixel));
+	else
+		for (int i = 0; i < channel; i++)
+			ptr[i] = pixel >> (i * 8);
+}
+
+/* horizontal pass: RESAMPLE_ROWS rows of pixels into rs->size pixels (the same row can be passed more than once)
+	src rows must have RESAMPLE_PADDING readable bytes after the last pixel */
+static inline void resample_horizontal(uint8_t *dst[], const uint8_t *src[], int channel, struct resample_t *rs)
+{
+	const int16_t *weight;
+	uint32_t pixel[RESAMPLE_ROWS];
+	long offset;
+	bool overrun;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128(), bits = _mm_cvtsi32_si128(rs->shift);
+	__m128i s0, s1, s2, s3, a, b, w;
+	int32_t pair;
+	long next;
+
+	for (int x = 0; x < rs->size; x++) {
+		offset = rs->start[x] * channel;
+		weight = rs->weight + x * rs->taps;
+		s0 = s1 = s2 = s3 = _mm_set1_epi32(1 << (rs->shift - 1));
+
+		/* one pixel (up to 4 channels) per 32bit, two pixels of four rows per iteration
+			(odd count: the last weight is 0) */
+		for (int k = 0; k < rs->count[x]; k += 2) {
+			next = offset + channel;
+			memcpy(&pair, weight + k, sizeof(pair));
+			w  = _mm_set1_epi32(pair);
+			a  = _mm_unpacklo_epi64(
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(load_pixel(src[0] + offset)), _mm_cvtsi32_si128(load_pixel(src[0] + next))),
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(load_pixel(src[1] + offset)), _mm_cvtsi32_si128(load_pixel(src[1] + next))));
+			b  = _mm_unpacklo_epi64(
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(load_pixel(src[2] + offset)), _mm_cvtsi32_si128(load_pixel(src[2] + next))),
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(load_pixel(src[3] + offset)), _mm_cvtsi32_si128(load_pixel(src[3] + next))));
+			s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(a, zero), w));
+			s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(a, zero), w));
+			s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(b, zero), w));
+			s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(b, zero), w));
+			offset += 2 * channel;
+		}
+		a = _mm_packs_epi32(_mm_sra_epi32(s0, bits), _mm_sra_epi32(s1, bits));
+		b = _mm_packs_epi32(_mm_sra_epi32(s2, bits), _mm_sra_epi32(s3, bits));
+		_mm_storeu_si128((__m128i *) pixel, _mm_packus_epi16(a, b));
+
+		overrun = (x * channel + 4 <= rs->size * channel);
+		for (int i = 0; i < RESAMPLE_ROWS; i++)
+			store_pixel(dst[i] + x * channel, pixel[i], channel, overrun);
+	}
+#elif defined(__ARM_NEON)
+	const int32x4_t bits = vdupq_n_s32(-rs->shift);
+	int32x4_t sum[RESAMPLE_ROWS];
+	int16x4_t a;
+	uint8x8_t lo, hi;
+
+	for (int x = 0; x < rs->size; x++) {
+		offset = rs->start[x] * channel;
+		weight = rs->weight + x * rs->taps;
+		for (int i = 0; i < RESAMPLE_ROWS; i++)
+			sum[i] = vdupq_n_s32(1 << (rs->shift - 1));
+
+		/* one pixel (up to 4 channels) per 32bit */
+		for (int k = 0; k < rs->count[x]; k++) {
+			for (int i = 0; i < RESAMPLE_ROWS; i++) {
+				a      = vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(vcreate_u8(load_pixel(src[i] + offset)))));
+				sum[i] = vmlal_n_s16(sum[i], a, weight[k]);
+			}
+			offset += channel;
+		}
+		lo = vqmovun_s16(vcombine_s16(vqmovn_s32(vshlq_s32(sum[0], bits)), vqmovn_s32(vshlq_s32(sum[1], bits))));
+		hi = vqmovun_s16(vcombine_s16(vqmovn_s32(vshlq_s32(sum[2], bits)), vqmovn_s32(vshlq_s32(sum[3], bits))));
+		vst1q_u8((uint8_t *) pixel, vcombine_u8(lo, hi));
+
+		overrun = (x * channel + 4 <= rs->size * channel);
+		for (int i = 0; i < RESAMPLE_ROWS; i++)
+			store_pixel(dst[i] + x * channel, pixel[i], channel, overrun);
+	}
+#else
+	int32_t sum;
+
+	for (int x = 0; x < rs->size; x++) {
+		weight = rs->weight + x * rs->taps;
+		for (int i = 0; i < RESAMPLE_ROWS; i++) {
+			for (int c = 0; c < channel; c++) {
+				offset = rs->start[x] * channel + c;
+				sum    = 1 << (rs->shift - 1);
+				for (int k = 0; k < rs->count[x]; k++, offset += channel)
+					sum += src[i][offset] * weight[k];
+				dst[i][x * channel + c] = clamp_pixel(sum, rs->shift);
+			}
+		}
+	}
+	(void) pixel; (void) overrun;
+#endif
+}
+
+/* still image holding a copy of one frame:
+	animation can be processed and drawn frame by frame without decoding all frames */
+bool copy_frame(struct image *img, int index, struct image *frame)
+{
+	uint8_t *src;
+	size_t size = img->width * img->height * img->channel;
+
+	init_image(frame);
+	if ((src = get_frame(img, index)) == NULL || !alloc_frames(frame, 1))
+		return false;
+
+	if ((frame->data[0] = (uint8_t *) ecalloc(1, size)) == NULL) {
+		free_image(frame);
+		return false;
+	}
+	memcpy(frame->data[0], src, size);
+
+	frame->width    = img->width;
+	frame->height   = img->height;
+	frame->channel  = img->channel;
+	frame->alpha    = img->alpha;
+	frame->delay[0] = img->delay[index];
+	/* part of image */
+	frame->part_x      = img->part_x;
+	frame->part_y      = img->part_y;
+	frame->full_width  = img->full_width;
+	frame->full_height = img->full_height;
+
+	return true;
+}
+
+/* transpose rows x cols pixels: pixel i of dst[j] = pixel j of src[i]
+	row pointers can be in any order, so the same kernel rotates 90 and 270 degrees */
+static inline void transpose_tile_scalar(uint8_t *dst[], const uint8_t *src[], int channel, int rows, int cols)
+{
+	for (int j = 0; j < cols; j++)
+		for (int i = 0; i < rows; i++)
+			memcpy(dst[j] + i * channel, src[i] + j * channel, channel);
+}
+
+/* transpose ROTATE_TILE x ROTATE_TILE pixels in registers (specialized by bytes per pixel) */
+static void transpose_tile8(uint8_t *dst[], const uint8_t *src[])
+{
+#if defined(__SSE2__)
+	__m128i a0, a1, a2, a3, b0, b1, b2, b3;
+
+	/* 8bit -> 16bit -> 32bit interleave */
+	a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src[0]), _mm_loadl_epi64((const __m128i *) src[1]));
+	a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src[2]), _mm_loadl_epi64((const __m128i *) src[3]));
+	a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src[4]), _mm_loadl_epi64((const __m128i *) src[5]));
+	a3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src[6]), _mm_loadl_epi64((const __m128i *) src[7]));
+	b0 = _mm_unpacklo_epi16(a0, a1);
+	b1 = _mm_unpackhi_epi16(a0, a1);
+	b2 = _mm_unpacklo_epi16(a2, a3);
+	b3 = _mm_unpackhi_epi16(a2, a3);
+	a0 = _mm_unpacklo_epi32(b0, b2);
+	a1 = _mm_unpackhi_epi32(b0, b2);
+	a2 = _mm_unpacklo_epi32(b1, b3);
+	a3 = _mm_unpackhi_epi32(b1, b3);
+	_mm_storel_epi64((__m128i *) dst[0], a0);
+	_mm_storel_epi64((__m128i *) dst[1], _mm_srli_si128(a0, 8));
+	_mm_storel_epi64((__m128i *) dst[2], a1);
+	_mm_storel_epi64((__m128i *) dst[3], _mm_srli_si128(a1, 8));
+	_mm_storel_epi64((__m128i *) dst[4], a2);
+	_mm_storel_epi64((__m128i *) dst[5], _mm_srli_si128(a2, 8));
+	_mm_storel_epi64((__m128i *) dst[6], a3);
+	_mm_storel_epi64((__m128i *) dst[7], _mm_srli_si128(a3, 8));
+#elif defined(__ARM_NEON)
+	uint8x8x2_t a0, a1, a2, a3;
+	uint16x4x2_t b0, b1, b2, b3;
+	uint32x2x2_t c0, c1, c2, c3;
+
+	/* 8bit -> 16bit -> 32bit transpose */
+	a0 = vtrn_u8(vld1_u8(src[0]), vld1_u8(src[1]));
+	a1 = vtrn_u8(vld1_u8(src[2]), vld1_u8(src[3]));
+	a2 = vtrn_u8(vld1_u8(src[4]), vld1_u8(src[5]));
+	a3 = vtrn_u8(vld1_u8(src[6]), vld1_u8(src[7]));
+	b0 = vtrn_u16(vreinterpret_u16_u8(a0.val[0]), vreinterpret_u16_u8(a1.val[0]));
+	b1 = vtrn_u16(vreinterpret_u16_u8(a0.val[1]), vreinterpret_u16_u8(a1.val[1]));
+	b2 = vtrn_u16(vreinterpret_u16_u8(a2.val[0]), vreinterpret_u16_u8(a3.val[0]));
+	b3 = vtrn_u16(vreinterpret_u16_u8(a2.val[1]), vreinterpret_u16_u8(a3.val[1]));
+	c0 = vtrn_u32(vreinterpret_u32_u16(b0.val[0]), vreinterpret_u32_u16(b2.val[0]));
+	c1 = vtrn_u32(vreinterpret_u32_u16(b1.val[0]), vreinterpret_u32_u16(b3.val[0]));
+	c2 = vtrn_u32(vreinterpret_u32_u16(b0.val[1]), vreinterpret_u32_u16(b2.val[1]));
+	c3 = vtrn_u32(vreinterpret_u32_u16(b1.val[1]), vreinterpret_u32_u16(b3.val[1]));
+	vst1_u8(dst[0], vreinterpret_u8_u32(c0.val[0]));
+	vst1_u8(dst[1], vreinterpret_u8_u32(c1.val[0]));
+	vst1_u8(dst[2], vreinterpret_u8_u32(c2.val[0]));
+	vst1_u8(dst[3], vreinterpret_u8_u32(c3.val[0]));
+	vst1_u8(dst[4], vreinterpret_u8_u32(c0.val[1]));
+	vst1_u8(dst[5], vreinterpret_u8_u32(c1.val[1]));
+	vst1_u8(dst[6], vreinterpret_u8_u32(c2.val[1]));
+	vst1_u8(dst[7], vreinterpret_u8_u32(c3.val[1]));
+#else
+	transpose_tile_scalar(dst, src, 1, ROTATE_TILE, ROTATE_TILE);
+#endif
+}
+
+static void transpose_tile16(uint8_t *dst[], const uint8_t *src[])
+{
+#if defined(__SSE2__)
+	__m128i a[8], b[8];
+
+	/* 16bit -> 32bit -> 64bit interleave */
+	for (int i = 0; i < 8; i += 2) {
+		b[i]     = _mm_loadu_si128((const __m128i *) src[i]);
+		b[i + 1] = _mm_loadu_si128((const __m128i *) src[i + 1]);
+		a[i]     = _mm_unpacklo_epi16(b[i], b[i + 1]);
+		a[i + 1] = _mm_unpackhi_epi16(b[i], b[i + 1]);
+	}
+	for (int i = 0; i < 8; i += 4) {
+		b[i]     = _mm_unpacklo_epi32(a[i], a[i + 2]);
+		b[i + 1] = _mm_unpackhi_epi32(a[i], a[i + 2]);
+		b[i + 2] = _mm_unpacklo_epi32(a[i + 1], a[i + 3]);
+		b[i + 3] = _mm_unpackhi_epi32(a[i + 1], a[i + 3]);
+	}
+	for (int i = 0; i < 4; i++) {
+		_mm_storeu_si128((__m128i *) dst[2 * i], _mm_unpacklo_epi64(b[i], b[i + 4]));
+		_mm_storeu_si128((__m128i *) dst[2 * i + 1], _mm_unpackhi_epi64(b[i], b[i + 4]));
+	}
+#elif defined(__ARM_NEON)
+	uint16x8x2_t a[4];
+	uint32x4x2_t b[4];
+
+	/* 16bit -> 32bit transpose, then swap 64bit halves */
+	for (int i = 0; i < 4; i++)
+		a[i] = vtrnq_u16(vreinterpretq_u16_u8(vld1q_u8(src[2 * i])), vreinterpretq_u16_u8(vld1q_u8(src[2 * i + 1])));
+	for (int i = 0; i < 2; i++) {
+		b[2 * i]     = vtrnq_u32(vreinterpretq_u32_u16(a[2 * i].val[0]), vreinterpretq_u32_u16(a[2 * i + 1].val[0]));
+		b[2 * i + 1] = vtrnq_u32(vreinterpretq_u32_u16(a[2 * i].val[1]), vreinterpretq_u32_u16(a[2 * i + 1].val[1]));
+	}
+	/* b[0]: column 0|4, 2|6 of rows 0-3, b[1]: column 1|5, 3|7 of rows 0-3, b[2], b[3]: rows 4-7 */
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 2; j++) {
+			vst1q_u8(dst[2 * i + j], vreinterpretq_u8_u32(
+				vcombine_u32(vget_low_u32(b[j].val[i]), vget_low_u32(b[j + 2].val[i]))));
+			vst1q_u8(dst[2 * i + j + 4], vreinterpretq_u8_u32(
+				vcombine_u32(vget_high_u32(b[j].val[i]), vget_high_u32(b[j + 2].val[i]))));
+		}
+	}
+#else
+	transpose_tile_scalar(dst, src, 2, ROTATE_TILE, ROTATE_TILE);
+#endif
+}
+
+static void transpose_tile24(uint8_t *dst[], const uint8_t *src[])
 {
-	int cell_num;
-	uint8_t r, g, b;
-	uint16_t rsum, gsum, bsum;
+	const int last = ROTATE_TILE - 1;
 
-	rsum = gsum = bsum = 0;
-	for (int y = y_from; y < y_to; y++) {
-		for (int x = x_from; x < x_to; x++) {
-			get_rgb(img, data, x, y, &r, &g, &b);
-			rsum += r; gsum += g; bsum += b;
+	/* no SIMD: copy pixel by 32bit, the extra byte is overwritten by the next pixel
+		(the last row/column of the tile is copied by 3 bytes not to touch outside of the tile) */
+	for (int j = 0; j < last; j++) {
+		for (int i = 0; i < last; i++)
+			store_pixel(dst[j] + i * 3, load_pixel(src[i] + j * 3), 3, true);
+		memcpy(dst[j] + last * 3, src[last] + j * 3, 3);
+	}
+	for (int i = 0; i < ROTATE_TILE; i++)
+		memcpy(dst[last] + i * 3, src[i] + last * 3, 3);
+}
+
+static void transpose_tile32(uint8_t *dst[], const uint8_t *src[])
+{
+	/* four 4x4 blocks: the block at (y, x) goes to (x, y) */
+	for (int y = 0; y < ROTATE_TILE; y += 4) {
+		for (int x = 0; x < ROTATE_TILE; x += 4) {
+#if defined(__SSE2__)
+			__m128i a0, a1, a2, a3, b0, b1, b2, b3;
+
+			a0 = _mm_loadu_si128((const __m128i *) (src[y] + x * 4));
+			a1 = _mm_loadu_si128((const __m128i *) (src[y + 1] + x * 4));
+			a2 = _mm_loadu_si128((const __m128i *) (src[y + 2] + x * 4));
+			a3 = _mm_loadu_si128((const __m128i *) (src[y + 3] + x * 4));
+			b0 = _mm_unpacklo_epi32(a0, a1);
+			b1 = _mm_unpackhi_epi32(a0, a1);
+			b2 = _mm_unpacklo_epi32(a2, a3);
+			b3 = _mm_unpackhi_epi32(a2, a3);
+			_mm_storeu_si128((__m128i *) (dst[x] + y * 4), _mm_unpacklo_epi64(b0, b2));
+			_mm_storeu_si128((__m128i *) (dst[x + 1] + y * 4), _mm_unpackhi_epi64(b0, b2));
+			_mm_storeu_si128((__m128i *) (dst[x + 2] + y * 4), _mm_unpacklo_epi64(b1, b3));
+			_mm_storeu_si128((__m128i *) (dst[x + 3] + y * 4), _mm_unpackhi_epi64(b1, b3));
+#elif defined(__ARM_NEON)
+			uint32x4x2_t a, b;
+
+			a = vtrnq_u32(vreinterpretq_u32_u8(vld1q_u8(src[y] + x * 4)), vreinterpretq_u32_u8(vld1q_u8(src[y + 1] + x * 4)));
+			b = vtrnq_u32(vreinterpretq_u32_u8(vld1q_u8(src[y + 2] + x * 4)), vreinterpretq_u32_u8(vld1q_u8(src[y + 3] + x * 4)));
+			vst1q_u8(dst[x] + y * 4, vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(a.val[0]), vget_low_u32(b.val[0]))));
+			vst1q_u8(dst[x + 1] + y * 4, vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(a.val[1]), vget_low_u32(b.val[1]))));
+			vst1q_u8(dst[x + 2] + y * 4, vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(a.val[0]), vget_high_u32(b.val[0]))));
+			vst1q_u8(dst[x + 3] + y * 4, vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(a.val[1]), vget_high_u32(b.val[1]))));
+#else
+			for (int j = 0; j < 4; j++)
+				for (int i = 0; i < 4; i++)
+					memcpy(dst[x + j] + (y + i) * 4, src[y + i] + (x + j) * 4, 4);
+#endif
 		}
 	}
+}
+
+/* reverse order of pixels (for 180 degrees): src is read from the end of row */
+static inline void reverse_row(uint8_t *dst, const uint8_t *src, int width, int channel)
+{
+	int x = 0;
 
-	cell_num = (y_to - y_from) * (x_to - x_from);
-	if (cell_num > 1) {
-		rsum /= cell_num; gsum /= cell_num; bsum /= cell_num;
+	src += (long) width * channel;
+#if defined(__SSE2__)
+	__m128i v;
+
+	/* reverse 32bit lanes, then 16bit and 8bit lanes inside them */
+	for (; channel != 3 && x + 16 / channel <= width; x += 16 / channel, src -= 16, dst += 16) {
+		v = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (src - 16)), _MM_SHUFFLE(0, 1, 2, 3));
+		if (channel <= 2)
+			v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+		if (channel == 1)
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) dst, v);
 	}
+#elif defined(__ARM_NEON)
+	uint8x16_t v;
 
-	if (img->channel <= 2)
-		*pixel++ = rsum;
-	else {
-		*pixel++ = rsum; *pixel++ = gsum; *pixel++ = bsum;
+	/* reverse lanes inside 64bit halves, then swap halves */
+	for (; channel != 3 && x + 16 / channel <= width; x += 16 / channel, src -= 16, dst += 16) {
+		v = vld1q_u8(src - 16);
+		v = (channel == 1) ? vrev64q_u8(v):
+			(channel == 2) ? vreinterpretq_u8_u16(vrev64q_u16(vreinterpretq_u16_u8(v))):
+			vreinterpretq_u8_u32(vrev64q_u32(vreinterpretq_u32_u8(v)));
+		vst1q_u8(dst, vcombine_u8(vget_high_u8(v), vget_low_u8(v)));
+	}
+#endif
+	/* 3 bytes per pixel: copy by 32bit except the first read and the last write */
+	if (channel == 3 && width > 2) {
+		src -= 3;
+		memcpy(dst, src, 3);
+		for (x = 1, dst += 3; x < width - 1; x++, dst += 3) {
+			src -= 3;
+			store_pixel(dst, load_pixel(src), 3, true);
+		}
 	}
+	for (; x < width; x++, dst += channel) {
+		src -= channel;
+		memcpy(dst, src, channel);
+	}
+}
 
-	if (img->alpha)
-		*pixel = 0;
+/* rotated rows [y0, y1) of width x height image into dst (rows of rotated image are contiguous)
+	clockwise        (angle 90) : rotated (x, y) = src (y, height - 1 - x)
+	counter clockwise(angle 270): rotated (x, y) = src (width - 1 - y, x)
+	upside down      (angle 180): rotated (x, y) = src (width - 1 - x, height - 1 - y) */
+static inline void rotate_rows(uint8_t *dst, const uint8_t *data, int width, int height, int channel, int angle, int y0, int y1)
+{
+	int x0, x1, rows, cols, x_end, y_end;
+	long src_stride = (long) width * channel, dst_stride, dst_step;
+	uint8_t *dst_row[ROTATE_TILE];
+	const uint8_t *src_row[ROTATE_TILE];
+	void (*transpose_tile)(uint8_t *dst[], const uint8_t *src[]);
+
+	if (angle == 180) {
+		for (int y = y0; y < y1; y++)
+			reverse_row(dst + (y - y0) * src_stride, data + (height - 1 - y) * src_stride, width, channel);
+		return;
+	}
+
+	transpose_tile = (channel == 1) ? transpose_tile8:
+		(channel == 2) ? transpose_tile16:
+		(channel == 3) ? transpose_tile24: transpose_tile32;
+
+	/* rotated rows are src columns [x0, x1): transpose ROTATE_TILE x ROTATE_TILE tiles
+		(with src or dst rows in reverse order), and visit tiles block by block:
+		src and dst of a block stay in cache */
+	x0 = (angle == 90) ? y0: width - y1;
+	x1 = (angle == 90) ? y1: width - y0;
+	dst_stride = (long) height * channel;
+	dst_step   = (angle == 90) ? ROTATE_TILE * dst_stride: -ROTATE_TILE * dst_stride;
+
+	for (int by = 0; by < height; by += ROTATE_BLOCK) {
+		for (int bx = x0; bx < x1; bx += ROTATE_BLOCK) {
+			y_end = (by + ROTATE_BLOCK < height) ? by + ROTATE_BLOCK: height;
+			x_end = (bx + ROTATE_BLOCK < x1) ? bx + ROTATE_BLOCK: x1;
+
+			for (int y = by; y < y_end; y += ROTATE_TILE) {
+				rows = (y + ROTATE_TILE < y_end) ? ROTATE_TILE: y_end - y;
+				cols = (bx + ROTATE_TILE < x_end) ? ROTATE_TILE: x_end - bx;
+
+				/* row pointers of the first tile, then step to the right */
+				for (int i = 0; i < rows; i++)
+					src_row[i] = data + (angle == 90 ? y + rows - 1 - i: y + i) * src_stride + bx * channel;
+				for (int j = 0; j < cols; j++)
+					dst_row[j] = dst + ((angle == 90) ? (bx - x0 + j) * dst_stride + (height - y - rows) * channel:
+						(x1 - 1 - bx - j) * dst_stride + y * channel);
+
+				for (int x = bx; x < x_end; x += ROTATE_TILE) {
+					if (x + ROTATE_TILE > x_end)
+						cols = x_end - x;
+
+					if (rows == ROTATE_TILE && cols == ROTATE_TILE)
+						transpose_tile(dst_row, src_row);
+					else
+						transpose_tile_scalar(dst_row, src_row, channel, rows, cols);
+
+					if (x + ROTATE_TILE >= x_end)
+						break;
+					for (int i = 0; i < rows; i++)
+						src_row[i] += ROTATE_TILE * channel;
+					for (int j = 0; j < cols; j++)
+						dst_row[j] += dst_step;
+				}
+			}
+		}
+	}
 }
 
 /* some image proccessing functions:
 	never use *_single functions directly */
 uint8_t *rotate_image_single(struct image *img, uint8_t *data, int angle)
 {
-	int x1, x2, y1, y2, r, dst_width, dst_height;
+	int dst_width, dst_height;
 	uint8_t *rotated_data;
-	long offset_dst, offset_src;
-
-	static const int cos[3] = {0, -1,  0};
-	static const int sin[3] = {1,  0, -1};
-
-	int shift[3][3] = {
-	/*   x_shift,         y_shift,        sign */
-		{img->height - 1, 0              , -1},
-		{img->width  - 1, img->height - 1,  1},
-		{              0, img->width  - 1, -1}
-	};
 
 	if (angle != 90 && angle != 180 && angle != 270)
 		return NULL;
-	/* r == 0: clockwise        : (angle 90)  */
-	/* r == 1: upside down      : (angle 180) */
-	/* r == 2: counter clockwise: (angle 270) */
-	r = angle / 90 - 1;
-	
+
 	if (angle == 90 || angle == 270) {
 		dst_width  = img->height;
 		dst_height = img->width;
@@ -123,15 +794,7 @@ uint8_t *rotate_image_single(struct image *img, uint8_t *data, int angle)
 	logging(DEBUG, "rotated image: %dx%d size:%d\n",
 		dst_width, dst_height, dst_width * dst_height * img->channel);
 
-	for (y2 = 0; y2 < dst_height; y2++) {
-		for (x2 = 0; x2 < dst_width; x2++) {
-			x1 = ((x2 - shift[r][0]) * cos[r] - (y2 - shift[r][1]) * sin[r]) * shift[r][2];
-			y1 = ((x2 - shift[r][0]) * sin[r] + (y2 - shift[r][1]) * cos[r]) * shift[r][2];
-			offset_src = img->channel * (y1 * img->width + x1);
-			offset_dst = img->channel * (y2 * dst_width + x2);
-			memcpy(rotated_data + offset_dst, data + offset_src, img->channel);
-		}
-	}
+	rotate_rows(rotated_data, data, img->width, img->height, img->channel, angle, 0, dst_height);
 	free(data);
 
 	img->width  = dst_width;
@@ -143,104 +806,421 @@ uint8_t *rotate_image_single(struct image *img, uint8_t *data, int angle)
 void rotate_image(struct image *img, int angle, bool rotate_all)
 {
 	uint8_t *rotated_data;
+	int width = img->width, height = img->height;
 
 	if (rotate_all) {
-		for (int i = 0; i < img->frame_count; i++)
+		load_all_frames(img);
+		for (int i = 0; i < img->frame_count; i++) {
+			/* every frame has the size before rotation */
+			img->width  = width;
+			img->height = height;
 			if ((rotated_data = rotate_image_single(img, img->data[i], angle)) != NULL)
 				img->data[i] = rotated_data;
+		}
 	} else {
-		if ((rotated_data = rotate_image_single(img, img->data[img->current_frame], angle)) != NULL)
+		if ((rotated_data = rotate_image_single(img, get_current_frame(img), angle)) != NULL)
 			img->data[img->current_frame] = rotated_data;
 	}
 }
 
-uint8_t *resize_image_single(struct image *img, uint8_t *data, int disp_width, int disp_height)
+/* size of image fitting in disp_width x disp_height (keep aspect ratio):
+	return false if no need to resize */
+static inline bool get_resized_size(int width, int height, int disp_width, int disp_height,
+	enum enlarge_t filter, int *dst_width, int *dst_height)
 {
-	/* TODO: support enlarge */
-	int width_rate, height_rate, resize_rate;
-	int dst_width, dst_height, y_from, x_from, y_to, x_to;
-	uint8_t *resized_data, pixel[img->channel];
-	long offset_dst;
+	int scale;
 
-	width_rate  = MULTIPLER * disp_width  / img->width;
-	height_rate = MULTIPLER * disp_height / img->height;
-	resize_rate = (width_rate < height_rate) ? width_rate: height_rate;
+	/* fit the side that needs more reduction (or less enlargement) */
+	if ((long) disp_width * height < (long) disp_height * width) {
+		*dst_width  = disp_width;
+		*dst_height = (long) height * disp_width / width;
+	} else {
+		*dst_width  = (long) width * disp_height / height;
+		*dst_height = disp_height;
+	}
+	*dst_width  = (*dst_width > 0) ? *dst_width: 1;
+	*dst_height = (*dst_height > 0) ? *dst_height: 1;
 
-	logging(DEBUG, "width_rate:%.2d height_rate:%.2d resize_rate:%.2d\n",
-		width_rate, height_rate, resize_rate);
+	if (*dst_width >= width && *dst_height >= height) {
+		if (filter == ENLARGE_NONE || (*dst_width == width && *dst_height == height))
+			return false;
 
-	/* only support shrink */
-	if ((resize_rate / MULTIPLER) >= 1)
-		return NULL;
+		/* nearest: integer scale only, each pixel becomes scale x scale block */
+		if (filter == ENLARGE_NEAREST) {
+			scale = (disp_width / width < disp_height / height) ? disp_width / width: disp_height / height;
+			if (scale < 2)
+				return false;
+			*dst_width  = width * scale;
+			*dst_height = height * scale;
+		}
+	}
+	return true;
+}
+
+/* rectangle [x, x + width) x [y, y + height) of image */
+struct view_t {
+	int x, y, width, height;
+};
+
+/* clip view to width x height image: return false if nothing is left */
+static inline bool clip_view(struct view_t *view, int width, int height)
+{
+	if (view->x < 0) {
+		view->width += view->x;
+		view->x = 0;
+	}
+	if (view->y < 0) {
+		view->height += view->y;
+		view->y = 0;
+	}
+	if (view->x + view->width > width)
+		view->width = width - view->x;
+	if (view->y + view->height > height)
+		view->height = height - view->y;
+
+	return (view->width > 0 && view->height > 0);
+}
+
+/* src pixels [*from, *to) read by dst pixels [x, x + size) */
+static inline void get_resample_range(struct resample_t *rs, int x, int size, int *from, int *to)
+{
+	*from = rs->start[x];
+	*to   = rs->start[x] + rs->count[x];
 
-	/* FIXME: let the same num (img->width == fb->width), if it causes SEGV, remove "+ 1" */
-	dst_width  = resize_rate * img->width / MULTIPLER + 1;
-	dst_height = resize_rate * img->height / MULTIPLER;
+	for (int i = x + 1; i < x + size; i++) {
+		*from = (rs->start[i] < *from) ? rs->start[i]: *from;
+		*to   = (rs->start[i] + rs->count[i] > *to) ? rs->start[i] + rs->count[i]: *to;
+	}
+}
+
+/* keep only dst pixels [x, x + size), src pixels are counted from src pixel from */
+static inline void crop_resample(struct resample_t *rs, int x, int size, int from)
+{
+	memmove(rs->start, rs->start + x, size * sizeof(int));
+	memmove(rs->count, rs->count + x, size * sizeof(int));
+	memmove(rs->weight, rs->weight + (long) x * rs->taps, (size_t) size * rs->taps * sizeof(int16_t));
+	rs->size = size;
+
+	for (int i = 0; i < size; i++)
+		rs->start[i] -= from;
+}
+
+/* part of src (width x height) needed to make view of the image resized to fit disp_width x disp_height
+	(disp_width/disp_height <= 0: no resize), view is clipped to the resized image:
+	return false if view is empty */
+bool get_view_source(int width, int height, int disp_width, int disp_height, enum enlarge_t filter,
+	struct view_t *view, struct view_t *source)
+{
+	int dst_width, dst_height, from, to;
+	struct resample_t rs = {0};
+
+	if (disp_width <= 0 || disp_height <= 0
+		|| !get_resized_size(width, height, disp_width, disp_height, filter, &dst_width, &dst_height)) {
+		if (!clip_view(view, width, height))
+			return false;
+		*source = *view;
+		return true;
+	}
+
+	if (!clip_view(view, dst_width, dst_height))
+		return false;
+
+	*source = (struct view_t) {0, 0, width, height};
+
+	if (init_resample(&rs, width, dst_width, filter)) {
+		get_resample_range(&rs, view->x, view->width, &from, &to);
+		*source = (struct view_t) {from, 0, to - from, height};
+		free_resample(&rs);
+	}
+	if (init_resample(&rs, height, dst_height, filter)) {
+		get_resample_range(&rs, view->y, view->height, &from, &to);
+		source->y      = from;
+		source->height = to - from;
+		free_resample(&rs);
+	}
+	return true;
+}
 
-	if ((resized_data = (uint8_t *) ecalloc(dst_width * dst_height, img->channel)) == NULL)
+/* rows of rotated image: rotated on demand into a window of rows
+	(angle 0: rows of src are used directly) */
+struct row_window_t {
+	const uint8_t *data;
+	int width, height; /* size of src (before rotation) */
+	int channel, angle;
+	uint8_t *buf;
+	int first, rows;   /* buf holds rotated rows [first, first + rows) */
+	int capacity;
+};
+
+/* rotated rows [y, y + count) (rows are contiguous) */
+static inline const uint8_t *get_window_rows(struct row_window_t *win, int y, int count)
+{
+	int rotated_width  = (win->angle == 90 || win->angle == 270) ? win->height: win->width;
+	int rotated_height = (win->angle == 90 || win->angle == 270) ? win->width: win->height;
+	long stride = (long) rotated_width * win->channel;
+
+	if (win->angle == 0)
+		return win->data + y * stride;
+
+	if (y < win->first || y + count > win->first + win->rows) {
+		win->first = y;
+		win->rows  = (y + win->capacity < rotated_height) ? win->capacity: rotated_height - y;
+		rotate_rows(win->buf, win->data, win->width, win->height, win->channel, win->angle, y, y + win->rows);
+	}
+	return win->buf + (y - win->first) * stride;
+}
+
+/* rotate, resize and normalize in one pass: each dst row is made once from src
+	(read through the window of rotated rows, vertical pass, horizontal pass, then normalize),
+	no full size intermediate image is allocated
+	disp_width/disp_height <= 0: no resize, bytes_per_pixel == img->channel: no normalize
+	(image with alpha can be normalized to 4: alpha is resampled as a color channel)
+	view: only this part of the transformed image is made from the src pixels under it (NULL: whole image),
+	data can be a part of src (img->full_width > 0, angle 0 only) covering get_view_source() of the view */
+uint8_t *transform_image_single(struct image *img, uint8_t *data, int angle,
+	int disp_width, int disp_height, enum enlarge_t filter, int bytes_per_pixel, struct view_t *view)
+{
+	int width, height, dst_width, dst_height, channel = img->channel;
+	int data_width, data_height, part_x = 0, part_y = 0, src_x, src_width, y0, y1;
+	bool resize, normalize, crop;
+	long stride, row_stride, dst_stride;
+	uint8_t *transformed_data = NULL, *row = NULL, *out = NULL, *dst[RESAMPLE_ROWS];
+	const uint8_t *src[RESAMPLE_ROWS], *rows;
+	struct resample_t rs_x = {0}, rs_y = {0};
+	struct view_t area;
+	struct row_window_t win = {
+		.data = data, .width = img->width, .height = img->height, .channel = channel,
+		.buf = NULL, .first = 0, .rows = 0,
+	};
+	void (*normalize_row)(uint8_t *dst, const uint8_t *src, int width) =
+		(bytes_per_pixel == 4) ? gray_alpha_to_rgba: (channel == 1) ? gray_to_rgb:
+		(channel == 2) ? gray_alpha_to_rgb: rgba_to_rgb;
+
+	if (angle != 90 && angle != 180 && angle != 270)
+		angle = 0;
+	win.angle = angle;
+
+	/* size after rotation */
+	width  = (angle == 90 || angle == 270) ? img->height: img->width;
+	height = (angle == 90 || angle == 270) ? img->width: img->height;
+	data_width  = width;
+	data_height = height;
+
+	if (img->full_width > 0) {
+		if (angle != 0 || view == NULL) {
+			logging(ERROR, "part of image can't be rotated or transformed without view\n");
+			return NULL;
+		}
+		part_x = img->part_x;
+		part_y = img->part_y;
+		width  = img->full_width;
+		height = img->full_height;
+	}
+
+	resize = (disp_width > 0 && disp_height > 0)
+		&& get_resized_size(width, height, disp_width, disp_height, filter, &dst_width, &dst_height);
+	/* XXX: now only support bytes_per_pixel == 3 (rgb) and 4 (rgba of gray + alpha) */
+	normalize = (bytes_per_pixel == 3 && channel != 3) || (bytes_per_pixel == 4 && channel == 2);
+
+	if (!resize) {
+		dst_width  = width;
+		dst_height = height;
+	}
+
+	area = (view != NULL) ? *view: (struct view_t) {0, 0, dst_width, dst_height};
+	if (!clip_view(&area, dst_width, dst_height)) {
+		logging(ERROR, "view is out of image\n");
 		return NULL;
+	}
+	crop = (area.width != dst_width || area.height != dst_height);
 
-	logging(DEBUG, "resized image: %dx%d size:%d\n",
-		dst_width, dst_height, dst_width * dst_height * img->channel);
+	if (!resize && !normalize && !crop && img->full_width <= 0)
+		return (angle != 0) ? rotate_image_single(img, data, angle): NULL;
+
+	stride     = (long) data_width * channel;
+	dst_stride = (long) area.width * (normalize ? bytes_per_pixel: channel);
+
+	logging(DEBUG, "src:%dx%d angle:%d disp:%dx%d dst:%dx%d view:%dx%d+%d+%d filter:%d bpp:%d\n",
+		img->width, img->height, angle, disp_width, disp_height, dst_width, dst_height,
+		area.width, area.height, area.x, area.y, filter, bytes_per_pixel);
+
+	/* src columns [src_x, src_x + src_width) and rows [y0, y1) under the view */
+	if (resize) {
+		if (!init_resample(&rs_x, width, dst_width, filter)
+			|| !init_resample(&rs_y, height, dst_height, filter))
+			goto release;
+		get_resample_range(&rs_x, area.x, area.width, &src_x, &src_width);
+		get_resample_range(&rs_y, area.y, area.height, &y0, &y1);
+		src_width -= src_x;
+		crop_resample(&rs_x, area.x, area.width, src_x);
+	} else {
+		src_x     = area.x;
+		src_width = area.width;
+		y0        = area.y;
+		y1        = area.y + area.height;
+	}
+
+	if (src_x < part_x || src_x + src_width > part_x + data_width
+		|| y0 < part_y || y1 > part_y + data_height) {
+		logging(ERROR, "part of image doesn't cover the view\n");
+		goto release;
+	}
+	src_x -= part_x;
+	row_stride = (long) src_width * channel;
+
+	win.capacity = (resize ? rs_y.taps: 1) + ROTATE_BLOCK;
+
+	if ((angle != 0 && (win.buf = (uint8_t *) ecalloc(win.capacity, stride)) == NULL)
+		|| (row = (uint8_t *) ecalloc(RESAMPLE_ROWS, row_stride + RESAMPLE_PADDING)) == NULL
+		|| (out = (uint8_t *) ecalloc(RESAMPLE_ROWS, (long) area.width * channel)) == NULL
+		|| (transformed_data = (uint8_t *) ecalloc(area.height, dst_stride)) == NULL)
+		goto release;
+
+	logging(DEBUG, "transformed image: %dx%d size:%ld\n", area.width, area.height, area.height * dst_stride);
+
+	if (!resize) {
+		for (int y = 0; y < area.height; y++) {
+			rows = get_window_rows(&win, area.y + y - part_y, 1) + src_x * channel;
+			if (normalize)
+				normalize_row(transformed_data + y * dst_stride, rows, area.width);
+			else
+				memcpy(transformed_data + y * dst_stride, rows, dst_stride);
+		}
+		goto transformed;
+	}
 
-	for (int y = 0; y < dst_height; y++) {
-		y_from = MULTIPLER * y / resize_rate;
-		y_to   = MULTIPLER * (y + 1) / resize_rate;
-		for (int x = 0; x < dst_width; x++) {
-			x_from = MULTIPLER * x / resize_rate;
-			x_to   = MULTIPLER * (x + 1) / resize_rate;
-			get_average(img, data, x_from, y_from, x_to, y_to, pixel);
-			offset_dst = img->channel * (y * dst_width + x);
-			memcpy(resized_data + offset_dst, pixel, img->channel);
+	/* RESAMPLE_ROWS dst rows at once: the last rows are filled by repeating the last dst row */
+	for (int y = 0; y < area.height; y += RESAMPLE_ROWS) {
+		for (int i = 0; i < RESAMPLE_ROWS; i++) {
+			if (y + i < area.height) {
+				rows = get_window_rows(&win, rs_y.start[area.y + y + i] - part_y, rs_y.count[area.y + y + i]);
+				resample_vertical(row + i * (row_stride + RESAMPLE_PADDING), rows + src_x * channel, stride,
+					rs_y.count[area.y + y + i], rs_y.weight + (area.y + y + i) * rs_y.taps, rs_y.shift, row_stride);
+				src[i] = row + i * (row_stride + RESAMPLE_PADDING);
+				dst[i] = normalize ? out + i * area.width * channel: transformed_data + (y + i) * dst_stride;
+			} else {
+				src[i] = src[i - 1];
+				dst[i] = dst[i - 1];
+			}
 		}
+		resample_horizontal(dst, src, channel, &rs_x);
+
+		for (int i = 0; normalize && i < RESAMPLE_ROWS && y + i < area.height; i++)
+			normalize_row(transformed_data + (y + i) * dst_stride, dst[i], area.width);
 	}
+
+transformed:
 	free(data);
 
-	img->width  = dst_width;
-	img->height = dst_height;
+	img->width  = area.width;
+	img->height = area.height;
+	img->part_x = img->part_y = 0;
+	img->full_width = img->full_height = 0;
 
-	return resized_data;
+release:
+	free(win.buf);
+	free(row);
+	free(out);
+	free_resample(&rs_x);
+	free_resample(&rs_y);
+	return transformed_data;
 }
 
-void resize_image(struct image *img, int disp_width, int disp_height, bool resize_all)
+/* rotate (angle 0: no rotate), then resize (disp_width/disp_height <= 0: no resize),
+	then normalize to bytes_per_pixel (3, or 4 for image with alpha, others: no normalize) */
+void transform_image(struct image *img, int angle, int disp_width, int disp_height,
+	enum enlarge_t filter, int bytes_per_pixel, bool transform_all)
 {
-	uint8_t *resized_data;
+	uint8_t *transformed_data;
+	int width = img->width, height = img->height;
 
-	if (resize_all) {
-		for (int i = 0; i < img->frame_count; i++)
-			if ((resized_data = resize_image_single(img, img->data[i], disp_width, disp_height)) != NULL)
-				img->data[i] = resized_data;
+	if (bytes_per_pixel != 3 && !(bytes_per_pixel == 4 && img->alpha))
+		bytes_per_pixel = img->channel;
+
+	if (transform_all) {
+		load_all_frames(img);
+		for (int i = 0; i < img->frame_count; i++) {
+			/* every frame has the size before transform */
+			img->width  = width;
+			img->height = height;
+			if ((transformed_data = transform_image_single(img, img->data[i],
+				angle, disp_width, disp_height, filter, bytes_per_pixel, NULL)) != NULL)
+				img->data[i] = transformed_data;
+		}
 	} else {
-		if ((resized_data = resize_image_single(img, img->data[img->current_frame], disp_width, disp_height)) != NULL)
-			img->data[img->current_frame] = resized_data;
+		if ((transformed_data = transform_image_single(img, get_current_frame(img),
+			angle, disp_width, disp_height, filter, bytes_per_pixel, NULL)) != NULL)
+			img->data[img->current_frame] = transformed_data;
 	}
+
+	if (bytes_per_pixel != img->channel) {
+		img->channel = bytes_per_pixel;
+		img->alpha   = (bytes_per_pixel == 4);
+	}
+}
+
+void resize_image(struct image *img, int disp_width, int disp_height, enum enlarge_t filter, bool resize_all)
+{
+	transform_image(img, 0, disp_width, disp_height, filter, img->channel, resize_all);
+}
+
+/* resize current frame to fit disp_width x disp_height, then crop view of the resized image in one pass:
+	only src pixels under the view are resampled (return false if view is out of image or on error) */
+bool view_image(struct image *img, int disp_width, int disp_height, enum enlarge_t filter, struct view_t *view)
+{
+	uint8_t *viewed_data;
+	int width  = (img->full_width > 0) ? img->full_width: img->width;
+	int height = (img->full_width > 0) ? img->full_height: img->height;
+	struct view_t area = *view, source;
+
+	if (!get_view_source(width, height, disp_width, disp_height, filter, &area, &source))
+		return false;
+
+	if ((viewed_data = transform_image_single(img, get_current_frame(img),
+		0, disp_width, disp_height, filter, img->channel, view)) == NULL)
+		/* nothing to do if view is the whole image */
+		return img->full_width <= 0 && area.width == img->width && area.height == img->height;
+
+	img->data[img->current_frame] = viewed_data;
+	return true;
+}
+
+enum enlarge_t str2enlarge(const char *str)
+{
+	if (strcmp(str, "nearest") == 0)
+		return ENLARGE_NEAREST;
+	else if (strcmp(str, "bilinear") == 0)
+		return ENLARGE_BILINEAR;
+	else if (strcmp(str, "lanczos") == 0)
+		return ENLARGE_LANCZOS;
+
+	logging(ERROR, "unknown enlarge filter: %s (reduce only)\n", str);
+	return ENLARGE_NONE;
 }
 
 uint8_t *normalize_bpp_single(struct image *img, uint8_t *data, int bytes_per_pixel)
 {
-	uint8_t *normalized_data, *src, *dst, r, g, b;
+	uint8_t *normalized_data;
+	long stride = (long) img->width * img->channel, dst_stride = (long) img->width * bytes_per_pixel;
+	void (*normalize_row)(uint8_t *dst, const uint8_t *src, int width) =
+		(bytes_per_pixel == 4) ? gray_alpha_to_rgba: (img->channel == 1) ? gray_to_rgb:
+		(img->channel == 2) ? gray_alpha_to_rgb: rgba_to_rgb;
+
+	/* rgba -> rgb: in place (rows never overtake src), then release the rest */
+	if (img->channel == 4 && bytes_per_pixel == 3) {
+		for (int y = 0; y < img->height; y++)
+			rgba_to_rgb(data + y * dst_stride, data + y * stride, img->width);
+		if ((normalized_data = (uint8_t *) erealloc(data, img->height * dst_stride)) == NULL)
+			return data;
+		return normalized_data;
+	}
 
 	if ((normalized_data = (uint8_t *)
 		ecalloc(img->width * img->height, bytes_per_pixel)) == NULL)
 		return NULL;
 
-	if (img->channel <= 2) { /* grayscale (+ alpha) */
-		for (int y = 0; y < img->height; y++) {
-			for (int x = 0; x < img->width; x++) {
-				src = data + img->channel * (y * img->width + x);
-				dst = normalized_data + bytes_per_pixel * (y * img->width + x);
-				*dst = *src; *(dst + 1) = *src; *(dst + 2) = *src;
-			}
-		}
-	} else {                 /* rgb (+ alpha) */
-		for (int y = 0; y < img->height; y++) {
-			for (int x = 0; x < img->width; x++) {
-				get_rgb(img, data, x, y, &r, &g, &b);
-				dst = normalized_data + bytes_per_pixel * (y * img->width + x);
-				*dst = r; *(dst + 1) = g; *(dst + 2) = b;
-			}
-		}
-	}
+	for (int y = 0; y < img->height; y++)
+		normalize_row(normalized_data + y * dst_stride, data + y * stride, img->width);
 	free(data);
 
 	return normalized_data;
@@ -250,16 +1230,20 @@ void normalize_bpp(struct image *img, int bytes_per_pixel, bool normalize_all)
 {
 	uint8_t *normalized_data;
 
-	/* XXX: now only support bytes_per_pixel == 3 */
-	if (bytes_per_pixel != 3)
+	/* XXX: now only support bytes_per_pixel == 3 (rgb) and 4 (rgba of gray + alpha) */
+	if ((bytes_per_pixel != 3 && !(bytes_per_pixel == 4 && img->channel == 2))
+		|| img->channel == bytes_per_pixel)
 		return;
 
 	if (normalize_all) {
+		load_all_frames(img);
 		for (int i = 0; i < img->frame_count; i++)
 			if ((normalized_data = normalize_bpp_single(img, img->data[i], bytes_per_pixel)) != NULL)
 				img->data[i] = normalized_data;
 	} else {
-		if ((normalized_data = normalize_bpp_single(img, img->data[img->current_frame], bytes_per_pixel)) != NULL)
+		if ((normalized_data = normalize_bpp_single(img, get_current_frame(img), bytes_per_pixel)) != NULL)
 			img->data[img->current_frame] = normalized_data;
 	}
+	img->channel = bytes_per_pixel;
+	img->alpha   = (bytes_per_pixel == 4);
 }
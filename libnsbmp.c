@@ -106,6 +106,17 @@ static inline uint32_t read_uint32(uint8_t *data, unsigned int o) {
 	return (uint32_t) (data[o] | (data[o+1] << 8) | (data[o+2] << 16) | (data[o+3] << 24));
 }
 
+/* store a pixel (0xAABBGGRR) in the bitmap format: 4 bytes (RGBA) or 3 bytes (RGB) per pixel */
+static inline void write_pixel(uint8_t *scanline, uint32_t x, uint32_t bpp, uint32_t pixel) {
+	uint8_t *dst = scanline + x * bpp;
+
+	dst[0] = pixel;
+	dst[1] = pixel >> 8;
+	dst[2] = pixel >> 16;
+	if (bpp == 4)
+		dst[3] = pixel >> 24;
+}
+
 static bmp_result next_ico_image(ico_collection *ico, ico_image *image);
 static bmp_result bmp_analyse_header(bmp_image *bmp, unsigned char *data);
 static bmp_result bmp_decode_rgb24(bmp_image *bmp, uint8_t **start, int bytes);
@@ -191,7 +202,11 @@ bmp_result bmp_analyse(bmp_image *bmp, size_t size, unsigned char *cdata) {
  * \return BMP_OK on success
  */
 bmp_result ico_analyse(ico_collection *ico, size_t size, uint8_t *data) {
+	static const uint8_t png_signature[8] = {
+		0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A
+	};
 	uint16_t count, i;
+	uint32_t offset;
 	bmp_result result;
 	int area, max_area = 0;
 
@@ -213,7 +228,7 @@ bmp_result ico_analyse(ico_collection *ico, size_t size, uint8_t *data) {
 		return BMP_INSUFFICIENT_DATA;
 // 	if (read_int16(data, 2) != 0x0000)
 // 		return BMP_DATA_ERROR;
-	if (read_uint16(data, 2) != 0x0001)
+	if (read_uint16(data, 2) != 0x0001 && read_uint16(data, 2) != 0x0002)
 		return BMP_DATA_ERROR;
 	count = read_uint16(data, 4);
 	if (count == 0)
@@ -252,24 +267,31 @@ bmp_result ico_analyse(ico_collection *ico, size_t size, uint8_t *data) {
 		if (image->bmp.height == 0)
 			image->bmp.height = 256;
 		image->bmp.buffer_size = read_uint32(data, 8);
-		image->bmp.bmp_data = ico->ico_data + read_uint32(data, 12);
+		offset = read_uint32(data, 12);
+		image->bmp.bmp_data = ico->ico_data + offset;
 		image->bmp.ico = true;
 		data += ICO_DIR_ENTRY_SIZE;
 
 		/* Ensure that the bitmap data resides in the buffer */
-		if (image->bmp.bmp_data - ico->ico_data >= 0 &&
-				(uint32_t)(image->bmp.bmp_data -
-				ico->ico_data) >= ico->buffer_size)
+		if (offset >= ico->buffer_size)
 			return BMP_DATA_ERROR;
 
-		/* Ensure that we have sufficient data to read the bitmap */
-		if (image->bmp.buffer_size - ICO_DIR_ENTRY_SIZE >= 
-		    ico->buffer_size - (ico->ico_data - data))
-			return BMP_INSUFFICIENT_DATA;
+		/* Truncated bitmap: decode what we have */
+		if (image->bmp.buffer_size > ico->buffer_size - offset)
+			image->bmp.buffer_size = ico->buffer_size - offset;
 
-		result = bmp_analyse_header(&image->bmp, image->bmp.bmp_data);
-		if (result != BMP_OK)
-			return result;
+		/* PNG compressed image (Vista and later): width/height are
+		 * taken from the directory, decoding is left to the caller
+		 */
+		if (image->bmp.buffer_size >= sizeof(png_signature) &&
+				memcmp(image->bmp.bmp_data, png_signature,
+				sizeof(png_signature)) == 0) {
+			image->bmp.png = true;
+		} else {
+			result = bmp_analyse_header(&image->bmp, image->bmp.bmp_data);
+			if (result != BMP_OK)
+				return result;
+		}
 
 		/* adjust the size based on the images available */
 		area = image->bmp.width * image->bmp.height;
@@ -530,12 +552,20 @@ static bmp_result bmp_analyse_header(bmp_image *bmp, uint8_t *data) {
 		for (i = 0; i < bmp->colours; i++) {
 			bmp->colour_table[i] = data[2] | (data[1] << 8) | (data[0] << 16);
 			if (bmp->opaque)
-				bmp->colour_table[i] |= (0xff << 24);
+				bmp->colour_table[i] |= (0xffu << 24);
 			data += palette_size;
-			bmp->colour_table[i] = read_uint32((uint8_t *)&bmp->colour_table[i],0);
 		}
 	}
 
+	/* BMPs within ICOs don't have BMP file headers, so the image data should
+	 * always be right after the colour table. Their bitmaps are created
+	 * by bmp_decode(), only for the image picked from the collection.
+	 */
+	if (bmp->ico) {
+		bmp->bitmap_offset = (intptr_t)data - (intptr_t)bmp->bmp_data;
+		return BMP_OK;
+	}
+
 	/* create our bitmap */
 	flags |= BMP_NEW | BMP_CLEAR_MEMORY;
 	bmp->bitmap = bmp->bitmap_callbacks.bitmap_create(bmp->width, bmp->height, flags);
@@ -545,11 +575,6 @@ static bmp_result bmp_analyse_header(bmp_image *bmp, uint8_t *data) {
 		bmp->colour_table = NULL;
 		return BMP_INSUFFICIENT_MEMORY;
 	}
-	/* BMPs within ICOs don't have BMP file headers, so the image data should
-	 * always be right after the colour table.
-	 */
-	if (bmp->ico)
-		bmp->bitmap_offset = (intptr_t)data - (intptr_t)bmp->bmp_data;
 	return BMP_OK;
 }
 
@@ -603,6 +628,14 @@ bmp_result bmp_decode(bmp_image *bmp) {
 	uint32_t bytes;
 	bmp_result result = BMP_OK;
 
+	if (bmp->png)
+		return BMP_DATA_ERROR;
+	if (bmp->ico && !bmp->bitmap) {
+		bmp->bitmap = bmp->bitmap_callbacks.bitmap_create(bmp->width,
+				bmp->height, BMP_NEW | BMP_CLEAR_MEMORY);
+		if (!bmp->bitmap)
+			return BMP_INSUFFICIENT_MEMORY;
+	}
 	assert(bmp->bitmap);
 
 	data = bmp->bmp_data + bmp->bitmap_offset;
@@ -673,16 +706,16 @@ bmp_result bmp_decode_trans(bmp_image *bmp, uint32_t colour) {
  *			in this case, the image may be partially viewable
  */
 static bmp_result bmp_decode_rgb24(bmp_image *bmp, uint8_t **start, int bytes) {
-	uint8_t *top, *bottom, *end, *data;
-	uint32_t *scanline;
+	uint8_t *top, *bottom, *end, *data, *scanline;
 	uint32_t x, y;
-	uint32_t swidth, skip;
+	uint32_t bpp, swidth, skip;
 	intptr_t addr;
 	uint8_t i;
-	uint32_t word;
+	uint32_t word, pixel;
 
 	data = *start;
-	swidth = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap) * bmp->width;
+	bpp = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap);
+	swidth = bpp * bmp->width;
 	top = bmp->bitmap_callbacks.bitmap_get_buffer(bmp->bitmap);
 	if (!top)
 		return BMP_INSUFFICIENT_MEMORY;
@@ -708,32 +741,42 @@ static bmp_result bmp_decode_rgb24(bmp_image *bmp, uint8_t **start, int bytes) {
 		if ((data + (skip * bmp->width)) > end)
 			return BMP_INSUFFICIENT_DATA;
 		if (bmp->reversed)
-			scanline = (void *)(top + (y * swidth));
+			scanline = top + (y * swidth);
 		else
-			scanline = (void *)(bottom - (y * swidth));
+			scanline = bottom - (y * swidth);
 		if (bmp->encoding == BMP_ENCODING_BITFIELDS) {
 			for (x = 0; x < bmp->width; x++) {
 				word = read_uint32(data, 0);
+				pixel = 0;
 				for (i = 0; i < 4; i++)
 					if (bmp->shift[i] > 0)
-						scanline[x] |= ((word & bmp->mask[i]) << bmp->shift[i]);
+						pixel |= ((word & bmp->mask[i]) << bmp->shift[i]);
 					else
-						scanline[x] |= ((word & bmp->mask[i]) >> (-bmp->shift[i]));
+						pixel |= ((word & bmp->mask[i]) >> (-bmp->shift[i]));
 				/* 32-bit BMPs have alpha masks, but sometimes they're not utilized */
 				if (bmp->opaque)
-					scanline[x] |= (0xff << 24);
+					pixel |= (0xffu << 24);
+				data += skip;
+				write_pixel(scanline, x, bpp, pixel);
+			}
+		} else if (bpp == 3 && !bmp->limited_trans) {
+			/* BGR(X) -> RGB: no alpha to fill */
+			for (x = 0; x < bmp->width; x++) {
+				scanline[0] = data[2];
+				scanline[1] = data[1];
+				scanline[2] = data[0];
+				scanline += 3;
 				data += skip;
-				scanline[x] = read_uint32((uint8_t *)&scanline[x],0);
 			}
 		} else {
 			for (x = 0; x < bmp->width; x++) {
-				scanline[x] = data[2] | (data[1] << 8) | (data[0] << 16);
-				if ((bmp->limited_trans) && (scanline[x] == bmp->transparent_index))
-					scanline[x] = bmp->trans_colour;
+				pixel = data[2] | (data[1] << 8) | (data[0] << 16);
+				if ((bmp->limited_trans) && (pixel == bmp->transparent_index))
+					pixel = bmp->trans_colour;
 				if (bmp->opaque)
-					scanline[x] |= (0xff << 24);
+					pixel |= (0xffu << 24);
 				data += skip;
-				scanline[x] = read_uint32((uint8_t *)&scanline[x],0);
+				write_pixel(scanline, x, bpp, pixel);
 			}
 		}
 	}
@@ -753,15 +796,16 @@ static bmp_result bmp_decode_rgb24(bmp_image *bmp, uint8_t **start, int bytes) {
  *			in this case, the image may be partially viewable
  */
 static bmp_result bmp_decode_rgb16(bmp_image *bmp, uint8_t **start, int bytes) {
-	uint8_t *top, *bottom, *end, *data;
-	uint32_t *scanline;
-	uint32_t x, y, swidth;
+	uint8_t *top, *bottom, *end, *data, *scanline;
+	uint32_t x, y, bpp, swidth;
 	intptr_t addr;
 	uint8_t i;
 	uint16_t word;
+	uint32_t pixel;
 
 	data = *start;
-	swidth = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap) * bmp->width;
+	bpp = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap);
+	swidth = bpp * bmp->width;
 	top = bmp->bitmap_callbacks.bitmap_get_buffer(bmp->bitmap);
 	if (!top)
 		return BMP_INSUFFICIENT_MEMORY;
@@ -783,42 +827,42 @@ static bmp_result bmp_decode_rgb16(bmp_image *bmp, uint8_t **start, int bytes) {
 		if ((data + (2 * bmp->width)) > end)
 			return BMP_INSUFFICIENT_DATA;
 		if (bmp->reversed)
-			scanline = (void *)(top + (y * swidth));
+			scanline = top + (y * swidth);
 		else
-			scanline = (void *)(bottom - (y * swidth));
+			scanline = bottom - (y * swidth);
 		if (bmp->encoding == BMP_ENCODING_BITFIELDS) {
 			for (x = 0; x < bmp->width; x++) {
 				word = read_uint16(data, 0);
 				if ((bmp->limited_trans) && (word == bmp->transparent_index))
-					scanline[x] = bmp->trans_colour;
+					pixel = bmp->trans_colour;
 				else {
-					scanline[x] = 0;
+					pixel = 0;
 					for (i = 0; i < 4; i++)
 						if (bmp->shift[i] > 0)
-							scanline[x] |= ((word & bmp->mask[i]) << bmp->shift[i]);
+							pixel |= ((word & bmp->mask[i]) << bmp->shift[i]);
 						else
-							scanline[x] |= ((word & bmp->mask[i]) >> (-bmp->shift[i]));
+							pixel |= ((word & bmp->mask[i]) >> (-bmp->shift[i]));
 					if (bmp->opaque)
-						scanline[x] |= (0xff << 24);
+						pixel |= (0xffu << 24);
 				}
 				data += 2;
-				scanline[x] = read_uint32((uint8_t *)&scanline[x],0);
+				write_pixel(scanline, x, bpp, pixel);
 			}
 		} else {
 			for (x = 0; x < bmp->width; x++) {
 				word = read_uint16(data, 0);
 				if ((bmp->limited_trans) && (word == bmp->transparent_index))
-					scanline[x] = bmp->trans_colour;
+					pixel = bmp->trans_colour;
 				else {
 					/* 16-bit RGB defaults to RGB555 */
-					scanline[x] = ((word & (31 << 0)) << 19) |
+					pixel = ((word & (31 << 0)) << 19) |
 							((word & (31 << 5)) << 6) |
 							((word & (31 << 10)) >> 7);
 				}
 				if (bmp->opaque)
-					scanline[x] |= (0xff << 24);
+					pixel |= (0xffu << 24);
 				data += 2;
-				scanline[x] = read_uint32((uint8_t *)&scanline[x],0);
+				write_pixel(scanline, x, bpp, pixel);
 			}
 		}
 	}
@@ -838,10 +882,9 @@ static bmp_result bmp_decode_rgb16(bmp_image *bmp, uint8_t **start, int bytes) {
  *			in this case, the image may be partially viewable
  */
 static bmp_result bmp_decode_rgb(bmp_image *bmp, uint8_t **start, int bytes) {
-	uint8_t *top, *bottom, *end, *data;
-	uint32_t *scanline;
+	uint8_t *top, *bottom, *end, *data, *scanline;
 	intptr_t addr;
-	uint32_t x, y, swidth;
+	uint32_t x, y, bpp, swidth, pixel;
 	uint8_t bit_shifts[8];
 	uint8_t ppb = 8 / bmp->bpp;
 	uint8_t bit_mask = (1 << bmp->bpp) - 1;
@@ -851,7 +894,8 @@ static bmp_result bmp_decode_rgb(bmp_image *bmp, uint8_t **start, int bytes) {
 	    bit_shifts[i] = 8 - ((i + 1) * bmp->bpp);
 
 	data = *start;
-	swidth = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap) * bmp->width;
+	bpp = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap);
+	swidth = bpp * bmp->width;
 	top = bmp->bitmap_callbacks.bitmap_get_buffer(bmp->bitmap);
 	if (!top)
 		return BMP_INSUFFICIENT_MEMORY;
@@ -871,17 +915,18 @@ static bmp_result bmp_decode_rgb(bmp_image *bmp, uint8_t **start, int bytes) {
 		if ((data + (bmp->width / ppb)) > end)
 			return BMP_INSUFFICIENT_DATA;
 		if (bmp->reversed)
-			scanline = (void *)(top + (y * swidth));
+			scanline = top + (y * swidth);
 		else
-			scanline = (void *)(bottom - (y * swidth));
+			scanline = bottom - (y * swidth);
 		for (x = 0; x < bmp->width; x++) {
 			if (bit >= ppb) {
 				bit = 0;
 				cur_byte = *data++;
 			}
-			scanline[x] = bmp->colour_table[(cur_byte >> bit_shifts[bit++]) & bit_mask];
-			if ((bmp->limited_trans) && (scanline[x] == bmp->transparent_index))
-				scanline[x] = bmp->trans_colour;
+			pixel = bmp->colour_table[(cur_byte >> bit_shifts[bit++]) & bit_mask];
+			if ((bmp->limited_trans) && (pixel == bmp->transparent_index))
+				pixel = bmp->trans_colour;
+			write_pixel(scanline, x, bpp, pixel);
 		}
 	}
 	*start = data;
@@ -898,13 +943,16 @@ static bmp_result bmp_decode_rgb(bmp_image *bmp, uint8_t **start, int bytes) {
  * \return BMP_OK on success
  */
 static bmp_result bmp_decode_mask(bmp_image *bmp, uint8_t *data, int bytes) {
-	uint8_t *top, *bottom, *end;
-	uint32_t *scanline;
+	uint8_t *top, *bottom, *end, *scanline;
 	intptr_t addr;
-	uint32_t x, y, swidth;
+	uint32_t x, y, bpp, swidth;
 	uint32_t cur_byte = 0;
 
-	swidth = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap) * bmp->width;
+	/* no alpha channel to apply the mask */
+	bpp = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap);
+	if (bpp != 4)
+		return BMP_OK;
+	swidth = bpp * bmp->width;
 	top = bmp->bitmap_callbacks.bitmap_get_buffer(bmp->bitmap);
 	if (!top)
 		return BMP_INSUFFICIENT_MEMORY;
@@ -917,15 +965,12 @@ static bmp_result bmp_decode_mask(bmp_image *bmp, uint8_t *data, int bytes) {
 			data++;
 		if ((data + (bmp->width >> 3)) > end)
 			return BMP_INSUFFICIENT_DATA;
-		scanline = (void *)(bottom - (y * swidth));
+		scanline = bottom - (y * swidth);
 		for (x = 0; x < bmp->width; x++) {
 			if ((x & 7) == 0)
 				cur_byte = *data++;
-			if ((cur_byte & 128) == 0) {
-				scanline[x] = read_uint32((uint8_t *)&scanline[x], 0);
-				scanline[x] |= (0xff << 24);
-				scanline[x] = read_uint32((uint8_t *)&scanline[x], 0);
-			}
+			if ((cur_byte & 128) == 0)
+				scanline[x * 4 + 3] = 0xff;
 			cur_byte = cur_byte << 1;
 		}
 	}
@@ -945,9 +990,8 @@ static bmp_result bmp_decode_mask(bmp_image *bmp, uint8_t *data, int bytes) {
  *			in this case, the image may be partially viewable
  */
 static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int size) {
-	uint8_t *top, *bottom, *end;
-	uint32_t *scanline;
-	uint32_t swidth;
+	uint8_t *top, *bottom, *end, *scanline;
+	uint32_t bpp, swidth;
 	uint32_t i, length, pixels_left;
 	uint32_t x = 0, y = 0, last_y = 0;
 	uint32_t pixel = 0, pixel2;
@@ -955,7 +999,8 @@ static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int s
 	if (bmp->ico)
 		return BMP_DATA_ERROR;
 
-	swidth = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap) * bmp->width;
+	bpp = bmp->bitmap_callbacks.bitmap_get_bpp(bmp->bitmap);
+	swidth = bpp * bmp->width;
 	top = bmp->bitmap_callbacks.bitmap_get_buffer(bmp->bitmap);
 	if (!top)
 		return BMP_INSUFFICIENT_MEMORY;
@@ -994,10 +1039,10 @@ static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int s
 				/* 00 - NN means escape NN pixels */
 				if (bmp->reversed) {
 					pixels_left = (y + 1) * bmp->width - x;
-					scanline = (void *)(top + (y * swidth));
+					scanline = top + (y * swidth);
 				} else {
 					pixels_left = (bmp->height - y + 1) * bmp->width - x;
-					scanline = (void *)(bottom - (y * swidth));
+					scanline = bottom - (y * swidth);
 				}
 				if (length > pixels_left)
 					length = pixels_left;
@@ -1013,9 +1058,9 @@ static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int s
 							x = 0;
 							if (++y > bmp->height)
 								return BMP_DATA_ERROR;
-							scanline -= bmp->width;
+							scanline -= swidth;
 						}
-						scanline[x++] = bmp->colour_table[(int)*data++];
+						write_pixel(scanline, x++, bpp, bmp->colour_table[(int)*data++]);
 					}
 				} else {
 					for (i = 0; i < length; i++) {
@@ -1023,15 +1068,13 @@ static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int s
 							x = 0;
 							if (++y > bmp->height)
 								return BMP_DATA_ERROR;
-							scanline -= bmp->width;
+							scanline -= swidth;
 						}
 						if ((i & 1) == 0) {
 							pixel = *data++;
-							scanline[x++] = bmp->colour_table
-									[pixel >> 4];
+							write_pixel(scanline, x++, bpp, bmp->colour_table[pixel >> 4]);
 						} else {
-							scanline[x++] = bmp->colour_table
-									[pixel & 0xf];
+							write_pixel(scanline, x++, bpp, bmp->colour_table[pixel & 0xf]);
 						}
 					}
 					length = (length + 1) >> 1;
@@ -1044,10 +1087,10 @@ static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int s
 			/* NN means perform RLE for NN pixels */
 			if (bmp->reversed) {
 				pixels_left = (y + 1) * bmp->width - x;
-				scanline = (void *)(top + (y * swidth));
+				scanline = top + (y * swidth);
 			} else {
 				pixels_left = (bmp->height - y + 1) * bmp->width - x;
-				scanline = (void *)(bottom - (y * swidth));
+				scanline = bottom - (y * swidth);
 			}
 			if (length > pixels_left)
 				length = pixels_left;
@@ -1066,9 +1109,9 @@ static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int s
 						x = 0;
 						if (++y > bmp->height)
 							return BMP_DATA_ERROR;
-						scanline -= bmp->width;
+						scanline -= swidth;
 					}
-					scanline[x++] = pixel;
+					write_pixel(scanline, x++, bpp, pixel);
 				}
 			} else {
 				pixel2 = *data++;
@@ -1079,12 +1122,12 @@ static bmp_result bmp_decode_rle(bmp_image *bmp, uint8_t *data, int bytes, int s
 						x = 0;
 						if (++y > bmp->height)
 							return BMP_DATA_ERROR;
-						scanline -= bmp->width;
+						scanline -= swidth;
 					}
 					if ((i & 1) == 0)
-						scanline[x++] = pixel;
+						write_pixel(scanline, x++, bpp, pixel);
 					else
-						scanline[x++] = pixel2;
+						write_pixel(scanline, x++, bpp, pixel2);
 				}
 			}
 		}
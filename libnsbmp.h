@@ -52,7 +52,7 @@ typedef struct bmp_bitmap_callback_vt_s {
 	bmp_bitmap_cb_create bitmap_create;			/**< Create a bitmap. */
 	bmp_bitmap_cb_destroy bitmap_destroy;			/**< Free a bitmap. */
 	bmp_bitmap_cb_get_buffer bitmap_get_buffer;		/**< Return a pointer to the pixel data in a bitmap. */
-	bmp_bitmap_cb_get_bpp bitmap_get_bpp;			/**< Find the width of a pixel row in bytes. */
+	bmp_bitmap_cb_get_bpp bitmap_get_bpp;			/**< Bytes per pixel of a bitmap: 4 (RGBA) or 3 (RGB, alpha is dropped). */
 } bmp_bitmap_callback_vt;
 
 typedef struct bmp_image {
@@ -75,6 +75,7 @@ typedef struct bmp_image {
 							  * using limited transparency */
 	bool reversed;					/** scanlines are top to bottom */
 	bool ico;					/** image is part of an ICO, mask follows */
+	bool png;					/** image is a PNG in an ICO, not decoded by libnsbmp */
 	bool opaque;					/** true if the bitmap does not contain an alpha channel */
 	uint32_t mask[4];				/** four bitwise mask */
 	int32_t shift[4];				/** four bitwise shifts */
@@ -80,6 +80,11 @@
 */
 #define GIF_MAX_LZW 12
 
+/*	Bytes allocated past the end of the decoded indices, so that short
+	strings can be copied with a fixed size
+*/
+#define GIF_LZW_SLACK 16
+
 /* Transparent colour
 */
 #define GIF_TRANSPARENT_COLOUR 0x00
@@ -111,37 +116,30 @@ static gif_result gif_initialise_frame(gif_animation *gif);
 static gif_result gif_initialise_frame_extensions(gif_animation *gif, const int frame);
 static gif_result gif_skip_frame_extensions(gif_animation *gif);
 static unsigned int gif_interlaced_line(int height, int y);
+static gif_result gif_internal_decode_frame(gif_animation *gif, unsigned int frame, bool clear_image);
 
 
 
 /*	Internal LZW routines
 */
-static void gif_init_LZW(gif_animation *gif);
-static bool gif_next_LZW(gif_animation *gif);
-static int gif_next_code(gif_animation *gif, int code_size);
+static gif_result gif_decode_LZW(gif_animation *gif, unsigned int count, unsigned int *decoded);
 
-/*	General LZW values. They are shared for all GIFs being decoded, and
-	thus we can't handle progressive decoding efficiently without having
-	the data for each image which would use an extra 10Kb or so per GIF.
-*/
-static unsigned char buf[4];
-static unsigned char *direct;
-static int maskTbl[16] = {0x0000, 0x0001, 0x0003, 0x0007, 0x000f, 0x001f, 0x003f, 0x007f,
-			  0x00ff, 0x01ff, 0x03ff, 0x07ff, 0x0fff, 0x1fff, 0x3fff, 0x7fff};
-static int table[2][(1 << GIF_MAX_LZW)];
-static unsigned char stack[(1 << GIF_MAX_LZW) * 2];
-static unsigned char *stack_pointer;
-static int code_size, set_code_size;
-static int max_code, max_code_size;
-static int clear_code, end_code;
-static int curbit, lastbit, last_byte;
-static int firstcode, oldcode;
-static bool zero_data_block = false;
-static bool get_done;
-
-/*	Whether to clear the decoded image rather than plot
+/*	LZW decoder state. It is held by each animation (allocated by the first
+	gif_decode_frame() and released by gif_finalise()), so that different
+	animations can be decoded on different threads.
+
+	A frame is decoded into 'indices' as a whole. Every code string is a run
+	of indices already written there (or a root entry), so the table only
+	keeps a pointer and a length per code and strings are emitted by memcpy()
+	instead of walking prefix chains one symbol at a time.
 */
-static bool clear_image = false;
+struct gif_lzw_context {
+	const unsigned char *string[1 << GIF_MAX_LZW];	/**< first index of the code string */
+	unsigned short length[1 << GIF_MAX_LZW];	/**< length of the code string */
+	unsigned char root[1 << GIF_MAX_LZW];		/**< strings of the root codes */
+	unsigned char *indices;				/**< colour indices of the frame */
+	unsigned int indices_size;
+};
 
 
 
@@ -748,6 +746,14 @@ static gif_result gif_initialise_frame_extensions(gif_animation *gif, const int
 			gif->current_error is set to GIF_FRAME_NO_DISPLAY
 */
 gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
+	return gif_internal_decode_frame(gif, frame, false);
+}
+
+/**	Decodes a GIF frame, or clears its area (clear_image) for the disposal of
+	the previous frame.
+*/
+static gif_result gif_internal_decode_frame(gif_animation *gif, unsigned int frame, bool clear_image) {
+	struct gif_lzw_context *lzw;
 	unsigned int index = 0;
 	unsigned char *gif_data, *gif_end;
 	int gif_bytes;
@@ -758,9 +764,10 @@ gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
 	unsigned int *frame_scanline;
 	unsigned int save_buffer_position;
 	unsigned int return_value = 0;
-	unsigned int x, y, decode_y, burst_bytes;
+	unsigned int x, y, decode_y, decoded, burst_bytes, transparent;
 	int last_undisposed_frame = (frame - 1);
-	register unsigned char colour;
+	unsigned char *indices;
+	unsigned char colour;
 
 	/*	Ensure this frame is supposed to be decoded
 	*/
@@ -903,6 +910,18 @@ gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
 	/*	If we are clearing the image we just clear, if not decode
 	*/
 	if (!clear_image) {
+		/*	Allocate the LZW decoder state on first use
+		*/
+		if (gif->lzw == NULL) {
+			if ((gif->lzw = calloc(1, sizeof(struct gif_lzw_context))) == NULL) {
+				return_value = GIF_INSUFFICIENT_MEMORY;
+				goto gif_decode_frame_exit;
+			}
+			for (index = 0; index < (1 << GIF_MAX_LZW); index++)
+				gif->lzw->root[index] = index;
+		}
+		lzw = gif->lzw;
+
 		/*	Ensure we have enough data for a 1-byte LZW code size + 1-byte gif trailer
 		*/
 		if (gif_bytes < 2) {
@@ -925,16 +944,14 @@ gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
 			 * transparency we likely wouldn't want to do that. */
 			/* memset((char*)frame_data, colour_table[gif->background_index], gif->width * gif->height * sizeof(int)); */
 		} else if ((frame != 0) && (gif->frames[frame - 1].disposal_method == GIF_FRAME_CLEAR)) {
-			clear_image = true;
-			if ((return_value = gif_decode_frame(gif, (frame - 1))) != GIF_OK)
+			if ((return_value = gif_internal_decode_frame(gif, (frame - 1), true)) != GIF_OK)
 				goto gif_decode_frame_exit;
-			clear_image = false;
 		/*	If the previous frame's disposal method requires we restore the previous
 		 *	image, find the last image set to "do not dispose" and get that frame data
 		*/
 		} else if ((frame != 0) && (gif->frames[frame - 1].disposal_method == GIF_FRAME_RESTORE)) {
-			while ((last_undisposed_frame != -1) && (gif->frames[--last_undisposed_frame].disposal_method == GIF_FRAME_RESTORE))
-				;
+			while ((last_undisposed_frame != -1) && (gif->frames[last_undisposed_frame].disposal_method == GIF_FRAME_RESTORE))
+				last_undisposed_frame--;
 
 			/*	If we don't find one, clear the frame data
 			 */
@@ -942,7 +959,7 @@ gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
 				/* see notes above on transparency vs. background color */
 				memset((char*)frame_data, GIF_TRANSPARENT_COLOUR, gif->width * gif->height * sizeof(int));
 			} else {
-				if ((return_value = gif_decode_frame(gif, last_undisposed_frame)) != GIF_OK)
+				if ((return_value = gif_internal_decode_frame(gif, last_undisposed_frame, false)) != GIF_OK)
 					goto gif_decode_frame_exit;
 				/*	Get this frame's data
 				*/
@@ -954,63 +971,46 @@ gif_result gif_decode_frame(gif_animation *gif, unsigned int frame) {
 		}
 		gif->decoded_frame = frame;
 
-		/*	Initialise the LZW decoding
+		/*	Decompress the data into colour indices
 		*/
-		set_code_size = gif_data[0];
-		gif->buffer_position = (gif_data - gif->gif_data) + 1;
+		gif->buffer_position = gif_data - gif->gif_data;
+		if (width * height > lzw->indices_size) {
+			free(lzw->indices);
+			if ((lzw->indices = malloc(width * height + GIF_LZW_SLACK)) == NULL) {
+				lzw->indices_size = 0;
+				return_value = GIF_INSUFFICIENT_MEMORY;
+				goto gif_decode_frame_exit;
+			}
+			lzw->indices_size = width * height;
+		}
+		return_value = gif_decode_LZW(gif, width * height, &decoded);
 
-		/*	Set our code variables
-		*/
-		code_size = set_code_size + 1;
-		clear_code = (1 << set_code_size);
-		end_code = clear_code + 1;
-		max_code_size = clear_code << 1;
-		max_code = clear_code + 2;
-		curbit = lastbit = 0;
-		last_byte = 2;
-		get_done = false;
-		direct = buf;
-		gif_init_LZW(gif);
-
-		/*	Decompress the data
+		/*	Plot the decoded pixels, looking up the colour table as we go.
+			Pixels beyond the end of truncated data are left untouched.
 		*/
-		for (y = 0; y < height; y++) {
+		transparent = (gif->frames[frame].transparency) ?
+				gif->frames[frame].transparency_index : GIF_MAX_COLOURS;
+		indices = lzw->indices;
+		for (y = 0; (y < height) && (decoded > 0); y++) {
 			if (interlace)
 				decode_y = gif_interlaced_line(height, y) + offset_y;
 			else
 				decode_y = y + offset_y;
 			frame_scanline = frame_data + offset_x + (decode_y * gif->width);
 
-			/*	Rather than decoding pixel by pixel, we try to burst out streams
-				of data to remove the need for end-of data checks every pixel.
-			*/
-			x = width;
-			while (x > 0) {
-				burst_bytes = (stack_pointer - stack);
-				if (burst_bytes > 0) {
-					if (burst_bytes > x)
-						burst_bytes = x;
-					x -= burst_bytes;
-					while (burst_bytes-- > 0) {
-						colour = *--stack_pointer;
-						if (((gif->frames[frame].transparency) &&
-							(colour != gif->frames[frame].transparency_index)) ||
-							(!gif->frames[frame].transparency))
-								*frame_scanline = colour_table[colour];
-						frame_scanline++;
-					}
-				} else {
-					if (!gif_next_LZW(gif)) {
-						/*	Unexpected end of frame, try to recover
-						*/
-						if (gif->current_error == GIF_END_OF_FRAME)
-							return_value = GIF_OK;
-						else
-							return_value = gif->current_error;
-						goto gif_decode_frame_exit;
-					}
+			burst_bytes = (decoded < width) ? decoded : width;
+			decoded -= burst_bytes;
+			if (transparent == GIF_MAX_COLOURS) {
+				for (x = 0; x < burst_bytes; x++)
+					frame_scanline[x] = colour_table[indices[x]];
+			} else {
+				for (x = 0; x < burst_bytes; x++) {
+					colour = indices[x];
+					if (colour != transparent)
+						frame_scanline[x] = colour_table[colour];
 				}
 			}
+			indices += width;
 		}
 	} else {
 		/*	Clear our frame
@@ -1136,151 +1136,128 @@ void gif_finalise(gif_animation *gif) {
 	gif->local_colour_table = NULL;
 	free(gif->global_colour_table);
 	gif->global_colour_table = NULL;
+	if (gif->lzw)
+		free(gif->lzw->indices);
+	free(gif->lzw);
+	gif->lzw = NULL;
 }
 
-/**
- * Initialise LZW decoding
- */
-void gif_init_LZW(gif_animation *gif) {
-	int i;
-
-	gif->current_error = 0;
-	if (clear_code >= (1 << GIF_MAX_LZW)) {
-		stack_pointer = stack;
-		gif->current_error = GIF_FRAME_DATA_ERROR;
-		return;
-	}
+/**	Decodes the LZW data of a frame into lzw->indices
 
-	/* initialise our table */
-	memset(table, 0x00, (1 << GIF_MAX_LZW) * 8);
-	for (i = 0; i < clear_code; ++i)
-		table[1][i] = i;
+	The 'buffer_position' must point to the LZW minimum code size. Codes are
+	read through a 64-bit bit buffer, refilled from the data sub-blocks.
 
-	/* update our LZW parameters */
+	@param count    number of indices the frame needs
+	@param decoded  set to the number of indices decoded
+	@return GIF_FRAME_DATA_ERROR for invalid LZW data or a premature end code
+		GIF_INSUFFICIENT_FRAME_DATA for insufficient data to complete the frame
+		GIF_OK for successful decoding (also if the data ends without an end code)
+*/
+static gif_result gif_decode_LZW(gif_animation *gif, unsigned int count, unsigned int *decoded) {
+	struct gif_lzw_context *lzw = gif->lzw;
+	unsigned char *gif_data = gif->gif_data + gif->buffer_position;
+	unsigned char *gif_end = gif->gif_data + gif->buffer_size;
+	unsigned char *out = lzw->indices, *out_end = lzw->indices + count;
+	const unsigned char *string, *prev_string = NULL;
+	unsigned int prev_length = 0, length, index, block_bytes = 0;
+	unsigned int set_code_size, code_size, clear_code, end_code, max_code, code;
+	uint64_t bits = 0;
+	unsigned int bit_count = 0;
+	bool get_done = false;
+	gif_result return_value = GIF_OK;
+
+	set_code_size = *gif_data++;
+	if (set_code_size >= GIF_MAX_LZW) {
+		return_value = GIF_FRAME_DATA_ERROR;
+		goto gif_decode_LZW_exit;
+	}
+	clear_code = (1 << set_code_size);
+	end_code = clear_code + 1;
 	code_size = set_code_size + 1;
-	max_code_size = clear_code << 1;
 	max_code = clear_code + 2;
-	stack_pointer = stack;
-	do {
-		firstcode = oldcode = gif_next_code(gif, code_size);
-	} while (firstcode == clear_code);
-	*stack_pointer++ =firstcode;
-}
-
-
-static bool gif_next_LZW(gif_animation *gif) {
-	int code, incode;
-	int block_size;
-	int new_code;
-
-	code = gif_next_code(gif, code_size);
-	if (code < 0) {
-	  	gif->current_error = code;
-		return false;
-	} else if (code == clear_code) {
-		gif_init_LZW(gif);
-		return true;
-	} else if (code == end_code) {
-		/* skip to the end of our data so multi-image GIFs work */
-		if (zero_data_block) {
-			gif->current_error = GIF_FRAME_DATA_ERROR;
-			return false;
-		}
-		block_size = 0;
-		while (block_size != 1) {
-			block_size = gif->gif_data[gif->buffer_position] + 1;
-			gif->buffer_position += block_size;
-		}
-		gif->current_error = GIF_FRAME_DATA_ERROR;
-		return false;
+	for (code = 0; code < clear_code; code++) {
+		lzw->string[code] = &lzw->root[code];
+		lzw->length[code] = 1;
 	}
 
-	incode = code;
-	if (code >= max_code) {
-		*stack_pointer++ = firstcode;
-		code = oldcode;
-	}
-
-	/* The following loop is the most important in the GIF decoding cycle as every
-	 * single pixel passes through it.
-	 *
-	 * Note: our stack is always big enough to hold a complete decompressed chunk. */
-	while (code >= clear_code) {
-		*stack_pointer++ = table[1][code];
-		new_code = table[0][code];
-		if (new_code < clear_code) {
-			code = new_code;
-			break;
+	while (out < out_end) {
+		/*	Refill the bit buffer from the data sub-blocks
+		*/
+		while ((bit_count < code_size) && !get_done) {
+			if (block_bytes == 0) {
+				if ((gif_data >= gif_end) || (gif_data + gif_data[0] >= gif_end)) {
+					return_value = GIF_INSUFFICIENT_FRAME_DATA;
+					goto gif_decode_LZW_exit;
+				}
+				if ((block_bytes = *gif_data++) == 0) {
+					get_done = true;
+					break;
+				}
+			}
+			while ((bit_count <= 56) && (block_bytes > 0)) {
+				bits |= (uint64_t)*gif_data++ << bit_count;
+				bit_count += 8;
+				block_bytes--;
+			}
 		}
-		*stack_pointer++ = table[1][new_code];
-		code = table[0][new_code];
-		if (code == new_code) {
-		  	gif->current_error = GIF_FRAME_DATA_ERROR;
-			return false;
+		if (bit_count < code_size)
+			goto gif_decode_LZW_exit;	/* end of data: treated as end of frame */
+
+		code = bits & ((1 << code_size) - 1);
+		bits >>= code_size;
+		bit_count -= code_size;
+
+		if (code == clear_code) {
+			code_size = set_code_size + 1;
+			max_code = clear_code + 2;
+			prev_string = NULL;
+			continue;
+		} else if (code == end_code) {
+			return_value = GIF_FRAME_DATA_ERROR;
+			goto gif_decode_LZW_exit;
 		}
-	}
 
-	*stack_pointer++ = firstcode = table[1][code];
-
-	if ((code = max_code) < (1 << GIF_MAX_LZW)) {
-		table[0][code] = oldcode;
-		table[1][code] = firstcode;
-		++max_code;
-		if ((max_code >= max_code_size) && (max_code_size < (1 << GIF_MAX_LZW))) {
-			max_code_size = max_code_size << 1;
-			++code_size;
+		/*	Emit the string of the code. A code not in the table yet is the
+			previous string plus its own first index: copy it forwards, so
+			the index we need has been written when we get there.
+		*/
+		if (code < max_code) {
+			string = lzw->string[code];
+			length = lzw->length[code];
+			if (length > (unsigned int)(out_end - out))
+				length = out_end - out;
+			/* short strings (most of them) are moved with a fixed size */
+			if (length <= GIF_LZW_SLACK)
+				memmove(out, string, GIF_LZW_SLACK);
+			else
+				memcpy(out, string, length);
+		} else {
+			if (prev_string == NULL) {
+				return_value = GIF_FRAME_DATA_ERROR;
+				goto gif_decode_LZW_exit;
+			}
+			string = prev_string;
+			length = prev_length + 1;
+			if (length > (unsigned int)(out_end - out))
+				length = out_end - out;
+			for (index = 0; index < length; index++)
+				out[index] = string[index];
 		}
-	}
-	oldcode = incode;
-	return true;
-}
 
-static int gif_next_code(gif_animation *gif, int code_size) {
-	int i, j, end, count, ret;
-	unsigned char *b;
-
-	end = curbit + code_size;
-	if (end >= lastbit) {
-		if (get_done)
-			return GIF_END_OF_FRAME;
-		buf[0] = direct[last_byte - 2];
-		buf[1] = direct[last_byte - 1];
-
-		/* get the next block */
-		direct = gif->gif_data + gif->buffer_position;
-		zero_data_block = ((count = direct[0]) == 0);
-		if ((gif->buffer_position + count) >= gif->buffer_size)
-			return GIF_INSUFFICIENT_FRAME_DATA;
-		if (count == 0)
-			get_done = true;
-		else {
-			direct -= 1;
-			buf[2] = direct[2];
-			buf[3] = direct[3];
+		/*	Add the previous string plus our first index, which are adjacent
+		*/
+		if ((prev_string != NULL) && (max_code < (1 << GIF_MAX_LZW))) {
+			lzw->string[max_code] = prev_string;
+			lzw->length[max_code] = prev_length + 1;
+			if ((++max_code >= (1u << code_size)) && (code_size < GIF_MAX_LZW))
+				++code_size;
 		}
-		gif->buffer_position += count + 1;
-
-		/* update our variables */
-		last_byte = 2 + count;
-		curbit = (curbit - lastbit) + 16;
-		lastbit = (2 + count) << 3;
-		end = curbit + code_size;
+		prev_string = out;
+		prev_length = length;
+		out += length;
 	}
 
-	i = curbit >> 3;
-	if (i < 2)
-		b = buf;
-	else
-		b = direct;
-
-	ret = b[i];
-	j = (end >> 3) - 1;
-	if (i <= j) {
-		ret |= (b[i + 1] << 8);
-		if (i < j)
-			ret |= (b[i + 2] << 16);
-	}
-	ret = (ret >> (curbit % 8)) & maskTbl[code_size];
-	curbit += code_size;
-	return ret;
+gif_decode_LZW_exit:
+	*decoded = out - lzw->indices;
+	return return_value;
 }
@@ -73,6 +73,10 @@ typedef struct gif_bitmap_callback_vt {
 	gif_bitmap_cb_modified bitmap_modified;	/**< The bitmap image has changed, so flush any persistant cache. */
 } gif_bitmap_callback_vt;
 
+/*	LZW decoder state (private to libnsgif.c)
+*/
+struct gif_lzw_context;
+
 /*	The GIF animation data
 */
 typedef struct gif_animation {
@@ -98,6 +102,7 @@ typedef struct gif_animation {
 	bool global_colours;				/**< whether the GIF has a global colour table */
 	unsigned int *global_colour_table;		/**< global colour table */
 	unsigned int *local_colour_table;		/**< local colour table */
+	struct gif_lzw_context *lzw;			/**< LZW decoder state (allocated on first decode) */
 } gif_animation;
 
 void gif_create(gif_animation *gif, gif_bitmap_callback_vt *bitmap_callbacks);
@@ -19,7 +19,11 @@ enum {
 	CHECK_HEADER_SIZE = 8,
 	BYTES_PER_PIXEL   = 4,
 	PNG_HEADER_SIZE   = 8,
-	MAX_FRAME_NUM     = 128, /* limit of gif frames */
+	FRAME_CACHE_SIZE  = 32 * 1024 * 1024, /* bytes of gif frame deltas kept in memory */
+	FRAME_CACHE_NUM   = 4,   /* composited gif frames kept in data[] */
+	PREVIEW_MIN_SIZE  = 64,  /* min width/height of preview for band streaming */
+	JPEG_MIN_PARALLEL = 4 * 1024 * 1024, /* pixels of the smallest jpeg decoded in parallel */
+	JPEG_MAX_THREADS  = 64,
 };
 
 enum filetype_t {
@@ -28,25 +32,510 @@ enum filetype_t {
 	TYPE_BMP,
 	TYPE_GIF,
 	TYPE_PNM,
+	TYPE_ICO,
 	TYPE_UNKNOWN,
 };
 
+/* whole image file in memory */
+struct input_t {
+	uint8_t *data;
+	size_t size;
+	size_t offset; /* read position for stream oriented readers */
+	bool mapped;   /* data is mmap()ed (true) or ecalloc()ed (false) */
+	/* decoders may reduce the image while decoding (0: full size),
+		but never below the size fitting in target_width x target_height */
+	int target_width;
+	int target_height;
+};
+
+/* gif frame stored as the rectangle that changed from the previous frame
+	(disposal of the previous frame is already applied) */
+struct gif_delta_t {
+	bool valid;
+	int x, y, width, height;
+	uint8_t *pixels; /* width * height * BYTES_PER_PIXEL */
+};
+
+/* animation gif: frames are decoded when they are requested */
+struct gif_decoder_t {
+	gif_animation gif;    /* keeps the canvas and disposal state of decoded_frame */
+	struct input_t input; /* libnsgif refers to the file data until finalised */
+	size_t frame_size;
+	/* frames are composited from deltas on canvas */
+	uint8_t *canvas;
+	int canvas_frame;     /* -1: empty canvas (before frame 0) */
+	struct gif_delta_t *delta; /* frame_count entries */
+	size_t delta_size;    /* bytes of valid deltas */
+	/* composited frames held in data[] */
+	int cache_num;
+	int cache_limit;
+	unsigned int clock;
+	unsigned int *last_used;   /* frame_count entries */
+	int frame_count;
+};
+
 struct image {
-	/* normally use data[0], data[n] (n > 1) for animanion gif */
-	uint8_t *data[MAX_FRAME_NUM];
+	/* frame_count entries allocated by alloc_frames():
+		normally use data[0], data[n] (n > 1) for animanion gif
+		(data[n] may be NULL while decoder is alive, use get_frame()) */
+	uint8_t **data;
 	int width;
 	int height;
 	int channel;
 	bool alpha;
+	/* data[0] is the part at (part_x, part_y) of full_width x full_height image
+		(full_width == 0: whole image, see load_jpeg_part()) */
+	int part_x, part_y;
+	int full_width, full_height;
 	/* for animation gif */
-	int delay[MAX_FRAME_NUM];
+	int *delay;
 	int frame_count; /* normally 1 */
 	int loop_count;
+	struct gif_decoder_t *decoder; /* NULL: all frames are in data[] */
 	/* for w3mimg */
 	int current_frame;
 	bool already_drew;
 };
 
+/* allocate frame table (frames themselves are allocated by loaders) */
+bool alloc_frames(struct image *img, int frame_count)
+{
+	img->data  = (uint8_t **) ecalloc(frame_count, sizeof(uint8_t *));
+	img->delay = (int *) ecalloc(frame_count, sizeof(int));
+
+	if (img->data == NULL || img->delay == NULL) {
+		free(img->data);
+		free(img->delay);
+		img->data  = NULL;
+		img->delay = NULL;
+		return false;
+	}
+	img->frame_count = frame_count;
+
+	return true;
+}
+
+/* input functions */
+bool map_input(FILE *fp, struct input_t *input)
+{
+	int fd;
+	size_t size, capacity;
+	uint8_t *buffer;
+	struct stat st;
+
+	input->data   = NULL;
+	input->size   = 0;
+	input->offset = 0;
+	input->mapped = false;
+	input->target_width  = 0;
+	input->target_height = 0;
+
+	/* regular file (or memfd): map it, decoders read page cache directly.
+		MAP_PRIVATE + PROT_WRITE because libnsgif patches truncated data in place */
+	fd = fileno(fp);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		if ((buffer = emmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+			posix_madvise(buffer, st.st_size, POSIX_MADV_SEQUENTIAL);
+			input->data   = buffer;
+			input->size   = st.st_size;
+			input->mapped = true;
+			return true;
+		}
+	}
+
+	/* pipe or mmap() failed: read until EOF */
+	capacity = BUFSIZE;
+	if ((input->data = ecalloc(1, capacity)) == NULL)
+		return false;
+
+	while ((size = fread(input->data + input->size, 1, capacity - input->size, fp)) > 0) {
+		input->size += size;
+		if (input->size < capacity)
+			continue;
+
+		capacity *= 2;
+		if ((buffer = erealloc(input->data, capacity)) == NULL) {
+			free(input->data);
+			return false;
+		}
+		input->data = buffer;
+	}
+
+	if (input->size == 0) {
+		free(input->data);
+		return false;
+	}
+
+	return true;
+}
+
+void unmap_input(struct input_t *input)
+{
+	if (input->data == NULL) /* already taken over by a lazy decoder */
+		return;
+
+	if (input->mapped)
+		emunmap(input->data, input->size);
+	else
+		free(input->data);
+
+	input->data = NULL;
+	input->size = 0;
+}
+
+/* largest denominator (8, 4, 2 or 1) that keeps width/denom x height/denom
+	not smaller than the image fitted into the target size */
+int get_scale_denom(struct input_t *input, int width, int height)
+{
+	int denom;
+
+	if (input->target_width <= 0 || input->target_height <= 0)
+		return 1;
+
+	for (denom = 8; denom > 1; denom /= 2)
+		if (width >= denom * input->target_width || height >= denom * input->target_height)
+			break;
+
+	return denom;
+}
+
+/* for multi resolution images: whether variant a suits the target size better than b.
+	the smallest variant not smaller than the image fitted into the target size wins,
+	or the largest one when every variant is smaller (or no target size) */
+bool better_variant(struct input_t *input, int a_width, int a_height, int b_width, int b_height)
+{
+	bool a_enough, b_enough;
+
+	if (input->target_width <= 0 || input->target_height <= 0)
+		return a_width * a_height > b_width * b_height;
+
+	a_enough = (a_width >= input->target_width || a_height >= input->target_height);
+	b_enough = (b_width >= input->target_width || b_height >= input->target_height);
+
+	if (a_enough != b_enough)
+		return a_enough;
+
+	return a_enough ? (a_width * a_height < b_width * b_height):
+		(a_width * a_height > b_width * b_height);
+}
+
+/* number of Adam7 passes that hold every denom-th pixel (denom: 8, 4, 2 or 1) */
+static inline int adam7_passes(int denom)
+{
+	return (denom >= 8) ? 1: (denom >= 4) ? 3: (denom >= 2) ? 5: 7;
+}
+
+/* integer factor box filter for decoders producing one row at a time:
+	add denom rows of width pixels to sum, then flush one reduced row to dst */
+static inline void reduce_row_add(uint32_t *sum, const uint8_t *src, int width, int channel, int denom)
+{
+	for (int x = 0; x < width; x++)
+		for (int i = 0; i < channel; i++)
+			sum[(x / denom) * channel + i] += src[x * channel + i];
+}
+
+static inline void reduce_row_flush(uint32_t *sum, uint8_t *dst, int width, int channel, int denom, int rows)
+{
+	int cells;
+
+	for (int x = 0; x < (width + denom - 1) / denom; x++) {
+		cells = rows * ((width - x * denom < denom) ? width - x * denom: denom);
+		for (int i = 0; i < channel; i++) {
+			dst[x * channel + i] = (sum[x * channel + i] + cells / 2) / cells;
+			sum[x * channel + i] = 0;
+		}
+	}
+}
+
+/* for band streaming:
+	preview() is called once with a downscaled whole image,
+	then band() is called for each band of decoded rows
+	(band->height rows from y, height is the height of whole image) */
+struct band_callback_t {
+	bool (*preview)(struct image *preview, void *priv);
+	bool (*band)(struct image *band, int y, int height, void *priv);
+	int band_height;
+	void *priv;
+};
+
+/* parallel jpeg decoding:
+	a baseline jpeg with restart markers is cut at the restart markers falling on
+	MCU row boundaries, and each part is decoded as a jpeg of its own. a part also
+	decodes the neighbouring rows if upsampling refers to them, and throws them away */
+struct jpeg_layout_t {
+	size_t header_size; /* SOI to the end of SOS, copied to each part */
+	size_t sof_height;  /* offset of the height field in SOF */
+	int width, height;
+	int mcu_width, mcu_height;
+	int mcu_cols, mcu_rows;
+	int interval;       /* MCUs per restart interval */
+	int unit_rows;      /* parts are cut every unit_rows MCU rows */
+	bool context;       /* chroma upsampling refers to the MCU rows above and below */
+	size_t *segment;    /* start of each entropy coded segment, then the end of scan + 2 */
+	int segment_count;
+};
+
+struct jpeg_part_t {
+	uint8_t *data;  /* jpeg of this part */
+	size_t size;
+	int denom;
+	int width;      /* width of decoded rows */
+	int skip;       /* context rows decoded before dst */
+	int rows;       /* rows stored to dst */
+	uint8_t *dst;
+	bool ok;
+};
+
+static inline int jpeg_get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline int gcd(int a, int b)
+{
+	int tmp;
+
+	while (b) {
+		tmp = a % b;
+		a   = b;
+		b   = tmp;
+	}
+	return a;
+}
+
+/* check that the jpeg can be decoded in parts, and find its restart markers */
+bool get_jpeg_layout(struct input_t *input, struct jpeg_layout_t *layout)
+{
+	const uint8_t *data = input->data, *ptr;
+	size_t pos = 2, length = 0;
+	int marker, components = 0, h, v, hmax = 1, vmax = 1, vmin = 4, i;
+
+	layout->segment  = NULL;
+	layout->width    = layout->height = 0;
+	layout->interval = 0;
+
+	/* marker segments until SOS */
+	while (true) {
+		if (pos + 4 > input->size || data[pos] != 0xFF)
+			return false;
+
+		if ((marker = data[pos + 1]) == 0xFF) { /* fill byte */
+			pos++;
+			continue;
+		}
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD9)) /* no marker segment */
+			return false;
+
+		length = jpeg_get16(data + pos + 2);
+		if (length < 2 || pos + 2 + length > input->size)
+			return false;
+
+		if (marker == 0xC0 || marker == 0xC1) { /* SOF0, SOF1: sequential huffman */
+			if (length < 8)
+				return false;
+			components = data[pos + 9];
+			if (data[pos + 4] != 8 || (components != 1 && components != 3)
+				|| length != 8 + 3 * (size_t) components)
+				return false;
+			layout->sof_height = pos + 5;
+			layout->height = jpeg_get16(data + pos + 5);
+			layout->width  = jpeg_get16(data + pos + 7);
+			for (i = 0; i < components; i++) {
+				h = data[pos + 11 + 3 * i] >> 4;
+				v = data[pos + 11 + 3 * i] & 0x0F;
+				if (h < 1 || h > 4 || v < 1 || v > 4)
+					return false;
+				hmax = (h > hmax) ? h: hmax;
+				vmax = (v > vmax) ? v: vmax;
+				vmin = (v < vmin) ? v: vmin;
+			}
+		} else if (marker >= 0xC2 && marker <= 0xCF
+			&& marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			return false; /* progressive, lossless or arithmetic coding */
+		} else if (marker == 0xDD && length >= 4) { /* DRI */
+			layout->interval = jpeg_get16(data + pos + 4);
+		} else if (marker == 0xDA) { /* SOS */
+			break;
+		}
+		pos += 2 + length;
+	}
+
+	/* one scan holding all components */
+	if (components == 0 || layout->width == 0 || layout->height == 0 || layout->interval == 0
+		|| length != 6 + 2 * (size_t) components || data[pos + 4] != components)
+		return false;
+
+	if ((long) layout->width * layout->height < JPEG_MIN_PARALLEL)
+		return false;
+
+	layout->header_size = pos + 2 + length;
+	layout->mcu_width   = (components == 1) ? 8: 8 * hmax;
+	layout->mcu_height  = (components == 1) ? 8: 8 * vmax;
+	layout->mcu_cols    = (layout->width + layout->mcu_width - 1) / layout->mcu_width;
+	layout->mcu_rows    = (layout->height + layout->mcu_height - 1) / layout->mcu_height;
+	layout->unit_rows   = layout->interval / gcd(layout->interval, layout->mcu_cols);
+	layout->context     = (vmin < vmax);
+
+	layout->segment_count = (layout->mcu_cols * layout->mcu_rows + layout->interval - 1) / layout->interval;
+	if ((layout->segment = (size_t *) ecalloc(layout->segment_count + 1, sizeof(size_t))) == NULL)
+		return false;
+
+	/* entropy coded data: 0xFF is followed by 0x00 (stuffing), 0xFF (fill) or a marker */
+	layout->segment[0] = layout->header_size;
+	pos = layout->header_size;
+	i   = 1;
+	while ((ptr = memchr(data + pos, 0xFF, input->size - pos)) != NULL) {
+		pos = ptr - data;
+		if (pos + 1 >= input->size)
+			break;
+
+		marker = data[pos + 1];
+		if (marker == 0x00 || marker == 0xFF) {
+			pos++;
+			continue;
+		}
+		if (marker < 0xD0 || marker > 0xD7) { /* end of scan */
+			if (marker == 0xD9 && i == layout->segment_count) {
+				layout->segment[i] = pos + 2;
+				return true;
+			}
+			break;
+		}
+		if (i == layout->segment_count) /* too many RST */
+			break;
+		layout->segment[i++] = pos + 2;
+		pos += 2;
+	}
+
+	free(layout->segment);
+	layout->segment = NULL;
+	return false;
+}
+
+/* make a jpeg holding MCU rows first to last - 1 (both multiples of unit_rows or mcu_rows) */
+bool make_jpeg_part(struct input_t *input, struct jpeg_layout_t *layout,
+	int first, int last, struct jpeg_part_t *part)
+{
+	int height, start, end;
+	size_t size;
+	uint8_t *ptr;
+
+	start  = first * layout->mcu_cols / layout->interval;
+	end    = (last == layout->mcu_rows) ? layout->segment_count: last * layout->mcu_cols / layout->interval;
+	height = (last == layout->mcu_rows) ? layout->height - first * layout->mcu_height:
+		(last - first) * layout->mcu_height;
+
+	part->size = layout->header_size + layout->segment[end] - layout->segment[start];
+	if ((part->data = (uint8_t *) ecalloc(1, part->size)) == NULL)
+		return false;
+
+	memcpy(part->data, input->data, layout->header_size);
+	part->data[layout->sof_height]     = height >> 8;
+	part->data[layout->sof_height + 1] = height & 0xFF;
+
+	/* decoders expect RST0, RST1, ... from the first segment */
+	ptr = part->data + layout->header_size;
+	for (int i = start; i < end; i++) {
+		size = layout->segment[i + 1] - 2 - layout->segment[i];
+		memcpy(ptr, input->data + layout->segment[i], size);
+		ptr   += size;
+		*ptr++ = 0xFF;
+		*ptr++ = (i + 1 < end) ? 0xD0 + ((i - start) & 7): 0xD9;
+	}
+	return true;
+}
+
+/* decode a large jpeg with restart markers on every core:
+	returns false (and leaves img untouched) if the jpeg can't be decoded this way */
+bool load_jpeg_parallel(struct input_t *input, struct image *img, void *(*decode_part)(void *))
+{
+	int parts, units, denom, first, last, context, i;
+	long cpus;
+	bool ok = false, *started = NULL;
+	pthread_t *thread = NULL;
+	struct jpeg_part_t *part = NULL;
+	struct jpeg_layout_t layout;
+
+	if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 2 || !get_jpeg_layout(input, &layout))
+		return false;
+
+	units = (layout.mcu_rows + layout.unit_rows - 1) / layout.unit_rows;
+	parts = (cpus < units) ? cpus: units;
+	if (parts > JPEG_MAX_THREADS)
+		parts = JPEG_MAX_THREADS;
+	if (parts < 2) {
+		free(layout.segment);
+		return false;
+	}
+
+	denom = get_scale_denom(input, layout.width, layout.height);
+	logging(DEBUG, "jpeg scale:1/%d parts:%d restart interval:%d\n", denom, parts, layout.interval);
+
+	img->width   = (layout.width + denom - 1) / denom;
+	img->height  = (layout.height + denom - 1) / denom;
+	img->channel = 3;
+
+	if (!alloc_frames(img, 1)
+		|| (img->data[0] = (uint8_t *) ecalloc(img->width * img->height, img->channel)) == NULL
+		|| (part = (struct jpeg_part_t *) ecalloc(parts, sizeof(struct jpeg_part_t))) == NULL
+		|| (thread = (pthread_t *) ecalloc(parts, sizeof(pthread_t))) == NULL
+		|| (started = (bool *) ecalloc(parts, sizeof(bool))) == NULL)
+		goto release;
+
+	context = layout.context ? layout.unit_rows: 0;
+	for (i = 0; i < parts; i++) {
+		first = units * i / parts * layout.unit_rows;
+		last  = units * (i + 1) / parts * layout.unit_rows;
+		if (last > layout.mcu_rows)
+			last = layout.mcu_rows;
+
+		if (!make_jpeg_part(input, &layout, (first > 0) ? first - context: 0,
+			(last + context < layout.mcu_rows) ? last + context: layout.mcu_rows, &part[i]))
+			goto release;
+
+		part[i].denom = denom;
+		part[i].width = img->width;
+		part[i].skip  = ((first > 0) ? context: 0) * layout.mcu_height / denom;
+		part[i].rows  = ((last == layout.mcu_rows) ? img->height: last * layout.mcu_height / denom)
+			- first * layout.mcu_height / denom;
+		part[i].dst   = img->data[0] + (size_t) first * layout.mcu_height / denom * img->width * img->channel;
+	}
+
+	/* part 0 is decoded by this thread */
+	for (i = 1; i < parts; i++)
+		started[i] = (epthread_create(&thread[i], decode_part, &part[i]) == 0);
+	decode_part(&part[0]);
+
+	ok = true;
+	for (i = 0; i < parts; i++) {
+		if (i > 0 && started[i])
+			pthread_join(thread[i], NULL);
+		else if (i > 0)
+			decode_part(&part[i]);
+		ok = ok && part[i].ok;
+	}
+
+release:
+	if (part) {
+		for (i = 0; i < parts; i++)
+			free(part[i].data);
+	}
+	free(part);
+	free(thread);
+	free(started);
+	free(layout.segment);
+
+	if (!ok) {
+		if (img->data)
+			free(img->data[0]);
+		free(img->data);
+		free(img->delay);
+		img->data  = NULL;
+		img->delay = NULL;
+	}
+	return ok;
+}
+
 /* libjpeg functions */
 struct my_jpeg_error_mgr {
 	struct jpeg_error_mgr pub;
@@ -87,7 +576,60 @@ void my_jpeg_warning(j_common_ptr cinfo, int msg_level)
 	}
 }
 
-bool load_jpeg(FILE *fp, struct image *img)
+/* thread function of load_jpeg_parallel() */
+void *decode_jpeg_part(void *arg)
+{
+	int row_stride;
+	uint8_t *buffer;
+	JSAMPROW row;
+	struct jpeg_part_t *part = (struct jpeg_part_t *) arg;
+	struct jpeg_decompress_struct cinfo;
+	struct my_jpeg_error_mgr jerr;
+
+	row_stride = part->width * 3;
+	if ((buffer = (uint8_t *) ecalloc(1, row_stride)) == NULL)
+		return NULL;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = my_jpeg_exit;
+	jerr.pub.emit_message = my_jpeg_warning;
+	jerr.pub.output_message = my_jpeg_error;
+
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		free(buffer);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, part->data, part->size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	cinfo.quantize_colors = FALSE;
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.scale_num   = 1;
+	cinfo.scale_denom = part->denom;
+
+	jpeg_start_decompress(&cinfo);
+
+	if ((int) cinfo.output_width == part->width
+		&& (int) cinfo.output_height >= part->skip + part->rows) {
+		/* context rows above go to buffer, the rows below are not decoded */
+		while ((int) cinfo.output_scanline < part->skip + part->rows) {
+			row = ((int) cinfo.output_scanline < part->skip) ? buffer:
+				part->dst + (cinfo.output_scanline - part->skip) * row_stride;
+			jpeg_read_scanlines(&cinfo, &row, 1);
+		}
+		part->ok = true;
+	}
+
+	jpeg_destroy_decompress(&cinfo);
+	free(buffer);
+
+	return NULL;
+}
+
+bool load_jpeg(struct input_t *input, struct image *img)
 {
 	int row_stride, size;
 	JSAMPARRAY buffer;
@@ -99,18 +641,28 @@ bool load_jpeg(FILE *fp, struct image *img)
 	jerr.pub.emit_message = my_jpeg_warning;
 	jerr.pub.output_message = my_jpeg_error;
 
+	/* large jpeg with restart markers: decode parts of it on every core */
+	if (load_jpeg_parallel(input, img, decode_jpeg_part))
+		return true;
+
 	if (setjmp(jerr.setjmp_buffer)) {
 		jpeg_destroy_decompress(&cinfo);
 		return false;
 	}
 
 	jpeg_create_decompress(&cinfo);
-	jpeg_stdio_src(&cinfo, fp);
+	jpeg_mem_src(&cinfo, input->data, input->size);
 	jpeg_read_header(&cinfo, TRUE);
 
 	/* disable colormap (indexed color), grayscale -> rgb */
 	cinfo.quantize_colors = FALSE;
 	cinfo.out_color_space = JCS_RGB;
+
+	/* scaled IDCT: skip the pixels resize_image() would throw away */
+	cinfo.scale_num   = 1;
+	cinfo.scale_denom = get_scale_denom(input, cinfo.image_width, cinfo.image_height);
+	logging(DEBUG, "jpeg scale:1/%d\n", cinfo.scale_denom);
+
 	jpeg_start_decompress(&cinfo);
 
 	img->width   = cinfo.output_width;
@@ -118,7 +670,7 @@ bool load_jpeg(FILE *fp, struct image *img)
 	img->channel = cinfo.output_components;
 
 	size = img->width * img->height * img->channel;
-	if ((img->data[0] = (uint8_t *) ecalloc(1, size)) == NULL) {
+	if (!alloc_frames(img, 1) || (img->data[0] = (uint8_t *) ecalloc(1, size)) == NULL) {
 		jpeg_finish_decompress(&cinfo);
 		jpeg_destroy_decompress(&cinfo);
 		return false;
@@ -138,6 +690,132 @@ bool load_jpeg(FILE *fp, struct image *img)
 	return true;
 }
 
+/* size of jpeg after scaled IDCT for the target size (only header is read) */
+bool get_jpeg_size(struct input_t *input, int *width, int *height)
+{
+	struct jpeg_decompress_struct cinfo;
+	struct my_jpeg_error_mgr jerr;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = my_jpeg_exit;
+	jerr.pub.emit_message = my_jpeg_warning;
+	jerr.pub.output_message = my_jpeg_error;
+
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, input->data, input->size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	cinfo.scale_num   = 1;
+	cinfo.scale_denom = get_scale_denom(input, cinfo.image_width, cinfo.image_height);
+	jpeg_calc_output_dimensions(&cinfo);
+
+	*width  = cinfo.output_width;
+	*height = cinfo.output_height;
+
+	jpeg_destroy_decompress(&cinfo);
+
+	return true;
+}
+
+/* decode only the part [x, x + width) x [y, y + height) of jpeg scaled for the target size:
+	rows above are skipped and rows below are never decoded,
+	libjpeg-turbo also skips the columns outside (the part is widened to iMCU boundary) */
+bool load_jpeg_part(struct input_t *input, struct image *img, int x, int y, int width, int height)
+{
+	int row_stride, dst_stride, offset = 0;
+	JDIMENSION crop_x, crop_width;
+	JSAMPARRAY buffer;
+	struct jpeg_decompress_struct cinfo;
+	struct my_jpeg_error_mgr jerr;
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = my_jpeg_exit;
+	jerr.pub.emit_message = my_jpeg_warning;
+	jerr.pub.output_message = my_jpeg_error;
+
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_mem_src(&cinfo, input->data, input->size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	cinfo.quantize_colors = FALSE;
+	cinfo.out_color_space = JCS_RGB;
+	cinfo.scale_num   = 1;
+	cinfo.scale_denom = get_scale_denom(input, cinfo.image_width, cinfo.image_height);
+
+	jpeg_start_decompress(&cinfo);
+
+	if (x < 0 || y < 0 || width <= 0 || height <= 0
+		|| x + width > (int) cinfo.output_width || y + height > (int) cinfo.output_height) {
+		logging(ERROR, "part %dx%d+%d+%d is out of jpeg (%dx%d)\n",
+			width, height, x, y, cinfo.output_width, cinfo.output_height);
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+
+	img->full_width  = cinfo.output_width;
+	img->full_height = cinfo.output_height;
+	img->channel     = cinfo.output_components;
+
+	crop_x     = x;
+	crop_width = width;
+#if defined(LIBJPEG_TURBO_VERSION_NUMBER)
+	/* the edge columns of crop are upsampled without their neighbors:
+		crop one more column on each side, then drop them */
+	int left, right;
+
+	crop_x     = (x > 0) ? x - 1: x;
+	crop_width = x + width - crop_x + ((x + width < img->full_width) ? 1: 0);
+	jpeg_crop_scanline(&cinfo, &crop_x, &crop_width);
+	left  = (crop_x > 0) ? 1: 0;
+	right = ((int) (crop_x + crop_width) < img->full_width) ? 1: 0;
+	crop_x     += left;
+	crop_width -= left + right;
+	offset = left * cinfo.output_components;
+
+	if (y > 0)
+		jpeg_skip_scanlines(&cinfo, y);
+#else
+	offset = x * cinfo.output_components;
+#endif
+	logging(DEBUG, "jpeg scale:1/%d part:%dx%d+%d+%d\n",
+		cinfo.scale_denom, crop_width, height, crop_x, y);
+
+	img->part_x = crop_x;
+	img->part_y = y;
+	img->width  = crop_width;
+	img->height = height;
+
+	/* decoded row: cropped by libjpeg-turbo, or whole row cropped here */
+	row_stride = cinfo.output_width * cinfo.output_components;
+	dst_stride = img->width * img->channel;
+	if (!alloc_frames(img, 1) || (img->data[0] = (uint8_t *) ecalloc(img->height, dst_stride)) == NULL) {
+		jpeg_destroy_decompress(&cinfo);
+		return false;
+	}
+	buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr) &cinfo, JPOOL_IMAGE, row_stride, 1);
+
+	while ((int) cinfo.output_scanline < y + height) {
+		jpeg_read_scanlines(&cinfo, buffer, 1);
+		if ((int) cinfo.output_scanline > y)
+			memcpy(img->data[0] + (cinfo.output_scanline - 1 - y) * dst_stride, buffer[0] + offset, dst_stride);
+	}
+
+	/* rows below are never read: destroy without finish */
+	jpeg_destroy_decompress(&cinfo);
+
+	return true;
+}
+
 /* libpng function */
 
 void my_png_error(png_structp png_ptr, png_const_charp error_msg)
@@ -153,16 +831,29 @@ void my_png_warning(png_structp png_ptr, png_const_charp warning_msg)
 	logging(WARN, "libpng: %s\n", warning_msg);
 }
 
-bool load_png(FILE *fp, struct image *img)
+void my_png_read(png_structp png_ptr, png_bytep data, png_size_t length)
 {
-	int row_stride, size;
-	png_bytep *row_pointers = NULL;
-	unsigned char header[PNG_HEADER_SIZE];
+	struct input_t *input = (struct input_t *) png_get_io_ptr(png_ptr);
+
+	if (length > input->size - input->offset)
+		png_error(png_ptr, "unexpected end of file");
+
+	memcpy(data, input->data + input->offset, length);
+	input->offset += length;
+}
+
+bool load_png(struct input_t *input, struct image *img)
+{
+	int width, height, passes, denom, row_stride;
+	bool preview;
+	uint8_t *dst;
+	uint8_t * volatile row = NULL;  /* row buffer for reduced decode */
+	uint32_t * volatile sum = NULL;
 	png_structp png_ptr;
 	png_infop info_ptr;
 
-	if (fread(header, 1, PNG_HEADER_SIZE, fp) != PNG_HEADER_SIZE
-		|| png_sig_cmp(header, 0, PNG_HEADER_SIZE)
+	if (input->size < PNG_HEADER_SIZE
+		|| png_sig_cmp(input->data, 0, PNG_HEADER_SIZE)
 		|| (png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, my_png_error, my_png_warning)) == NULL)
 		return false;
 
@@ -172,100 +863,469 @@ bool load_png(FILE *fp, struct image *img)
 	}
 
 	if (setjmp(png_jmpbuf(png_ptr))) {
+		free(row);
+		free(sum);
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 		return false;
 	}
 
-	png_init_io(png_ptr, fp);
+	input->offset = PNG_HEADER_SIZE;
+	png_set_read_fn(png_ptr, input, my_png_read);
 	png_set_sig_bytes(png_ptr, PNG_HEADER_SIZE);
-	/* force 3 bytes per pixel image
-		-	strip alpha
-		-	6 bytes per pixel -> 3 bytes per pixel
+	png_read_info(png_ptr, info_ptr);
+
+	/* force 3 (rgb) or 4 (rgba) bytes per pixel image
+		-	6 (8) bytes per pixel -> 3 (4) bytes per pixel
 		-	1,2,4 bits per color -> 8 bits per color
 		-	grayscale -> rgb
-		-	perform set_expand() */
-	png_read_png(png_ptr, info_ptr,
-		PNG_TRANSFORM_STRIP_ALPHA | PNG_TRANSFORM_STRIP_16 |
-		PNG_TRANSFORM_PACKING | PNG_TRANSFORM_GRAY_TO_RGB |
-		PNG_TRANSFORM_EXPAND, NULL);
-
-	img->width   = png_get_image_width(png_ptr, info_ptr);
-	img->height  = png_get_image_height(png_ptr, info_ptr);
+		-	perform set_expand() (tRNS chunk -> alpha) */
+	png_set_strip_16(png_ptr);
+	png_set_packing(png_ptr);
+	png_set_gray_to_rgb(png_ptr);
+	png_set_expand(png_ptr);
+
+	width  = png_get_image_width(png_ptr, info_ptr);
+	height = png_get_image_height(png_ptr, info_ptr);
+	denom  = get_scale_denom(input, width, height);
+
+	/* the first Adam7 passes already hold every denom-th pixel:
+		read them as they are and stop there (no interlace handling) */
+	preview = (png_get_interlace_type(png_ptr, info_ptr) == PNG_INTERLACE_ADAM7 && denom > 1);
+	passes  = preview ? adam7_passes(denom): png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+
 	img->channel = png_get_channels(png_ptr, info_ptr);
+	row_stride   = png_get_rowbytes(png_ptr, info_ptr);
 
-	size = img->width * img->height * img->channel;
-	if ((img->data[0] = (uint8_t *) ecalloc(1, size)) == NULL) {
+	/* rows of interlaced image are completed only at the last pass */
+	if (passes > 1 && !preview)
+		denom = 1;
+	logging(DEBUG, "png passes:%d scale:1/%d\n", passes, denom);
+
+	img->width  = (width  + denom - 1) / denom;
+	img->height = (height + denom - 1) / denom;
+
+	if (!alloc_frames(img, 1)
+		|| (img->data[0] = (uint8_t *) ecalloc(img->width * img->height, img->channel)) == NULL) {
 		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 		return false;
 	}
 
-	row_stride   = png_get_rowbytes(png_ptr, info_ptr);
-	row_pointers = png_get_rows(png_ptr, info_ptr);
+	/* decode rows straight into the image (previous passes are kept there) */
+	if (denom == 1) {
+		for (int pass = 0; pass < passes; pass++)
+			for (int y = 0; y < height; y++)
+				png_read_row(png_ptr, img->data[0] + row_stride * y, NULL);
+	} else if (preview) {
+		if ((row = (uint8_t *) ecalloc(1, row_stride)) == NULL)
+			png_error(png_ptr, "couldn't allocate row buffer");
+
+		for (int pass = 0; pass < passes; pass++) {
+			/* libpng skips empty passes */
+			if (PNG_PASS_COLS(width, pass) == 0 || PNG_PASS_ROWS(height, pass) == 0)
+				continue;
+
+			for (int y = 0; y < (int) PNG_PASS_ROWS(height, pass); y++) {
+				png_read_row(png_ptr, row, NULL);
+				dst = img->data[0] + img->width * img->channel
+					* (PNG_ROW_FROM_PASS_ROW(y, pass) / denom);
+				for (int x = 0; x < (int) PNG_PASS_COLS(width, pass); x++)
+					memcpy(dst + img->channel * (PNG_COL_FROM_PASS_COL(x, pass) / denom),
+						row + img->channel * x, img->channel);
+			}
+		}
+		free(row);
+		row = NULL;
+	} else {
+		if ((row = (uint8_t *) ecalloc(1, row_stride)) == NULL
+			|| (sum = (uint32_t *) ecalloc(img->width * img->channel, sizeof(uint32_t))) == NULL)
+			png_error(png_ptr, "couldn't allocate row buffer");
+
+		for (int y = 0; y < height; y++) {
+			png_read_row(png_ptr, row, NULL);
+			reduce_row_add(sum, row, width, img->channel, denom);
+			if ((y + 1) % denom == 0 || y == height - 1)
+				reduce_row_flush(sum, img->data[0] + img->width * img->channel * (y / denom),
+					width, img->channel, denom, y % denom + 1);
+		}
+		free(row);
+		free(sum);
+		row = NULL;
+		sum = NULL;
+	}
+
+	/* the remaining passes of preview are never inflated */
+	if (!preview)
+		png_read_end(png_ptr, NULL);
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+
+	return true;
+}
+
+/* libns{gif,bmp} functions */
+void *gif_bitmap_create(int width, int height)
+{
+	return calloc(width * height, BYTES_PER_PIXEL);
+}
+
+void gif_bitmap_set_opaque(void *bitmap, bool opaque)
+{
+	(void) opaque; /* unused */
+	(void) bitmap;
+}
+
+bool gif_bitmap_test_opaque(void *bitmap)
+{
+	(void) bitmap; /* unused */
+	return false;
+}
+
+unsigned char *gif_bitmap_get_buffer(void *bitmap)
+{
+	return bitmap;
+}
+
+void gif_bitmap_destroy(void *bitmap)
+{
+	free(bitmap);
+}
+
+void gif_bitmap_modified(void *bitmap)
+{
+	(void) bitmap; /* unused */
+	return;
+}
+
+void release_decoder(struct image *img)
+{
+	struct gif_decoder_t *decoder = img->decoder;
+
+	if (!decoder)
+		return;
+
+	if (decoder->delta) {
+		for (int i = 0; i < decoder->frame_count; i++)
+			free(decoder->delta[i].pixels);
+	}
+	free(decoder->delta);
+	free(decoder->last_used);
+	free(decoder->canvas);
+	gif_finalise(&decoder->gif);
+	unmap_input(&decoder->input);
+	free(decoder);
+	img->decoder = NULL;
+}
+
+/* free the least recently used frame except keep */
+static bool evict_frame(struct image *img, int keep)
+{
+	int i, victim = -1;
+	struct gif_decoder_t *decoder = img->decoder;
+
+	for (i = 0; i < img->frame_count; i++) {
+		if (i == keep || img->data[i] == NULL)
+			continue;
+		if (victim < 0 || decoder->last_used[i] < decoder->last_used[victim])
+			victim = i;
+	}
+
+	if (victim < 0)
+		return false;
+
+	free(img->data[victim]);
+	img->data[victim] = NULL;
+	decoder->cache_num--;
+	return true;
+}
+
+static void apply_delta(struct gif_decoder_t *decoder, struct image *img, struct gif_delta_t *delta)
+{
+	int stride = img->width * BYTES_PER_PIXEL, size = delta->width * BYTES_PER_PIXEL;
+	uint8_t *src = delta->pixels, *dst;
+
+	dst = decoder->canvas + delta->y * stride + delta->x * BYTES_PER_PIXEL;
+	for (int y = 0; y < delta->height; y++) {
+		memcpy(dst, src, size);
+		dst += stride;
+		src += size;
+	}
+}
+
+/* bounding box of the pixels that differ between frame and canvas */
+static void diff_rect(struct image *img, uint8_t *frame, uint8_t *canvas, struct gif_delta_t *delta)
+{
+	int x, y, left, right, top = -1, bottom = -1;
+	int stride = img->width * BYTES_PER_PIXEL;
+
+	left  = img->width;
+	right = -1;
+	for (y = 0; y < img->height; y++) {
+		if (memcmp(frame + y * stride, canvas + y * stride, stride) == 0)
+			continue;
+
+		if (top < 0)
+			top = y;
+		bottom = y;
+
+		for (x = 0; x < left; x++)
+			if (memcmp(frame + y * stride + x * BYTES_PER_PIXEL,
+				canvas + y * stride + x * BYTES_PER_PIXEL, BYTES_PER_PIXEL) != 0)
+				break;
+		left = x;
+
+		for (x = img->width - 1; x > right; x--)
+			if (memcmp(frame + y * stride + x * BYTES_PER_PIXEL,
+				canvas + y * stride + x * BYTES_PER_PIXEL, BYTES_PER_PIXEL) != 0)
+				break;
+		right = x;
+	}
+
+	delta->x      = (top < 0) ? 0: left;
+	delta->y      = (top < 0) ? 0: top;
+	delta->width  = (top < 0) ? 0: right - left + 1;
+	delta->height = (top < 0) ? 0: bottom - top + 1;
+}
+
+/* decode frame index by libnsgif and put it on the canvas (holding frame index - 1) */
+static void decode_delta(struct image *img, int index)
+{
+	int i, size, stride, offset;
+	gif_result code;
+	uint8_t *frame, *pixels;
+	struct gif_decoder_t *decoder = img->decoder;
+	struct gif_delta_t delta;
+
+	/* libnsgif composites frame n onto its canvas of frame n - 1:
+		go forward from the last decoded frame, restart from frame 0 to go back */
+	if (decoder->gif.decoded_frame > index)
+		decoder->gif.decoded_frame = -1; /* GIF_INVALID_FRAME */
+
+	for (i = decoder->gif.decoded_frame + 1; i <= index; i++) {
+		if ((code = gif_decode_frame(&decoder->gif, i)) != GIF_OK) {
+			/* show what we have so far */
+			logging(ERROR, "gif_decode_frame() failed frame:%d code:%d\n", i, code);
+			break;
+		}
+	}
+	frame = decoder->gif.frame_image;
+
+	diff_rect(img, frame, decoder->canvas, &delta);
+	size   = delta.width * BYTES_PER_PIXEL;
+	stride = img->width * BYTES_PER_PIXEL;
+	offset = delta.y * stride + delta.x * BYTES_PER_PIXEL;
+
+	/* keep the delta while it fits, otherwise decode it again next time */
+	delta.pixels = NULL;
+	delta.valid  = (size * delta.height == 0)
+		|| (decoder->delta_size + size * delta.height <= FRAME_CACHE_SIZE
+		&& (delta.pixels = (uint8_t *) ecalloc(delta.height, size)) != NULL);
+	if (delta.valid)
+		decoder->delta_size += size * delta.height;
+
+	pixels = delta.pixels;
+	for (i = 0; i < delta.height; i++) {
+		memcpy(decoder->canvas + offset, frame + offset, size);
+		if (pixels) {
+			memcpy(pixels, frame + offset, size);
+			pixels += size;
+		}
+		offset += stride;
+	}
+	decoder->delta[index] = delta;
+}
+
+#if defined(__SSE2__)
+/* 4 pixels in 32bit lanes (4th byte is ignored) -> 12 bytes of rgb (low of register) */
+static inline __m128i pack_rgb(__m128i v)
+{
+	/* 2 pixels in each 64bit lane -> 6 bytes, then close the gap between lanes */
+	v = _mm_or_si128(_mm_and_si128(v, _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF)),
+		_mm_and_si128(_mm_srli_epi64(v, 8), _mm_set_epi32(0x0000FFFF, 0xFF000000, 0x0000FFFF, 0xFF000000)));
+	return _mm_or_si128(_mm_and_si128(v, _mm_set_epi32(0, 0, 0x0000FFFF, 0xFFFFFFFF)),
+		_mm_and_si128(_mm_srli_si128(v, 2), _mm_set_epi32(0, 0xFFFFFFFF, 0xFFFF0000, 0)));
+}
 
-	for (int i = 0; i < img->height; i++)
-		memcpy(img->data[0] + row_stride * i, row_pointers[i], row_stride);
+/* 4 gray pixels in 32bit lanes -> 12 bytes of rgb */
+static inline __m128i pack_gray(__m128i v)
+{
+	return pack_rgb(_mm_or_si128(_mm_or_si128(v, _mm_slli_epi32(v, 8)), _mm_slli_epi32(v, 16)));
+}
+#endif
 
-	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+/* convert a row to rgb (kernels are chosen once per image by bytes per pixel):
+	gray is copied to r, g and b, alpha is dropped
+	SSE2 stores 16 bytes for 12 bytes, the extra bytes are overwritten by the next store */
+static void gray_to_rgb(uint8_t *dst, const uint8_t *src, int width)
+{
+	int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, lo, hi;
+
+	for (; x + 18 <= width; x += 16) {
+		v  = _mm_loadu_si128((const __m128i *) (src + x));
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i *) (dst + x * 3),      pack_gray(_mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x * 3 + 12), pack_gray(_mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x * 3 + 24), pack_gray(_mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x * 3 + 36), pack_gray(_mm_unpackhi_epi16(hi, zero)));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16x3_t rgb;
 
-	return true;
+	for (; x + 16 <= width; x += 16) {
+		rgb.val[0] = rgb.val[1] = rgb.val[2] = vld1q_u8(src + x);
+		vst3q_u8(dst + x * 3, rgb);
+	}
+#endif
+	for (; x < width; x++)
+		dst[x * 3] = dst[x * 3 + 1] = dst[x * 3 + 2] = src[x];
 }
 
-/* libns{gif,bmp} functions */
-unsigned char *file_into_memory(FILE *fp, size_t *data_size)
+static void gray_alpha_to_rgb(uint8_t *dst, const uint8_t *src, int width)
 {
-	unsigned char *buffer;
-	size_t n, size;
+	int x = 0;
 
-	fseek(fp, 0L, SEEK_END);
-	size = ftell(fp);
-
-	if ((buffer = ecalloc(1, size)) == NULL)
-		return NULL;
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
 
-	fseek(fp, 0L, SEEK_SET);
-	if ((n = fread(buffer, 1, size, fp)) != size) {
-		free(buffer);
-		return NULL;
+	for (; x + 10 <= width; x += 8) {
+		v = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + x * 2)), _mm_set1_epi16(0x00FF));
+		_mm_storeu_si128((__m128i *) (dst + x * 3),      pack_gray(_mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x * 3 + 12), pack_gray(_mm_unpackhi_epi16(v, zero)));
 	}
-	*data_size = size;
+#elif defined(__ARM_NEON)
+	uint8x16x3_t rgb;
 
-	return buffer;
+	for (; x + 16 <= width; x += 16) {
+		rgb.val[0] = rgb.val[1] = rgb.val[2] = vld2q_u8(src + x * 2).val[0];
+		vst3q_u8(dst + x * 3, rgb);
+	}
+#endif
+	for (; x < width; x++)
+		dst[x * 3] = dst[x * 3 + 1] = dst[x * 3 + 2] = src[x * 2];
 }
 
-void *gif_bitmap_create(int width, int height)
+/* gray + alpha -> rgba (for the image drawn with transparency) */
+static void gray_alpha_to_rgba(uint8_t *dst, const uint8_t *src, int width)
 {
-	return calloc(width * height, BYTES_PER_PIXEL);
-}
+	int x = 0;
 
-void gif_bitmap_set_opaque(void *bitmap, bool opaque)
-{
-	(void) opaque; /* unused */
-	(void) bitmap;
-}
+#if defined(__SSE2__)
+	__m128i v, gray;
 
-bool gif_bitmap_test_opaque(void *bitmap)
-{
-	(void) bitmap; /* unused */
-	return false;
+	for (; x + 8 <= width; x += 8) {
+		v    = _mm_loadu_si128((const __m128i *) (src + x * 2));
+		gray = _mm_and_si128(v, _mm_set1_epi16(0x00FF));
+		gray = _mm_or_si128(gray, _mm_slli_epi16(gray, 8));
+		_mm_storeu_si128((__m128i *) (dst + x * 4),      _mm_unpacklo_epi16(gray, v));
+		_mm_storeu_si128((__m128i *) (dst + x * 4 + 16), _mm_unpackhi_epi16(gray, v));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16x2_t ga;
+	uint8x16x4_t rgba;
+
+	for (; x + 16 <= width; x += 16) {
+		ga = vld2q_u8(src + x * 2);
+		rgba.val[0] = rgba.val[1] = rgba.val[2] = ga.val[0];
+		rgba.val[3] = ga.val[1];
+		vst4q_u8(dst + x * 4, rgba);
+	}
+#endif
+	for (; x < width; x++) {
+		dst[x * 4] = dst[x * 4 + 1] = dst[x * 4 + 2] = src[x * 2];
+		dst[x * 4 + 3] = src[x * 2 + 1];
+	}
 }
 
-unsigned char *gif_bitmap_get_buffer(void *bitmap)
+/* dst can be src (in place): dst never overtakes src,
+	the whole gif canvas is converted as a row (the canvas keeps 4bpp for next frames) */
+static void rgba_to_rgb(uint8_t *dst, const uint8_t *src, int width)
 {
-	return bitmap;
+	int x = 0;
+
+#if defined(__SSE2__)
+	for (; x + 6 <= width; x += 4)
+		_mm_storeu_si128((__m128i *) (dst + x * 3), pack_rgb(_mm_loadu_si128((const __m128i *) (src + x * 4))));
+#elif defined(__ARM_NEON)
+	uint8x16x4_t rgba;
+	uint8x16x3_t rgb;
+
+	for (; x + 16 <= width; x += 16) {
+		rgba = vld4q_u8(src + x * 4);
+		rgb.val[0] = rgba.val[0];
+		rgb.val[1] = rgba.val[1];
+		rgb.val[2] = rgba.val[2];
+		vst3q_u8(dst + x * 3, rgb);
+	}
+#endif
+	for (; x < width; x++) {
+		dst[x * 3]     = src[x * 4];
+		dst[x * 3 + 1] = src[x * 4 + 1];
+		dst[x * 3 + 2] = src[x * 4 + 2];
+	}
 }
 
-void gif_bitmap_destroy(void *bitmap)
+uint8_t *get_frame(struct image *img, int index)
 {
-	free(bitmap);
+	struct gif_decoder_t *decoder = img->decoder;
+
+	if (!decoder)
+		return (img->data) ? img->data[index]: NULL;
+
+	decoder->last_used[index] = ++decoder->clock;
+	if (img->data[index])
+		return img->data[index];
+
+	while (decoder->cache_num >= decoder->cache_limit && evict_frame(img, index))
+		;
+
+	if ((img->data[index] = (uint8_t *) ecalloc(img->width * img->height, img->channel)) == NULL)
+		return NULL;
+	decoder->cache_num++;
+
+	/* composite forward from the canvas, or from the empty canvas to go back */
+	if (decoder->canvas_frame > index) {
+		memset(decoder->canvas, 0, decoder->frame_size);
+		decoder->canvas_frame = -1;
+	}
+
+	while (decoder->canvas_frame < index) {
+		struct gif_delta_t *delta = &decoder->delta[++decoder->canvas_frame];
+
+		if (delta->valid)
+			apply_delta(decoder, img, delta);
+		else
+			decode_delta(img, decoder->canvas_frame);
+	}
+	if (img->channel == BYTES_PER_PIXEL)
+		memcpy(img->data[index], decoder->canvas, decoder->frame_size);
+	else
+		rgba_to_rgb(img->data[index], decoder->canvas, img->width * img->height);
+
+	return img->data[index];
 }
 
-void gif_bitmap_modified(void *bitmap)
+/* decode every frame and release the decoder (for functions processing all frames) */
+void load_all_frames(struct image *img)
 {
-	(void) bitmap; /* unused */
-	return;
+	if (!img->decoder)
+		return;
+
+	img->decoder->cache_limit = img->frame_count;
+	for (int i = 0; i < img->frame_count; i++) {
+		if (get_frame(img, i) == NULL) {
+			img->frame_count = i;
+			break;
+		}
+	}
+	release_decoder(img);
 }
 
-bool load_gif(FILE *fp, struct image *img)
+bool load_gif(struct input_t *input, struct image *img)
 {
 	gif_bitmap_callback_vt gif_callbacks = {
 		gif_bitmap_create,
@@ -275,80 +1335,130 @@ bool load_gif(FILE *fp, struct image *img)
 		gif_bitmap_test_opaque,
 		gif_bitmap_modified
 	};
-	size_t size;
 	gif_result code;
-	unsigned char *mem;
-	gif_animation gif;
-	int i;
+	struct gif_decoder_t *decoder;
 
-	gif_create(&gif, &gif_callbacks);
-	if ((mem = file_into_memory(fp, &size)) == NULL)
+	if ((decoder = (struct gif_decoder_t *) ecalloc(1, sizeof(struct gif_decoder_t))) == NULL)
 		return false;
 
-	code = gif_initialise(&gif, size, mem);
-	if (code != GIF_OK && code != GIF_WORKING)
-		goto error_initialize_failed;
-
-	img->width   = gif.width;
-	img->height  = gif.height;
-	img->channel = BYTES_PER_PIXEL; /* libnsgif always return 4bpp image */
-	size = img->width * img->height * img->channel;
-
-	/* read animation gif */
-	img->frame_count = (gif.frame_count < MAX_FRAME_NUM) ? gif.frame_count: MAX_FRAME_NUM - 1;
-	img->loop_count = gif.loop_count;
+	gif_create(&decoder->gif, &gif_callbacks);
 
-	for (i = 0; i < img->frame_count; i++) {
-		code = gif_decode_frame(&gif, i);
-		if (code != GIF_OK)
-			goto error_decode_failed;
+	code = gif_initialise(&decoder->gif, input->size, input->data);
+	if (code != GIF_OK && code != GIF_WORKING) {
+		gif_finalise(&decoder->gif);
+		free(decoder);
+		return false;
+	}
 
-		if ((img->data[i] = (uint8_t *) ecalloc(1, size)) == NULL)
-			goto error_decode_failed;
-		memcpy(img->data[i], gif.frame_image, size);
+	img->width   = decoder->gif.width;
+	img->height  = decoder->gif.height;
+	/* libnsgif canvas is 4bpp, frames are taken out as RGB:
+		still image with transparency keeps alpha (frames of animation are
+		drawn over the previous one, so transparent pixels must be drawn) */
+	img->channel = (decoder->gif.frame_count == 1 && decoder->gif.frames[0].transparency) ?
+		BYTES_PER_PIXEL: 3;
 
-		img->delay[i] = gif.frames[i].frame_delay;
+	/* read animation gif */
+	if (decoder->gif.frame_count < 1 || !alloc_frames(img, decoder->gif.frame_count)) {
+		gif_finalise(&decoder->gif);
+		free(decoder);
+		return false;
 	}
+	img->loop_count = decoder->gif.loop_count;
+
+	for (int i = 0; i < img->frame_count; i++)
+		img->delay[i] = decoder->gif.frames[i].frame_delay;
+
+	/* take over the input: frames are decoded later by get_frame() */
+	decoder->input        = *input;
+	decoder->frame_size   = img->width * img->height * BYTES_PER_PIXEL;
+	decoder->canvas_frame = -1;
+	decoder->cache_limit  = FRAME_CACHE_NUM;
+	decoder->frame_count  = img->frame_count;
+	input->data = NULL;
+	input->size = 0;
+	img->decoder = decoder;
+
+	if ((decoder->canvas = (uint8_t *) ecalloc(1, decoder->frame_size)) == NULL
+		|| (decoder->delta = (struct gif_delta_t *)
+			ecalloc(decoder->frame_count, sizeof(struct gif_delta_t))) == NULL
+		|| (decoder->last_used = (unsigned int *)
+			ecalloc(decoder->frame_count, sizeof(unsigned int))) == NULL)
+		goto release;
+
+	/* decode the first frame here to report broken file */
+	if ((code = gif_decode_frame(&decoder->gif, 0)) != GIF_OK)
+		goto release;
 
-	gif_finalise(&gif);
-	free(mem);
 	return true;
 
-error_decode_failed:
-	img->frame_count = i;
-	for (i = 0; i < img->frame_count; i++) {
-		free(img->data[i]);
-		img->data[i] = NULL;
-	}
-	gif_finalise(&gif);
-error_initialize_failed:
-	free(mem);
+release:
+	/* no frame is decoded yet: only the frame table is left with the decoder */
+	release_decoder(img);
+	free(img->data);
+	free(img->delay);
+	img->data  = NULL;
+	img->delay = NULL;
+	img->frame_count = 0;
 	return false;
 }
 
+/* libnsbmp writes RGB (3 bytes per pixel) to the bitmap of opaque image,
+	RGBA otherwise. loaders take the pixels over without copying */
+struct bmp_bitmap_t {
+	size_t bpp;
+	uint8_t *pixels;
+};
+
 void *bmp_bitmap_create(int width, int height, unsigned int state)
 {
-	(void) state; /* unused */
-	return calloc(width * height, BYTES_PER_PIXEL);
+	struct bmp_bitmap_t *bitmap;
+
+	if ((bitmap = (struct bmp_bitmap_t *) calloc(1, sizeof(struct bmp_bitmap_t))) == NULL)
+		return NULL;
+
+	bitmap->bpp = (state & BMP_OPAQUE) ? 3: BYTES_PER_PIXEL;
+	if ((bitmap->pixels = (uint8_t *) calloc(width * height, bitmap->bpp)) == NULL) {
+		free(bitmap);
+		return NULL;
+	}
+	return bitmap;
 }
 
 unsigned char *bmp_bitmap_get_buffer(void *bitmap)
 {
-	return bitmap;
+	return ((struct bmp_bitmap_t *) bitmap)->pixels;
 }
 
 void bmp_bitmap_destroy(void *bitmap)
 {
+	free(((struct bmp_bitmap_t *) bitmap)->pixels);
 	free(bitmap);
 }
 
 size_t bmp_bitmap_get_bpp(void *bitmap)
 {
-	(void) bitmap; /* unused */
-	return BYTES_PER_PIXEL;
+	return ((struct bmp_bitmap_t *) bitmap)->bpp;
+}
+
+/* move the pixels decoded by libnsbmp to img */
+bool take_bmp_bitmap(bmp_image *bmp, struct image *img)
+{
+	struct bmp_bitmap_t *bitmap = (struct bmp_bitmap_t *) bmp->bitmap;
+
+	if (!alloc_frames(img, 1))
+		return false;
+
+	img->width   = bmp->width;
+	img->height  = bmp->height;
+	img->channel = bitmap->bpp;
+	img->data[0] = bitmap->pixels;
+	bitmap->pixels = NULL;
+
+	return true;
 }
 
-bool load_bmp(FILE *fp, struct image *img)
+bool load_bmp(struct input_t *input, struct image *img)
 {
 	bmp_bitmap_callback_vt bmp_callbacks = {
 		bmp_bitmap_create,
@@ -357,172 +1467,529 @@ bool load_bmp(FILE *fp, struct image *img)
 		bmp_bitmap_get_bpp
 	};
 	bmp_result code;
-	size_t size;
-	unsigned char *mem;
 	bmp_image bmp;
 
 	bmp_create(&bmp, &bmp_callbacks);
-	if ((mem = file_into_memory(fp, &size)) == NULL)
-		return false;
 
-	code = bmp_analyse(&bmp, size, mem);
+	code = bmp_analyse(&bmp, input->size, input->data);
 	if (code != BMP_OK)
-		goto error_analyse_failed;
+		goto error_decode_failed;
 
 	code = bmp_decode(&bmp);
 	if (code != BMP_OK)
 		goto error_decode_failed;
 
-	img->width   = bmp.width;
-	img->height  = bmp.height;
-	img->channel = BYTES_PER_PIXEL; /* libnsbmp always return 4bpp image */
-
-	size = img->width * img->height * img->channel;
-	if ((img->data[0] = (uint8_t *) ecalloc(1, size)) == NULL)
+	if (!take_bmp_bitmap(&bmp, img))
 		goto error_decode_failed;
-	memcpy(img->data[0], bmp.bitmap, size);
 
 	bmp_finalise(&bmp);
-	free(mem);
 	return true;
 
 error_decode_failed:
 	bmp_finalise(&bmp);
-error_analyse_failed:
-	free(mem);
 	return false;
 }
 
+bool load_ico(struct input_t *input, struct image *img)
+{
+	bmp_bitmap_callback_vt bmp_callbacks = {
+		bmp_bitmap_create,
+		bmp_bitmap_destroy,
+		bmp_bitmap_get_buffer,
+		bmp_bitmap_get_bpp
+	};
+	bool ret = false;
+	ico_collection ico;
+	ico_image *entry;
+	bmp_image *bmp = NULL;
+	struct input_t png;
+
+	ico_collection_create(&ico, &bmp_callbacks);
+
+	if (ico_analyse(&ico, input->size, input->data) != BMP_OK)
+		goto release;
+
+	/* decode only the embedded size suitable for the target size
+		(deeper one if there are the same sizes, png entries are 32bpp) */
+	for (entry = ico.first; entry; entry = entry->next) {
+		if (!bmp || better_variant(input, entry->bmp.width, entry->bmp.height, bmp->width, bmp->height)
+			|| (entry->bmp.width == bmp->width && entry->bmp.height == bmp->height
+				&& (entry->bmp.png ? 32: entry->bmp.bpp) > (bmp->png ? 32: bmp->bpp)))
+			bmp = &entry->bmp;
+	}
+	logging(DEBUG, "ico size:%dx%d png:%s\n", bmp->width, bmp->height, (bmp->png) ? "true": "false");
+
+	if (bmp->png) {
+		png        = *input;
+		png.data   = bmp->bmp_data;
+		png.size   = bmp->buffer_size;
+		png.offset = 0;
+		ret = load_png(&png, img);
+		goto release;
+	}
+
+	if (bmp_decode(bmp) != BMP_OK)
+		goto release;
+
+	ret = take_bmp_bitmap(bmp, img);
+
+release:
+	ico_finalise(&ico);
+	return ret;
+}
+
 /* pnm functions */
-inline int getint(FILE *fp)
+static inline int input_getc(struct input_t *input)
 {
-	int c, n = 0;
+	return (input->offset < input->size) ? input->data[input->offset++]: EOF;
+}
 
-	do {
-		c = fgetc(fp);
-	} while (isspace(c));
+/* skip whitespace and comments between header fields */
+static inline void pnm_skip(struct input_t *input)
+{
+	int c;
 
-	while (isdigit(c)) {
-		n = n * 10 + c - '0';
-		c = fgetc(fp);
+	while ((c = input_getc(input)) != EOF) {
+		if (c == '#')
+			while ((c = input_getc(input)) != '\n' && c != EOF);
+		else if (!isspace(c)) {
+			input->offset--;
+			break;
+		}
 	}
+}
+
+/* offset is left at the character after the digits */
+static inline int pnm_getint(struct input_t *input)
+{
+	int n = 0;
+	const uint8_t *p, *end = input->data + input->size;
+
+	pnm_skip(input);
+	p = input->data + input->offset;
+	if (p >= end || (unsigned) (*p - '0') >= 10)
+		return -1;
+
+	while (p < end && (unsigned) (*p - '0') < 10 && n < INT_MAX / 10)
+		n = n * 10 + (*p++ - '0');
+
+	input->offset = p - input->data;
 	return n;
 }
 
-inline uint8_t pnm_normalize(int c, int type, int max_value)
+static inline bool pnm_gettoken(struct input_t *input, char *token, size_t len)
 {
-	if (type == 1 || type == 4)
-		return (c == 0) ? 0: 0xFF;
-	else
-		return 0xFF * c / max_value;
+	int c;
+	size_t i = 0;
+
+	pnm_skip(input);
+	while ((c = input_getc(input)) != EOF && !isspace(c))
+		if (i < len - 1)
+			token[i++] = c;
+	token[i] = '\0';
+
+	if (c != EOF) /* keep the whitespace after ENDHDR */
+		input->offset--;
+
+	return (i > 0);
+}
+
+/* PAM header: "WIDTH w HEIGHT h DEPTH d MAXVAL m [TUPLTYPE t] ENDHDR" */
+static bool pam_header(struct input_t *input, struct image *img, int *max_value)
+{
+	char token[BUFSIZE];
+
+	while (pnm_gettoken(input, token, BUFSIZE)) {
+		if (strcmp(token, "ENDHDR") == 0)
+			return true;
+		else if (strcmp(token, "WIDTH") == 0)
+			img->width = pnm_getint(input);
+		else if (strcmp(token, "HEIGHT") == 0)
+			img->height = pnm_getint(input);
+		else if (strcmp(token, "DEPTH") == 0)
+			img->channel = pnm_getint(input);
+		else if (strcmp(token, "MAXVAL") == 0)
+			*max_value = pnm_getint(input);
+		else if (strcmp(token, "TUPLTYPE") == 0)
+			while (input->offset < input->size && input->data[input->offset] != '\n')
+				input->offset++;
+	}
+	return false;
 }
 
-bool load_pnm(FILE *fp, struct image *img)
+static inline uint8_t pnm_scale(unsigned int value, unsigned int max_value)
 {
-	int size, type, c, count, max_value = 0;
+	return (value >= max_value) ? 0xFF: (value * 0xFF + max_value / 2) / max_value;
+}
 
-	if (fgetc(fp) != 'P')
-		return false;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+/* 16 bytes at p: bit i of return value is set if p[i] is a digit, bit i of *comment if p[i] is '#' */
+static inline unsigned int pnm_digit_mask(const uint8_t *p, unsigned int *comment)
+{
+#if defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+
+	*comment = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+	/* bytes >= 0x80 are negative: never greater than '0' - 1 */
+	return _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))));
+#else
+	static const uint8_t bit[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	uint8x16_t v = vld1q_u8(p), weight = vld1q_u8(bit), digit, sharp;
+	uint8x8_t d, c;
+
+	digit = vandq_u8(vandq_u8(vcgeq_u8(v, vdupq_n_u8('0')), vcleq_u8(v, vdupq_n_u8('9'))), weight);
+	sharp = vandq_u8(vceqq_u8(v, vdupq_n_u8('#')), weight);
+
+	/* movemask: add up bit weights of each half */
+	d = vpadd_u8(vget_low_u8(digit), vget_high_u8(digit));
+	c = vpadd_u8(vget_low_u8(sharp), vget_high_u8(sharp));
+	d = vpadd_u8(d, c);
+	d = vpadd_u8(d, d);
+
+	*comment = vget_lane_u16(vreinterpret_u16_u8(d), 1);
+	return vget_lane_u16(vreinterpret_u16_u8(d), 0);
+#endif
+}
+#endif
 
-	type = fgetc(fp) - '0';
-	img->channel = (type == 1 || type == 2 || type == 4 || type == 5) ? 1:
-		(type == 3 || type == 6) ? 3: -1;
+/* len (1-8) ascii digits at p (8 bytes must be readable): digits are moved to the top bytes
+	(the bytes below become leading zeros), then merged in pairs, quads and octets by multiply */
+static inline unsigned int pnm_atoi8(const uint8_t *p, int len)
+{
+	uint64_t x;
 
-	if (img->channel == -1)
-		return false;
+	memcpy(&x, p, sizeof(x));
+	x <<= 8 * (8 - len);
+	x = ((x & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+	x = ((x & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+	return ((x & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
 
-	/* read header */
-	while ((c = fgetc(fp)) != EOF) {
-		if (c == '#')
-			while ((c = fgetc(fp)) != '\n');
-		
-		if (isspace(c))
+/* ascii samples (P1-P3): parse digits straight from the buffer
+	(SSE2/NEON: digits of 16 bytes are found at once, each number is converted without a loop) */
+static void pnm_read_ascii(struct input_t *input, uint8_t *dst, int size, int type, int max_value)
+{
+	int count = 0;
+	unsigned int n;
+	const uint8_t *p = input->data + input->offset, *end = input->data + input->size;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+	unsigned int digit, comment, valid, tail;
+	int first, last, len;
+	uint8_t table[UINT8_MAX + 1];
+
+	for (int i = 0; i <= UINT8_MAX; i++)
+		table[i] = pnm_scale(i, max_value);
+#endif
+
+	while (count < size && p < end) {
+#if defined(__SSE2__) || defined(__ARM_NEON)
+		/* 8 more bytes are readable for pnm_atoi8() */
+		if (end - p >= 16 + 8) {
+			digit = pnm_digit_mask(p, &comment);
+
+			/* take samples ending before the comment, or before the digits running over 16 bytes */
+			if (comment)
+				last = __builtin_ctz(comment);
+			else if (digit == 0xFFFF)
+				last = 0;
+			else if (digit & 0x8000)
+				last = 32 - __builtin_clz(~digit & 0xFFFF);
+			else
+				last = 16;
+
+			valid = digit & ((1U << last) - 1);
+			if (type == 1) { /* pbm: '1' is black, digits need not be separated */
+				for (; valid && count < size; valid &= valid - 1)
+					dst[count++] = (p[__builtin_ctz(valid)] == '0') ? 0xFF: 0x00;
+				valid = 0;
+			}
+
+			/* tail: last digit of each number */
+			tail = valid & ~(valid >> 1);
+			while (valid && count < size) {
+				first = __builtin_ctz(valid);
+				len   = __builtin_ctz(tail >> first) + 1;
+				if (len > 5) { /* may overflow: left to the loop below */
+					last = first;
+					break;
+				}
+				n = pnm_atoi8(p + first, len);
+				dst[count++] = (n <= UINT8_MAX) ? table[n]: pnm_scale(n, max_value);
+				valid &= ~0U << (first + len);
+			}
+
+			p += last;
+			if (last > 0)
+				continue;
+		}
+#endif
+		if ((unsigned) (*p - '0') >= 10) {
+			if (*p == '#')
+				while (p < end && *p != '\n')
+					p++;
+			p++;
 			continue;
+		}
 
-		if (isdigit(c)) {
-			ungetc(c, fp);
-			img->width  = getint(fp);
-			img->height = getint(fp);
-			if (type != 1 && type != 4)
-				max_value = getint(fp);
-			break;
+		if (type == 1) { /* pbm: '1' is black, digits need not be separated */
+			dst[count++] = (*p++ == '0') ? 0xFF: 0x00;
+			continue;
 		}
+
+		n = 0;
+		while (p < end && (unsigned) (*p - '0') < 10 && n <= 0xFFFF)
+			n = n * 10 + (*p++ - '0');
+		dst[count++] = pnm_scale(n, max_value);
 	}
+}
 
-	size = img->width * img->height * img->channel;
-	if ((img->data[0] = ecalloc(1, size)) == NULL)
+/* raw samples (P5-P7): one or two (big endian) bytes per sample */
+static void pnm_read_raw(struct input_t *input, uint8_t *dst, int size, int max_value)
+{
+	int count;
+	uint8_t table[UINT8_MAX + 1];
+	const uint8_t *src = input->data + input->offset;
+	size_t left = input->size - input->offset;
+
+	if (max_value == UINT8_MAX) {
+		memcpy(dst, src, ((size_t) size < left) ? (size_t) size: left);
+	} else if (max_value < UINT8_MAX) {
+		for (int i = 0; i <= UINT8_MAX; i++)
+			table[i] = pnm_scale(i, max_value);
+
+		count = ((size_t) size < left) ? size: (int) left;
+		for (int i = 0; i < count; i++)
+			dst[i] = table[src[i]];
+	} else {
+		count = ((size_t) size < left / 2) ? size: (int) (left / 2);
+		for (int i = 0; i < count; i++)
+			dst[i] = pnm_scale((src[2 * i] << 8) | src[2 * i + 1], max_value);
+	}
+}
+
+/* raw bitmap (P4): 8 pixels per byte, rows padded to a byte, 1 is black */
+static void pbm_read_raw(struct input_t *input, uint8_t *dst, int width, int height)
+{
+	int row_bytes = (width + 7) / 8;
+	const uint8_t *src = input->data + input->offset;
+	size_t left = input->size - input->offset;
+
+	for (int y = 0; y < height && (size_t) (y + 1) * row_bytes <= left; y++)
+		for (int x = 0; x < width; x++)
+			dst[y * width + x] = (src[y * row_bytes + x / 8] & (0x80 >> (x % 8))) ? 0x00: 0xFF;
+}
+
+bool load_pnm(struct input_t *input, struct image *img)
+{
+	int type, max_value = 1;
+
+	if (input_getc(input) != 'P')
 		return false;
 
-	/* read data */
-	count = 0;
-	if (1 <= type && type <= 3) {
-		while ((c = fgetc(fp)) != EOF) {
-			if (c == '#')
-				while ((c = fgetc(fp)) != '\n');
-			
-			if (isspace(c))
-				continue;
+	type = input_getc(input) - '0';
+	if (type < 1 || type > 7)
+		return false;
 
-			if (isdigit(c)) {
-				ungetc(c, fp);
-				*(img->data[0] + count++) = pnm_normalize(getint(fp), type, max_value);
-			}
-		}
+	/* read header */
+	if (type == 7) {
+		if (!pam_header(input, img, &max_value))
+			return false;
+	} else {
+		img->channel = (type == 3 || type == 6) ? 3: 1;
+		img->width   = pnm_getint(input);
+		img->height  = pnm_getint(input);
+		if (type != 1 && type != 4)
+			max_value = pnm_getint(input);
 	}
-	else {
-		while ((c = fgetc(fp)) != EOF)
-			*(img->data[0] + count++) = pnm_normalize(c, type, max_value);
+	/* single whitespace before raster */
+	input_getc(input);
+
+	if (img->width <= 0 || img->height <= 0 || img->channel < 1 || img->channel > 4
+		|| max_value < 1 || max_value > UINT16_MAX
+		|| img->width > INT_MAX / img->height / img->channel) {
+		logging(ERROR, "invalid pnm header\n");
+		return false;
 	}
 
+	logging(DEBUG, "pnm type:P%d max_value:%d\n", type, max_value);
+
+	if (!alloc_frames(img, 1) || (img->data[0] = ecalloc(img->width * img->height, img->channel)) == NULL)
+		return false;
+
+	/* read data */
+	if (type <= 3)
+		pnm_read_ascii(input, img->data[0], img->width * img->height * img->channel, type, max_value);
+	else if (type == 4)
+		pbm_read_raw(input, img->data[0], img->width, img->height);
+	else
+		pnm_read_raw(input, img->data[0], img->width * img->height * img->channel, max_value);
+
 	return true;
 }
 
 void init_image(struct image *img)
 {
-	for (int i = 0; i < MAX_FRAME_NUM; i++) {
-		img->data[i] = NULL;
-		img->delay[i] = 0;
-	}
+	img->data    = NULL;
+	img->delay   = NULL;
 	img->width   = 0;
 	img->height  = 0;
 	img->channel = 0;
 	img->alpha   = false;
+	/* part of image */
+	img->part_x      = 0;
+	img->part_y      = 0;
+	img->full_width  = 0;
+	img->full_height = 0;
 	/* for animation gif */
 	img->frame_count   = 1;
 	img->loop_count    = 0;
 	img->current_frame = 0;
 	img->already_drew  = false;
+	img->decoder       = NULL;
 }
 
 void free_image(struct image *img)
 {
-	for (int i = 0; i < img->frame_count; i++) {
-		free(img->data[i]);
-		img->data[i] = NULL;
+	if (img->data) {
+		for (int i = 0; i < img->frame_count; i++)
+			free(img->data[i]);
+	}
+	free(img->data);
+	free(img->delay);
+	img->data  = NULL;
+	img->delay = NULL;
+	release_decoder(img);
+}
+
+/* band streaming functions */
+bool stream_jpeg(struct input_t *input, struct band_callback_t *cb)
+{
+	int scale, row_stride;
+	JSAMPROW row;
+	struct image preview, band;
+	struct jpeg_decompress_struct cinfo;
+	struct my_jpeg_error_mgr jerr;
+
+	init_image(&preview);
+	init_image(&band);
+
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = my_jpeg_exit;
+	jerr.pub.emit_message = my_jpeg_warning;
+	jerr.pub.output_message = my_jpeg_error;
+
+	if (setjmp(jerr.setjmp_buffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		free_image(&preview);
+		free_image(&band);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+
+	/* 1st pass: DCT scaled (1/8 at most) preview, only used for palette */
+	jpeg_mem_src(&cinfo, input->data, input->size);
+	jpeg_read_header(&cinfo, TRUE);
+
+	for (scale = 8; scale > 1; scale /= 2) {
+		if ((int) cinfo.image_width  / scale >= PREVIEW_MIN_SIZE
+			&& (int) cinfo.image_height / scale >= PREVIEW_MIN_SIZE)
+			break;
+	}
+	cinfo.scale_num           = 1;
+	cinfo.scale_denom         = scale;
+	cinfo.dct_method          = JDCT_IFAST;
+	cinfo.do_fancy_upsampling = FALSE;
+	cinfo.quantize_colors     = FALSE;
+	cinfo.out_color_space     = JCS_RGB;
+	jpeg_start_decompress(&cinfo);
+
+	preview.width   = cinfo.output_width;
+	preview.height  = cinfo.output_height;
+	preview.channel = cinfo.output_components;
+	logging(DEBUG, "preview scale:1/%d width:%d height:%d\n", scale, preview.width, preview.height);
+
+	row_stride = preview.width * preview.channel;
+	if (!alloc_frames(&preview, 1)
+		|| (preview.data[0] = (uint8_t *) ecalloc(preview.height, row_stride)) == NULL)
+		goto error_occured;
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		row = preview.data[0] + cinfo.output_scanline * row_stride;
+		jpeg_read_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_decompress(&cinfo);
+
+	if (!cb->preview(&preview, cb->priv))
+		goto error_occured;
+	free_image(&preview);
+
+	/* 2nd pass: full size, pass each band to callback as soon as decoded */
+	jpeg_mem_src(&cinfo, input->data, input->size);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.quantize_colors = FALSE;
+	cinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&cinfo);
+
+	band.width   = cinfo.output_width;
+	band.height  = 0;
+	band.channel = cinfo.output_components;
+
+	row_stride = band.width * band.channel;
+	if (!alloc_frames(&band, 1)
+		|| (band.data[0] = (uint8_t *) ecalloc(cb->band_height, row_stride)) == NULL)
+		goto error_occured;
+
+	while (cinfo.output_scanline < cinfo.output_height) {
+		row = band.data[0] + band.height * row_stride;
+		band.height += jpeg_read_scanlines(&cinfo, &row, 1);
+
+		if (band.height == cb->band_height
+			|| cinfo.output_scanline == cinfo.output_height) {
+			if (!cb->band(&band, cinfo.output_scanline - band.height,
+				cinfo.output_height, cb->priv))
+				goto error_occured;
+			band.height = 0;
+		}
 	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	free_image(&band);
+
+	return true;
+
+error_occured:
+	jpeg_destroy_decompress(&cinfo);
+	free_image(&preview);
+	free_image(&band);
+	return false;
 }
 
-enum filetype_t check_filetype(FILE *fp)
+enum filetype_t check_filetype(struct input_t *input)
 {
 	/*
 		JPEG(JFIF): FF D8
 		PNG       : 89 50 4E 47 0D 0A 1A 0A (0x89 'P' 'N' 'G' '\r' '\n' 0x1A '\n')
 		GIF       : 47 49 46 (ASCII 'G' 'I' 'F')
 		BMP       : 42 4D (ASCII 'B' 'M')
-		PNM       : 50 [31|32|33|34|35|36] ('P' ['1' - '6'])
+		PNM/PAM   : 50 [31|32|33|34|35|36|37] ('P' ['1' - '7'])
+		ICO/CUR   : 00 00 [01|02] 00 (reserved, type)
 	*/
-	uint8_t header[CHECK_HEADER_SIZE];
+	uint8_t *header;
 	static uint8_t jpeg_header[] = {0xFF, 0xD8};
 	static uint8_t png_header[]  = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
 	static uint8_t gif_header[]  = {0x47, 0x49, 0x46};
 	static uint8_t bmp_header[]  = {0x42, 0x4D};
-	size_t size;
+	static uint8_t ico_header[]  = {0x00, 0x00, 0x01, 0x00};
+	static uint8_t cur_header[]  = {0x00, 0x00, 0x02, 0x00};
 
-	if ((size = fread(header, 1, CHECK_HEADER_SIZE, fp)) != CHECK_HEADER_SIZE) {
+	if (input->size < CHECK_HEADER_SIZE) {
 		logging(ERROR, "couldn't read header\n");
 		return TYPE_UNKNOWN;
 	}
-	fseek(fp, 0L, SEEK_SET);
+	header = input->data;
 
 	if (memcmp(header, jpeg_header, 2) == 0)
 		return TYPE_JPEG;
@@ -532,50 +1999,79 @@ enum filetype_t check_filetype(FILE *fp)
 		return TYPE_GIF;
 	else if (memcmp(header, bmp_header, 2) == 0)
 		return TYPE_BMP;
-	else if (header[0] == 'P' && ('0' <= header[1] && header[1] <= '6'))
+	else if (header[0] == 'P' && ('1' <= header[1] && header[1] <= '7'))
 		return TYPE_PNM;
+	else if (memcmp(header, ico_header, 4) == 0 || memcmp(header, cur_header, 4) == 0)
+		return TYPE_ICO;
 	else
 		return TYPE_UNKNOWN;
 }
 
-bool load_image(const char *file, struct image *img)
+bool load_image_input(struct input_t *input, struct image *img)
 {
 	int i;
 	enum filetype_t type;
-	FILE *fp;
 
-	static bool (*loader[])(FILE *fp, struct image *img) = {
+	static bool (*loader[])(struct input_t *input, struct image *img) = {
 		[TYPE_JPEG] = load_jpeg,
 		[TYPE_PNG]  = load_png,
 		[TYPE_GIF]  = load_gif,
 		[TYPE_BMP]  = load_bmp,
 		[TYPE_PNM]  = load_pnm,
+		[TYPE_ICO]  = load_ico,
 	};
 
-	if ((fp = efopen(file, "r")) == NULL)
+	if ((type = check_filetype(input)) == TYPE_UNKNOWN) {
+		logging(ERROR, "unknown file type\n");
 		return false;
- 
-	if ((type = check_filetype(fp)) == TYPE_UNKNOWN) {
-		logging(ERROR, "unknown file type: %s\n", file);
-		goto image_load_error;
 	}
 
-	if (loader[type](fp, img)) {
-		img->alpha = (img->channel == 2 || img->channel == 4) ? true: false;
-		logging(DEBUG, "image width:%d height:%d channel:%d alpha:%s\n",
-			img->width, img->height, img->channel, (img->alpha) ? "true": "false");
-		if (img->frame_count > 1) {
-			logging(DEBUG, "frame:%d loop:%d\n", img->frame_count, img->loop_count);
-			for (i = 0; i < img->frame_count; i++)
-				logging(DEBUG, "delay[%u]:%u\n", i, img->delay[i]);
-		}
-		efclose(fp);
-		return true;
+	if (!loader[type](input, img))
+		return false;
+
+	img->alpha = (img->channel == 2 || img->channel == 4) ? true: false;
+	logging(DEBUG, "image width:%d height:%d channel:%d alpha:%s\n",
+		img->width, img->height, img->channel, (img->alpha) ? "true": "false");
+	if (img->frame_count > 1) {
+		logging(DEBUG, "frame:%d loop:%d\n", img->frame_count, img->loop_count);
+		for (i = 0; i < img->frame_count; i++)
+			logging(DEBUG, "delay[%u]:%u\n", i, img->delay[i]);
+	}
+
+	return true;
+}
+
+/* width/height: display size the image will be fitted to (0: no reduction) */
+bool load_image_fp(FILE *fp, struct image *img, int width, int height)
+{
+	bool ret;
+	struct input_t input;
+
+	if (!map_input(fp, &input)) {
+		logging(ERROR, "couldn't read input\n");
+		return false;
 	}
+	input.target_width  = width;
+	input.target_height = height;
+
+	ret = load_image_input(&input, img);
+	unmap_input(&input);
+
+	return ret;
+}
 
-image_load_error:
-	logging(ERROR, "image load error: %s\n", file);
+bool load_image(const char *file, struct image *img, int width, int height)
+{
+	FILE *fp;
+	bool ret;
+
+	if ((fp = efopen(file, "r")) == NULL)
+		return false;
+
+	if ((ret = load_image_fp(fp, img, width, height)) == false)
+		logging(ERROR, "image load error: %s\n", file);
 	//init_image(img);
+
 	efclose(fp);
-	return false;
+	return ret;
 }
@@ -37,6 +37,16 @@ Rename this file to lodepng.cpp to use it for C++, or to lodepng.c to use it for
 #include <fstream>
 #endif /*LODEPNG_COMPILE_CPP*/
 
+#if defined(LODEPNG_COMPILE_SIMD) && defined(LODEPNG_COMPILE_PNG)
+#if defined(__GNUC__) && defined(__SSE2__) && (defined(__x86_64__) || defined(__i386__))
+#define LODEPNG_SIMD_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define LODEPNG_SIMD_NEON
+#include <arm_neon.h>
+#endif
+#endif /*LODEPNG_COMPILE_SIMD*/
+
 #define VERSION_STRING "20131222"
 
 /*
@@ -419,23 +429,78 @@ static void addBitsToStreamReversed(size_t* bitpointer, ucvector* bitstream, uns
 
 #ifdef LODEPNG_COMPILE_DECODER
 
-#define READBIT(bitpointer, bitstream) ((bitstream[bitpointer >> 3] >> (bitpointer & 0x7)) & (unsigned char)1)
+/*
+Reads the deflate bit stream. The next bits are kept in a 64-bit buffer (lsb
+first), which is refilled 8 bytes at a time. Past the end of the data zero bits
+are read: bp then goes past bitsize, which the callers check.
+*/
+typedef struct BitReader
+{
+  const unsigned char* data;
+  size_t size; /*size of data in bytes*/
+  size_t bitsize; /*size of data in bits*/
+  size_t bp; /*bit pointer: number of bits read so far*/
+  size_t next; /*next byte of data to go into the buffer*/
+  unsigned long long buffer; /*the bits from bp on*/
+  unsigned avail; /*number of valid bits in buffer*/
+} BitReader;
+
+/*start reading at bit position bp, which must be a multiple of 8*/
+static void BitReader_init(BitReader* reader, const unsigned char* data, size_t size, size_t bp)
+{
+  reader->data = data;
+  reader->size = size;
+  reader->bitsize = size * 8;
+  reader->bp = bp;
+  reader->next = bp >> 3;
+  reader->buffer = 0;
+  reader->avail = 0;
+}
+
+/*makes at least 56 bits available*/
+static void ensureBits(BitReader* reader)
+{
+  if(reader->avail >= 56) return;
+  if(reader->next + 8 <= reader->size)
+  {
+    const unsigned char* p = &reader->data[reader->next];
+    unsigned long long v = (unsigned long long)p[0] | ((unsigned long long)p[1] << 8)
+                         | ((unsigned long long)p[2] << 16) | ((unsigned long long)p[3] << 24)
+                         | ((unsigned long long)p[4] << 32) | ((unsigned long long)p[5] << 40)
+                         | ((unsigned long long)p[6] << 48) | ((unsigned long long)p[7] << 56);
+    /*take as many whole bytes as fit, the bits above avail are the same data again*/
+    reader->buffer |= v << reader->avail;
+    reader->next += (63 - reader->avail) >> 3;
+    reader->avail |= 56;
+  }
+  else
+  {
+    while(reader->avail <= 56 && reader->next < reader->size)
+    {
+      reader->buffer |= (unsigned long long)reader->data[reader->next++] << reader->avail;
+      reader->avail += 8;
+    }
+    if(reader->avail < 56) reader->avail = 56; /*zero bits past the end*/
+  }
+}
 
-static unsigned char readBitFromStream(size_t* bitpointer, const unsigned char* bitstream)
+/*nbits must be available (see ensureBits)*/
+static unsigned peekBits(const BitReader* reader, unsigned nbits)
 {
-  unsigned char result = (unsigned char)(READBIT(*bitpointer, bitstream));
-  (*bitpointer)++;
-  return result;
+  return (unsigned)(reader->buffer & ((1ULL << nbits) - 1u));
 }
 
-static unsigned readBitsFromStream(size_t* bitpointer, const unsigned char* bitstream, size_t nbits)
+static void advanceBits(BitReader* reader, unsigned nbits)
 {
-  unsigned result = 0, i;
-  for(i = 0; i < nbits; i++)
-  {
-    result += ((unsigned)READBIT(*bitpointer, bitstream)) << i;
-    (*bitpointer)++;
-  }
+  reader->buffer >>= nbits;
+  reader->avail -= nbits;
+  reader->bp += nbits;
+}
+
+static unsigned readBits(BitReader* reader, unsigned nbits)
+{
+  unsigned result = peekBits(reader, nbits);
+  advanceBits(reader, nbits);
   return result;
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
@@ -485,11 +550,13 @@ Huffman tree struct, containing multiple representations of the tree
 */
 typedef struct HuffmanTree
 {
-  unsigned* tree2d;
   unsigned* tree1d;
   unsigned* lengths; /*the lengths of the codes of the 1d-tree*/
   unsigned maxbitlen; /*maximum number of bits a single code can get*/
   unsigned numcodes; /*number of symbols in the alphabet = number of codes*/
+  /*the decoder's lookup tables, indexed by the next bits of the stream, see HuffmanTree_makeTable*/
+  unsigned char* table_len; /*length of the code, 0 if no code matches*/
+  unsigned short* table_value; /*the symbol, or the start of a second level table*/
 } HuffmanTree;
 
 /*function used for debug purposes to draw the tree in ascii art with C++*/
@@ -507,73 +574,111 @@ static void HuffmanTree_draw(HuffmanTree* tree)
 
 static void HuffmanTree_init(HuffmanTree* tree)
 {
-  tree->tree2d = 0;
   tree->tree1d = 0;
   tree->lengths = 0;
+  tree->table_len = 0;
+  tree->table_value = 0;
 }
 
 static void HuffmanTree_cleanup(HuffmanTree* tree)
 {
-  lodepng_free(tree->tree2d);
   lodepng_free(tree->tree1d);
   lodepng_free(tree->lengths);
+  lodepng_free(tree->table_len);
+  lodepng_free(tree->table_value);
 }
 
-/*the tree representation used by the decoder. return value is error*/
-static unsigned HuffmanTree_make2DTree(HuffmanTree* tree)
+/*the first FIRSTBITS bits of a code are looked up in the first table, longer codes continue in a second one*/
+#define FIRSTBITS 9u
+
+static unsigned reverseBits(unsigned bits, unsigned num)
 {
-  unsigned nodefilled = 0; /*up to which node it is filled*/
-  unsigned treepos = 0; /*position in the tree (1 of the numcodes columns)*/
-  unsigned n, i;
+  unsigned i, result = 0;
+  for(i = 0; i < num; i++) result |= ((bits >> (num - i - 1u)) & 1u) << i;
+  return result;
+}
 
-  tree->tree2d = (unsigned*)lodepng_malloc(tree->numcodes * 2 * sizeof(unsigned));
-  if(!tree->tree2d) return 83; /*alloc fail*/
+/*
+the tables used by the decoder. return value is error
+The stream gives the code bits msb first, read lsb first, so the tables are
+indexed by the reversed code. An entry of the first table (2^FIRSTBITS entries)
+holds the symbol and code length for codes up to FIRSTBITS bits, repeated for all
+values of the bits after it. For longer codes it holds the longest length with that
+prefix and the start of a second table, indexed by the following bits.
+*/
+static unsigned HuffmanTree_makeTable(HuffmanTree* tree)
+{
+  static const unsigned headsize = 1u << FIRSTBITS;
+  static const unsigned mask = (1u << FIRSTBITS) - 1u;
+  unsigned i, j, pointer = headsize;
+  size_t size = headsize, kraft = 0;
+  unsigned maxlens[1u << FIRSTBITS];
 
-  /*
-  convert tree1d[] to tree2d[][]. In the 2D array, a value of 32767 means
-  uninited, a value >= numcodes is an address to another bit, a value < numcodes
-  is a code. The 2 rows are the 2 possible bit values (0 or 1), there are as
-  many columns as codes - 1.
-  A good huffmann tree has N * 2 - 1 nodes, of which N - 1 are internal nodes.
-  Here, the internal nodes are stored (what their 0 and 1 option point to).
-  There is only memory for such good tree currently, if there are more nodes
-  (due to too long length codes), error 55 will happen
-  */
-  for(n = 0; n < tree->numcodes * 2; n++)
+  /*more codes than fit in the code space can't be a prefix code*/
+  for(i = 0; i < tree->numcodes; i++)
   {
-    tree->tree2d[n] = 32767; /*32767 here means the tree2d isn't filled there yet*/
+    if(tree->lengths[i]) kraft += (size_t)1 << (15 - tree->lengths[i]);
   }
+  if(kraft > (1u << 15)) return 55; /*oversubscribed, see comment in lodepng_error_text*/
 
-  for(n = 0; n < tree->numcodes; n++) /*the codes*/
+  /*the longest code for each first table entry*/
+  for(i = 0; i < headsize; i++) maxlens[i] = 0;
+  for(i = 0; i < tree->numcodes; i++)
+  {
+    unsigned l = tree->lengths[i];
+    if(l <= FIRSTBITS) continue;
+    j = reverseBits(tree->tree1d[i] >> (l - FIRSTBITS), FIRSTBITS);
+    if(maxlens[j] < l) maxlens[j] = l;
+  }
+  for(i = 0; i < headsize; i++)
   {
-    for(i = 0; i < tree->lengths[n]; i++) /*the bits for this code*/
+    if(maxlens[i] > FIRSTBITS) size += (size_t)1 << (maxlens[i] - FIRSTBITS);
+  }
+
+  tree->table_len = (unsigned char*)lodepng_malloc(size * sizeof(unsigned char));
+  tree->table_value = (unsigned short*)lodepng_malloc(size * sizeof(unsigned short));
+  if(!tree->table_len || !tree->table_value) return 83; /*alloc fail*/
+  for(i = 0; i < size; i++)
+  {
+    tree->table_len[i] = 0;
+    tree->table_value[i] = 0;
+  }
+
+  /*place the second tables*/
+  for(i = 0; i < headsize; i++)
+  {
+    if(maxlens[i] <= FIRSTBITS) continue;
+    tree->table_len[i] = (unsigned char)maxlens[i];
+    tree->table_value[i] = (unsigned short)pointer;
+    pointer += 1u << (maxlens[i] - FIRSTBITS);
+  }
+
+  for(i = 0; i < tree->numcodes; i++)
+  {
+    unsigned l = tree->lengths[i], reverse, index, num;
+    if(l == 0) continue;
+    reverse = reverseBits(tree->tree1d[i], l);
+    if(l <= FIRSTBITS)
     {
-      unsigned char bit = (unsigned char)((tree->tree1d[n] >> (tree->lengths[n] - i - 1)) & 1);
-      if(treepos > tree->numcodes - 2) return 55; /*oversubscribed, see comment in lodepng_error_text*/
-      if(tree->tree2d[2 * treepos + bit] == 32767) /*not yet filled in*/
+      num = 1u << (FIRSTBITS - l);
+      for(j = 0; j < num; j++)
       {
-        if(i + 1 == tree->lengths[n]) /*last bit*/
-        {
-          tree->tree2d[2 * treepos + bit] = n; /*put the current code in it*/
-          treepos = 0;
-        }
-        else
-        {
-          /*put address of the next step in here, first that address has to be found of course
-          (it's just nodefilled + 1)...*/
-          nodefilled++;
-          /*addresses encoded with numcodes added to it*/
-          tree->tree2d[2 * treepos + bit] = nodefilled + tree->numcodes;
-          treepos = nodefilled;
-        }
+        index = reverse | (j << l);
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
+      }
+    }
+    else
+    {
+      unsigned start = tree->table_value[reverse & mask], maxlen = tree->table_len[reverse & mask];
+      num = 1u << (maxlen - l);
+      for(j = 0; j < num; j++)
+      {
+        index = start + ((reverse >> FIRSTBITS) | (j << (l - FIRSTBITS)));
+        tree->table_len[index] = (unsigned char)l;
+        tree->table_value[index] = (unsigned short)i;
       }
-      else treepos = tree->tree2d[2 * treepos + bit] - tree->numcodes;
     }
-  }
-
-  for(n = 0; n < tree->numcodes * 2; n++)
-  {
-    if(tree->tree2d[n] == 32767) tree->tree2d[n] = 0; /*remove possible remaining 32767's*/
   }
 
   return 0;
@@ -619,7 +724,7 @@ static unsigned HuffmanTree_makeFromLengths2(HuffmanTree* tree)
   uivector_cleanup(&blcount);
   uivector_cleanup(&nextcode);
 
-  if(!error) return HuffmanTree_make2DTree(tree);
+  if(!error) return HuffmanTree_makeTable(tree);
   else return error;
 }
 
@@ -896,27 +1001,27 @@ static unsigned generateFixedDistanceTree(HuffmanTree* tree)
 #ifdef LODEPNG_COMPILE_DECODER
 
 /*
-returns the code, or (unsigned)(-1) if error happened
-inbitlength is the length of the complete buffer, in bits (so its byte length times 8)
+returns the code, or (unsigned)(-1) if no code matches the next bits
+at least 15 bits must be available in the reader (see ensureBits)
 */
-static unsigned huffmanDecodeSymbol(const unsigned char* in, size_t* bp,
-                                    const HuffmanTree* codetree, size_t inbitlength)
+static unsigned huffmanDecodeSymbol(BitReader* reader, const HuffmanTree* codetree)
 {
-  unsigned treepos = 0, ct;
-  for(;;)
+  unsigned index = peekBits(reader, FIRSTBITS);
+  unsigned l = codetree->table_len[index];
+  unsigned value = codetree->table_value[index];
+  if(l <= FIRSTBITS)
   {
-    if(*bp >= inbitlength) return (unsigned)(-1); /*error: end of input memory reached without endcode*/
-    /*
-    decode the symbol from the tree. The "readBitFromStream" code is inlined in
-    the expression below because this is the biggest bottleneck while decoding
-    */
-    ct = codetree->tree2d[(treepos << 1) + READBIT(*bp, in)];
-    (*bp)++;
-    if(ct < codetree->numcodes) return ct; /*the symbol is decoded, return it*/
-    else treepos = ct - codetree->numcodes; /*symbol not yet decoded, instead move tree position*/
-
-    if(treepos >= codetree->numcodes) return (unsigned)(-1); /*error: it appeared outside the codetree*/
+    if(l == 0) return (unsigned)(-1); /*error: no code starts with these bits*/
+    advanceBits(reader, l);
+    return value;
   }
+  /*longer code: the following bits index the second table*/
+  advanceBits(reader, FIRSTBITS);
+  index = value + peekBits(reader, l - FIRSTBITS);
+  l = codetree->table_len[index];
+  if(l == 0) return (unsigned)(-1);
+  advanceBits(reader, l - FIRSTBITS);
+  return codetree->table_value[index];
 }
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -935,13 +1040,11 @@ static void getTreeInflateFixed(HuffmanTree* tree_ll, HuffmanTree* tree_d)
 }
 
 /*get the tree of a deflated block with dynamic tree, the tree itself is also Huffman compressed with a known tree*/
-static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
-                                      const unsigned char* in, size_t* bp, size_t inlength)
+static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d, BitReader* reader)
 {
   /*make sure that length values that aren't filled in will be 0, or a wrong tree will be generated*/
   unsigned error = 0;
   unsigned n, HLIT, HDIST, HCLEN, i;
-  size_t inbitlength = inlength * 8;
 
   /*see comments in deflateDynamic for explanation of the context and these variables, it is analogous*/
   unsigned* bitlen_ll = 0; /*lit,len code lengths*/
@@ -950,14 +1053,15 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
   unsigned* bitlen_cl = 0;
   HuffmanTree tree_cl; /*the code tree for code length codes (the huffman tree for compressed huffman trees)*/
 
-  if((*bp) >> 3 >= inlength - 2) return 49; /*error: the bit pointer is or will go past the memory*/
+  if(reader->bp + 14 > reader->bitsize) return 49; /*error: the bit pointer is or will go past the memory*/
 
+  ensureBits(reader);
   /*number of literal/length codes + 257. Unlike the spec, the value 257 is added to it here already*/
-  HLIT =  readBitsFromStream(bp, in, 5) + 257;
+  HLIT =  readBits(reader, 5) + 257;
   /*number of distance codes. Unlike the spec, the value 1 is added to it here already*/
-  HDIST = readBitsFromStream(bp, in, 5) + 1;
+  HDIST = readBits(reader, 5) + 1;
   /*number of code length codes. Unlike the spec, the value 4 is added to it here already*/
-  HCLEN = readBitsFromStream(bp, in, 4) + 4;
+  HCLEN = readBits(reader, 4) + 4;
 
   HuffmanTree_init(&tree_cl);
 
@@ -970,9 +1074,11 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 
     for(i = 0; i < NUM_CODE_LENGTH_CODES; i++)
     {
-      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBitsFromStream(bp, in, 3);
+      ensureBits(reader);
+      if(i < HCLEN) bitlen_cl[CLCL_ORDER[i]] = readBits(reader, 3);
       else bitlen_cl[CLCL_ORDER[i]] = 0; /*if not, it must stay 0*/
     }
+    if(reader->bp > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
     error = HuffmanTree_makeFromLengths(&tree_cl, bitlen_cl, NUM_CODE_LENGTH_CODES, 7);
     if(error) break;
@@ -988,7 +1094,10 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
     i = 0;
     while(i < HLIT + HDIST)
     {
-      unsigned code = huffmanDecodeSymbol(in, bp, &tree_cl, inbitlength);
+      unsigned code;
+      ensureBits(reader); /*a code length code (up to 7 bits) and its repeat bits (up to 7)*/
+      code = huffmanDecodeSymbol(reader, &tree_cl);
+      if(reader->bp > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
       if(code <= 15) /*a length code*/
       {
         if(i < HLIT) bitlen_ll[i] = code;
@@ -1000,10 +1109,9 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
         unsigned replength = 3; /*read in the 2 bits that indicate repeat length (3-6)*/
         unsigned value; /*set value to the previous code*/
 
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
         if (i == 0) ERROR_BREAK(54); /*can't repeat previous if i is 0*/
 
-        replength += readBitsFromStream(bp, in, 2);
+        replength += readBits(reader, 2);
 
         if(i < HLIT + 1) value = bitlen_ll[i - 1];
         else value = bitlen_d[i - HLIT - 1];
@@ -1019,9 +1127,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 17) /*repeat "0" 3-10 times*/
       {
         unsigned replength = 3; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-        replength += readBitsFromStream(bp, in, 3);
+        replength += readBits(reader, 3);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -1036,9 +1143,8 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       else if(code == 18) /*repeat "0" 11-138 times*/
       {
         unsigned replength = 11; /*read in the bits that indicate repeat length*/
-        if(*bp >= inbitlength) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
-        replength += readBitsFromStream(bp, in, 7);
+        replength += readBits(reader, 7);
 
         /*repeat this value in the next lengths*/
         for(n = 0; n < replength; n++)
@@ -1052,17 +1158,14 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
       }
       else /*if(code == (unsigned)(-1))*/ /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
       {
-        if(code == (unsigned)(-1))
-        {
-          /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
-          (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inbitlength ? 10 : 11;
-        }
+        if(code == (unsigned)(-1)) error = 11; /*no code matched*/
         else error = 16; /*unexisting code, this can never happen*/
         break;
       }
+      if(error) break;
     }
     if(error) break;
+    if(reader->bp > reader->bitsize) ERROR_BREAK(50); /*error, bit pointer jumps past memory*/
 
     if(bitlen_ll[256] == 0) ERROR_BREAK(64); /*the length of the end code 256 must be larger than 0*/
 
@@ -1083,24 +1186,27 @@ static unsigned getTreeInflateDynamic(HuffmanTree* tree_ll, HuffmanTree* tree_d,
 }
 
 /*inflate a block with dynamic of fixed Huffman tree*/
-static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size_t* bp,
-                                    size_t* pos, size_t inlength, unsigned btype)
+static unsigned inflateHuffmanBlock(ucvector* out, BitReader* reader,
+                                    size_t* pos, unsigned btype, size_t maxpos)
 {
   unsigned error = 0;
   HuffmanTree tree_ll; /*the huffman tree for literal and length codes*/
   HuffmanTree tree_d; /*the huffman tree for distance codes*/
-  size_t inbitlength = inlength * 8;
 
   HuffmanTree_init(&tree_ll);
   HuffmanTree_init(&tree_d);
 
   if(btype == 1) getTreeInflateFixed(&tree_ll, &tree_d);
-  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, in, bp, inlength);
+  else if(btype == 2) error = getTreeInflateDynamic(&tree_ll, &tree_d, reader);
 
   while(!error) /*decode all symbols until end reached, breaks at end code*/
   {
+    unsigned code_ll;
+    /*one refill is enough for a length code, a distance code and their extra bits: 15 + 5 + 15 + 13 bits*/
+    ensureBits(reader);
     /*code_ll is literal, length or end code*/
-    unsigned code_ll = huffmanDecodeSymbol(in, bp, &tree_ll, inbitlength);
+    code_ll = huffmanDecodeSymbol(reader, &tree_ll);
+    if(reader->bp > reader->bitsize) ERROR_BREAK(10); /*error: end of input reached without end code*/
     if(code_ll <= 255) /*literal symbol*/
     {
       if((*pos) >= out->size)
@@ -1114,55 +1220,46 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
     else if(code_ll >= FIRST_LENGTH_CODE_INDEX && code_ll <= LAST_LENGTH_CODE_INDEX) /*length code*/
     {
       unsigned code_d, distance;
-      unsigned numextrabits_l, numextrabits_d; /*extra bits for length and distance*/
-      size_t start, forward, backward, length;
+      size_t forward, length;
+      unsigned char* dst;
+      const unsigned char* src;
 
-      /*part 1: get length base*/
+      /*part 1 and 2: get length base and add the value of the extra bits to it*/
       length = LENGTHBASE[code_ll - FIRST_LENGTH_CODE_INDEX];
-
-      /*part 2: get extra bits and add the value of that to length*/
-      numextrabits_l = LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
-      length += readBitsFromStream(bp, in, numextrabits_l);
+      length += readBits(reader, LENGTHEXTRA[code_ll - FIRST_LENGTH_CODE_INDEX]);
 
       /*part 3: get distance code*/
-      code_d = huffmanDecodeSymbol(in, bp, &tree_d, inbitlength);
+      code_d = huffmanDecodeSymbol(reader, &tree_d);
       if(code_d > 29)
       {
-        if(code_ll == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
+        if(code_d == (unsigned)(-1)) /*huffmanDecodeSymbol returns (unsigned)(-1) in case of error*/
         {
           /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
           (10=no endcode, 11=wrong jump outside of tree)*/
-          error = (*bp) > inlength * 8 ? 10 : 11;
+          error = reader->bp > reader->bitsize ? 10 : 11;
         }
         else error = 18; /*error: invalid distance code (30-31 are never used)*/
         break;
       }
-      distance = DISTANCEBASE[code_d];
-
-      /*part 4: get extra bits from distance*/
-      numextrabits_d = DISTANCEEXTRA[code_d];
-      if(*bp >= inbitlength) ERROR_BREAK(51); /*error, bit pointer will jump past memory*/
 
-      distance += readBitsFromStream(bp, in, numextrabits_d);
+      /*part 4: get distance base and add the extra bits*/
+      distance = DISTANCEBASE[code_d];
+      distance += readBits(reader, DISTANCEEXTRA[code_d]);
+      if(reader->bp > reader->bitsize) ERROR_BREAK(51); /*error, bit pointer jumped past memory*/
 
       /*part 5: fill in all the out[n] values based on the length and dist*/
-      start = (*pos);
-      if(distance > start) ERROR_BREAK(52); /*too long backward distance*/
-      backward = start - distance;
+      if(distance > (*pos)) ERROR_BREAK(52); /*too long backward distance*/
       if((*pos) + length >= out->size)
       {
         /*reserve more room at once*/
         if(!ucvector_resize(out, ((*pos) + length) * 2)) ERROR_BREAK(83 /*alloc fail*/);
       }
 
-      for(forward = 0; forward < length; forward++)
-      {
-        out->data[(*pos)] = out->data[backward];
-        (*pos)++;
-        backward++;
-        if(backward >= start) backward = start - distance;
-      }
+      /*byte by byte, so a distance shorter than length repeats the last bytes*/
+      dst = &out->data[(*pos)];
+      src = dst - distance;
+      for(forward = 0; forward < length; forward++) dst[forward] = src[forward];
+      (*pos) += length;
     }
     else if(code_ll == 256)
     {
@@ -1172,9 +1269,10 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
     {
       /*return error code 10 or 11 depending on the situation that happened in huffmanDecodeSymbol
       (10=no endcode, 11=wrong jump outside of tree)*/
-      error = (*bp) > inlength * 8 ? 10 : 11;
+      error = reader->bp > reader->bitsize ? 10 : 11;
       break;
     }
+    if(maxpos && (*pos) >= maxpos) break; /*caller needs no more output*/
   }
 
   HuffmanTree_cleanup(&tree_ll);
@@ -1183,32 +1281,35 @@ static unsigned inflateHuffmanBlock(ucvector* out, const unsigned char* in, size
   return error;
 }
 
-static unsigned inflateNoCompression(ucvector* out, const unsigned char* in, size_t* bp, size_t* pos, size_t inlength)
+static unsigned inflateNoCompression(ucvector* out, BitReader* reader, size_t* pos)
 {
   /*go to first boundary of byte*/
-  size_t p;
+  size_t p = (reader->bp + 7) / 8; /*byte position*/
+  size_t inlength = reader->size;
+  const unsigned char* in = reader->data;
   unsigned LEN, NLEN, n, error = 0;
-  while(((*bp) & 0x7) != 0) (*bp)++;
-  p = (*bp) / 8; /*byte position*/
 
   /*read LEN (2 bytes) and NLEN (2 bytes)*/
-  if(p >= inlength - 4) return 52; /*error, bit pointer will jump past memory*/
+  if(p + 4 > inlength) return 52; /*error, bit pointer will jump past memory*/
   LEN = in[p] + 256 * in[p + 1]; p += 2;
   NLEN = in[p] + 256 * in[p + 1]; p += 2;
 
   /*check if 16-bit NLEN is really the one's complement of LEN*/
   if(LEN + NLEN != 65535) return 21; /*error: NLEN is not one's complement of LEN*/
 
+  /*p <= inlength here and LEN < 65536: p + LEN cannot wrap around*/
+  if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
+
   if((*pos) + LEN >= out->size)
   {
     if(!ucvector_resize(out, (*pos) + LEN)) return 83; /*alloc fail*/
   }
 
   /*read the literal data: LEN bytes are now stored in the out buffer*/
-  if(p + LEN > inlength) return 23; /*error: reading outside of in buffer*/
   for(n = 0; n < LEN; n++) out->data[(*pos)++] = in[p++];
 
-  (*bp) = p * 8;
+  /*continue after the stored bytes, the bit buffer starts over there*/
+  BitReader_init(reader, in, inlength, p * 8);
 
   return error;
 }
@@ -1217,26 +1318,26 @@ static unsigned lodepng_inflatev(ucvector* out,
                                  const unsigned char* in, size_t insize,
                                  const LodePNGDecompressSettings* settings)
 {
-  /*bit pointer in the "in" data, current byte is bp >> 3, current bit is bp & 0x7 (from lsb to msb of the byte)*/
-  size_t bp = 0;
+  BitReader reader;
   unsigned BFINAL = 0;
   size_t pos = 0; /*byte position in the out buffer*/
 
   unsigned error = 0;
 
-  (void)settings;
+  BitReader_init(&reader, in, insize, 0);
 
-  while(!BFINAL)
+  /*stop early once max_output_size bytes are there*/
+  while(!BFINAL && !(settings->max_output_size && pos >= settings->max_output_size))
   {
     unsigned BTYPE;
-    if(bp + 2 >= insize * 8) return 52; /*error, bit pointer will jump past memory*/
-    BFINAL = readBitFromStream(&bp, in);
-    BTYPE = 1 * readBitFromStream(&bp, in);
-    BTYPE += 2 * readBitFromStream(&bp, in);
+    if(reader.bp + 2 >= reader.bitsize) return 52; /*error, bit pointer will jump past memory*/
+    ensureBits(&reader);
+    BFINAL = readBits(&reader, 1);
+    BTYPE = readBits(&reader, 2);
 
     if(BTYPE == 3) return 20; /*error: invalid BTYPE*/
-    else if(BTYPE == 0) error = inflateNoCompression(out, in, &bp, &pos, insize); /*no compression*/
-    else error = inflateHuffmanBlock(out, in, &bp, &pos, insize, BTYPE); /*compression, BTYPE 01 or 10*/
+    else if(BTYPE == 0) error = inflateNoCompression(out, &reader, &pos); /*no compression*/
+    else error = inflateHuffmanBlock(out, &reader, &pos, BTYPE, settings->max_output_size); /*compression, BTYPE 01 or 10*/
 
     if(error) return error;
   }
@@ -2103,7 +2204,8 @@ unsigned lodepng_zlib_decompress(unsigned char** out, size_t* outsize, const uns
   error = inflate(out, outsize, in + 2, insize - 2, settings);
   if(error) return error;
 
-  if(!settings->ignore_adler32)
+  /*a stream stopped at max_output_size can't be checked*/
+  if(!settings->ignore_adler32 && !(settings->max_output_size && *outsize >= settings->max_output_size))
   {
     unsigned ADLER32 = lodepng_read32bitInt(&in[insize - 4]);
     unsigned checksum = adler32(*out, (unsigned)(*outsize));
@@ -2245,9 +2347,10 @@ void lodepng_decompress_settings_init(LodePNGDecompressSettings* settings)
   settings->custom_zlib = 0;
   settings->custom_inflate = 0;
   settings->custom_context = 0;
+  settings->max_output_size = 0;
 }
 
-const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0};
+const LodePNGDecompressSettings lodepng_default_decompress_settings = {0, 0, 0, 0, 0};
 
 #endif /*LODEPNG_COMPILE_DECODER*/
 
@@ -2355,6 +2458,306 @@ static void setBitOfReversedStream(size_t* bitpointer, unsigned char* bitstream,
   (*bitpointer)++;
 }
 
+/* ////////////////////////////////////////////////////////////////////////// */
+/* / SIMD versions of the unfilter and color conversion loops              / */
+/* ////////////////////////////////////////////////////////////////////////// */
+
+/*
+The kernels below give exactly the same bytes as the plain C loops, they are only
+used when the row layout suits them (previous scanline present, 3 or 4 bytes per
+pixel for Sub, Avg and Paeth) and return 0 otherwise to fall back to the C code.
+Sub, Avg and Paeth depend on the pixel to the left, so those work one pixel per
+step, with all channels of the pixel in one register. On x86 SSE2 is assumed
+(always present on x86-64), SSSE3 and AVX2 are detected at runtime.
+*/
+
+#ifdef LODEPNG_SIMD_X86
+
+#define SIMD_SSSE3 1
+#define SIMD_AVX2  2
+
+static int simdFeatures(void)
+{
+  static int features = -1; /*detected once, racing threads write the same value*/
+  if(features < 0)
+  {
+    int f = 0;
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("ssse3")) f |= SIMD_SSSE3;
+    if(__builtin_cpu_supports("avx2")) f |= SIMD_AVX2;
+    features = f;
+  }
+  return features;
+}
+
+/*load/store one pixel of 3 or 4 bytes in the low lanes, without touching bytes past it*/
+static __m128i loadPixelSSE2(const unsigned char* p, size_t bytewidth)
+{
+  unsigned v = p[0] | (p[1] << 8) | (p[2] << 16);
+  if(bytewidth == 4) v |= (unsigned)p[3] << 24;
+  return _mm_cvtsi32_si128((int)v);
+}
+
+static void storePixelSSE2(unsigned char* p, __m128i x, size_t bytewidth)
+{
+  unsigned v = (unsigned)_mm_cvtsi128_si32(x);
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  if(bytewidth == 4) p[3] = (unsigned char)(v >> 24);
+}
+
+#ifdef LODEPNG_COMPILE_DECODER
+static size_t unfilterUpSSE2(unsigned char* recon, const unsigned char* scanline,
+                             const unsigned char* precon, size_t length)
+{
+  size_t i;
+  for(i = 0; i + 16 <= length; i += 16)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&scanline[i]);
+    __m128i b = _mm_loadu_si128((const __m128i*)&precon[i]);
+    _mm_storeu_si128((__m128i*)&recon[i], _mm_add_epi8(x, b));
+  }
+  return i;
+}
+
+__attribute__((target("avx2")))
+static size_t unfilterUpAVX2(unsigned char* recon, const unsigned char* scanline,
+                             const unsigned char* precon, size_t length)
+{
+  size_t i;
+  for(i = 0; i + 32 <= length; i += 32)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&scanline[i]);
+    __m256i b = _mm256_loadu_si256((const __m256i*)&precon[i]);
+    _mm256_storeu_si256((__m256i*)&recon[i], _mm256_add_epi8(x, b));
+  }
+  return i;
+}
+
+static void unfilterSubSSE2(unsigned char* recon, const unsigned char* scanline,
+                            size_t bytewidth, size_t length)
+{
+  size_t i;
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i < length; i += bytewidth)
+  {
+    a = _mm_add_epi8(a, loadPixelSSE2(&scanline[i], bytewidth));
+    storePixelSSE2(&recon[i], a, bytewidth);
+  }
+}
+
+static void unfilterAvgSSE2(unsigned char* recon, const unsigned char* scanline,
+                            const unsigned char* precon, size_t bytewidth, size_t length)
+{
+  size_t i;
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for(i = 0; i < length; i += bytewidth)
+  {
+    __m128i b = loadPixelSSE2(&precon[i], bytewidth);
+    /*pavgb rounds up, (a + b) / 2 rounds down: subtract the carried low bit*/
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(avg, loadPixelSSE2(&scanline[i], bytewidth));
+    storePixelSSE2(&recon[i], a, bytewidth);
+  }
+}
+
+static __m128i absSSE2(__m128i x)
+{
+  return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+static __m128i selectSSE2(__m128i mask, __m128i x, __m128i y)
+{
+  return _mm_or_si128(_mm_and_si128(mask, x), _mm_andnot_si128(mask, y));
+}
+
+static void unfilterPaethSSE2(unsigned char* recon, const unsigned char* scanline,
+                              const unsigned char* precon, size_t bytewidth, size_t length)
+{
+  size_t i;
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero; /*16-bit lanes*/
+  for(i = 0; i < length; i += bytewidth)
+  {
+    __m128i b = _mm_unpacklo_epi8(loadPixelSSE2(&precon[i], bytewidth), zero);
+    __m128i p = _mm_sub_epi16(b, c);
+    __m128i q = _mm_sub_epi16(a, c);
+    __m128i pa = absSSE2(p);
+    __m128i pb = absSSE2(q);
+    __m128i pc = absSSE2(_mm_add_epi16(p, q));
+    __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    /*same tie order as paethPredictor: a, then b, then c*/
+    __m128i nearest = selectSSE2(_mm_cmpeq_epi16(pa, smallest), a,
+                                 selectSSE2(_mm_cmpeq_epi16(pb, smallest), b, c));
+    __m128i x = _mm_add_epi8(_mm_packus_epi16(nearest, nearest), loadPixelSSE2(&scanline[i], bytewidth));
+    storePixelSSE2(&recon[i], x, bytewidth);
+    a = _mm_unpacklo_epi8(x, zero);
+    c = b;
+  }
+}
+
+static unsigned unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                     size_t bytewidth, unsigned char filterType, size_t length)
+{
+  size_t i;
+  if(filterType == 2)
+  {
+    i = (simdFeatures() & SIMD_AVX2) ? unfilterUpAVX2(recon, scanline, precon, length) : 0;
+    i += unfilterUpSSE2(&recon[i], &scanline[i], &precon[i], length - i);
+    for(; i < length; i++) recon[i] = scanline[i] + precon[i];
+    return 1;
+  }
+  if(bytewidth != 3 && bytewidth != 4) return 0;
+  switch(filterType)
+  {
+    case 1: unfilterSubSSE2(recon, scanline, bytewidth, length); return 1;
+    case 3: unfilterAvgSSE2(recon, scanline, precon, bytewidth, length); return 1;
+    case 4: unfilterPaethSSE2(recon, scanline, precon, bytewidth, length); return 1;
+    default: return 0;
+  }
+}
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+/*the out buffer must have room for 16 bytes from each store, so stop 6 pixels before the end*/
+__attribute__((target("ssse3")))
+static size_t rgbaToRgbSSSE3(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  size_t i;
+  const __m128i shuffle = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  for(i = 0; i + 6 <= numpixels; i += 4)
+  {
+    __m128i x = _mm_loadu_si128((const __m128i*)&in[i * 4]);
+    _mm_storeu_si128((__m128i*)&out[i * 3], _mm_shuffle_epi8(x, shuffle));
+  }
+  return i;
+}
+
+/*each lane packs 4 pixels to 12 bytes, the permute joins both lanes to 24 bytes*/
+__attribute__((target("avx2")))
+static size_t rgbaToRgbAVX2(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  size_t i;
+  const __m256i shuffle = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+                                           0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+  const __m256i permute = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 7, 7);
+  for(i = 0; i + 11 <= numpixels; i += 8)
+  {
+    __m256i x = _mm256_loadu_si256((const __m256i*)&in[i * 4]);
+    x = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(x, shuffle), permute);
+    _mm256_storeu_si256((__m256i*)&out[i * 3], x);
+  }
+  return i;
+}
+
+/*returns how many pixels were converted, the caller does the rest*/
+static size_t rgbaToRgbSIMD(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  size_t i = 0;
+  int features = simdFeatures();
+  if(features & SIMD_AVX2) i = rgbaToRgbAVX2(out, in, numpixels);
+  if(features & SIMD_SSSE3) i += rgbaToRgbSSSE3(&out[i * 3], &in[i * 4], numpixels - i);
+  return i;
+}
+
+#elif defined(LODEPNG_SIMD_NEON)
+
+#ifdef LODEPNG_COMPILE_DECODER
+static uint8x8_t loadPixelNEON(const unsigned char* p, size_t bytewidth)
+{
+  uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+  if(bytewidth == 4) v |= (uint32_t)p[3] << 24;
+  return vreinterpret_u8_u32(vdup_n_u32(v));
+}
+
+static void storePixelNEON(unsigned char* p, uint8x8_t x, size_t bytewidth)
+{
+  uint32_t v = vget_lane_u32(vreinterpret_u32_u8(x), 0);
+  p[0] = (unsigned char)v;
+  p[1] = (unsigned char)(v >> 8);
+  p[2] = (unsigned char)(v >> 16);
+  if(bytewidth == 4) p[3] = (unsigned char)(v >> 24);
+}
+
+static void unfilterPaethNEON(unsigned char* recon, const unsigned char* scanline,
+                              const unsigned char* precon, size_t bytewidth, size_t length)
+{
+  size_t i;
+  int16x8_t a = vdupq_n_s16(0), c = vdupq_n_s16(0);
+  for(i = 0; i < length; i += bytewidth)
+  {
+    int16x8_t b = vreinterpretq_s16_u16(vmovl_u8(loadPixelNEON(&precon[i], bytewidth)));
+    int16x8_t p = vsubq_s16(b, c);
+    int16x8_t q = vsubq_s16(a, c);
+    int16x8_t pa = vabsq_s16(p);
+    int16x8_t pb = vabsq_s16(q);
+    int16x8_t pc = vabsq_s16(vaddq_s16(p, q));
+    int16x8_t smallest = vminq_s16(pc, vminq_s16(pa, pb));
+    /*same tie order as paethPredictor: a, then b, then c*/
+    int16x8_t nearest = vbslq_s16(vceqq_s16(pa, smallest), a, vbslq_s16(vceqq_s16(pb, smallest), b, c));
+    uint8x8_t x = vadd_u8(vmovn_u16(vreinterpretq_u16_s16(nearest)), loadPixelNEON(&scanline[i], bytewidth));
+    storePixelNEON(&recon[i], x, bytewidth);
+    a = vreinterpretq_s16_u16(vmovl_u8(x));
+    c = b;
+  }
+}
+
+static unsigned unfilterScanlineSIMD(unsigned char* recon, const unsigned char* scanline, const unsigned char* precon,
+                                     size_t bytewidth, unsigned char filterType, size_t length)
+{
+  size_t i;
+  uint8x8_t a = vdup_n_u8(0);
+  if(filterType == 2)
+  {
+    for(i = 0; i + 16 <= length; i += 16)
+    {
+      vst1q_u8(&recon[i], vaddq_u8(vld1q_u8(&scanline[i]), vld1q_u8(&precon[i])));
+    }
+    for(; i < length; i++) recon[i] = scanline[i] + precon[i];
+    return 1;
+  }
+  if(bytewidth != 3 && bytewidth != 4) return 0;
+  switch(filterType)
+  {
+    case 1:
+      for(i = 0; i < length; i += bytewidth)
+      {
+        a = vadd_u8(a, loadPixelNEON(&scanline[i], bytewidth));
+        storePixelNEON(&recon[i], a, bytewidth);
+      }
+      return 1;
+    case 3:
+      for(i = 0; i < length; i += bytewidth)
+      {
+        /*vhadd rounds down like (a + b) / 2*/
+        a = vadd_u8(vhadd_u8(a, loadPixelNEON(&precon[i], bytewidth)), loadPixelNEON(&scanline[i], bytewidth));
+        storePixelNEON(&recon[i], a, bytewidth);
+      }
+      return 1;
+    case 4: unfilterPaethNEON(recon, scanline, precon, bytewidth, length); return 1;
+    default: return 0;
+  }
+}
+#endif /*LODEPNG_COMPILE_DECODER*/
+
+static size_t rgbaToRgbSIMD(unsigned char* out, const unsigned char* in, size_t numpixels)
+{
+  size_t i;
+  for(i = 0; i + 16 <= numpixels; i += 16)
+  {
+    uint8x16x4_t x = vld4q_u8(&in[i * 4]);
+    uint8x16x3_t y;
+    y.val[0] = x.val[0];
+    y.val[1] = x.val[1];
+    y.val[2] = x.val[2];
+    vst3q_u8(&out[i * 3], y);
+  }
+  return i;
+}
+
+#endif /*LODEPNG_SIMD_NEON*/
+
 /* ////////////////////////////////////////////////////////////////////////// */
 /* / PNG chunks                                                             / */
 /* ////////////////////////////////////////////////////////////////////////// */
@@ -3322,7 +3725,15 @@ static unsigned getPixelColorsRGBA8(unsigned char* buffer, size_t numpixels,
   {
     if(mode->bitdepth == 8)
     {
-      for(i = 0; i < numpixels; i++, buffer += num_channels)
+      i = 0;
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+      if(!has_alpha)
+      {
+        i = rgbaToRgbSIMD(buffer, in, numpixels);
+        buffer += i * 3;
+      }
+#endif
+      for(; i < numpixels; i++, buffer += num_channels)
       {
         buffer[0] = in[i * 4 + 0];
         buffer[1] = in[i * 4 + 1];
@@ -4018,6 +4429,9 @@ static unsigned unfilterScanline(unsigned char* recon, const unsigned char* scan
   */
 
   size_t i;
+#if defined(LODEPNG_SIMD_X86) || defined(LODEPNG_SIMD_NEON)
+  if(precon && unfilterScanlineSIMD(recon, scanline, precon, bytewidth, filterType, length)) return 0;
+#endif
   switch(filterType)
   {
     case 0:
@@ -4121,17 +4535,27 @@ out must be big enough AND must be 0 everywhere if bpp < 8 in the current implem
 (because that's likely a little bit faster)
 NOTE: comments about padding bits are only relevant if bpp < 8
 */
-static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp)
+/*number of Adam7 passes that together give every denom-th pixel in both directions (denom 1, 2, 4 or 8)*/
+static unsigned Adam7_passes(unsigned denom)
+{
+  return denom >= 8 ? 1 : denom >= 4 ? 3 : denom >= 2 ? 5 : 7;
+}
+
+/*with denom > 1, only the first Adam7_passes(denom) passes are used and out is the
+(w + denom - 1) / denom x (h + denom - 1) / denom image*/
+static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsigned w, unsigned h, unsigned bpp,
+                              unsigned denom)
 {
   unsigned passw[7], passh[7];
   size_t filter_passstart[8], padded_passstart[8], passstart[8];
-  unsigned i;
+  unsigned i, passes = Adam7_passes(denom);
+  unsigned ow = (w + denom - 1) / denom;
 
   Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
   if(bpp >= 8)
   {
-    for(i = 0; i < 7; i++)
+    for(i = 0; i < passes; i++)
     {
       unsigned x, y, b;
       size_t bytewidth = bpp / 8;
@@ -4139,7 +4563,8 @@ static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsig
       for(x = 0; x < passw[i]; x++)
       {
         size_t pixelinstart = passstart[i] + (y * passw[i] + x) * bytewidth;
-        size_t pixeloutstart = ((ADAM7_IY[i] + y * ADAM7_DY[i]) * w + ADAM7_IX[i] + x * ADAM7_DX[i]) * bytewidth;
+        size_t pixeloutstart = ((ADAM7_IY[i] + y * ADAM7_DY[i]) / denom * ow
+                              + (ADAM7_IX[i] + x * ADAM7_DX[i]) / denom) * bytewidth;
         for(b = 0; b < bytewidth; b++)
         {
           out[pixeloutstart + b] = in[pixelinstart + b];
@@ -4149,17 +4574,17 @@ static void Adam7_deinterlace(unsigned char* out, const unsigned char* in, unsig
   }
   else /*bpp < 8: Adam7 with pixels < 8 bit is a bit trickier: with bit pointers*/
   {
-    for(i = 0; i < 7; i++)
+    for(i = 0; i < passes; i++)
     {
       unsigned x, y, b;
       unsigned ilinebits = bpp * passw[i];
-      unsigned olinebits = bpp * w;
+      unsigned olinebits = bpp * ow;
       size_t obp, ibp; /*bit pointers (for out and in buffer)*/
       for(y = 0; y < passh[i]; y++)
       for(x = 0; x < passw[i]; x++)
       {
         ibp = (8 * passstart[i]) + (y * ilinebits + x * bpp);
-        obp = (ADAM7_IY[i] + y * ADAM7_DY[i]) * olinebits + (ADAM7_IX[i] + x * ADAM7_DX[i]) * bpp;
+        obp = (ADAM7_IY[i] + y * ADAM7_DY[i]) / denom * olinebits + (ADAM7_IX[i] + x * ADAM7_DX[i]) / denom * bpp;
         for(b = 0; b < bpp; b++)
         {
           unsigned char bit = readBitFromReversedStream(&ibp, in);
@@ -4202,7 +4627,7 @@ static void removePaddingBits(unsigned char* out, const unsigned char* in,
 the IDAT chunks (with filter index bytes and possible padding bits)
 return value is error*/
 static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
-                                     unsigned w, unsigned h, const LodePNGInfo* info_png)
+                                     unsigned w, unsigned h, const LodePNGInfo* info_png, unsigned denom)
 {
   /*
   This function converts the filtered-padded-interlaced data into pure 2D image buffer with the PNG's colortype.
@@ -4231,7 +4656,7 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
 
     Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
 
-    for(i = 0; i < 7; i++)
+    for(i = 0; i < Adam7_passes(denom); i++)
     {
       CERROR_TRY_RETURN(unfilter(&in[padded_passstart[i]], &in[filter_passstart[i]], passw[i], passh[i], bpp));
       /*TODO: possible efficiency improvement: if in this reduced image the bits fit nicely in 1 scanline,
@@ -4245,7 +4670,7 @@ static unsigned postProcessScanlines(unsigned char* out, unsigned char* in,
       }
     }
 
-    Adam7_deinterlace(out, in, w, h, bpp);
+    Adam7_deinterlace(out, in, w, h, bpp, denom);
   }
 
   return 0;
@@ -4558,6 +4983,20 @@ static unsigned readChunk_pHYs(LodePNGInfo* info, const unsigned char* data, siz
 }
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
 
+/*size of the zlib decompressed image data: all scanlines (of all Adam7 passes) with their filter bytes*/
+static size_t idatSize(unsigned w, unsigned h, const LodePNGInfo* info)
+{
+  unsigned bpp = lodepng_get_bpp(&info->color);
+  if(info->interlace_method == 1)
+  {
+    unsigned passw[7], passh[7];
+    size_t filter_passstart[8], padded_passstart[8], passstart[8];
+    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart, w, h, bpp);
+    return filter_passstart[7];
+  }
+  return (size_t)h * (1 + ((size_t)w * bpp + 7) / 8);
+}
+
 /*read a PNG, the result will be in the same color type as the PNG (hence "generic")*/
 static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
                           LodePNGState* state,
@@ -4568,6 +5007,9 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
   size_t i;
   ucvector idat; /*the data from idat chunks*/
   ucvector scanlines;
+  LodePNGDecompressSettings zlibsettings;
+  unsigned denom = 1; /*output is 1/denom of the png size*/
+  size_t needed = 0; /*inflated bytes required*/
 
   /*for unknown chunk order*/
   unsigned unknown = 0;
@@ -4705,31 +5147,50 @@ static void decodeGeneric(unsigned char** out, unsigned* w, unsigned* h,
     if(!IEND) chunk = lodepng_chunk_next_const(chunk);
   }
 
+  /*interlaced image at reduced size: only the first Adam7 passes are inflated*/
+  zlibsettings = state->decoder.zlibsettings;
+  if(!state->error && state->info_png.interlace_method == 1
+     && (state->decoder.scale_denom == 2 || state->decoder.scale_denom == 4 || state->decoder.scale_denom == 8))
+  {
+    unsigned passw[7], passh[7];
+    size_t filter_passstart[8], padded_passstart[8], passstart[8];
+
+    denom = state->decoder.scale_denom;
+    Adam7_getpassvalues(passw, passh, filter_passstart, padded_passstart, passstart,
+                        *w, *h, lodepng_get_bpp(&state->info_png.color));
+    needed = filter_passstart[Adam7_passes(denom)];
+    zlibsettings.max_output_size = needed;
+  }
+
   ucvector_init(&scanlines);
   if(!state->error)
   {
-    /*maximum final image length is already reserved in the vector's length - this is not really necessary*/
-    if(!ucvector_resize(&scanlines, lodepng_get_raw_size(*w, *h, &state->info_png.color) + *h))
-    {
-      state->error = 83; /*alloc fail*/
-    }
+    /*the inflated size follows from the header: allocate it once, the inflator only grows it for broken data*/
+    size_t expected = needed ? needed : idatSize(*w, *h, &state->info_png);
+    scanlines.data = (unsigned char*)lodepng_malloc(expected);
+    if(!scanlines.data) state->error = 83; /*alloc fail*/
+    else scanlines.size = scanlines.allocsize = expected;
   }
   if(!state->error)
   {
     /*decompress with the Zlib decompressor*/
     state->error = zlib_decompress(&scanlines.data, &scanlines.size, idat.data,
-                                   idat.size, &state->decoder.zlibsettings);
+                                   idat.size, &zlibsettings);
   }
   ucvector_cleanup(&idat);
 
+  if(!state->error && scanlines.size < needed) state->error = 91; /*passes missing*/
+
   if(!state->error)
   {
     ucvector outv;
     ucvector_init(&outv);
-    if(!ucvector_resizev(&outv,
-        lodepng_get_raw_size(*w, *h, &state->info_png.color), 0)) state->error = 83; /*alloc fail*/
-    if(!state->error) state->error = postProcessScanlines(outv.data, scanlines.data, *w, *h, &state->info_png);
+    if(!ucvector_resizev(&outv, lodepng_get_raw_size((*w + denom - 1) / denom, (*h + denom - 1) / denom,
+        &state->info_png.color), 0)) state->error = 83; /*alloc fail*/
+    if(!state->error) state->error = postProcessScanlines(outv.data, scanlines.data, *w, *h, &state->info_png, denom);
     *out = outv.data;
+    *w = (*w + denom - 1) / denom;
+    *h = (*h + denom - 1) / denom;
   }
   ucvector_cleanup(&scanlines);
 }
@@ -4834,6 +5295,7 @@ void lodepng_decoder_settings_init(LodePNGDecoderSettings* settings)
 #endif /*LODEPNG_COMPILE_ANCILLARY_CHUNKS*/
   settings->ignore_crc = 0;
   settings->fix_png = 0;
+  settings->scale_denom = 1;
   lodepng_decompress_settings_init(&settings->zlibsettings);
 }
 
@@ -6022,6 +6484,7 @@ const char* lodepng_error_text(unsigned code)
     case 89: return "text chunk keyword too short or long: must have size 1-79";
     /*the windowsize in the LodePNGCompressSettings. Requiring POT(==> & instead of %) makes encoding 12% faster.*/
     case 90: return "windowsize must be a power of two";
+    case 91: return "image data too short for the requested Adam7 passes";
   }
   return "unknown error code";
 }
@@ -75,6 +75,11 @@ source files with custom allocators.*/
 #ifndef LODEPNG_NO_COMPILE_ALLOCATORS
 #define LODEPNG_COMPILE_ALLOCATORS
 #endif
+/*SSE2/SSSE3/AVX2 or NEON versions of the unfilter and RGBA to RGB loops, chosen at
+runtime where the CPU may lack them. They give the same output as the C code.*/
+#ifndef LODEPNG_NO_COMPILE_SIMD
+#define LODEPNG_COMPILE_SIMD
+#endif
 /*compile the C++ version (you can disable the C++ wrapper here even when compiling for C++)*/
 #ifdef __cplusplus
 #ifndef LODEPNG_NO_COMPILE_CPP
@@ -263,6 +268,10 @@ struct LodePNGDecompressSettings
                              const LodePNGDecompressSettings*);
 
   const void* custom_context; /*optional custom settings for custom functions*/
+
+  /*stop inflating once this many bytes are output (default: 0 = no limit).
+  the Adler32 checksum is not checked for a stream that was stopped*/
+  size_t max_output_size;
 };
 
 extern const LodePNGDecompressSettings lodepng_default_decompress_settings;
@@ -525,6 +534,12 @@ typedef struct LodePNGDecoderSettings
   */
   unsigned fix_png;
   unsigned color_convert; /*whether to convert the PNG to the color type you want. Default: yes*/
+  /*
+  1, 2, 4 or 8: decode an Adam7 interlaced PNG at 1/scale_denom of its size in each direction,
+  using only the first 5, 3 or 1 passes (only that part of the image data is inflated).
+  w and h returned by the decoder are the reduced size. Ignored for non-interlaced PNGs. Default: 1
+  */
+  unsigned scale_denom;
 
 #ifdef LODEPNG_COMPILE_ANCILLARY_CHUNKS
   unsigned read_text_chunks; /*if false but remember_unknown_chunks is true, they're stored in the unknown chunks*/
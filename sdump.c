@@ -8,28 +8,49 @@
 void usage()
 {
 	printf("usage:\n"
-		"\tsdump [-h] [-f] [-r angle] image\n"
+		"\tsdump [-h] [-f] [-e filter] [-s] [-a] [-r angle] image\n"
 		"\tcat image | sdump\n"
 		"\twget -O - image_url | sdump\n"
 		"options:\n"
 		"\t-h: show this help\n"
 		"\t-f: fit image to display\n"
+		"\t-e: fit and enlarge small image (nearest/bilinear/lanczos)\n"
+		"\t-s: draw jpeg band by band while decoding\n"
+		"\t-a: play animation gif\n"
 		"\t-r: rotate image (90/180/270)\n"
 		);
 }
 
-void remove_temp_file()
+FILE *open_anonymous_file()
 {
-	extern char temp_file[PATH_MAX]; /* global */
-	remove(temp_file);
+	FILE *fp;
+#ifdef MFD_CLOEXEC
+	int fd;
+
+	/* memory backed file: no disk I/O and no cleanup needed (linux >= 3.17) */
+	if ((fd = memfd_create("sdump", MFD_CLOEXEC)) >= 0) {
+		if ((fp = fdopen(fd, "w+")) != NULL)
+			return fp;
+		eclose(fd);
+	}
+	logging(DEBUG, "memfd_create() failed, fallback to tmpfile()\n");
+#endif
+
+	/* tmpfile() is removed automatically when it is closed */
+	errno = 0;
+	if ((fp = tmpfile()) == NULL)
+		logging(ERROR, "tmpfile: %s\n", strerror(errno));
+
+	return fp;
 }
 
-char *make_temp_file(const char *template)
+FILE *read_stdin()
 {
-	extern char temp_file[PATH_MAX]; /* global */
 	int fd;
-	ssize_t size, file_size = 0;
-	char buf[BUFSIZE], *env;
+	ssize_t size = -1, file_size = 0;
+	char buf[PIPE_BUFSIZE];
+	struct stat st;
+	FILE *fp;
 
 	/* stdin is tty or not */
 	if (isatty(STDIN_FILENO)) {
@@ -37,35 +58,89 @@ char *make_temp_file(const char *template)
 		return NULL;
 	}
 
-	/* prepare temp file */
-	memset(temp_file, 0, BUFSIZE);
-	if ((env = getenv("TMPDIR")) != NULL) {
-		snprintf(temp_file, BUFSIZE, "%s/%s", env, template);
-	} else {
-		snprintf(temp_file, BUFSIZE, "/tmp/%s", template);
+	/* redirect from regular file: read it directly */
+	if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (st.st_size == 0) {
+			logging(ERROR, "stdin is empty\n");
+			return NULL;
+		}
+		return fdopen(STDIN_FILENO, "r");
 	}
 
-	if ((fd = emkstemp(temp_file)) < 0)
+	if ((fp = open_anonymous_file()) == NULL)
 		return NULL;
-	logging(DEBUG, "tmp file:%s\n", temp_file);
+	fd = fileno(fp);
 
-	/* register cleanup function */
-	if (atexit(remove_temp_file))
-		logging(ERROR, "atexit() failed\nmaybe temporary file remains...\n");
-
-	/* read data */
-	while ((size = read(STDIN_FILENO, buf, BUFSIZE)) > 0) {
-		write(fd, buf, size);
+#ifdef SPLICE_F_MOVE
+	/* move pages from pipe to file without copying them to user space */
+	while ((size = splice(STDIN_FILENO, NULL, fd, NULL,
+		PIPE_BUFSIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
 		file_size += size;
+#endif
+
+	/* stdin is not a pipe or splice() failed: fallback to read()/write() */
+	if (size < 0) {
+		while ((size = read(STDIN_FILENO, buf, PIPE_BUFSIZE)) > 0) {
+			if (ewrite(fd, buf, size) != size)
+				break;
+			file_size += size;
+		}
 	}
-	eclose(fd);
 
 	if (file_size == 0) {
 		logging(ERROR, "stdin is empty\n");
+		efclose(fp);
 		return NULL;
 	}
+	fseek(fp, 0L, SEEK_SET);
+
+	return fp;
+}
+
+bool stream_preview(struct image *preview, void *priv)
+{
+	struct sixel_t *sixel = (struct sixel_t *) priv;
+
+	/* palette is decided by preview image */
+	return sixel_init(sixel->tty, sixel, preview);
+}
+
+bool stream_band(struct image *band, int y, int height, void *priv)
+{
+	struct sixel_t *sixel = (struct sixel_t *) priv;
+
+	sixel_write_band(sixel, band, y, height);
+	return true;
+}
+
+/* decode, rotate/resize and draw frames in order:
+	only the drawing frame is held (besides the bounded gif decoder state),
+	so memory does not grow with the length of animation */
+bool play_animation(struct tty_t *tty, struct sixel_t *sixel, struct image *img, int angle, bool resize, enum enlarge_t enlarge)
+{
+	struct image frame;
+
+	ewrite(tty->fd, "\0337", 2); /* save cursor position */
+	for (int i = 0; i < get_frame_count(img); i++) {
+		if (!copy_frame(img, i, &frame))
+			return false;
+
+		transform_image(&frame, angle, resize ? tty->width: 0, resize ? tty->height: 0,
+			enlarge, get_sixel_bpp(&frame), false);
+
+		/* XXX: palette is decided by the first frame */
+		if (i == 0 && !sixel_init(tty, sixel, &frame)) {
+			free_image(&frame);
+			return false;
+		}
+
+		ewrite(tty->fd, "\0338", 2); /* restore cursor position */
+		sixel_write(tty, sixel, &frame);
+		usleep(get_current_delay(&frame) * 10000); /* gif delay 1 == 1/100 sec */
+		free_image(&frame);
+	}
 
-	return temp_file;
+	return true;
 }
 
 void cleanup(struct sixel_t *sixel, struct image *img)
@@ -76,21 +151,27 @@ void cleanup(struct sixel_t *sixel, struct image *img)
 
 int main(int argc, char **argv)
 {
-	const char *template = "sdump.XXXXXX";
-	char *file;
-	bool resize = false;
+	bool resize = false, stream = false, animate = false;
 	int angle = 0, opt;
+	enum enlarge_t enlarge = ENLARGE_NONE;
 	struct winsize ws;
 	struct image img;
 	struct tty_t tty = {
+		.fd = STDOUT_FILENO,
 		.cell_width = CELL_WIDTH, .cell_height = CELL_HEIGHT,
-	};;
+	};
+	FILE *fp;
+	struct input_t input;
 	struct sixel_t sixel = {
-		.context = NULL, .dither = NULL,
+		.context = NULL, .dither = NULL, .tty = &tty,
+	};
+	struct band_callback_t band_callbacks = {
+		.preview = stream_preview, .band = stream_band,
+		.band_height = SIXEL_BAND_HEIGHT, .priv = &sixel,
 	};
 
 	/* check arg */
-	while ((opt = getopt(argc, argv, "hfr:")) != -1) {
+	while ((opt = getopt(argc, argv, "hfe:sar:")) != -1) {
 		switch (opt) {
 		case 'h':
 			usage();
@@ -98,6 +179,16 @@ int main(int argc, char **argv)
 		case 'f':
 			resize = true;
 			break;
+		case 'e':
+			resize  = true;
+			enlarge = str2enlarge(optarg);
+			break;
+		case 's':
+			stream = true;
+			break;
+		case 'a':
+			animate = true;
+			break;
 		case 'r':
 			angle = str2num(optarg);
 			break;
@@ -108,11 +199,11 @@ int main(int argc, char **argv)
 
 	/* open file */
 	if (optind < argc)
-		file = argv[optind];
+		fp = efopen(argv[optind], "r");
 	else
-		file = make_temp_file(template);
+		fp = read_stdin();
 
-	if (file == NULL) {
+	if (fp == NULL) {
 		logging(FATAL, "input file not found\n");
 		usage();
 		return EXIT_FAILURE;
@@ -121,12 +212,7 @@ int main(int argc, char **argv)
 	/* init */
 	init_image(&img);
 
-	if (load_image(file, &img) == false) {
-		logging(FATAL, "couldn't load image\n");
-		return EXIT_FAILURE;
-	}
-
-	if (ioctl(STDIN_FILENO, TIOCGWINSZ, &ws)) {
+	if (ioctl(tty.fd, TIOCGWINSZ, &ws)) {
 		logging(ERROR, "ioctl: TIOCGWINSZ failed\n");
 		tty.width  = tty.cell_width * 80;
 		tty.height = tty.cell_height * 24;
@@ -135,13 +221,51 @@ int main(int argc, char **argv)
 		tty.height = tty.cell_height * ws.ws_row;
 	}
 
-	/* rotate/resize and draw */
-	/* TODO: support color reduction for 8bpp mode */
-	if (angle != 0)
-		rotate_image(&img, angle, true);
+	if (map_input(fp, &input) == false) {
+		logging(FATAL, "couldn't read input\n");
+		efclose(fp);
+		return EXIT_FAILURE;
+	}
+	efclose(fp);
+
+	/* let the decoder shrink the image as far as resize_image() would */
+	if (resize) {
+		input.target_width  = (angle == 90 || angle == 270) ? tty.height: tty.width;
+		input.target_height = (angle == 90 || angle == 270) ? tty.width: tty.height;
+	}
 
-	if (resize)
-		resize_image(&img, tty.width, tty.height, true);
+	/* band streaming: decode, quantize and draw at the same time
+		XXX: only jpeg without rotate/resize */
+	if (stream && angle == 0 && !resize && check_filetype(&input) == TYPE_JPEG) {
+		if (!stream_jpeg(&input, &band_callbacks)) {
+			logging(FATAL, "couldn't stream image\n");
+			unmap_input(&input);
+			goto error_occured;
+		}
+		unmap_input(&input);
+		cleanup(&sixel, &img);
+		return EXIT_SUCCESS;
+	}
+
+	if (load_image_input(&input, &img) == false) {
+		logging(FATAL, "couldn't load image\n");
+		unmap_input(&input);
+		return EXIT_FAILURE;
+	}
+	unmap_input(&input);
+
+	if (animate && get_frame_count(&img) > 1) {
+		if (!play_animation(&tty, &sixel, &img, angle, resize, enlarge))
+			goto error_occured;
+		cleanup(&sixel, &img);
+		return EXIT_SUCCESS;
+	}
+
+	/* rotate/resize/normalize at once and draw: only the current frame is drawn,
+		other gif frames are never decoded */
+	/* TODO: support color reduction for 8bpp mode */
+	transform_image(&img, angle, resize ? tty.width: 0, resize ? tty.height: 0,
+		enlarge, get_sixel_bpp(&img), false);
 
 	/* sixel */
 	if (!sixel_init(&tty, &sixel, &img))
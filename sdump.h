@@ -1,10 +1,12 @@
 /* See LICENSE for licence details. */
+#define _GNU_SOURCE /* for memfd_create() and splice() */
 #define _XOPEN_SOURCE 600
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -18,12 +20,18 @@
 #include <signal.h>
 #include <unistd.h>
 #include <sixel.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 enum {
-	VERBOSE     = false,
-	BUFSIZE     = 1024,
-	CELL_WIDTH  = 16,
-	CELL_HEIGHT = 8,
+	VERBOSE      = false,
+	BUFSIZE      = 1024,
+	PIPE_BUFSIZE = 64 * 1024, /* for reading stdin */
+	CELL_WIDTH   = 16,
+	CELL_HEIGHT  = 8,
 };
 
 struct tty_t {
@@ -31,5 +39,3 @@ struct tty_t {
 	int width, height;           /* terminal size (by pixel) */
 	int cell_width, cell_height; /* cell_size (by pixel) */
 };
-
-char temp_file[PATH_MAX];
@@ -2,41 +2,129 @@
 #include <sixel.h>
 
 enum {
-	SIXEL_COLORS = 256,
-	SIXEL_BPP    = 3,
+	SIXEL_COLORS      = 256,
+	SIXEL_BPP         = 3,
+#if defined(SIXEL_DEPTH_RGBA)
+	SIXEL_BPP_ALPHA   = SIXEL_DEPTH_RGBA, /* transparent pixels are not drawn */
+#else
+	SIXEL_BPP_ALPHA   = 3,                /* libsixel drops alpha */
+#endif
+	SIXEL_BAND_HEIGHT = 6 * 8, /* must be multiple of 6 (height of sixel) */
+};
+
+/* state of band streaming filter:
+	every band is encoded as an independent sixel image,
+	the filter joins them into one DCS sequence */
+enum band_state_t {
+	BAND_NONE = 0,    /* not streaming: write all */
+	BAND_INTRODUCER,  /* DCS P1; P2; P3 q */
+	BAND_RASTER,      /* " Pan; Pad; Ph; Pv */
+	BAND_BODY,        /* palette and sixel data */
+	BAND_TERMINATOR,  /* ST (ESC \) */
 };
 
 struct sixel_t {
 	sixel_output_t *context;
 	sixel_dither_t *dither;
+	struct tty_t *tty;
+	/* for band streaming */
+	enum band_state_t band_state;
+	bool band_first, band_last;
+	int width, height; /* size of whole image */
+	char last_char;
 };
 
-int sixel_write_callback(char *data, int size, void *priv)
+/* bytes per pixel passed to libsixel: image with alpha keeps it */
+static inline int get_sixel_bpp(struct image *img)
+{
+	return img->alpha ? SIXEL_BPP_ALPHA: SIXEL_BPP;
+}
+
+void sixel_write_all(int fd, char *data, int size)
 {
-	struct tty_t *tty = (struct tty_t *) priv;
 	char *ptr;
 	ssize_t wsize, left;
 
-	logging(DEBUG, "callback() data size:%d\n", size);
-
 	ptr  = data;
 	left = size;
 
 	while (ptr < (data + size)) {
-		wsize = ewrite(tty->fd, ptr, left);
+		if ((wsize = ewrite(fd, ptr, left)) <= 0)
+			break;
 		ptr  += wsize;
 		left -= wsize;
 	}
+}
+
+int sixel_write_callback(char *data, int size, void *priv)
+{
+	struct sixel_t *sixel = (struct sixel_t *) priv;
+	char *ptr, *from, buf[BUFSIZE];
+
+	logging(DEBUG, "callback() data size:%d\n", size);
+
+	if (sixel->band_state == BAND_NONE) {
+		sixel_write_all(sixel->tty->fd, data, size);
+		return true;
+	}
+
+	/* drop introducer and raster attributes except the first band,
+		and terminator except the last band */
+	for (ptr = from = data; ptr < (data + size); ptr++) {
+		switch (sixel->band_state) {
+		case BAND_INTRODUCER:
+			if (!sixel->band_first)
+				from = ptr + 1;
+			if (*ptr == 'q')
+				sixel->band_state = BAND_RASTER;
+			break;
+		case BAND_RASTER:
+			if (*ptr == '"' || *ptr == ';' || isdigit((unsigned char) *ptr)) {
+				sixel_write_all(sixel->tty->fd, from, ptr - from);
+				from = ptr + 1;
+				break;
+			}
+			/* raster attributes of a band has only band height: use whole image size */
+			if (sixel->band_first) {
+				sixel_write_all(sixel->tty->fd, from, ptr - from);
+				snprintf(buf, BUFSIZE, "\"1;1;%d;%d", sixel->width, sixel->height);
+				sixel_write_all(sixel->tty->fd, buf, strlen(buf));
+				from = ptr;
+			}
+			sixel->band_state = BAND_BODY;
+			/* fall through */
+		case BAND_BODY:
+			if (*ptr == '\033' && !sixel->band_last) {
+				sixel_write_all(sixel->tty->fd, from, ptr - from);
+				/* next band must start at next sixel line */
+				if ((ptr > from ? *(ptr - 1): sixel->last_char) != '-')
+					sixel_write_all(sixel->tty->fd, "-", 1);
+				from = ptr + 1;
+				sixel->band_state = BAND_TERMINATOR;
+			}
+			break;
+		case BAND_TERMINATOR:
+		default:
+			from = ptr + 1;
+			break;
+		}
+	}
+
+	if (ptr > from) {
+		sixel_write_all(sixel->tty->fd, from, ptr - from);
+		sixel->last_char = *(ptr - 1);
+	}
 
 	return true;
 }
 
 bool sixel_init(struct tty_t *tty, struct sixel_t *sixel, struct image *img)
 {
-	/* XXX: libsixel only allows 3 bytes per pixel image,
-		we should convert bpp when bpp is 1 or 2 or 4 */
-	if (get_image_channel(img) != SIXEL_BPP)
-		normalize_bpp(img, SIXEL_BPP, true);
+	/* XXX: libsixel only allows 3 (or 4: rgba) bytes per pixel image,
+		we should convert bpp when bpp is 1 or 2 or 4
+		(only the current frame is drawn) */
+	if (get_image_channel(img) != get_sixel_bpp(img))
+		normalize_bpp(img, get_sixel_bpp(img), false);
 
 	if ((sixel->dither = sixel_dither_create(SIXEL_COLORS)) == NULL) {
 		logging(ERROR, "couldn't create dither\n");
@@ -46,7 +134,7 @@ bool sixel_init(struct tty_t *tty, struct sixel_t *sixel, struct image *img)
 	/* XXX: use first frame for dither initialize */
 	if (sixel_dither_initialize(sixel->dither, get_current_frame(img),
 		get_image_width(img), get_image_height(img),
-		SIXEL_BPP, LARGE_AUTO, REP_AUTO, QUALITY_AUTO) != 0) {
+		get_image_channel(img), LARGE_AUTO, REP_AUTO, QUALITY_AUTO) != 0) {
 		logging(ERROR, "couldn't initialize dither\n");
 		sixel_dither_unref(sixel->dither);
 		return false;
@@ -54,7 +142,11 @@ bool sixel_init(struct tty_t *tty, struct sixel_t *sixel, struct image *img)
 	sixel_dither_set_diffusion_type(sixel->dither, DIFFUSE_AUTO);
 	//sixel_dither_set_diffusion_type(sixel->dither, DIFFUSE_NONE);
 
-	if ((sixel->context = sixel_output_create(sixel_write_callback, (void *) tty)) == NULL) {
+	sixel->tty        = tty;
+	sixel->band_state = BAND_NONE;
+	sixel->last_char  = '\0';
+
+	if ((sixel->context = sixel_output_create(sixel_write_callback, (void *) sixel)) == NULL) {
 		logging(ERROR, "couldn't create sixel context\n");
 		return false;
 	}
@@ -79,3 +171,17 @@ void sixel_write(struct tty_t *tty, struct sixel_t *sixel, struct image *img)
 	sixel_encode(get_current_frame(img), get_image_width(img), get_image_height(img),
 		get_image_channel(img), sixel->dither, sixel->context);
 }
+
+void sixel_write_band(struct sixel_t *sixel, struct image *band, int y, int height)
+{
+	sixel->band_state = BAND_INTRODUCER;
+	sixel->band_first = (y == 0);
+	sixel->band_last  = (y + get_image_height(band) >= height);
+	sixel->width      = get_image_width(band);
+	sixel->height     = height;
+
+	sixel_encode(get_current_frame(band), get_image_width(band), get_image_height(band),
+		get_image_channel(band), sixel->dither, sixel->context);
+
+	sixel->band_state = BAND_NONE;
+}
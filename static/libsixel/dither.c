@@ -112,6 +112,29 @@ static const unsigned char pal_xterm256[] = {
 };
 
 
+/* copy rgb of 4 bytes per pixel image (transparent pixels are skipped
+   if opaque_only), returns number of copied pixels */
+static int
+strip_alpha(unsigned char *dst, unsigned char const *src,
+            int npixels, int opaque_only)
+{
+    int i;
+    int n = 0;
+
+    for (i = 0; i < npixels; i++, src += 4) {
+        if (opaque_only && src[3] < LSQ_ALPHA_THRESHOLD) {
+            continue;
+        }
+        dst[n * 3 + 0] = src[0];
+        dst[n * 3 + 1] = src[1];
+        dst[n * 3 + 2] = src[2];
+        n++;
+    }
+
+    return n;
+}
+
+
 sixel_dither_t *
 sixel_dither_create(int ncolors)
 {
@@ -227,18 +250,48 @@ sixel_dither_initialize(sixel_dither_t *dither, unsigned char *data,
                         int quality_mode)
 {
     unsigned char *buf;
+    unsigned char *rgb = NULL;
+    int npixels = width * height;
+    int ntransparent = 0;
 
-    buf = LSQ_MakePalette(data, width, height, depth,
-                          dither->reqcolors, &dither->ncolors,
-                          &dither->origcolors,
-                          dither->method_for_largest,
-                          dither->method_for_rep,
-                          dither->quality_mode);
-    if (buf == NULL) {
-        return (-1);
+    /* 4 bytes per pixel (rgba): the palette is made of opaque pixels,
+       one more entry is reserved for the keycolor of transparent pixels */
+    dither->keycolor = (-1);
+    if (depth == 4) {
+        rgb = malloc(npixels * 3);
+        if (rgb == NULL) {
+            return (-1);
+        }
+        npixels = strip_alpha(rgb, data, npixels, 1);
+        ntransparent = width * height - npixels;
+        data = rgb;
+        depth = 3;
+    }
+
+    dither->ncolors = 0;
+    dither->origcolors = 0;
+    if (npixels > 0) {
+        buf = LSQ_MakePalette(data, npixels, 1, depth,
+                              dither->reqcolors - (ntransparent > 0 ? 1: 0),
+                              &dither->ncolors,
+                              &dither->origcolors,
+                              dither->method_for_largest,
+                              dither->method_for_rep,
+                              dither->quality_mode);
+        if (buf == NULL) {
+            free(rgb);
+            return (-1);
+        }
+        memcpy(dither->palette, buf, dither->ncolors * depth);
+        free(buf);
+    }
+    free(rgb);
+
+    if (ntransparent > 0) {
+        dither->keycolor = dither->ncolors;
+        memset(dither->palette + dither->ncolors * 3, 0, 3);
+        dither->ncolors++;
     }
-    memcpy(dither->palette, buf, dither->ncolors * depth);
-    free(buf);
 
     dither->optimized = 1;
     if (dither->origcolors <= dither->ncolors) {
@@ -282,8 +335,11 @@ sixel_apply_palette(sixel_image_t *im)
 {
     int ret;
     unsigned char *src;
+    unsigned char *rgb = NULL;
+    unsigned char const *alpha = NULL;
     int bufsize;
     int cachesize;
+    int ncolors;
     sixel_dither_t *dither;
 
     dither = im->dither;
@@ -310,13 +366,34 @@ sixel_apply_palette(sixel_image_t *im)
         }
     }
 
+    /* 4 bytes per pixel (rgba): transparent pixels are mapped to the keycolor,
+       opaque pixels are looked up from the other entries */
+    ncolors = dither->ncolors;
+    if (im->depth == 4) {
+        rgb = malloc(im->sx * im->sy * 3);
+        if (rgb == NULL) {
+            return (-1);
+        }
+        strip_alpha(rgb, src, im->sx * im->sy, 0);
+        if (dither->keycolor != -1) {
+            alpha = src + 3;
+            if (dither->keycolor == ncolors - 1 && ncolors > 1) {
+                ncolors--;
+            }
+        }
+        src = rgb;
+    }
+
     ret = LSQ_ApplyPalette(src, im->sx, im->sy, 3,
                            dither->palette,
-                           dither->ncolors,
+                           ncolors,
                            dither->method_for_diffuse,
                            dither->optimized,
                            dither->cachetable,
-                           im->pixels);
+                           im->pixels,
+                           alpha,
+                           dither->keycolor);
+    free(rgb);
 
     if (ret != 0) {
         return ret;
@@ -629,14 +629,17 @@ computeHistogram(unsigned char *data,
         return (-1);
     }
     memset(histgram, 0, (1 << depth * 5) * sizeof(unit_t));
-    it = ref = refmap = (unsigned short *)malloc(max_sample * sizeof(unit_t));
+    /* every sample can be a new color (samples can be more than max_sample,
+       colors are at most the size of histgram) */
+    it = ref = refmap = (unsigned short *)malloc((1 << depth * 5) * sizeof(unit_t));
     if (!it) {
         quant_trace(stderr, "Unable to allocate memory for lookup table.");
         return (-1);
     }
 
+    /* step in bytes: whole pixels, so that every sample starts on a pixel */
     if (length > max_sample * depth) {
-        step = length / depth / max_sample;
+        step = length / depth / max_sample * depth;
     } else {
         step = depth;
     }
@@ -1065,7 +1068,10 @@ LSQ_ApplyPalette(unsigned char *data,
                  int methodForDiffuse,
                  int foptimize,
                  unsigned short *cachetable,
-                 unsigned char *result)
+                 unsigned char *result,
+                 unsigned char const *alpha,   /* alpha of 4 bytes per pixel
+                                                  source (NULL: opaque) */
+                 int keycolor)                 /* index for transparent pixel */
 {
     typedef int component_t;
     int pos, j, n, x, y, sum1, sum2;
@@ -1149,6 +1155,11 @@ LSQ_ApplyPalette(unsigned char *data,
     for (y = 0; y < height; ++y) {
         for (x = 0; x < width; ++x) {
             pos = y * width + x;
+            if (alpha && alpha[pos * 4] < LSQ_ALPHA_THRESHOLD) {
+                /* not drawn: neither looked up nor diffused */
+                result[pos] = keycolor;
+                continue;
+            }
             index = f_lookup(data + (pos * depth), depth,
                              palette, ncolor, indextable);
             result[pos] = index;
@@ -33,13 +33,18 @@ LSQ_MakePalette(unsigned char *data, int x, int y, int depth,
                 int const methodForRep,
                 int const qualityMode);
 
+/* pixels whose alpha is less than this are transparent */
+#define LSQ_ALPHA_THRESHOLD 128
+
 int
 LSQ_ApplyPalette(unsigned char *data, int width, int height, int depth,
                  unsigned char *palette, int ncolor,
                  int const methodForDiffuse,
                  int foptimize,
                  unsigned short *cachetable,
-                 unsigned char *result);
+                 unsigned char *result,
+                 unsigned char const *alpha,
+                 int keycolor);
 
 
 extern void
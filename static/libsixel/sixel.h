@@ -30,6 +30,11 @@
 #define SIXEL_OUTPUT_PACKET_SIZE 1024
 #define SIXEL_PALETTE_MAX 256
 
+/* sixel_dither_initialize() and sixel_encode() take 4 bytes per pixel
+   (rgba) image: transparent pixels are mapped to the keycolor and not drawn
+   (DCS P2 = 1, the background is left as it is) */
+#define SIXEL_DEPTH_RGBA 4
+
 /* output character size */
 enum characterSize {
     CSIZE_7BIT = 0,  /* 7bit character */
@@ -163,7 +168,7 @@ sixel_dither_initialize(sixel_dither_t *dither,          /* dither context objec
                         unsigned char /* in */ *data,    /* sample image */
                         int /* in */ width,              /* image width */
                         int /* in */ height,             /* image height */
-                        int /* in */ depth,              /* pixel depth, now only '3' is supported */
+                        int /* in */ depth,              /* pixel depth, 3 or 4 (rgba) */
                         int /* in */ method_for_largest, /* method for finding the largest dimention */
                         int /* in */ method_for_rep,     /* method for choosing a color from the box */
                         int /* in */ quality_mode);      /* quality of histgram processing */
@@ -202,7 +207,7 @@ int
 sixel_encode(unsigned char  /* in */ *pixels,     /* pixel bytes */
              int            /* in */  width,      /* image width */
              int            /* in */  height,     /* image height */
-             int            /* in */  depth,      /* pixel depth */
+             int            /* in */  depth,      /* pixel depth, 3 or 4 (rgba) */
              sixel_dither_t /* in */ *dither,     /* dither context */
              sixel_output_t /* in */ *context);   /* output context */
 
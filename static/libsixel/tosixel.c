@@ -230,20 +230,17 @@ static int
 PutNode(sixel_output_t *const context, sixel_image_t *im, int x,
         sixel_node_t *np, int ncolors, int keycolor)
 {
-    if (ncolors != 2 || keycolor == -1) {
+    if (ncolors != 2 || keycolor != 0) {
         PutPalet(context, im, np->pal);
     }
 
+    /* pixels of keycolor are never in the map: no need to skip them here */
     for (; x < np->sx; x++) {
-        if (x != keycolor) {
-            PutPixel(context, 0);
-        }
+        PutPixel(context, 0);
     }
 
     for (; x < np->mx; x++) {
-        if (x != keycolor) {
-            PutPixel(context, np->map[x]);
-        }
+        PutPixel(context, np->map[x]);
     }
 
     PutFlash(context);
@@ -293,10 +290,11 @@ LibSixel_LSImageToSixel(sixel_image_t *im, sixel_output_t *context)
         context->conv_palette[n] = list[n] = n;
     }
 
+    /* P2 = 1: pixels of keycolor are transparent (left as it is) */
     if (context->has_8bit_control) {
-        nwrite = sprintf((char *)context->buffer, "\x90" "0;0;0" "q");
+        nwrite = sprintf((char *)context->buffer, "\x90" "0;%d;0" "q", back == -1 ? 0: 1);
     } else {
-        nwrite = sprintf((char *)context->buffer, "\x1bP" "0;0;0" "q");
+        nwrite = sprintf((char *)context->buffer, "\x1bP" "0;%d;0" "q", back == -1 ? 0: 1);
     }
     if (nwrite <= 0) {
         return (-1);
@@ -308,7 +306,8 @@ LibSixel_LSImageToSixel(sixel_image_t *im, sixel_output_t *context)
     }
     advance(context, nwrite);
 
-    if (maxPalet != 2 || back == -1) {
+    /* builtin mono palettes (keycolor 0) use the colors of terminal */
+    if (maxPalet != 2 || back != 0) {
         for (n = 0; n < maxPalet; n++) {
             /* DECGCI Graphics Color Introducer  # Pc ; Pu; Px; Py; Pz */
             nwrite = sprintf((char *)context->buffer + context->pos, "#%d;2;%d;%d;%d",
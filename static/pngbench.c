@@ -0,0 +1,120 @@
+/* See LICENSE for licence details. */
+/* pngbench: throughput of the lodepng decoder
+ *	usage: pngbench [-n count] png...
+ * build it with another lodepng.c to compare implementations:
+ *	make pngbench LODEPNG=/path/to/old/lodepng.c */
+#define _XOPEN_SOURCE 600
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lodepng.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* concatenate IDAT chunks: the zlib stream lodepng inflates */
+static unsigned char *get_idat(const unsigned char *png, size_t size, size_t *idat_size)
+{
+	const unsigned char *chunk = png + 8, *end = png + size;
+	unsigned char *idat = NULL;
+	size_t length;
+
+	*idat_size = 0;
+	while (chunk + 12 <= end) {
+		length = lodepng_chunk_length(chunk);
+		if (chunk + 12 + length > end)
+			break;
+		if (lodepng_chunk_type_equals(chunk, "IDAT")) {
+			idat = realloc(idat, *idat_size + length);
+			if (idat == NULL)
+				return NULL;
+			memcpy(idat + *idat_size, lodepng_chunk_data_const(chunk), length);
+			*idat_size += length;
+		}
+		chunk = lodepng_chunk_next_const(chunk);
+	}
+	return idat;
+}
+
+int main(int argc, char **argv)
+{
+	int opt, count = 10, i;
+	unsigned char *png, *idat, *out;
+	unsigned width, height, error;
+	size_t png_size, idat_size, out_size;
+	double start, inflate_time, decode_time;
+	double total_in = 0, total_out = 0, total_inflate = 0, total_decode = 0;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: pngbench [-n count] png...\n");
+			return EXIT_FAILURE;
+		}
+	}
+	if (count < 1)
+		count = 1;
+
+	printf("%-24s %9s %9s %12s %12s\n", "file", "in(KB)", "out(KB)", "inflate(MB/s)", "decode(MB/s)");
+	for (; optind < argc; optind++) {
+		if (lodepng_load_file(&png, &png_size, argv[optind]) != 0) {
+			fprintf(stderr, "%s: can't read\n", argv[optind]);
+			continue;
+		}
+		idat = get_idat(png, png_size, &idat_size);
+
+		/* zlib stream alone */
+		out_size = 0;
+		start = now();
+		for (i = 0; i < count; i++) {
+			out = NULL;
+			out_size = 0;
+			error = lodepng_zlib_decompress(&out, &out_size, idat, idat_size,
+				&lodepng_default_decompress_settings);
+			free(out);
+			if (error)
+				break;
+		}
+		inflate_time = (now() - start) / count;
+
+		/* whole decode to RGB, as sdump does */
+		start = now();
+		for (i = 0; i < count && !error; i++) {
+			error = lodepng_decode24(&out, &width, &height, png, png_size);
+			free(out);
+		}
+		decode_time = (now() - start) / count;
+
+		if (error) {
+			fprintf(stderr, "%s: %s\n", argv[optind], lodepng_error_text(error));
+		} else {
+			printf("%-24.24s %9.1f %9.1f %12.1f %12.1f\n", argv[optind],
+				idat_size / 1024.0, out_size / 1024.0,
+				out_size / inflate_time / 1e6, out_size / decode_time / 1e6);
+			total_in += idat_size;
+			total_out += out_size;
+			total_inflate += inflate_time;
+			total_decode += decode_time;
+		}
+		free(idat);
+		free(png);
+	}
+
+	if (total_inflate > 0)
+		printf("%-24s %9.1f %9.1f %12.1f %12.1f\n", "total",
+			total_in / 1024.0, total_out / 1024.0,
+			total_out / total_inflate / 1e6, total_out / total_decode / 1e6);
+
+	return EXIT_SUCCESS;
+}
@@ -1,10 +1,12 @@
 /* See LICENSE for licence details. */
+#define _GNU_SOURCE /* for memfd_create() and splice() */
 #define _XOPEN_SOURCE 600
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -15,11 +17,21 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
 
 enum {
-	VERBOSE   = false,
-	BUFSIZE   = 1024,
-	MULTIPLER = 1024,
+	VERBOSE      = false,
+	BUFSIZE      = 1024,
+	PIPE_BUFSIZE = 64 * 1024, /* for reading stdin */
+	RESAMPLE_SHIFT   = 22, /* max fixed-point precision of resampling weights */
+	RESAMPLE_PADDING = 16, /* readable bytes after a row for resample_horizontal() */
+	RESAMPLE_ROWS    = 4,  /* rows processed at once by resample_horizontal() */
+	ROTATE_TILE      = 8,  /* pixels transposed in registers at once (rows and columns) */
+	ROTATE_BLOCK     = 64, /* pixels of cache block (rows and columns) for rotation */
 };
 
 /* error functions */
@@ -108,6 +120,17 @@ void *ecalloc(size_t nmemb, size_t size)
 	return ptr;
 }
 
+void *erealloc(void *ptr, size_t size)
+{
+	void *new;
+	errno = 0;
+
+	if ((new = realloc(ptr, size)) == NULL)
+		logging(ERROR, "realloc: %s\n", strerror(errno));
+
+	return new;
+}
+
 long int estrtol(const char *nptr, char **endptr, int base)
 {
 	long int ret;
@@ -135,6 +158,38 @@ int emkstemp(char *template)
 	return ret;
 }
 
+void *emmap(void *addr, size_t len, int prot, int flag, int fd, off_t offset)
+{
+	void *ptr;
+	errno = 0;
+
+	if ((ptr = mmap(addr, len, prot, flag, fd, offset)) == MAP_FAILED)
+		logging(ERROR, "mmap: %s\n", strerror(errno));
+
+	return ptr;
+}
+
+int emunmap(void *ptr, size_t len)
+{
+	int ret;
+	errno = 0;
+
+	if ((ret = munmap(ptr, len)) < 0)
+		logging(ERROR, "munmap: %s\n", strerror(errno));
+
+	return ret;
+}
+
+int epthread_create(pthread_t *thread, void *(*start_routine)(void *), void *arg)
+{
+	int ret;
+
+	if ((ret = pthread_create(thread, NULL, start_routine, arg)) != 0)
+		logging(ERROR, "pthread_create: %s\n", strerror(ret));
+
+	return ret;
+}
+
 /* some useful functions */
 int str2num(char *str)
 {
@@ -148,7 +203,7 @@ int str2num(char *str)
 /* for png */
 #include "../lodepng.h"
 
-/* for gif/bmp/(ico not supported) */
+/* for gif/bmp/ico */
 #include "../libnsgif.h"
 #include "../libnsbmp.h"
 
@@ -161,7 +216,8 @@ enum {
 	CHECK_HEADER_SIZE = 8,
 	BYTES_PER_PIXEL   = 4,
 	PNG_HEADER_SIZE   = 8,
-	MAX_FRAME_NUM     = 128, /* limit of gif frames */
+	JPEG_MIN_PARALLEL = 4 * 1024 * 1024, /* pixels of the smallest jpeg decoded in parallel */
+	JPEG_MAX_THREADS  = 64,
 };
 
 enum filetype_t {
@@ -170,67 +226,553 @@ enum filetype_t {
 	TYPE_BMP,
 	TYPE_GIF,
 	TYPE_PNM,
+	TYPE_ICO,
 	TYPE_UNKNOWN,
 };
 
+/* whole image file in memory */
+struct input_t {
+	uint8_t *data;
+	size_t size;
+	size_t offset; /* read position for stream oriented readers */
+	bool mapped;   /* data is mmap()ed (true) or ecalloc()ed (false) */
+	/* decoders may reduce the image while decoding (0: full size),
+		but never below the size fitting in target_width x target_height */
+	int target_width;
+	int target_height;
+};
+
+/* animation gif: frames are decoded in order when they are requested */
+struct gif_stream_t {
+	gif_animation gif;    /* keeps the canvas and disposal state of decoded_frame */
+	struct input_t input; /* libnsgif refers to the file data until finalised */
+	int held_frame;       /* the only frame held in data[] (-1: none) */
+};
+
 struct image {
-	/* normally use data[0], data[n] (n > 1) for animanion gif */
-	uint8_t *data[MAX_FRAME_NUM];
+	/* frame_count entries allocated by alloc_frames():
+		normally use data[0], data[n] (n > 1) for animanion gif
+		(data[n] may be NULL while stream is alive, use get_frame()) */
+	uint8_t **data;
 	int width;
 	int height;
 	int channel;
 	bool alpha;
+	/* data[0] is the part at (part_x, part_y) of full_width x full_height image
+		(full_width == 0: whole image) */
+	int part_x, part_y;
+	int full_width, full_height;
 	/* for animation gif */
-	int delay[MAX_FRAME_NUM];
+	int *delay;
 	int frame_count; /* normally 1 */
 	int loop_count;
+	struct gif_stream_t *stream; /* NULL: all frames are in data[] */
 	int current_frame; /* for yaimgfb */
 };
 
-unsigned char *file_into_memory(FILE *fp, size_t *data_size)
+/* allocate frame table (frames themselves are allocated by loaders) */
+bool alloc_frames(struct image *img, int frame_count)
 {
-	unsigned char *buffer;
-	size_t n, size;
+	img->data  = (uint8_t **) ecalloc(frame_count, sizeof(uint8_t *));
+	img->delay = (int *) ecalloc(frame_count, sizeof(int));
+
+	if (img->data == NULL || img->delay == NULL) {
+		free(img->data);
+		free(img->delay);
+		img->data  = NULL;
+		img->delay = NULL;
+		return false;
+	}
+	img->frame_count = frame_count;
 
-	fseek(fp, 0L, SEEK_END);
-	size = ftell(fp);
+	return true;
+}
 
-	if ((buffer = ecalloc(1, size)) == NULL)
-		return NULL;
+bool map_input(FILE *fp, struct input_t *input)
+{
+	int fd;
+	size_t size, capacity;
+	uint8_t *buffer;
+	struct stat st;
+
+	input->data   = NULL;
+	input->size   = 0;
+	input->offset = 0;
+	input->mapped = false;
+	input->target_width  = 0;
+	input->target_height = 0;
+
+	/* regular file (or memfd): map it, decoders read page cache directly.
+		MAP_PRIVATE + PROT_WRITE because libnsgif patches truncated data in place */
+	fd = fileno(fp);
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		if ((buffer = emmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+			posix_madvise(buffer, st.st_size, POSIX_MADV_SEQUENTIAL);
+			input->data   = buffer;
+			input->size   = st.st_size;
+			input->mapped = true;
+			return true;
+		}
+	}
 
-	fseek(fp, 0L, SEEK_SET);
-	if ((n = fread(buffer, 1, size, fp)) != size) {
-		free(buffer);
-		return NULL;
+	/* pipe or mmap() failed: read until EOF */
+	capacity = BUFSIZE;
+	if ((input->data = ecalloc(1, capacity)) == NULL)
+		return false;
+
+	while ((size = fread(input->data + input->size, 1, capacity - input->size, fp)) > 0) {
+		input->size += size;
+		if (input->size < capacity)
+			continue;
+
+		capacity *= 2;
+		if ((buffer = erealloc(input->data, capacity)) == NULL) {
+			free(input->data);
+			return false;
+		}
+		input->data = buffer;
+	}
+
+	if (input->size == 0) {
+		free(input->data);
+		return false;
 	}
-	*data_size = size;
 
-	return buffer;
+	return true;
 }
 
-bool load_jpeg(FILE *fp, struct image *img)
+void unmap_input(struct input_t *input)
 {
-	if ((img->data[0] = (uint8_t *) stbi_load_from_file(fp, &img->width, &img->height, &img->channel, 3)) == NULL)
+	if (input->data == NULL) /* already taken over by gif stream */
+		return;
+
+	if (input->mapped)
+		emunmap(input->data, input->size);
+	else
+		free(input->data);
+
+	input->data = NULL;
+	input->size = 0;
+}
+
+/* largest denominator (8, 4, 2 or 1) that keeps width/denom x height/denom
+	not smaller than the image fitted into the target size */
+int get_scale_denom(struct input_t *input, int width, int height)
+{
+	int denom;
+
+	if (input->target_width <= 0 || input->target_height <= 0)
+		return 1;
+
+	for (denom = 8; denom > 1; denom /= 2)
+		if (width >= denom * input->target_width || height >= denom * input->target_height)
+			break;
+
+	return denom;
+}
+
+/* for multi resolution images: whether variant a suits the target size better than b.
+	the smallest variant not smaller than the image fitted into the target size wins,
+	or the largest one when every variant is smaller (or no target size) */
+bool better_variant(struct input_t *input, int a_width, int a_height, int b_width, int b_height)
+{
+	bool a_enough, b_enough;
+
+	if (input->target_width <= 0 || input->target_height <= 0)
+		return a_width * a_height > b_width * b_height;
+
+	a_enough = (a_width >= input->target_width || a_height >= input->target_height);
+	b_enough = (b_width >= input->target_width || b_height >= input->target_height);
+
+	if (a_enough != b_enough)
+		return a_enough;
+
+	return a_enough ? (a_width * a_height < b_width * b_height):
+		(a_width * a_height > b_width * b_height);
+}
+
+/* parallel jpeg decoding:
+	a baseline jpeg with restart markers is cut at the restart markers falling on
+	MCU row boundaries, and each part is decoded as a jpeg of its own. a part also
+	decodes the neighbouring rows if upsampling refers to them, and throws them away */
+struct jpeg_layout_t {
+	size_t header_size; /* SOI to the end of SOS, copied to each part */
+	size_t sof_height;  /* offset of the height field in SOF */
+	int width, height;
+	int mcu_width, mcu_height;
+	int mcu_cols, mcu_rows;
+	int interval;       /* MCUs per restart interval */
+	int unit_rows;      /* parts are cut every unit_rows MCU rows */
+	bool context;       /* chroma upsampling refers to the MCU rows above and below */
+	size_t *segment;    /* start of each entropy coded segment, then the end of scan + 2 */
+	int segment_count;
+};
+
+struct jpeg_part_t {
+	uint8_t *data;  /* jpeg of this part */
+	size_t size;
+	int denom;
+	int width;      /* width of decoded rows */
+	int skip;       /* context rows decoded before dst */
+	int rows;       /* rows stored to dst */
+	uint8_t *dst;
+	bool ok;
+};
+
+static inline int jpeg_get16(const uint8_t *p)
+{
+	return (p[0] << 8) | p[1];
+}
+
+static inline int gcd(int a, int b)
+{
+	int tmp;
+
+	while (b) {
+		tmp = a % b;
+		a   = b;
+		b   = tmp;
+	}
+	return a;
+}
+
+/* check that the jpeg can be decoded in parts, and find its restart markers */
+bool get_jpeg_layout(struct input_t *input, struct jpeg_layout_t *layout)
+{
+	const uint8_t *data = input->data, *ptr;
+	size_t pos = 2, length = 0;
+	int marker, components = 0, h, v, hmax = 1, vmax = 1, vmin = 4, i;
+
+	layout->segment  = NULL;
+	layout->width    = layout->height = 0;
+	layout->interval = 0;
+
+	/* marker segments until SOS */
+	while (true) {
+		if (pos + 4 > input->size || data[pos] != 0xFF)
+			return false;
+
+		if ((marker = data[pos + 1]) == 0xFF) { /* fill byte */
+			pos++;
+			continue;
+		}
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD9)) /* no marker segment */
+			return false;
+
+		length = jpeg_get16(data + pos + 2);
+		if (length < 2 || pos + 2 + length > input->size)
+			return false;
+
+		if (marker == 0xC0 || marker == 0xC1) { /* SOF0, SOF1: sequential huffman */
+			if (length < 8)
+				return false;
+			components = data[pos + 9];
+			if (data[pos + 4] != 8 || (components != 1 && components != 3)
+				|| length != 8 + 3 * (size_t) components)
+				return false;
+			layout->sof_height = pos + 5;
+			layout->height = jpeg_get16(data + pos + 5);
+			layout->width  = jpeg_get16(data + pos + 7);
+			for (i = 0; i < components; i++) {
+				h = data[pos + 11 + 3 * i] >> 4;
+				v = data[pos + 11 + 3 * i] & 0x0F;
+				if (h < 1 || h > 4 || v < 1 || v > 4)
+					return false;
+				hmax = (h > hmax) ? h: hmax;
+				vmax = (v > vmax) ? v: vmax;
+				vmin = (v < vmin) ? v: vmin;
+			}
+		} else if (marker >= 0xC2 && marker <= 0xCF
+			&& marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			return false; /* progressive, lossless or arithmetic coding */
+		} else if (marker == 0xDD && length >= 4) { /* DRI */
+			layout->interval = jpeg_get16(data + pos + 4);
+		} else if (marker == 0xDA) { /* SOS */
+			break;
+		}
+		pos += 2 + length;
+	}
+
+	/* one scan holding all components */
+	if (components == 0 || layout->width == 0 || layout->height == 0 || layout->interval == 0
+		|| length != 6 + 2 * (size_t) components || data[pos + 4] != components)
 		return false;
 
-	return true;
+	if ((long) layout->width * layout->height < JPEG_MIN_PARALLEL)
+		return false;
+
+	layout->header_size = pos + 2 + length;
+	layout->mcu_width   = (components == 1) ? 8: 8 * hmax;
+	layout->mcu_height  = (components == 1) ? 8: 8 * vmax;
+	layout->mcu_cols    = (layout->width + layout->mcu_width - 1) / layout->mcu_width;
+	layout->mcu_rows    = (layout->height + layout->mcu_height - 1) / layout->mcu_height;
+	layout->unit_rows   = layout->interval / gcd(layout->interval, layout->mcu_cols);
+	layout->context     = (vmin < vmax);
+
+	layout->segment_count = (layout->mcu_cols * layout->mcu_rows + layout->interval - 1) / layout->interval;
+	if ((layout->segment = (size_t *) ecalloc(layout->segment_count + 1, sizeof(size_t))) == NULL)
+		return false;
+
+	/* entropy coded data: 0xFF is followed by 0x00 (stuffing), 0xFF (fill) or a marker */
+	layout->segment[0] = layout->header_size;
+	pos = layout->header_size;
+	i   = 1;
+	while ((ptr = memchr(data + pos, 0xFF, input->size - pos)) != NULL) {
+		pos = ptr - data;
+		if (pos + 1 >= input->size)
+			break;
+
+		marker = data[pos + 1];
+		if (marker == 0x00 || marker == 0xFF) {
+			pos++;
+			continue;
+		}
+		if (marker < 0xD0 || marker > 0xD7) { /* end of scan */
+			if (marker == 0xD9 && i == layout->segment_count) {
+				layout->segment[i] = pos + 2;
+				return true;
+			}
+			break;
+		}
+		if (i == layout->segment_count) /* too many RST */
+			break;
+		layout->segment[i++] = pos + 2;
+		pos += 2;
+	}
+
+	free(layout->segment);
+	layout->segment = NULL;
+	return false;
 }
 
-bool load_png(FILE *fp, struct image *img)
+/* make a jpeg holding MCU rows first to last - 1 (both multiples of unit_rows or mcu_rows) */
+bool make_jpeg_part(struct input_t *input, struct jpeg_layout_t *layout,
+	int first, int last, struct jpeg_part_t *part)
 {
-	unsigned char *mem;
+	int height, start, end;
 	size_t size;
+	uint8_t *ptr;
+
+	start  = first * layout->mcu_cols / layout->interval;
+	end    = (last == layout->mcu_rows) ? layout->segment_count: last * layout->mcu_cols / layout->interval;
+	height = (last == layout->mcu_rows) ? layout->height - first * layout->mcu_height:
+		(last - first) * layout->mcu_height;
+
+	part->size = layout->header_size + layout->segment[end] - layout->segment[start];
+	if ((part->data = (uint8_t *) ecalloc(1, part->size)) == NULL)
+		return false;
+
+	memcpy(part->data, input->data, layout->header_size);
+	part->data[layout->sof_height]     = height >> 8;
+	part->data[layout->sof_height + 1] = height & 0xFF;
+
+	/* decoders expect RST0, RST1, ... from the first segment */
+	ptr = part->data + layout->header_size;
+	for (int i = start; i < end; i++) {
+		size = layout->segment[i + 1] - 2 - layout->segment[i];
+		memcpy(ptr, input->data + layout->segment[i], size);
+		ptr   += size;
+		*ptr++ = 0xFF;
+		*ptr++ = (i + 1 < end) ? 0xD0 + ((i - start) & 7): 0xD9;
+	}
+	return true;
+}
 
-	if ((mem = file_into_memory(fp, &size)) == NULL)
+/* decode a large jpeg with restart markers on every core:
+	returns false (and leaves img untouched) if the jpeg can't be decoded this way */
+bool load_jpeg_parallel(struct input_t *input, struct image *img, void *(*decode_part)(void *))
+{
+	int parts, units, denom, first, last, context, i;
+	long cpus;
+	bool ok = false, *started = NULL;
+	pthread_t *thread = NULL;
+	struct jpeg_part_t *part = NULL;
+	struct jpeg_layout_t layout;
+
+	if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 2 || !get_jpeg_layout(input, &layout))
 		return false;
 
-	if (lodepng_decode24(&img->data[0], (unsigned *) &img->width, (unsigned *) &img->height, mem, size) != 0) {
-		free(mem);
+	units = (layout.mcu_rows + layout.unit_rows - 1) / layout.unit_rows;
+	parts = (cpus < units) ? cpus: units;
+	if (parts > JPEG_MAX_THREADS)
+		parts = JPEG_MAX_THREADS;
+	if (parts < 2) {
+		free(layout.segment);
 		return false;
 	}
 
+	denom = get_scale_denom(input, layout.width, layout.height);
+	logging(DEBUG, "jpeg scale:1/%d parts:%d restart interval:%d\n", denom, parts, layout.interval);
+
+	img->width   = (layout.width + denom - 1) / denom;
+	img->height  = (layout.height + denom - 1) / denom;
 	img->channel = 3;
-	free(mem);
+
+	if (!alloc_frames(img, 1)
+		|| (img->data[0] = (uint8_t *) ecalloc(img->width * img->height, img->channel)) == NULL
+		|| (part = (struct jpeg_part_t *) ecalloc(parts, sizeof(struct jpeg_part_t))) == NULL
+		|| (thread = (pthread_t *) ecalloc(parts, sizeof(pthread_t))) == NULL
+		|| (started = (bool *) ecalloc(parts, sizeof(bool))) == NULL)
+		goto release;
+
+	context = layout.context ? layout.unit_rows: 0;
+	for (i = 0; i < parts; i++) {
+		first = units * i / parts * layout.unit_rows;
+		last  = units * (i + 1) / parts * layout.unit_rows;
+		if (last > layout.mcu_rows)
+			last = layout.mcu_rows;
+
+		if (!make_jpeg_part(input, &layout, (first > 0) ? first - context: 0,
+			(last + context < layout.mcu_rows) ? last + context: layout.mcu_rows, &part[i]))
+			goto release;
+
+		part[i].denom = denom;
+		part[i].width = img->width;
+		part[i].skip  = ((first > 0) ? context: 0) * layout.mcu_height / denom;
+		part[i].rows  = ((last == layout.mcu_rows) ? img->height: last * layout.mcu_height / denom)
+			- first * layout.mcu_height / denom;
+		part[i].dst   = img->data[0] + (size_t) first * layout.mcu_height / denom * img->width * img->channel;
+	}
+
+	/* part 0 is decoded by this thread */
+	for (i = 1; i < parts; i++)
+		started[i] = (epthread_create(&thread[i], decode_part, &part[i]) == 0);
+	decode_part(&part[0]);
+
+	ok = true;
+	for (i = 0; i < parts; i++) {
+		if (i > 0 && started[i])
+			pthread_join(thread[i], NULL);
+		else if (i > 0)
+			decode_part(&part[i]);
+		ok = ok && part[i].ok;
+	}
+
+release:
+	if (part) {
+		for (i = 0; i < parts; i++)
+			free(part[i].data);
+	}
+	free(part);
+	free(thread);
+	free(started);
+	free(layout.segment);
+
+	if (!ok) {
+		if (img->data)
+			free(img->data[0]);
+		free(img->data);
+		free(img->delay);
+		img->data  = NULL;
+		img->delay = NULL;
+	}
+	return ok;
+}
+
+/* thread function of load_jpeg_parallel() */
+void *decode_jpeg_part(void *arg)
+{
+	int width, height, channel, row_stride;
+	uint8_t *data;
+	struct jpeg_part_t *part = (struct jpeg_part_t *) arg;
+
+	/* the scale denominator of stb_image is set by load_jpeg() */
+	if ((data = (uint8_t *) stbi_load_from_memory(part->data, part->size,
+		&width, &height, &channel, 3)) == NULL)
+		return NULL;
+
+	if (width == part->width && height >= part->skip + part->rows) {
+		row_stride = width * 3;
+		memcpy(part->dst, data + part->skip * row_stride, part->rows * row_stride);
+		part->ok = true;
+	}
+	stbi_image_free(data);
+
+	return NULL;
+}
+
+bool load_jpeg(struct input_t *input, struct image *img)
+{
+	int width, height, channel, denom = 1;
+	bool ret = false;
+
+	/* reduced IDCT: skip the pixels resize_image() would throw away */
+	if (stbi_info_from_memory(input->data, input->size, &width, &height, NULL))
+		denom = get_scale_denom(input, width, height);
+	stbi_set_jpeg_scale_denom(denom);
+
+	/* large jpeg with restart markers: decode parts of it on every core */
+	if (load_jpeg_parallel(input, img, decode_jpeg_part)) {
+		ret = true;
+	} else if (alloc_frames(img, 1)) {
+		logging(DEBUG, "jpeg scale:1/%d\n", denom);
+		/* channel is that of the file (1 for grayscale), data is always RGB */
+		img->data[0] = (uint8_t *) stbi_load_from_memory(input->data, input->size,
+			&img->width, &img->height, &channel, 3);
+		img->channel = 3;
+		ret = (img->data[0] != NULL);
+		if (!ret) { /* broken jpeg: release the frame table allocated above */
+			free(img->data);
+			free(img->delay);
+			img->data  = NULL;
+			img->delay = NULL;
+			img->frame_count = 0;
+		}
+	}
+	stbi_set_jpeg_scale_denom(1);
+
+	return ret;
+}
+
+/* alpha channel, or tRNS chunk (transparent palette entries or key color) before image data:
+	lodepng_inspect() reads only IHDR */
+static bool png_has_alpha(struct input_t *input, LodePNGColorType colortype)
+{
+	const unsigned char *chunk = input->data + PNG_HEADER_SIZE, *end = input->data + input->size;
+
+	if (colortype == LCT_GREY_ALPHA || colortype == LCT_RGBA)
+		return true;
+
+	while (end - chunk >= 12 && lodepng_chunk_length(chunk) <= (size_t) (end - chunk) - 12
+		&& !lodepng_chunk_type_equals(chunk, "IDAT")) {
+		if (lodepng_chunk_type_equals(chunk, "tRNS"))
+			return true;
+		chunk = lodepng_chunk_next_const(chunk);
+	}
+	return false;
+}
+
+bool load_png(struct input_t *input, struct image *img)
+{
+	unsigned width, height, error;
+	LodePNGState state;
+
+	if (!alloc_frames(img, 1))
+		return false;
+
+	lodepng_state_init(&state);
+	state.info_raw.colortype = LCT_RGB;
+	state.info_raw.bitdepth  = 8;
+
+	/* interlaced image: only inflate the Adam7 passes needed for the target size,
+		image with alpha is decoded as rgba */
+	if (lodepng_inspect(&width, &height, &state, input->data, input->size) == 0) {
+		state.decoder.scale_denom = get_scale_denom(input, width, height);
+		if (png_has_alpha(input, state.info_png.color.colortype))
+			state.info_raw.colortype = LCT_RGBA;
+	}
+	logging(DEBUG, "png interlace:%u scale:1/%u\n",
+		state.info_png.interlace_method, state.decoder.scale_denom);
+
+	img->channel = (state.info_raw.colortype == LCT_RGBA) ? 4: 3;
+	error = lodepng_decode(&img->data[0], &width, &height, &state, input->data, input->size);
+	lodepng_state_cleanup(&state);
+
+	if (error != 0)
+		return false;
+
+	img->width   = width;
+	img->height  = height;
 	return true;
 }
 
@@ -268,7 +810,213 @@ void gif_bitmap_modified(void *bitmap)
 	return;
 }
 
-bool load_gif(FILE *fp, struct image *img)
+void release_stream(struct image *img)
+{
+	struct gif_stream_t *stream = img->stream;
+
+	if (!stream)
+		return;
+
+	gif_finalise(&stream->gif);
+	unmap_input(&stream->input);
+	free(stream);
+	img->stream = NULL;
+}
+
+#if defined(__SSE2__)
+/* 4 pixels in 32bit lanes (4th byte is ignored) -> 12 bytes of rgb (low of register) */
+static inline __m128i pack_rgb(__m128i v)
+{
+	/* 2 pixels in each 64bit lane -> 6 bytes, then close the gap between lanes */
+	v = _mm_or_si128(_mm_and_si128(v, _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF)),
+		_mm_and_si128(_mm_srli_epi64(v, 8), _mm_set_epi32(0x0000FFFF, 0xFF000000, 0x0000FFFF, 0xFF000000)));
+	return _mm_or_si128(_mm_and_si128(v, _mm_set_epi32(0, 0, 0x0000FFFF, 0xFFFFFFFF)),
+		_mm_and_si128(_mm_srli_si128(v, 2), _mm_set_epi32(0, 0xFFFFFFFF, 0xFFFF0000, 0)));
+}
+
+/* 4 gray pixels in 32bit lanes -> 12 bytes of rgb */
+static inline __m128i pack_gray(__m128i v)
+{
+	return pack_rgb(_mm_or_si128(_mm_or_si128(v, _mm_slli_epi32(v, 8)), _mm_slli_epi32(v, 16)));
+}
+#endif
+
+/* convert a row to rgb (kernels are chosen once per image by bytes per pixel):
+	gray is copied to r, g and b, alpha is dropped
+	SSE2 stores 16 bytes for 12 bytes, the extra bytes are overwritten by the next store */
+static void gray_to_rgb(uint8_t *dst, const uint8_t *src, int width)
+{
+	int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v, lo, hi;
+
+	for (; x + 18 <= width; x += 16) {
+		v  = _mm_loadu_si128((const __m128i *) (src + x));
+		lo = _mm_unpacklo_epi8(v, zero);
+		hi = _mm_unpackhi_epi8(v, zero);
+		_mm_storeu_si128((__m128i *) (dst + x * 3),      pack_gray(_mm_unpacklo_epi16(lo, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x * 3 + 12), pack_gray(_mm_unpackhi_epi16(lo, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x * 3 + 24), pack_gray(_mm_unpacklo_epi16(hi, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x * 3 + 36), pack_gray(_mm_unpackhi_epi16(hi, zero)));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16x3_t rgb;
+
+	for (; x + 16 <= width; x += 16) {
+		rgb.val[0] = rgb.val[1] = rgb.val[2] = vld1q_u8(src + x);
+		vst3q_u8(dst + x * 3, rgb);
+	}
+#endif
+	for (; x < width; x++)
+		dst[x * 3] = dst[x * 3 + 1] = dst[x * 3 + 2] = src[x];
+}
+
+static void gray_alpha_to_rgb(uint8_t *dst, const uint8_t *src, int width)
+{
+	int x = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	__m128i v;
+
+	for (; x + 10 <= width; x += 8) {
+		v = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src + x * 2)), _mm_set1_epi16(0x00FF));
+		_mm_storeu_si128((__m128i *) (dst + x * 3),      pack_gray(_mm_unpacklo_epi16(v, zero)));
+		_mm_storeu_si128((__m128i *) (dst + x * 3 + 12), pack_gray(_mm_unpackhi_epi16(v, zero)));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16x3_t rgb;
+
+	for (; x + 16 <= width; x += 16) {
+		rgb.val[0] = rgb.val[1] = rgb.val[2] = vld2q_u8(src + x * 2).val[0];
+		vst3q_u8(dst + x * 3, rgb);
+	}
+#endif
+	for (; x < width; x++)
+		dst[x * 3] = dst[x * 3 + 1] = dst[x * 3 + 2] = src[x * 2];
+}
+
+/* gray + alpha -> rgba (for the image drawn with transparency) */
+static void gray_alpha_to_rgba(uint8_t *dst, const uint8_t *src, int width)
+{
+	int x = 0;
+
+#if defined(__SSE2__)
+	__m128i v, gray;
+
+	for (; x + 8 <= width; x += 8) {
+		v    = _mm_loadu_si128((const __m128i *) (src + x * 2));
+		gray = _mm_and_si128(v, _mm_set1_epi16(0x00FF));
+		gray = _mm_or_si128(gray, _mm_slli_epi16(gray, 8));
+		_mm_storeu_si128((__m128i *) (dst + x * 4),      _mm_unpacklo_epi16(gray, v));
+		_mm_storeu_si128((__m128i *) (dst + x * 4 + 16), _mm_unpackhi_epi16(gray, v));
+	}
+#elif defined(__ARM_NEON)
+	uint8x16x2_t ga;
+	uint8x16x4_t rgba;
+
+	for (; x + 16 <= width; x += 16) {
+		ga = vld2q_u8(src + x * 2);
+		rgba.val[0] = rgba.val[1] = rgba.val[2] = ga.val[0];
+		rgba.val[3] = ga.val[1];
+		vst4q_u8(dst + x * 4, rgba);
+	}
+#endif
+	for (; x < width; x++) {
+		dst[x * 4] = dst[x * 4 + 1] = dst[x * 4 + 2] = src[x * 2];
+		dst[x * 4 + 3] = src[x * 2 + 1];
+	}
+}
+
+/* dst can be src (in place): dst never overtakes src,
+	the whole gif canvas is converted as a row (the canvas keeps 4bpp for next frames) */
+static void rgba_to_rgb(uint8_t *dst, const uint8_t *src, int width)
+{
+	int x = 0;
+
+#if defined(__SSE2__)
+	for (; x + 6 <= width; x += 4)
+		_mm_storeu_si128((__m128i *) (dst + x * 3), pack_rgb(_mm_loadu_si128((const __m128i *) (src + x * 4))));
+#elif defined(__ARM_NEON)
+	uint8x16x4_t rgba;
+	uint8x16x3_t rgb;
+
+	for (; x + 16 <= width; x += 16) {
+		rgba = vld4q_u8(src + x * 4);
+		rgb.val[0] = rgba.val[0];
+		rgb.val[1] = rgba.val[1];
+		rgb.val[2] = rgba.val[2];
+		vst3q_u8(dst + x * 3, rgb);
+	}
+#endif
+	for (; x < width; x++) {
+		dst[x * 3]     = src[x * 4];
+		dst[x * 3 + 1] = src[x * 4 + 1];
+		dst[x * 3 + 2] = src[x * 4 + 2];
+	}
+}
+
+/* frame index of animation gif: decoded in order on the libnsgif canvas,
+	only one frame is held in data[] (valid until another frame is requested) */
+uint8_t *get_frame(struct image *img, int index)
+{
+	gif_result code;
+	struct gif_stream_t *stream = img->stream;
+
+	if (!stream)
+		return (img->data) ? img->data[index]: NULL;
+
+	if (img->data[index])
+		return img->data[index];
+
+	if (stream->held_frame >= 0) {
+		free(img->data[stream->held_frame]);
+		img->data[stream->held_frame] = NULL;
+		stream->held_frame = -1;
+	}
+
+	/* libnsgif composites frame n onto its canvas of frame n - 1:
+		go forward from the last decoded frame, restart from frame 0 to go back */
+	if (stream->gif.decoded_frame > index)
+		stream->gif.decoded_frame = -1; /* GIF_INVALID_FRAME */
+
+	for (int i = stream->gif.decoded_frame + 1; i <= index; i++) {
+		if ((code = gif_decode_frame(&stream->gif, i)) != GIF_OK) {
+			logging(ERROR, "gif_decode_frame() failed frame:%d code:%d\n", i, code);
+			return NULL;
+		}
+	}
+
+	if ((img->data[index] = (uint8_t *) ecalloc(img->width * img->height, img->channel)) == NULL)
+		return NULL;
+	if (img->channel == BYTES_PER_PIXEL)
+		memcpy(img->data[index], stream->gif.frame_image, img->width * img->height * BYTES_PER_PIXEL);
+	else
+		rgba_to_rgb(img->data[index], stream->gif.frame_image, img->width * img->height);
+	stream->held_frame = index;
+
+	return img->data[index];
+}
+
+/* decode every frame into data[] and release the stream (for functions processing all frames) */
+void load_all_frames(struct image *img)
+{
+	if (!img->stream)
+		return;
+
+	for (int i = 0; i < img->frame_count; i++) {
+		if (get_frame(img, i) == NULL) {
+			img->frame_count = i;
+			break;
+		}
+		img->stream->held_frame = -1; /* keep it */
+	}
+	release_stream(img);
+}
+
+bool load_gif(struct input_t *input, struct image *img)
 {
 	gif_bitmap_callback_vt gif_callbacks = {
 		gif_bitmap_create,
@@ -278,80 +1026,114 @@ bool load_gif(FILE *fp, struct image *img)
 		gif_bitmap_test_opaque,
 		gif_bitmap_modified
 	};
-	size_t size;
 	gif_result code;
-	unsigned char *mem;
-	gif_animation gif;
-	int i;
+	struct gif_stream_t *stream;
 
-	gif_create(&gif, &gif_callbacks);
-	if ((mem = file_into_memory(fp, &size)) == NULL)
+	if ((stream = (struct gif_stream_t *) ecalloc(1, sizeof(struct gif_stream_t))) == NULL)
 		return false;
 
-	code = gif_initialise(&gif, size, mem);
-	if (code != GIF_OK && code != GIF_WORKING)
-		goto error_initialize_failed;
-
-	img->width   = gif.width;
-	img->height  = gif.height;
-	img->channel = BYTES_PER_PIXEL; /* libnsgif always return 4bpp image */
-	size = img->width * img->height * img->channel;
-
-	/* read animation gif */
-	img->frame_count = (gif.frame_count < MAX_FRAME_NUM) ? gif.frame_count: MAX_FRAME_NUM - 1;
-	img->loop_count = gif.loop_count;
+	gif_create(&stream->gif, &gif_callbacks);
 
-	for (i = 0; i < img->frame_count; i++) {
-		code = gif_decode_frame(&gif, i);
-		if (code != GIF_OK)
-			goto error_decode_failed;
+	code = gif_initialise(&stream->gif, input->size, input->data);
+	if ((code != GIF_OK && code != GIF_WORKING)
+		|| stream->gif.frame_count < 1 || !alloc_frames(img, stream->gif.frame_count)) {
+		gif_finalise(&stream->gif);
+		free(stream);
+		return false;
+	}
 
-		if ((img->data[i] = (uint8_t *) ecalloc(1, size)) == NULL)
-			goto error_decode_failed;
-		memcpy(img->data[i], gif.frame_image, size);
+	img->width   = stream->gif.width;
+	img->height  = stream->gif.height;
+	/* libnsgif canvas is 4bpp, frames are taken out as RGB:
+		still image with transparency keeps alpha (frames of animation are
+		drawn over the previous one, so transparent pixels must be drawn) */
+	img->channel = (stream->gif.frame_count == 1 && stream->gif.frames[0].transparency) ?
+		BYTES_PER_PIXEL: 3;
 
-		img->delay[i] = gif.frames[i].frame_delay;
+	/* read animation gif */
+	img->loop_count = stream->gif.loop_count;
+
+	for (int i = 0; i < img->frame_count; i++)
+		img->delay[i] = stream->gif.frames[i].frame_delay;
+
+	/* take over the input: frames are decoded later by get_frame() */
+	stream->input      = *input;
+	stream->held_frame = -1;
+	input->data = NULL;
+	input->size = 0;
+	img->stream = stream;
+
+	/* decode the first frame here to report broken file */
+	if (get_frame(img, 0) == NULL) {
+		/* no frame is held: only the frame table is left with the stream */
+		release_stream(img);
+		free(img->data);
+		free(img->delay);
+		img->data  = NULL;
+		img->delay = NULL;
+		img->frame_count = 0;
+		return false;
 	}
 
-	gif_finalise(&gif);
-	free(mem);
 	return true;
-
-error_decode_failed:
-	img->frame_count = i;
-	for (i = 0; i < img->frame_count; i++) {
-		free(img->data[i]);
-		img->data[i] = NULL;
-	}
-	gif_finalise(&gif);
-error_initialize_failed:
-	free(mem);
-	return false;
 }
 
+/* libnsbmp writes RGB (3 bytes per pixel) to the bitmap of opaque image,
+	RGBA otherwise. loaders take the pixels over without copying */
+struct bmp_bitmap_t {
+	size_t bpp;
+	uint8_t *pixels;
+};
+
 void *bmp_bitmap_create(int width, int height, unsigned int state)
 {
-	(void) state; /* unused */
-	return calloc(width * height, BYTES_PER_PIXEL);
+	struct bmp_bitmap_t *bitmap;
+
+	if ((bitmap = (struct bmp_bitmap_t *) calloc(1, sizeof(struct bmp_bitmap_t))) == NULL)
+		return NULL;
+
+	bitmap->bpp = (state & BMP_OPAQUE) ? 3: BYTES_PER_PIXEL;
+	if ((bitmap->pixels = (uint8_t *) calloc(width * height, bitmap->bpp)) == NULL) {
+		free(bitmap);
+		return NULL;
+	}
+	return bitmap;
 }
 
 unsigned char *bmp_bitmap_get_buffer(void *bitmap)
 {
-	return bitmap;
+	return ((struct bmp_bitmap_t *) bitmap)->pixels;
 }
 
 void bmp_bitmap_destroy(void *bitmap)
 {
+	free(((struct bmp_bitmap_t *) bitmap)->pixels);
 	free(bitmap);
 }
 
 size_t bmp_bitmap_get_bpp(void *bitmap)
 {
-	(void) bitmap; /* unused */
-	return BYTES_PER_PIXEL;
+	return ((struct bmp_bitmap_t *) bitmap)->bpp;
+}
+
+/* move the pixels decoded by libnsbmp to img */
+bool take_bmp_bitmap(bmp_image *bmp, struct image *img)
+{
+	struct bmp_bitmap_t *bitmap = (struct bmp_bitmap_t *) bmp->bitmap;
+
+	if (!alloc_frames(img, 1))
+		return false;
+
+	img->width   = bmp->width;
+	img->height  = bmp->height;
+	img->channel = bitmap->bpp;
+	img->data[0] = bitmap->pixels;
+	bitmap->pixels = NULL;
+
+	return true;
 }
 
-bool load_bmp(FILE *fp, struct image *img)
+bool load_bmp(struct input_t *input, struct image *img)
 {
 	bmp_bitmap_callback_vt bmp_callbacks = {
 		bmp_bitmap_create,
@@ -360,332 +1142,1261 @@ bool load_bmp(FILE *fp, struct image *img)
 		bmp_bitmap_get_bpp
 	};
 	bmp_result code;
-	size_t size;
-	unsigned char *mem;
 	bmp_image bmp;
 
 	bmp_create(&bmp, &bmp_callbacks);
-	if ((mem = file_into_memory(fp, &size)) == NULL)
-		return false;
 
-	code = bmp_analyse(&bmp, size, mem);
+	code = bmp_analyse(&bmp, input->size, input->data);
 	if (code != BMP_OK)
-		goto error_analyse_failed;
+		goto error_decode_failed;
 
 	code = bmp_decode(&bmp);
 	if (code != BMP_OK)
 		goto error_decode_failed;
 
-	img->width   = bmp.width;
-	img->height  = bmp.height;
-	img->channel = BYTES_PER_PIXEL; /* libnsbmp always return 4bpp image */
-
-	size = img->width * img->height * img->channel;
-	if ((img->data[0] = (uint8_t *) ecalloc(1, size)) == NULL)
+	if (!take_bmp_bitmap(&bmp, img))
 		goto error_decode_failed;
-	memcpy(img->data[0], bmp.bitmap, size);
 
 	bmp_finalise(&bmp);
-	free(mem);
 	return true;
 
 error_decode_failed:
 	bmp_finalise(&bmp);
-error_analyse_failed:
-	free(mem);
 	return false;
 }
 
+bool load_ico(struct input_t *input, struct image *img)
+{
+	bmp_bitmap_callback_vt bmp_callbacks = {
+		bmp_bitmap_create,
+		bmp_bitmap_destroy,
+		bmp_bitmap_get_buffer,
+		bmp_bitmap_get_bpp
+	};
+	bool ret = false;
+	ico_collection ico;
+	ico_image *entry;
+	bmp_image *bmp = NULL;
+	struct input_t png;
+
+	ico_collection_create(&ico, &bmp_callbacks);
+
+	if (ico_analyse(&ico, input->size, input->data) != BMP_OK)
+		goto release;
+
+	/* decode only the embedded size suitable for the target size
+		(deeper one if there are the same sizes, png entries are 32bpp) */
+	for (entry = ico.first; entry; entry = entry->next) {
+		if (!bmp || better_variant(input, entry->bmp.width, entry->bmp.height, bmp->width, bmp->height)
+			|| (entry->bmp.width == bmp->width && entry->bmp.height == bmp->height
+				&& (entry->bmp.png ? 32: entry->bmp.bpp) > (bmp->png ? 32: bmp->bpp)))
+			bmp = &entry->bmp;
+	}
+	logging(DEBUG, "ico size:%dx%d png:%s\n", bmp->width, bmp->height, (bmp->png) ? "true": "false");
+
+	if (bmp->png) {
+		png        = *input;
+		png.data   = bmp->bmp_data;
+		png.size   = bmp->buffer_size;
+		png.offset = 0;
+		ret = load_png(&png, img);
+		goto release;
+	}
+
+	if (bmp_decode(bmp) != BMP_OK)
+		goto release;
+
+	ret = take_bmp_bitmap(bmp, img);
+
+release:
+	ico_finalise(&ico);
+	return ret;
+}
+
 /* pnm functions */
-inline int getint(FILE *fp)
+static inline int input_getc(struct input_t *input)
 {
-	int c, n = 0;
+	return (input->offset < input->size) ? input->data[input->offset++]: EOF;
+}
 
-	do {
-		c = fgetc(fp);
-	} while (isspace(c));
+/* skip whitespace and comments between header fields */
+static inline void pnm_skip(struct input_t *input)
+{
+	int c;
 
-	while (isdigit(c)) {
-		n = n * 10 + c - '0';
-		c = fgetc(fp);
+	while ((c = input_getc(input)) != EOF) {
+		if (c == '#')
+			while ((c = input_getc(input)) != '\n' && c != EOF);
+		else if (!isspace(c)) {
+			input->offset--;
+			break;
+		}
 	}
+}
+
+/* offset is left at the character after the digits */
+static inline int pnm_getint(struct input_t *input)
+{
+	int n = 0;
+	const uint8_t *p, *end = input->data + input->size;
+
+	pnm_skip(input);
+	p = input->data + input->offset;
+	if (p >= end || (unsigned) (*p - '0') >= 10)
+		return -1;
+
+	while (p < end && (unsigned) (*p - '0') < 10 && n < INT_MAX / 10)
+		n = n * 10 + (*p++ - '0');
+
+	input->offset = p - input->data;
 	return n;
 }
 
-inline uint8_t pnm_normalize(int c, int type, int max_value)
+static inline bool pnm_gettoken(struct input_t *input, char *token, size_t len)
 {
-	if (type == 1 || type == 4)
-		return (c == 0) ? 0: 0xFF;
-	else
-		return 0xFF * c / max_value;
+	int c;
+	size_t i = 0;
+
+	pnm_skip(input);
+	while ((c = input_getc(input)) != EOF && !isspace(c))
+		if (i < len - 1)
+			token[i++] = c;
+	token[i] = '\0';
+
+	if (c != EOF) /* keep the whitespace after ENDHDR */
+		input->offset--;
+
+	return (i > 0);
 }
 
-bool load_pnm(FILE *fp, struct image *img)
+/* PAM header: "WIDTH w HEIGHT h DEPTH d MAXVAL m [TUPLTYPE t] ENDHDR" */
+static bool pam_header(struct input_t *input, struct image *img, int *max_value)
 {
-	int size, type, c, count, max_value = 0;
+	char token[BUFSIZE];
+
+	while (pnm_gettoken(input, token, BUFSIZE)) {
+		if (strcmp(token, "ENDHDR") == 0)
+			return true;
+		else if (strcmp(token, "WIDTH") == 0)
+			img->width = pnm_getint(input);
+		else if (strcmp(token, "HEIGHT") == 0)
+			img->height = pnm_getint(input);
+		else if (strcmp(token, "DEPTH") == 0)
+			img->channel = pnm_getint(input);
+		else if (strcmp(token, "MAXVAL") == 0)
+			*max_value = pnm_getint(input);
+		else if (strcmp(token, "TUPLTYPE") == 0)
+			while (input->offset < input->size && input->data[input->offset] != '\n')
+				input->offset++;
+	}
+	return false;
+}
 
-	if (fgetc(fp) != 'P')
-		return false;
+static inline uint8_t pnm_scale(unsigned int value, unsigned int max_value)
+{
+	return (value >= max_value) ? 0xFF: (value * 0xFF + max_value / 2) / max_value;
+}
 
-	type = fgetc(fp) - '0';
-	img->channel = (type == 1 || type == 2 || type == 4 || type == 5) ? 1:
-		(type == 3 || type == 6) ? 3: -1;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+/* 16 bytes at p: bit i of return value is set if p[i] is a digit, bit i of *comment if p[i] is '#' */
+static inline unsigned int pnm_digit_mask(const uint8_t *p, unsigned int *comment)
+{
+#if defined(__SSE2__)
+	__m128i v = _mm_loadu_si128((const __m128i *) p);
+
+	*comment = _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+	/* bytes >= 0x80 are negative: never greater than '0' - 1 */
+	return _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+		_mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1))));
+#else
+	static const uint8_t bit[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+	uint8x16_t v = vld1q_u8(p), weight = vld1q_u8(bit), digit, sharp;
+	uint8x8_t d, c;
+
+	digit = vandq_u8(vandq_u8(vcgeq_u8(v, vdupq_n_u8('0')), vcleq_u8(v, vdupq_n_u8('9'))), weight);
+	sharp = vandq_u8(vceqq_u8(v, vdupq_n_u8('#')), weight);
+
+	/* movemask: add up bit weights of each half */
+	d = vpadd_u8(vget_low_u8(digit), vget_high_u8(digit));
+	c = vpadd_u8(vget_low_u8(sharp), vget_high_u8(sharp));
+	d = vpadd_u8(d, c);
+	d = vpadd_u8(d, d);
+
+	*comment = vget_lane_u16(vreinterpret_u16_u8(d), 1);
+	return vget_lane_u16(vreinterpret_u16_u8(d), 0);
+#endif
+}
+#endif
 
-	if (img->channel == -1)
-		return false;
+/* len (1-8) ascii digits at p (8 bytes must be readable): digits are moved to the top bytes
+	(the bytes below become leading zeros), then merged in pairs, quads and octets by multiply */
+static inline unsigned int pnm_atoi8(const uint8_t *p, int len)
+{
+	uint64_t x;
 
-	/* read header */
-	while ((c = fgetc(fp)) != EOF) {
-		if (c == '#')
-			while ((c = fgetc(fp)) != '\n');
-		
-		if (isspace(c))
+	memcpy(&x, p, sizeof(x));
+	x <<= 8 * (8 - len);
+	x = ((x & 0x0F0F0F0F0F0F0F0FULL) * 2561) >> 8;
+	x = ((x & 0x00FF00FF00FF00FFULL) * 6553601) >> 16;
+	return ((x & 0x0000FFFF0000FFFFULL) * 42949672960001ULL) >> 32;
+}
+
+/* ascii samples (P1-P3): parse digits straight from the buffer
+	(SSE2/NEON: digits of 16 bytes are found at once, each number is converted without a loop) */
+static void pnm_read_ascii(struct input_t *input, uint8_t *dst, int size, int type, int max_value)
+{
+	int count = 0;
+	unsigned int n;
+	const uint8_t *p = input->data + input->offset, *end = input->data + input->size;
+#if defined(__SSE2__) || defined(__ARM_NEON)
+	unsigned int digit, comment, valid, tail;
+	int first, last, len;
+	uint8_t table[UINT8_MAX + 1];
+
+	for (int i = 0; i <= UINT8_MAX; i++)
+		table[i] = pnm_scale(i, max_value);
+#endif
+
+	while (count < size && p < end) {
+#if defined(__SSE2__) || defined(__ARM_NEON)
+		/* 8 more bytes are readable for pnm_atoi8() */
+		if (end - p >= 16 + 8) {
+			digit = pnm_digit_mask(p, &comment);
+
+			/* take samples ending before the comment, or before the digits running over 16 bytes */
+			if (comment)
+				last = __builtin_ctz(comment);
+			else if (digit == 0xFFFF)
+				last = 0;
+			else if (digit & 0x8000)
+				last = 32 - __builtin_clz(~digit & 0xFFFF);
+			else
+				last = 16;
+
+			valid = digit & ((1U << last) - 1);
+			if (type == 1) { /* pbm: '1' is black, digits need not be separated */
+				for (; valid && count < size; valid &= valid - 1)
+					dst[count++] = (p[__builtin_ctz(valid)] == '0') ? 0xFF: 0x00;
+				valid = 0;
+			}
+
+			/* tail: last digit of each number */
+			tail = valid & ~(valid >> 1);
+			while (valid && count < size) {
+				first = __builtin_ctz(valid);
+				len   = __builtin_ctz(tail >> first) + 1;
+				if (len > 5) { /* may overflow: left to the loop below */
+					last = first;
+					break;
+				}
+				n = pnm_atoi8(p + first, len);
+				dst[count++] = (n <= UINT8_MAX) ? table[n]: pnm_scale(n, max_value);
+				valid &= ~0U << (first + len);
+			}
+
+			p += last;
+			if (last > 0)
+				continue;
+		}
+#endif
+		if ((unsigned) (*p - '0') >= 10) {
+			if (*p == '#')
+				while (p < end && *p != '\n')
+					p++;
+			p++;
 			continue;
+		}
 
-		if (isdigit(c)) {
-			ungetc(c, fp);
-			img->width  = getint(fp);
-			img->height = getint(fp);
-			if (type != 1 && type != 4)
-				max_value = getint(fp);
-			break;
+		if (type == 1) { /* pbm: '1' is black, digits need not be separated */
+			dst[count++] = (*p++ == '0') ? 0xFF: 0x00;
+			continue;
 		}
+
+		n = 0;
+		while (p < end && (unsigned) (*p - '0') < 10 && n <= 0xFFFF)
+			n = n * 10 + (*p++ - '0');
+		dst[count++] = pnm_scale(n, max_value);
 	}
+}
 
-	size = img->width * img->height * img->channel;
-	if ((img->data[0] = ecalloc(1, size)) == NULL)
+/* raw samples (P5-P7): one or two (big endian) bytes per sample */
+static void pnm_read_raw(struct input_t *input, uint8_t *dst, int size, int max_value)
+{
+	int count;
+	uint8_t table[UINT8_MAX + 1];
+	const uint8_t *src = input->data + input->offset;
+	size_t left = input->size - input->offset;
+
+	if (max_value == UINT8_MAX) {
+		memcpy(dst, src, ((size_t) size < left) ? (size_t) size: left);
+	} else if (max_value < UINT8_MAX) {
+		for (int i = 0; i <= UINT8_MAX; i++)
+			table[i] = pnm_scale(i, max_value);
+
+		count = ((size_t) size < left) ? size: (int) left;
+		for (int i = 0; i < count; i++)
+			dst[i] = table[src[i]];
+	} else {
+		count = ((size_t) size < left / 2) ? size: (int) (left / 2);
+		for (int i = 0; i < count; i++)
+			dst[i] = pnm_scale((src[2 * i] << 8) | src[2 * i + 1], max_value);
+	}
+}
+
+/* raw bitmap (P4): 8 pixels per byte, rows padded to a byte, 1 is black */
+static void pbm_read_raw(struct input_t *input, uint8_t *dst, int width, int height)
+{
+	int row_bytes = (width + 7) / 8;
+	const uint8_t *src = input->data + input->offset;
+	size_t left = input->size - input->offset;
+
+	for (int y = 0; y < height && (size_t) (y + 1) * row_bytes <= left; y++)
+		for (int x = 0; x < width; x++)
+			dst[y * width + x] = (src[y * row_bytes + x / 8] & (0x80 >> (x % 8))) ? 0x00: 0xFF;
+}
+
+bool load_pnm(struct input_t *input, struct image *img)
+{
+	int type, max_value = 1;
+
+	if (input_getc(input) != 'P')
 		return false;
 
-	/* read data */
-	count = 0;
-	if (1 <= type && type <= 3) {
-		while ((c = fgetc(fp)) != EOF) {
-			if (c == '#')
-				while ((c = fgetc(fp)) != '\n');
-			
-			if (isspace(c))
-				continue;
+	type = input_getc(input) - '0';
+	if (type < 1 || type > 7)
+		return false;
 
-			if (isdigit(c)) {
-				ungetc(c, fp);
-				*(img->data[0] + count++) = pnm_normalize(getint(fp), type, max_value);
-			}
-		}
+	/* read header */
+	if (type == 7) {
+		if (!pam_header(input, img, &max_value))
+			return false;
+	} else {
+		img->channel = (type == 3 || type == 6) ? 3: 1;
+		img->width   = pnm_getint(input);
+		img->height  = pnm_getint(input);
+		if (type != 1 && type != 4)
+			max_value = pnm_getint(input);
 	}
-	else {
-		while ((c = fgetc(fp)) != EOF)
-			*(img->data[0] + count++) = pnm_normalize(c, type, max_value);
+	/* single whitespace before raster */
+	input_getc(input);
+
+	if (img->width <= 0 || img->height <= 0 || img->channel < 1 || img->channel > 4
+		|| max_value < 1 || max_value > UINT16_MAX
+		|| img->width > INT_MAX / img->height / img->channel) {
+		logging(ERROR, "invalid pnm header\n");
+		return false;
 	}
 
+	logging(DEBUG, "pnm type:P%d max_value:%d\n", type, max_value);
+
+	if (!alloc_frames(img, 1) || (img->data[0] = ecalloc(img->width * img->height, img->channel)) == NULL)
+		return false;
+
+	/* read data */
+	if (type <= 3)
+		pnm_read_ascii(input, img->data[0], img->width * img->height * img->channel, type, max_value);
+	else if (type == 4)
+		pbm_read_raw(input, img->data[0], img->width, img->height);
+	else
+		pnm_read_raw(input, img->data[0], img->width * img->height * img->channel, max_value);
+
 	return true;
 }
 
 void init_image(struct image *img)
 {
-	for (int i = 0; i < MAX_FRAME_NUM; i++) {
-		img->data[i] = NULL;
-		img->delay[i] = 0;
-	}
+	img->data    = NULL;
+	img->delay   = NULL;
 	img->width   = 0;
 	img->height  = 0;
 	img->channel = 0;
 	img->alpha   = false;
+	/* part of image */
+	img->part_x      = 0;
+	img->part_y      = 0;
+	img->full_width  = 0;
+	img->full_height = 0;
 	/* for animation gif */
 	img->frame_count   = 1;
 	img->loop_count    = 0;
 	img->current_frame = 0;
+	img->stream        = NULL;
 }
 
 void free_image(struct image *img)
 {
-	for (int i = 0; i < img->frame_count; i++) {
-		free(img->data[i]);
-		img->data[i] = NULL;
+	if (img->data) {
+		for (int i = 0; i < img->frame_count; i++)
+			free(img->data[i]);
 	}
+	free(img->data);
+	free(img->delay);
+	img->data  = NULL;
+	img->delay = NULL;
+	release_stream(img);
 }
 
-enum filetype_t check_filetype(FILE *fp)
+enum filetype_t check_filetype(struct input_t *input)
 {
 	/*
 		JPEG(JFIF): FF D8
 		PNG       : 89 50 4E 47 0D 0A 1A 0A (0x89 'P' 'N' 'G' '\r' '\n' 0x1A '\n')
 		GIF       : 47 49 46 (ASCII 'G' 'I' 'F')
 		BMP       : 42 4D (ASCII 'B' 'M')
-		PNM       : 50 [31|32|33|34|35|36] ('P' ['1' - '6'])
+		PNM/PAM   : 50 [31|32|33|34|35|36|37] ('P' ['1' - '7'])
+		ICO/CUR   : 00 00 [01|02] 00 (reserved, type)
 	*/
-	uint8_t header[CHECK_HEADER_SIZE];
+	uint8_t *header;
 	static uint8_t jpeg_header[] = {0xFF, 0xD8};
 	static uint8_t png_header[]  = {0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A};
 	static uint8_t gif_header[]  = {0x47, 0x49, 0x46};
 	static uint8_t bmp_header[]  = {0x42, 0x4D};
-	size_t size;
+	static uint8_t ico_header[]  = {0x00, 0x00, 0x01, 0x00};
+	static uint8_t cur_header[]  = {0x00, 0x00, 0x02, 0x00};
+
+	if (input->size < CHECK_HEADER_SIZE) {
+		logging(ERROR, "couldn't read header\n");
+		return TYPE_UNKNOWN;
+	}
+	header = input->data;
+
+	if (memcmp(header, jpeg_header, 2) == 0)
+		return TYPE_JPEG;
+	else if (memcmp(header, png_header, 8) == 0)
+		return TYPE_PNG;
+	else if (memcmp(header, gif_header, 3) == 0)
+		return TYPE_GIF;
+	else if (memcmp(header, bmp_header, 2) == 0)
+		return TYPE_BMP;
+	else if (header[0] == 'P' && ('1' <= header[1] && header[1] <= '7'))
+		return TYPE_PNM;
+	else if (memcmp(header, ico_header, 4) == 0 || memcmp(header, cur_header, 4) == 0)
+		return TYPE_ICO;
+	else
+		return TYPE_UNKNOWN;
+}
+
+/* width/height: display size the image will be fitted to (0: no reduction) */
+bool load_image_fp(FILE *fp, struct image *img, int width, int height)
+{
+	int i;
+	bool ret;
+	enum filetype_t type;
+	struct input_t input;
+
+	static bool (*loader[])(struct input_t *input, struct image *img) = {
+		[TYPE_JPEG] = load_jpeg,
+		[TYPE_PNG]  = load_png,
+		[TYPE_GIF]  = load_gif,
+		[TYPE_BMP]  = load_bmp,
+		[TYPE_PNM]  = load_pnm,
+		[TYPE_ICO]  = load_ico,
+	};
+
+	if (!map_input(fp, &input)) {
+		logging(ERROR, "couldn't read input\n");
+		return false;
+	}
+	input.target_width  = width;
+	input.target_height = height;
+
+	if ((type = check_filetype(&input)) == TYPE_UNKNOWN) {
+		logging(ERROR, "unknown file type\n");
+		unmap_input(&input);
+		return false;
+	}
+
+	ret = loader[type](&input, img);
+	unmap_input(&input);
+
+	if (!ret)
+		return false;
+
+	img->alpha = (img->channel == 2 || img->channel == 4) ? true: false;
+	logging(DEBUG, "image width:%d height:%d channel:%d alpha:%s\n",
+		img->width, img->height, img->channel, (img->alpha) ? "true": "false");
+	if (img->frame_count > 1) {
+		logging(DEBUG, "frame:%d loop:%d\n", img->frame_count, img->loop_count);
+		for (i = 0; i < img->frame_count; i++)
+			logging(DEBUG, "delay[%u]:%u\n", i, img->delay[i]);
+	}
+
+	return true;
+}
+
+/* filter for enlarging image (shrink always uses area average) */
+enum enlarge_t {
+	ENLARGE_NONE = 0, /* shrink only */
+	ENLARGE_NEAREST,  /* integer scale, for pixel art */
+	ENLARGE_BILINEAR,
+	ENLARGE_LANCZOS,  /* lanczos-3 */
+};
+
+/* inline functions for accessing member of struct image:
+	never access member of struct image directly */
+static inline int get_frame_count(struct image *img)
+{
+	return img->frame_count;
+}
+
+static inline uint8_t *get_current_frame(struct image *img)
+{
+	return get_frame(img, img->current_frame);
+}
+
+static inline int get_current_delay(struct image *img)
+{
+	return (img->delay) ? img->delay[img->current_frame]: 0;
+}
+
+static inline void increment_frame(struct image *img)
+{
+	img->current_frame = (img->current_frame + 1) % img->frame_count;
+}
+
+static inline int get_image_width(struct image *img)
+{
+	return img->width;
+}
+
+static inline int get_image_height(struct image *img)
+{
+	return img->height;
+}
+
+static inline int get_image_channel(struct image *img)
+{
+	return img->channel;
+}
+
+/* still image holding a copy of one frame:
+	animation can be processed and drawn frame by frame without decoding all frames */
+bool copy_frame(struct image *img, int index, struct image *frame)
+{
+	uint8_t *src;
+	size_t size = img->width * img->height * img->channel;
+
+	init_image(frame);
+	if ((src = get_frame(img, index)) == NULL || !alloc_frames(frame, 1))
+		return false;
+
+	if ((frame->data[0] = (uint8_t *) ecalloc(1, size)) == NULL) {
+		free_image(frame);
+		return false;
+	}
+	memcpy(frame->data[0], src, size);
+
+	frame->width    = img->width;
+	frame->height   = img->height;
+	frame->channel  = img->channel;
+	frame->alpha    = img->alpha;
+	frame->delay[0] = img->delay[index];
+	/* part of image */
+	frame->part_x      = img->part_x;
+	frame->part_y      = img->part_y;
+	frame->full_width  = img->full_width;
+	frame->full_height = img->full_height;
+
+	return true;
+}
+
+/* image proccessing functions:
+	never use *_single functions directly */
+static inline void get_rgb(struct image *img, uint8_t *data, int x, int y, uint8_t *r, uint8_t *g, uint8_t *b)
+{
+	uint8_t *ptr;
+
+	ptr = data + img->channel * (y * img->width + x);
+
+	if (img->channel <= 2) { /* grayscale (+ alpha) */
+		*r = *g = *b = *ptr;
+	} else {                 /* rgb (+ alpha) */
+		*r = *ptr; *g = *(ptr + 1); *b = *(ptr + 2);
+	}
+}
+
+/* separable resampling:
+	weight table of one axis, dst pixel i = sum(src[start[i] + k] * weight[i * taps + k]) >> shift */
+struct resample_t {
+	int size;        /* number of dst pixels */
+	int taps;        /* stride of weight (even, unused weights are 0) */
+	int shift;       /* fixed-point precision of weight */
+	int *start;      /* first src pixel of each dst pixel */
+	int *count;      /* number of src pixels of each dst pixel */
+	int16_t *weight;
+};
+
+static inline void free_resample(struct resample_t *rs)
+{
+	free(rs->start);
+	free(rs->count);
+	free(rs->weight);
+	rs->start  = rs->count = NULL;
+	rs->weight = NULL;
+}
+
+/* largest shift that keeps weight (max: num / den) in int16_t with room for rounding error
+	and 255 * (1 << shift) in 32bit accumulator */
+static inline int get_resample_shift(long num, long den)
+{
+	int shift = RESAMPLE_SHIFT;
+
+	while (shift > 1 && ((int64_t) num << shift) > (int64_t) INT16_MAX / 2 * den)
+		shift--;
+	return shift;
+}
+
+/* set weights of dst pixel i (raw weights sum up to total):
+	rounding error is added to the largest weight, so flat areas stay flat */
+static inline void set_resample_weight(struct resample_t *rs, int i, int start, int count, int64_t raw[], int64_t total)
+{
+	int16_t *weight = rs->weight + i * rs->taps;
+	int32_t sum = 0;
+	int max = 0;
+
+	for (int k = 0; k < count; k++) {
+		weight[k] = raw[k] * ((int64_t) 1 << rs->shift) / total;
+		sum += weight[k];
+		if (weight[k] > weight[max])
+			max = k;
+	}
+	weight[max] += (1 << rs->shift) - sum;
+
+	rs->start[i] = start;
+	rs->count[i] = count;
+}
+
+static inline bool alloc_resample(struct resample_t *rs, int dst_size, int taps, int shift)
+{
+	rs->size  = dst_size;
+	rs->taps  = (taps + 1) & ~1;
+	rs->shift = shift;
+
+	rs->start  = (int *) ecalloc(dst_size, sizeof(int));
+	rs->count  = (int *) ecalloc(dst_size, sizeof(int));
+	rs->weight = (int16_t *) ecalloc((size_t) dst_size * rs->taps, sizeof(int16_t));
+
+	if (rs->start == NULL || rs->count == NULL || rs->weight == NULL) {
+		free_resample(rs);
+		return false;
+	}
+	return true;
+}
+
+/* area average (for shrink): dst pixel i covers src [i * src_size / dst_size, (i + 1) * src_size / dst_size)
+	in 1/dst_size src pixel unit, dst pixel covers src_size units and a src pixel has dst_size units */
+bool init_area_resample(struct resample_t *rs, int src_size, int dst_size)
+{
+	int64_t *raw, from, to, left, right;
+	int start, end;
+
+	if (!alloc_resample(rs, dst_size, src_size / dst_size + 2, get_resample_shift(dst_size, src_size)))
+		return false;
+
+	if ((raw = (int64_t *) ecalloc(rs->taps, sizeof(int64_t))) == NULL) {
+		free_resample(rs);
+		return false;
+	}
+
+	for (int i = 0; i < dst_size; i++) {
+		from  = (int64_t) i * src_size;
+		to    = from + src_size;
+		start = from / dst_size;
+		end   = (to + dst_size - 1) / dst_size;
+
+		for (int k = 0; k < end - start; k++) {
+			left   = (int64_t) (start + k) * dst_size;
+			right  = left + dst_size;
+			raw[k] = ((right < to) ? right: to) - ((left > from) ? left: from);
+		}
+		set_resample_weight(rs, i, start, end - start, raw, src_size);
+	}
+	free(raw);
+
+	return true;
+}
 
-	if ((size = fread(header, 1, CHECK_HEADER_SIZE, fp)) != CHECK_HEADER_SIZE) {
-		logging(ERROR, "couldn't read header\n");
-		return TYPE_UNKNOWN;
+/* sin(pi * x) without math.h: reduce x to [-0.5, 0.5] then taylor series */
+static inline double sin_pi(double x)
+{
+	const double pi = 3.14159265358979323846;
+	int n = (x < 0) ? (int) (x - 0.5): (int) (x + 0.5);
+	double r = (x - n) * pi, term = r, sum = r;
+
+	for (int k = 1; k <= 6; k++) {
+		term *= -r * r / ((2 * k) * (2 * k + 1));
+		sum  += term;
 	}
-	fseek(fp, 0L, SEEK_SET);
+	return (n & 1) ? -sum: sum;
+}
 
-	if (memcmp(header, jpeg_header, 2) == 0)
-		return TYPE_JPEG;
-	else if (memcmp(header, png_header, 8) == 0)
-		return TYPE_PNG;
-	else if (memcmp(header, gif_header, 3) == 0)
-		return TYPE_GIF;
-	else if (memcmp(header, bmp_header, 2) == 0)
-		return TYPE_BMP;
-	else if (header[0] == 'P' && ('0' <= header[1] && header[1] <= '6'))
-		return TYPE_PNM;
-	else
-		return TYPE_UNKNOWN;
+static inline double bilinear_kernel(double x)
+{
+	x = (x < 0) ? -x: x;
+	return (x < 1.0) ? 1.0 - x: 0.0;
 }
 
-bool load_image(const char *file, struct image *img)
+static inline double lanczos_kernel(double x)
 {
-	int i;
-	enum filetype_t type;
-	FILE *fp;
+	const double pi = 3.14159265358979323846;
 
-	static bool (*loader[])(FILE *fp, struct image *img) = {
-		[TYPE_JPEG] = load_jpeg,
-		[TYPE_PNG]  = load_png,
-		[TYPE_GIF]  = load_gif,
-		[TYPE_BMP]  = load_bmp,
-		[TYPE_PNM]  = load_pnm,
-	};
+	if (x == 0.0)
+		return 1.0;
+	else if (x <= -3.0 || x >= 3.0)
+		return 0.0;
+	return 3.0 * sin_pi(x) * sin_pi(x / 3.0) / (pi * pi * x * x);
+}
+
+/* convolution (for enlarge): dst pixel i is centered at src (i + 0.5) * src_size / dst_size,
+	the kernel is stretched when shrinking and cut (and normalized) at the edges */
+bool init_filter_resample(struct resample_t *rs, int src_size, int dst_size, enum enlarge_t filter)
+{
+	double (*kernel)(double) = (filter == ENLARGE_LANCZOS) ? lanczos_kernel: bilinear_kernel;
+	double scale, stretch, support, center;
+	int64_t *raw, total;
+	int start, end;
+
+	scale   = (double) src_size / dst_size;
+	stretch = (scale > 1.0) ? scale: 1.0;
+	support = ((filter == ENLARGE_LANCZOS) ? 3.0: 1.0) * stretch;
 
-	if ((fp = efopen(file, "r")) == NULL)
+	/* weight is 1.0 at most (a bit more at the edges) */
+	if (!alloc_resample(rs, dst_size, (int) support * 2 + 3, get_resample_shift(1, 1)))
 		return false;
- 
- 	if ((type = check_filetype(fp)) == TYPE_UNKNOWN) {
-		logging(ERROR, "unknown file type: %s\n", file);
-		goto image_load_error;
-	}
-
-	if (loader[type](fp, img)) {
-		img->alpha = (img->channel == 2 || img->channel == 4) ? true: false;
-		logging(DEBUG, "image width:%d height:%d channel:%d alpha:%s\n",
-			img->width, img->height, img->channel, (img->alpha) ? "true": "false");
-		if (img->frame_count > 1) {
-			logging(DEBUG, "frame:%d loop:%d\n", img->frame_count, img->loop_count);
-			for (i = 0; i < img->frame_count; i++)
-				logging(DEBUG, "delay[%u]:%u\n", i, img->delay[i]);
+
+	if ((raw = (int64_t *) ecalloc(rs->taps, sizeof(int64_t))) == NULL) {
+		free_resample(rs);
+		return false;
+	}
+
+	for (int i = 0; i < dst_size; i++) {
+		center = (i + 0.5) * scale;
+		start  = (int) (center - support + 0.5);
+		end    = (int) (center + support + 0.5);
+		start  = (start < 0) ? 0: start;
+		end    = (end > src_size) ? src_size: end;
+
+		total = 0;
+		for (int k = 0; k < end - start; k++) {
+			raw[k] = kernel((start + k + 0.5 - center) / stretch) * (1 << 24);
+			total += raw[k];
+		}
+
+		if (total > 0) {
+			set_resample_weight(rs, i, start, end - start, raw, total);
+		} else { /* never happens: use the nearest pixel */
+			raw[0] = 1;
+			set_resample_weight(rs, i, (int) center, 1, raw, 1);
 		}
-		efclose(fp);
-		return true;
 	}
+	free(raw);
 
-image_load_error:
-	logging(ERROR, "image load error: %s\n", file);
-	//init_image(img);
-	efclose(fp);
-	return false;
+	return true;
 }
 
-/* inline functions for accessing member of struct image:
-	never access member of struct image directly */
-static inline int get_frame_count(struct image *img)
+/* nearest neighbor (for enlarge by integer scale): dst pixel i is a copy of src pixel i * src_size / dst_size */
+bool init_nearest_resample(struct resample_t *rs, int src_size, int dst_size)
 {
-	return img->frame_count;
+	int64_t one = 1;
+
+	if (!alloc_resample(rs, dst_size, 1, get_resample_shift(1, 1)))
+		return false;
+
+	for (int i = 0; i < dst_size; i++)
+		set_resample_weight(rs, i, (int64_t) i * src_size / dst_size, 1, &one, 1);
+
+	return true;
 }
 
-static inline uint8_t *get_current_frame(struct image *img)
+/* area average for shrink, filter for enlarge */
+static inline bool init_resample(struct resample_t *rs, int src_size, int dst_size, enum enlarge_t filter)
 {
-	return img->data[img->current_frame];
+	if (dst_size <= src_size)
+		return init_area_resample(rs, src_size, dst_size);
+	else if (filter == ENLARGE_NEAREST)
+		return init_nearest_resample(rs, src_size, dst_size);
+	else
+		return init_filter_resample(rs, src_size, dst_size, filter);
 }
 
-static inline int get_current_delay(struct image *img)
+static inline uint8_t clamp_pixel(int32_t sum, int shift)
 {
-	return img->delay[img->current_frame];
+	return (sum < 0) ? 0: ((sum >> shift) > UINT8_MAX) ? UINT8_MAX: (sum >> shift);
 }
 
-static inline void increment_frame(struct image *img)
+/* vertical pass: blend count rows (stride bytes apart) of size bytes into dst,
+	channel doesn't matter */
+static inline void resample_vertical(uint8_t *dst, const uint8_t *src, long stride,
+	int count, const int16_t *weight, int shift, int size)
 {
-	img->current_frame = (img->current_frame + 1) % img->frame_count;
+	int i = 0, k;
+	int32_t sum;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128(), bits = _mm_cvtsi32_si128(shift);
+	__m128i s0, s1, s2, s3, a, b, w, lo, hi;
+	int32_t pair;
+
+	for (; i + 16 <= size; i += 16) {
+		s0 = s1 = s2 = s3 = _mm_set1_epi32(1 << (shift - 1));
+		/* two rows at once: (a0 * w0 + b0 * w1) by pmaddwd */
+		for (k = 0; k + 1 < count; k += 2) {
+			memcpy(&pair, weight + k, sizeof(pair));
+			w  = _mm_set1_epi32(pair);
+			a  = _mm_loadu_si128((const __m128i *) (src + k * stride + i));
+			b  = _mm_loadu_si128((const __m128i *) (src + (k + 1) * stride + i));
+			lo = _mm_unpacklo_epi8(a, b);
+			hi = _mm_unpackhi_epi8(a, b);
+			s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(lo, zero), w));
+			s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(lo, zero), w));
+			s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(hi, zero), w));
+			s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(hi, zero), w));
+		}
+		if (k < count) {
+			w  = _mm_set1_epi32((uint16_t) weight[k]);
+			a  = _mm_loadu_si128((const __m128i *) (src + k * stride + i));
+			lo = _mm_unpacklo_epi8(a, zero);
+			hi = _mm_unpackhi_epi8(a, zero);
+			s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi16(lo, zero), w));
+			s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi16(lo, zero), w));
+			s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi16(hi, zero), w));
+			s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi16(hi, zero), w));
+		}
+		lo = _mm_packs_epi32(_mm_sra_epi32(s0, bits), _mm_sra_epi32(s1, bits));
+		hi = _mm_packs_epi32(_mm_sra_epi32(s2, bits), _mm_sra_epi32(s3, bits));
+		_mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(lo, hi));
+	}
+#elif defined(__ARM_NEON)
+	const int32x4_t bits = vdupq_n_s32(-shift);
+	int32x4_t s0, s1, s2, s3;
+	int16x8_t lo, hi;
+	uint8x16_t a;
+
+	for (; i + 16 <= size; i += 16) {
+		s0 = s1 = s2 = s3 = vdupq_n_s32(1 << (shift - 1));
+		for (k = 0; k < count; k++) {
+			a  = vld1q_u8(src + k * stride + i);
+			lo = vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(a)));
+			hi = vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(a)));
+			s0 = vmlal_n_s16(s0, vget_low_s16(lo), weight[k]);
+			s1 = vmlal_n_s16(s1, vget_high_s16(lo), weight[k]);
+			s2 = vmlal_n_s16(s2, vget_low_s16(hi), weight[k]);
+			s3 = vmlal_n_s16(s3, vget_high_s16(hi), weight[k]);
+		}
+		lo = vcombine_s16(vqmovn_s32(vshlq_s32(s0, bits)), vqmovn_s32(vshlq_s32(s1, bits)));
+		hi = vcombine_s16(vqmovn_s32(vshlq_s32(s2, bits)), vqmovn_s32(vshlq_s32(s3, bits)));
+		vst1q_u8(dst + i, vcombine_u8(vqmovun_s16(lo), vqmovun_s16(hi)));
+	}
+#endif
+	for (; i < size; i++) {
+		sum = 1 << (shift - 1);
+		for (k = 0; k < count; k++)
+			sum += src[k * stride + i] * weight[k];
+		dst[i] = clamp_pixel(sum, shift);
+	}
 }
 
-static inline int get_image_width(struct image *img)
+static inline uint32_t load_pixel(const uint8_t *ptr)
 {
-	return img->width;
+	uint32_t pixel;
+
+	memcpy(&pixel, ptr, sizeof(pixel));
+	return pixel;
 }
 
-static inline int get_image_height(struct image *img)
+/* overrun: write whole 32bit, extra bytes are overwritten by the next pixels
+	(caller must not overrun the end of row) */
+static inline void store_pixel(uint8_t *ptr, uint32_t pixel, int channel, bool overrun)
 {
-	return img->height;
+	if (overrun)
+		memcpy(ptr, &pixel, sizeof(pixel));
+	else
+		for (int i = 0; i < channel; i++)
+			ptr[i] = pixel >> (i * 8);
 }
 
-static inline int get_image_channel(struct image *img)
+/* horizontal pass: RESAMPLE_ROWS rows of pixels into rs->size pixels (the same row can be passed more than once)
+	src rows must have RESAMPLE_PADDING readable bytes after the last pixel */
+static inline void resample_horizontal(uint8_t *dst[], const uint8_t *src[], int channel, struct resample_t *rs)
 {
-	return img->channel;
+	const int16_t *weight;
+	uint32_t pixel[RESAMPLE_ROWS];
+	long offset;
+	bool overrun;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128(), bits = _mm_cvtsi32_si128(rs->shift);
+	__m128i s0, s1, s2, s3, a, b, w;
+	int32_t pair;
+	long next;
+
+	for (int x = 0; x < rs->size; x++) {
+		offset = rs->start[x] * channel;
+		weight = rs->weight + x * rs->taps;
+		s0 = s1 = s2 = s3 = _mm_set1_epi32(1 << (rs->shift - 1));
+
+		/* one pixel (up to 4 channels) per 32bit, two pixels of four rows per iteration
+			(odd count: the last weight is 0) */
+		for (int k = 0; k < rs->count[x]; k += 2) {
+			next = offset + channel;
+			memcpy(&pair, weight + k, sizeof(pair));
+			w  = _mm_set1_epi32(pair);
+			a  = _mm_unpacklo_epi64(
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(load_pixel(src[0] + offset)), _mm_cvtsi32_si128(load_pixel(src[0] + next))),
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(load_pixel(src[1] + offset)), _mm_cvtsi32_si128(load_pixel(src[1] + next))));
+			b  = _mm_unpacklo_epi64(
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(load_pixel(src[2] + offset)), _mm_cvtsi32_si128(load_pixel(src[2] + next))),
+				_mm_unpacklo_epi8(_mm_cvtsi32_si128(load_pixel(src[3] + offset)), _mm_cvtsi32_si128(load_pixel(src[3] + next))));
+			s0 = _mm_add_epi32(s0, _mm_madd_epi16(_mm_unpacklo_epi8(a, zero), w));
+			s1 = _mm_add_epi32(s1, _mm_madd_epi16(_mm_unpackhi_epi8(a, zero), w));
+			s2 = _mm_add_epi32(s2, _mm_madd_epi16(_mm_unpacklo_epi8(b, zero), w));
+			s3 = _mm_add_epi32(s3, _mm_madd_epi16(_mm_unpackhi_epi8(b, zero), w));
+			offset += 2 * channel;
+		}
+		a = _mm_packs_epi32(_mm_sra_epi32(s0, bits), _mm_sra_epi32(s1, bits));
+		b = _mm_packs_epi32(_mm_sra_epi32(s2, bits), _mm_sra_epi32(s3, bits));
+		_mm_storeu_si128((__m128i *) pixel, _mm_packus_epi16(a, b));
+
+		overrun = (x * channel + 4 <= rs->size * channel);
+		for (int i = 0; i < RESAMPLE_ROWS; i++)
+			store_pixel(dst[i] + x * channel, pixel[i], channel, overrun);
+	}
+#elif defined(__ARM_NEON)
+	const int32x4_t bits = vdupq_n_s32(-rs->shift);
+	int32x4_t sum[RESAMPLE_ROWS];
+	int16x4_t a;
+	uint8x8_t lo, hi;
+
+	for (int x = 0; x < rs->size; x++) {
+		offset = rs->start[x] * channel;
+		weight = rs->weight + x * rs->taps;
+		for (int i = 0; i < RESAMPLE_ROWS; i++)
+			sum[i] = vdupq_n_s32(1 << (rs->shift - 1));
+
+		/* one pixel (up to 4 channels) per 32bit */
+		for (int k = 0; k < rs->count[x]; k++) {
+			for (int i = 0; i < RESAMPLE_ROWS; i++) {
+				a      = vget_low_s16(vreinterpretq_s16_u16(vmovl_u8(vcreate_u8(load_pixel(src[i] + offset)))));
+				sum[i] = vmlal_n_s16(sum[i], a, weight[k]);
+			}
+			offset += channel;
+		}
+		lo = vqmovun_s16(vcombine_s16(vqmovn_s32(vshlq_s32(sum[0], bits)), vqmovn_s32(vshlq_s32(sum[1], bits))));
+		hi = vqmovun_s16(vcombine_s16(vqmovn_s32(vshlq_s32(sum[2], bits)), vqmovn_s32(vshlq_s32(sum[3], bits))));
+		vst1q_u8((uint8_t *) pixel, vcombine_u8(lo, hi));
+
+		overrun = (x * channel + 4 <= rs->size * channel);
+		for (int i = 0; i < RESAMPLE_ROWS; i++)
+			store_pixel(dst[i] + x * channel, pixel[i], channel, overrun);
+	}
+#else
+	int32_t sum;
+
+	for (int x = 0; x < rs->size; x++) {
+		weight = rs->weight + x * rs->taps;
+		for (int i = 0; i < RESAMPLE_ROWS; i++) {
+			for (int c = 0; c < channel; c++) {
+				offset = rs->start[x] * channel + c;
+				sum    = 1 << (rs->shift - 1);
+				for (int k = 0; k < rs->count[x]; k++, offset += channel)
+					sum += src[i][offset] * weight[k];
+				dst[i][x * channel + c] = clamp_pixel(sum, rs->shift);
+			}
+		}
+	}
+	(void) pixel; (void) overrun;
+#endif
 }
 
-/* image proccessing functions:
-	never use *_single functions directly */
-static inline void get_rgb(struct image *img, uint8_t *data, int x, int y, uint8_t *r, uint8_t *g, uint8_t *b)
+/* transpose rows x cols pixels: pixel i of dst[j] = pixel j of src[i]
+	row pointers can be in any order, so the same kernel rotates 90 and 270 degrees */
+static inline void transpose_tile_scalar(uint8_t *dst[], const uint8_t *src[], int channel, int rows, int cols)
 {
-	uint8_t *ptr;
+	for (int j = 0; j < cols; j++)
+		for (int i = 0; i < rows; i++)
+			memcpy(dst[j] + i * channel, src[i] + j * channel, channel);
+}
 
-	ptr = data + img->channel * (y * img->width + x);
+/* transpose ROTATE_TILE x ROTATE_TILE pixels in registers (specialized by bytes per pixel) */
+static void transpose_tile8(uint8_t *dst[], const uint8_t *src[])
+{
+#if defined(__SSE2__)
+	__m128i a0, a1, a2, a3, b0, b1, b2, b3;
+
+	/* 8bit -> 16bit -> 32bit interleave */
+	a0 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src[0]), _mm_loadl_epi64((const __m128i *) src[1]));
+	a1 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src[2]), _mm_loadl_epi64((const __m128i *) src[3]));
+	a2 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src[4]), _mm_loadl_epi64((const __m128i *) src[5]));
+	a3 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) src[6]), _mm_loadl_epi64((const __m128i *) src[7]));
+	b0 = _mm_unpacklo_epi16(a0, a1);
+	b1 = _mm_unpackhi_epi16(a0, a1);
+	b2 = _mm_unpacklo_epi16(a2, a3);
+	b3 = _mm_unpackhi_epi16(a2, a3);
+	a0 = _mm_unpacklo_epi32(b0, b2);
+	a1 = _mm_unpackhi_epi32(b0, b2);
+	a2 = _mm_unpacklo_epi32(b1, b3);
+	a3 = _mm_unpackhi_epi32(b1, b3);
+	_mm_storel_epi64((__m128i *) dst[0], a0);
+	_mm_storel_epi64((__m128i *) dst[1], _mm_srli_si128(a0, 8));
+	_mm_storel_epi64((__m128i *) dst[2], a1);
+	_mm_storel_epi64((__m128i *) dst[3], _mm_srli_si128(a1, 8));
+	_mm_storel_epi64((__m128i *) dst[4], a2);
+	_mm_storel_epi64((__m128i *) dst[5], _mm_srli_si128(a2, 8));
+	_mm_storel_epi64((__m128i *) dst[6], a3);
+	_mm_storel_epi64((__m128i *) dst[7], _mm_srli_si128(a3, 8));
+#elif defined(__ARM_NEON)
+	uint8x8x2_t a0, a1, a2, a3;
+	uint16x4x2_t b0, b1, b2, b3;
+	uint32x2x2_t c0, c1, c2, c3;
+
+	/* 8bit -> 16bit -> 32bit transpose */
+	a0 = vtrn_u8(vld1_u8(src[0]), vld1_u8(src[1]));
+	a1 = vtrn_u8(vld1_u8(src[2]), vld1_u8(src[3]));
+	a2 = vtrn_u8(vld1_u8(src[4]), vld1_u8(src[5]));
+	a3 = vtrn_u8(vld1_u8(src[6]), vld1_u8(src[7]));
+	b0 = vtrn_u16(vreinterpret_u16_u8(a0.val[0]), vreinterpret_u16_u8(a1.val[0]));
+	b1 = vtrn_u16(vreinterpret_u16_u8(a0.val[1]), vreinterpret_u16_u8(a1.val[1]));
+	b2 = vtrn_u16(vreinterpret_u16_u8(a2.val[0]), vreinterpret_u16_u8(a3.val[0]));
+	b3 = vtrn_u16(vreinterpret_u16_u8(a2.val[1]), vreinterpret_u16_u8(a3.val[1]));
+	c0 = vtrn_u32(vreinterpret_u32_u16(b0.val[0]), vreinterpret_u32_u16(b2.val[0]));
+	c1 = vtrn_u32(vreinterpret_u32_u16(b1.val[0]), vreinterpret_u32_u16(b3.val[0]));
+	c2 = vtrn_u32(vreinterpret_u32_u16(b0.val[1]), vreinterpret_u32_u16(b2.val[1]));
+	c3 = vtrn_u32(vreinterpret_u32_u16(b1.val[1]), vreinterpret_u32_u16(b3.val[1]));
+	vst1_u8(dst[0], vreinterpret_u8_u32(c0.val[0]));
+	vst1_u8(dst[1], vreinterpret_u8_u32(c1.val[0]));
+	vst1_u8(dst[2], vreinterpret_u8_u32(c2.val[0]));
+	vst1_u8(dst[3], vreinterpret_u8_u32(c3.val[0]));
+	vst1_u8(dst[4], vreinterpret_u8_u32(c0.val[1]));
+	vst1_u8(dst[5], vreinterpret_u8_u32(c1.val[1]));
+	vst1_u8(dst[6], vreinterpret_u8_u32(c2.val[1]));
+	vst1_u8(dst[7], vreinterpret_u8_u32(c3.val[1]));
+#else
+	transpose_tile_scalar(dst, src, 1, ROTATE_TILE, ROTATE_TILE);
+#endif
+}
 
-	if (img->channel <= 2) { /* grayscale (+ alpha) */
-		*r = *g = *b = *ptr;
-	} else {                 /* rgb (+ alpha) */
-		*r = *ptr; *g = *(ptr + 1); *b = *(ptr + 2);
+static void transpose_tile16(uint8_t *dst[], const uint8_t *src[])
+{
+#if defined(__SSE2__)
+	__m128i a[8], b[8];
+
+	/* 16bit -> 32bit -> 64bit interleave */
+	for (int i = 0; i < 8; i += 2) {
+		b[i]     = _mm_loadu_si128((const __m128i *) src[i]);
+		b[i + 1] = _mm_loadu_si128((const __m128i *) src[i + 1]);
+		a[i]     = _mm_unpacklo_epi16(b[i], b[i + 1]);
+		a[i + 1] = _mm_unpackhi_epi16(b[i], b[i + 1]);
+	}
+	for (int i = 0; i < 8; i += 4) {
+		b[i]     = _mm_unpacklo_epi32(a[i], a[i + 2]);
+		b[i + 1] = _mm_unpackhi_epi32(a[i], a[i + 2]);
+		b[i + 2] = _mm_unpacklo_epi32(a[i + 1], a[i + 3]);
+		b[i + 3] = _mm_unpackhi_epi32(a[i + 1], a[i + 3]);
+	}
+	for (int i = 0; i < 4; i++) {
+		_mm_storeu_si128((__m128i *) dst[2 * i], _mm_unpacklo_epi64(b[i], b[i + 4]));
+		_mm_storeu_si128((__m128i *) dst[2 * i + 1], _mm_unpackhi_epi64(b[i], b[i + 4]));
 	}
+#elif defined(__ARM_NEON)
+	uint16x8x2_t a[4];
+	uint32x4x2_t b[4];
+
+	/* 16bit -> 32bit transpose, then swap 64bit halves */
+	for (int i = 0; i < 4; i++)
+		a[i] = vtrnq_u16(vreinterpretq_u16_u8(vld1q_u8(src[2 * i])), vreinterpretq_u16_u8(vld1q_u8(src[2 * i + 1])));
+	for (int i = 0; i < 2; i++) {
+		b[2 * i]     = vtrnq_u32(vreinterpretq_u32_u16(a[2 * i].val[0]), vreinterpretq_u32_u16(a[2 * i + 1].val[0]));
+		b[2 * i + 1] = vtrnq_u32(vreinterpretq_u32_u16(a[2 * i].val[1]), vreinterpretq_u32_u16(a[2 * i + 1].val[1]));
+	}
+	/* b[0]: column 0|4, 2|6 of rows 0-3, b[1]: column 1|5, 3|7 of rows 0-3, b[2], b[3]: rows 4-7 */
+	for (int i = 0; i < 2; i++) {
+		for (int j = 0; j < 2; j++) {
+			vst1q_u8(dst[2 * i + j], vreinterpretq_u8_u32(
+				vcombine_u32(vget_low_u32(b[j].val[i]), vget_low_u32(b[j + 2].val[i]))));
+			vst1q_u8(dst[2 * i + j + 4], vreinterpretq_u8_u32(
+				vcombine_u32(vget_high_u32(b[j].val[i]), vget_high_u32(b[j + 2].val[i]))));
+		}
+	}
+#else
+	transpose_tile_scalar(dst, src, 2, ROTATE_TILE, ROTATE_TILE);
+#endif
 }
 
-static inline void get_average(struct image *img, uint8_t *data, int x_from, int y_from, int x_to, int y_to, uint8_t pixel[])
+static void transpose_tile24(uint8_t *dst[], const uint8_t *src[])
 {
-	int cell_num;
-	uint8_t r, g, b;
-	uint16_t rsum, gsum, bsum;
+	const int last = ROTATE_TILE - 1;
+
+	/* no SIMD: copy pixel by 32bit, the extra byte is overwritten by the next pixel
+		(the last row/column of the tile is copied by 3 bytes not to touch outside of the tile) */
+	for (int j = 0; j < last; j++) {
+		for (int i = 0; i < last; i++)
+			store_pixel(dst[j] + i * 3, load_pixel(src[i] + j * 3), 3, true);
+		memcpy(dst[j] + last * 3, src[last] + j * 3, 3);
+	}
+	for (int i = 0; i < ROTATE_TILE; i++)
+		memcpy(dst[last] + i * 3, src[i] + last * 3, 3);
+}
 
-	rsum = gsum = bsum = 0;
-	for (int y = y_from; y < y_to; y++) {
-		for (int x = x_from; x < x_to; x++) {
-			get_rgb(img, data, x, y, &r, &g, &b);
-			rsum += r; gsum += g; bsum += b;
+static void transpose_tile32(uint8_t *dst[], const uint8_t *src[])
+{
+	/* four 4x4 blocks: the block at (y, x) goes to (x, y) */
+	for (int y = 0; y < ROTATE_TILE; y += 4) {
+		for (int x = 0; x < ROTATE_TILE; x += 4) {
+#if defined(__SSE2__)
+			__m128i a0, a1, a2, a3, b0, b1, b2, b3;
+
+			a0 = _mm_loadu_si128((const __m128i *) (src[y] + x * 4));
+			a1 = _mm_loadu_si128((const __m128i *) (src[y + 1] + x * 4));
+			a2 = _mm_loadu_si128((const __m128i *) (src[y + 2] + x * 4));
+			a3 = _mm_loadu_si128((const __m128i *) (src[y + 3] + x * 4));
+			b0 = _mm_unpacklo_epi32(a0, a1);
+			b1 = _mm_unpackhi_epi32(a0, a1);
+			b2 = _mm_unpacklo_epi32(a2, a3);
+			b3 = _mm_unpackhi_epi32(a2, a3);
+			_mm_storeu_si128((__m128i *) (dst[x] + y * 4), _mm_unpacklo_epi64(b0, b2));
+			_mm_storeu_si128((__m128i *) (dst[x + 1] + y * 4), _mm_unpackhi_epi64(b0, b2));
+			_mm_storeu_si128((__m128i *) (dst[x + 2] + y * 4), _mm_unpacklo_epi64(b1, b3));
+			_mm_storeu_si128((__m128i *) (dst[x + 3] + y * 4), _mm_unpackhi_epi64(b1, b3));
+#elif defined(__ARM_NEON)
+			uint32x4x2_t a, b;
+
+			a = vtrnq_u32(vreinterpretq_u32_u8(vld1q_u8(src[y] + x * 4)), vreinterpretq_u32_u8(vld1q_u8(src[y + 1] + x * 4)));
+			b = vtrnq_u32(vreinterpretq_u32_u8(vld1q_u8(src[y + 2] + x * 4)), vreinterpretq_u32_u8(vld1q_u8(src[y + 3] + x * 4)));
+			vst1q_u8(dst[x] + y * 4, vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(a.val[0]), vget_low_u32(b.val[0]))));
+			vst1q_u8(dst[x + 1] + y * 4, vreinterpretq_u8_u32(vcombine_u32(vget_low_u32(a.val[1]), vget_low_u32(b.val[1]))));
+			vst1q_u8(dst[x + 2] + y * 4, vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(a.val[0]), vget_high_u32(b.val[0]))));
+			vst1q_u8(dst[x + 3] + y * 4, vreinterpretq_u8_u32(vcombine_u32(vget_high_u32(a.val[1]), vget_high_u32(b.val[1]))));
+#else
+			for (int j = 0; j < 4; j++)
+				for (int i = 0; i < 4; i++)
+					memcpy(dst[x + j] + (y + i) * 4, src[y + i] + (x + j) * 4, 4);
+#endif
 		}
 	}
+}
 
-	cell_num = (y_to - y_from) * (x_to - x_from);
-	if (cell_num > 1) {
-		rsum /= cell_num; gsum /= cell_num; bsum /= cell_num;
+/* reverse order of pixels (for 180 degrees): src is read from the end of row */
+static inline void reverse_row(uint8_t *dst, const uint8_t *src, int width, int channel)
+{
+	int x = 0;
+
+	src += (long) width * channel;
+#if defined(__SSE2__)
+	__m128i v;
+
+	/* reverse 32bit lanes, then 16bit and 8bit lanes inside them */
+	for (; channel != 3 && x + 16 / channel <= width; x += 16 / channel, src -= 16, dst += 16) {
+		v = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) (src - 16)), _MM_SHUFFLE(0, 1, 2, 3));
+		if (channel <= 2)
+			v = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, _MM_SHUFFLE(2, 3, 0, 1)), _MM_SHUFFLE(2, 3, 0, 1));
+		if (channel == 1)
+			v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+		_mm_storeu_si128((__m128i *) dst, v);
 	}
+#elif defined(__ARM_NEON)
+	uint8x16_t v;
+
+	/* reverse lanes inside 64bit halves, then swap halves */
+	for (; channel != 3 && x + 16 / channel <= width; x += 16 / channel, src -= 16, dst += 16) {
+		v = vld1q_u8(src - 16);
+		v = (channel == 1) ? vrev64q_u8(v):
+			(channel == 2) ? vreinterpretq_u8_u16(vrev64q_u16(vreinterpretq_u16_u8(v))):
+			vreinterpretq_u8_u32(vrev64q_u32(vreinterpretq_u32_u8(v)));
+		vst1q_u8(dst, vcombine_u8(vget_high_u8(v), vget_low_u8(v)));
+	}
+#endif
+	/* 3 bytes per pixel: copy by 32bit except the first read and the last write */
+	if (channel == 3 && width > 2) {
+		src -= 3;
+		memcpy(dst, src, 3);
+		for (x = 1, dst += 3; x < width - 1; x++, dst += 3) {
+			src -= 3;
+			store_pixel(dst, load_pixel(src), 3, true);
+		}
+	}
+	for (; x < width; x++, dst += channel) {
+		src -= channel;
+		memcpy(dst, src, channel);
+	}
+}
 
-	if (img->channel <= 2)
-		*pixel++ = rsum;
-	else {
-		*pixel++ = rsum; *pixel++ = gsum; *pixel++ = bsum;
+/* rotated rows [y0, y1) of width x height image into dst (rows of rotated image are contiguous)
+	clockwise        (angle 90) : rotated (x, y) = src (y, height - 1 - x)
+	counter clockwise(angle 270): rotated (x, y) = src (width - 1 - y, x)
+	upside down      (angle 180): rotated (x, y) = src (width - 1 - x, height - 1 - y) */
+static inline void rotate_rows(uint8_t *dst, const uint8_t *data, int width, int height, int channel, int angle, int y0, int y1)
+{
+	int x0, x1, rows, cols, x_end, y_end;
+	long src_stride = (long) width * channel, dst_stride, dst_step;
+	uint8_t *dst_row[ROTATE_TILE];
+	const uint8_t *src_row[ROTATE_TILE];
+	void (*transpose_tile)(uint8_t *dst[], const uint8_t *src[]);
+
+	if (angle == 180) {
+		for (int y = y0; y < y1; y++)
+			reverse_row(dst + (y - y0) * src_stride, data + (height - 1 - y) * src_stride, width, channel);
+		return;
 	}
 
-	if (img->alpha)
-		*pixel = 0;
+	transpose_tile = (channel == 1) ? transpose_tile8:
+		(channel == 2) ? transpose_tile16:
+		(channel == 3) ? transpose_tile24: transpose_tile32;
+
+	/* rotated rows are src columns [x0, x1): transpose ROTATE_TILE x ROTATE_TILE tiles
+		(with src or dst rows in reverse order), and visit tiles block by block:
+		src and dst of a block stay in cache */
+	x0 = (angle == 90) ? y0: width - y1;
+	x1 = (angle == 90) ? y1: width - y0;
+	dst_stride = (long) height * channel;
+	dst_step   = (angle == 90) ? ROTATE_TILE * dst_stride: -ROTATE_TILE * dst_stride;
+
+	for (int by = 0; by < height; by += ROTATE_BLOCK) {
+		for (int bx = x0; bx < x1; bx += ROTATE_BLOCK) {
+			y_end = (by + ROTATE_BLOCK < height) ? by + ROTATE_BLOCK: height;
+			x_end = (bx + ROTATE_BLOCK < x1) ? bx + ROTATE_BLOCK: x1;
+
+			for (int y = by; y < y_end; y += ROTATE_TILE) {
+				rows = (y + ROTATE_TILE < y_end) ? ROTATE_TILE: y_end - y;
+				cols = (bx + ROTATE_TILE < x_end) ? ROTATE_TILE: x_end - bx;
+
+				/* row pointers of the first tile, then step to the right */
+				for (int i = 0; i < rows; i++)
+					src_row[i] = data + (angle == 90 ? y + rows - 1 - i: y + i) * src_stride + bx * channel;
+				for (int j = 0; j < cols; j++)
+					dst_row[j] = dst + ((angle == 90) ? (bx - x0 + j) * dst_stride + (height - y - rows) * channel:
+						(x1 - 1 - bx - j) * dst_stride + y * channel);
+
+				for (int x = bx; x < x_end; x += ROTATE_TILE) {
+					if (x + ROTATE_TILE > x_end)
+						cols = x_end - x;
+
+					if (rows == ROTATE_TILE && cols == ROTATE_TILE)
+						transpose_tile(dst_row, src_row);
+					else
+						transpose_tile_scalar(dst_row, src_row, channel, rows, cols);
+
+					if (x + ROTATE_TILE >= x_end)
+						break;
+					for (int i = 0; i < rows; i++)
+						src_row[i] += ROTATE_TILE * channel;
+					for (int j = 0; j < cols; j++)
+						dst_row[j] += dst_step;
+				}
+			}
+		}
+	}
 }
 
+/* some image proccessing functions:
+	never use *_single functions directly */
 uint8_t *rotate_image_single(struct image *img, uint8_t *data, int angle)
 {
-	int x1, x2, y1, y2, r, dst_width, dst_height;
+	int dst_width, dst_height;
 	uint8_t *rotated_data;
-	long offset_dst, offset_src;
-
-	static const int cos[3] = {0, -1,  0};
-	static const int sin[3] = {1,  0, -1};
-
-	int shift[3][3] = {
-	/*   x_shift,         y_shift,        sign */
-		{img->height - 1, 0              , -1},
-		{img->width  - 1, img->height - 1,  1},
-		{              0, img->width  - 1, -1}
-	};
 
 	if (angle != 90 && angle != 180 && angle != 270)
 		return NULL;
-	/* r == 0: clockwise        : (angle 90)  */
-	/* r == 1: upside down      : (angle 180) */
-	/* r == 2: counter clockwise: (angle 270) */
-	r = angle / 90 - 1;
-	
+
 	if (angle == 90 || angle == 270) {
 		dst_width  = img->height;
 		dst_height = img->width;
@@ -700,15 +2411,7 @@ uint8_t *rotate_image_single(struct image *img, uint8_t *data, int angle)
 	logging(DEBUG, "rotated image: %dx%d size:%d\n",
 		dst_width, dst_height, dst_width * dst_height * img->channel);
 
-	for (y2 = 0; y2 < dst_height; y2++) {
-		for (x2 = 0; x2 < dst_width; x2++) {
-			x1 = ((x2 - shift[r][0]) * cos[r] - (y2 - shift[r][1]) * sin[r]) * shift[r][2];
-			y1 = ((x2 - shift[r][0]) * sin[r] + (y2 - shift[r][1]) * cos[r]) * shift[r][2];
-			offset_src = img->channel * (y1 * img->width + x1);
-			offset_dst = img->channel * (y2 * dst_width + x2);
-			memcpy(rotated_data + offset_dst, data + offset_src, img->channel);
-		}
-	}
+	rotate_rows(rotated_data, data, img->width, img->height, img->channel, angle, 0, dst_height);
 	free(data);
 
 	img->width  = dst_width;
@@ -720,104 +2423,421 @@ uint8_t *rotate_image_single(struct image *img, uint8_t *data, int angle)
 void rotate_image(struct image *img, int angle, bool rotate_all)
 {
 	uint8_t *rotated_data;
+	int width = img->width, height = img->height;
 
 	if (rotate_all) {
-		for (int i = 0; i < img->frame_count; i++)
+		load_all_frames(img);
+		for (int i = 0; i < img->frame_count; i++) {
+			/* every frame has the size before rotation */
+			img->width  = width;
+			img->height = height;
 			if ((rotated_data = rotate_image_single(img, img->data[i], angle)) != NULL)
 				img->data[i] = rotated_data;
+		}
 	} else {
-		if ((rotated_data = rotate_image_single(img, img->data[img->current_frame], angle)) != NULL)
+		if ((rotated_data = rotate_image_single(img, get_current_frame(img), angle)) != NULL)
 			img->data[img->current_frame] = rotated_data;
 	}
 }
 
-uint8_t *resize_image_single(struct image *img, uint8_t *data, int disp_width, int disp_height)
+/* size of image fitting in disp_width x disp_height (keep aspect ratio):
+	return false if no need to resize */
+static inline bool get_resized_size(int width, int height, int disp_width, int disp_height,
+	enum enlarge_t filter, int *dst_width, int *dst_height)
+{
+	int scale;
+
+	/* fit the side that needs more reduction (or less enlargement) */
+	if ((long) disp_width * height < (long) disp_height * width) {
+		*dst_width  = disp_width;
+		*dst_height = (long) height * disp_width / width;
+	} else {
+		*dst_width  = (long) width * disp_height / height;
+		*dst_height = disp_height;
+	}
+	*dst_width  = (*dst_width > 0) ? *dst_width: 1;
+	*dst_height = (*dst_height > 0) ? *dst_height: 1;
+
+	if (*dst_width >= width && *dst_height >= height) {
+		if (filter == ENLARGE_NONE || (*dst_width == width && *dst_height == height))
+			return false;
+
+		/* nearest: integer scale only, each pixel becomes scale x scale block */
+		if (filter == ENLARGE_NEAREST) {
+			scale = (disp_width / width < disp_height / height) ? disp_width / width: disp_height / height;
+			if (scale < 2)
+				return false;
+			*dst_width  = width * scale;
+			*dst_height = height * scale;
+		}
+	}
+	return true;
+}
+
+/* rectangle [x, x + width) x [y, y + height) of image */
+struct view_t {
+	int x, y, width, height;
+};
+
+/* clip view to width x height image: return false if nothing is left */
+static inline bool clip_view(struct view_t *view, int width, int height)
+{
+	if (view->x < 0) {
+		view->width += view->x;
+		view->x = 0;
+	}
+	if (view->y < 0) {
+		view->height += view->y;
+		view->y = 0;
+	}
+	if (view->x + view->width > width)
+		view->width = width - view->x;
+	if (view->y + view->height > height)
+		view->height = height - view->y;
+
+	return (view->width > 0 && view->height > 0);
+}
+
+/* src pixels [*from, *to) read by dst pixels [x, x + size) */
+static inline void get_resample_range(struct resample_t *rs, int x, int size, int *from, int *to)
 {
-	/* TODO: support enlarge */
-	int width_rate, height_rate, resize_rate;
-	int dst_width, dst_height, y_from, x_from, y_to, x_to;
-	uint8_t *resized_data, pixel[img->channel];
-	long offset_dst;
+	*from = rs->start[x];
+	*to   = rs->start[x] + rs->count[x];
 
-	width_rate  = MULTIPLER * disp_width  / img->width;
-	height_rate = MULTIPLER * disp_height / img->height;
-	resize_rate = (width_rate < height_rate) ? width_rate: height_rate;
+	for (int i = x + 1; i < x + size; i++) {
+		*from = (rs->start[i] < *from) ? rs->start[i]: *from;
+		*to   = (rs->start[i] + rs->count[i] > *to) ? rs->start[i] + rs->count[i]: *to;
+	}
+}
 
-	logging(DEBUG, "width_rate:%.2d height_rate:%.2d resize_rate:%.2d\n",
-		width_rate, height_rate, resize_rate);
+/* keep only dst pixels [x, x + size), src pixels are counted from src pixel from */
+static inline void crop_resample(struct resample_t *rs, int x, int size, int from)
+{
+	memmove(rs->start, rs->start + x, size * sizeof(int));
+	memmove(rs->count, rs->count + x, size * sizeof(int));
+	memmove(rs->weight, rs->weight + (long) x * rs->taps, (size_t) size * rs->taps * sizeof(int16_t));
+	rs->size = size;
 
-	/* only support shrink */
-	if ((resize_rate / MULTIPLER) >= 1)
-		return NULL;
+	for (int i = 0; i < size; i++)
+		rs->start[i] -= from;
+}
+
+/* part of src (width x height) needed to make view of the image resized to fit disp_width x disp_height
+	(disp_width/disp_height <= 0: no resize), view is clipped to the resized image:
+	return false if view is empty */
+bool get_view_source(int width, int height, int disp_width, int disp_height, enum enlarge_t filter,
+	struct view_t *view, struct view_t *source)
+{
+	int dst_width, dst_height, from, to;
+	struct resample_t rs = {0};
+
+	if (disp_width <= 0 || disp_height <= 0
+		|| !get_resized_size(width, height, disp_width, disp_height, filter, &dst_width, &dst_height)) {
+		if (!clip_view(view, width, height))
+			return false;
+		*source = *view;
+		return true;
+	}
+
+	if (!clip_view(view, dst_width, dst_height))
+		return false;
+
+	*source = (struct view_t) {0, 0, width, height};
+
+	if (init_resample(&rs, width, dst_width, filter)) {
+		get_resample_range(&rs, view->x, view->width, &from, &to);
+		*source = (struct view_t) {from, 0, to - from, height};
+		free_resample(&rs);
+	}
+	if (init_resample(&rs, height, dst_height, filter)) {
+		get_resample_range(&rs, view->y, view->height, &from, &to);
+		source->y      = from;
+		source->height = to - from;
+		free_resample(&rs);
+	}
+	return true;
+}
+
+/* rows of rotated image: rotated on demand into a window of rows
+	(angle 0: rows of src are used directly) */
+struct row_window_t {
+	const uint8_t *data;
+	int width, height; /* size of src (before rotation) */
+	int channel, angle;
+	uint8_t *buf;
+	int first, rows;   /* buf holds rotated rows [first, first + rows) */
+	int capacity;
+};
+
+/* rotated rows [y, y + count) (rows are contiguous) */
+static inline const uint8_t *get_window_rows(struct row_window_t *win, int y, int count)
+{
+	int rotated_width  = (win->angle == 90 || win->angle == 270) ? win->height: win->width;
+	int rotated_height = (win->angle == 90 || win->angle == 270) ? win->width: win->height;
+	long stride = (long) rotated_width * win->channel;
+
+	if (win->angle == 0)
+		return win->data + y * stride;
+
+	if (y < win->first || y + count > win->first + win->rows) {
+		win->first = y;
+		win->rows  = (y + win->capacity < rotated_height) ? win->capacity: rotated_height - y;
+		rotate_rows(win->buf, win->data, win->width, win->height, win->channel, win->angle, y, y + win->rows);
+	}
+	return win->buf + (y - win->first) * stride;
+}
+
+/* rotate, resize and normalize in one pass: each dst row is made once from src
+	(read through the window of rotated rows, vertical pass, horizontal pass, then normalize),
+	no full size intermediate image is allocated
+	disp_width/disp_height <= 0: no resize, bytes_per_pixel == img->channel: no normalize
+	(image with alpha can be normalized to 4: alpha is resampled as a color channel)
+	view: only this part of the transformed image is made from the src pixels under it (NULL: whole image),
+	data can be a part of src (img->full_width > 0, angle 0 only) covering get_view_source() of the view */
+uint8_t *transform_image_single(struct image *img, uint8_t *data, int angle,
+	int disp_width, int disp_height, enum enlarge_t filter, int bytes_per_pixel, struct view_t *view)
+{
+	int width, height, dst_width, dst_height, channel = img->channel;
+	int data_width, data_height, part_x = 0, part_y = 0, src_x, src_width, y0, y1;
+	bool resize, normalize, crop;
+	long stride, row_stride, dst_stride;
+	uint8_t *transformed_data = NULL, *row = NULL, *out = NULL, *dst[RESAMPLE_ROWS];
+	const uint8_t *src[RESAMPLE_ROWS], *rows;
+	struct resample_t rs_x = {0}, rs_y = {0};
+	struct view_t area;
+	struct row_window_t win = {
+		.data = data, .width = img->width, .height = img->height, .channel = channel,
+		.buf = NULL, .first = 0, .rows = 0,
+	};
+	void (*normalize_row)(uint8_t *dst, const uint8_t *src, int width) =
+		(bytes_per_pixel == 4) ? gray_alpha_to_rgba: (channel == 1) ? gray_to_rgb:
+		(channel == 2) ? gray_alpha_to_rgb: rgba_to_rgb;
 
-	/* FIXME: let the same num (img->width == fb->width), if it causes SEGV, remove "+ 1" */
-	dst_width  = resize_rate * img->width / MULTIPLER + 1;
-	dst_height = resize_rate * img->height / MULTIPLER;
+	if (angle != 90 && angle != 180 && angle != 270)
+		angle = 0;
+	win.angle = angle;
+
+	/* size after rotation */
+	width  = (angle == 90 || angle == 270) ? img->height: img->width;
+	height = (angle == 90 || angle == 270) ? img->width: img->height;
+	data_width  = width;
+	data_height = height;
+
+	if (img->full_width > 0) {
+		if (angle != 0 || view == NULL) {
+			logging(ERROR, "part of image can't be rotated or transformed without view\n");
+			return NULL;
+		}
+		part_x = img->part_x;
+		part_y = img->part_y;
+		width  = img->full_width;
+		height = img->full_height;
+	}
+
+	resize = (disp_width > 0 && disp_height > 0)
+		&& get_resized_size(width, height, disp_width, disp_height, filter, &dst_width, &dst_height);
+	/* XXX: now only support bytes_per_pixel == 3 (rgb) and 4 (rgba of gray + alpha) */
+	normalize = (bytes_per_pixel == 3 && channel != 3) || (bytes_per_pixel == 4 && channel == 2);
 
-	if ((resized_data = (uint8_t *) ecalloc(dst_width * dst_height, img->channel)) == NULL)
+	if (!resize) {
+		dst_width  = width;
+		dst_height = height;
+	}
+
+	area = (view != NULL) ? *view: (struct view_t) {0, 0, dst_width, dst_height};
+	if (!clip_view(&area, dst_width, dst_height)) {
+		logging(ERROR, "view is out of image\n");
 		return NULL;
+	}
+	crop = (area.width != dst_width || area.height != dst_height);
+
+	if (!resize && !normalize && !crop && img->full_width <= 0)
+		return (angle != 0) ? rotate_image_single(img, data, angle): NULL;
+
+	stride     = (long) data_width * channel;
+	dst_stride = (long) area.width * (normalize ? bytes_per_pixel: channel);
+
+	logging(DEBUG, "src:%dx%d angle:%d disp:%dx%d dst:%dx%d view:%dx%d+%d+%d filter:%d bpp:%d\n",
+		img->width, img->height, angle, disp_width, disp_height, dst_width, dst_height,
+		area.width, area.height, area.x, area.y, filter, bytes_per_pixel);
+
+	/* src columns [src_x, src_x + src_width) and rows [y0, y1) under the view */
+	if (resize) {
+		if (!init_resample(&rs_x, width, dst_width, filter)
+			|| !init_resample(&rs_y, height, dst_height, filter))
+			goto release;
+		get_resample_range(&rs_x, area.x, area.width, &src_x, &src_width);
+		get_resample_range(&rs_y, area.y, area.height, &y0, &y1);
+		src_width -= src_x;
+		crop_resample(&rs_x, area.x, area.width, src_x);
+	} else {
+		src_x     = area.x;
+		src_width = area.width;
+		y0        = area.y;
+		y1        = area.y + area.height;
+	}
 
-	logging(DEBUG, "resized image: %dx%d size:%d\n",
-		dst_width, dst_height, dst_width * dst_height * img->channel);
+	if (src_x < part_x || src_x + src_width > part_x + data_width
+		|| y0 < part_y || y1 > part_y + data_height) {
+		logging(ERROR, "part of image doesn't cover the view\n");
+		goto release;
+	}
+	src_x -= part_x;
+	row_stride = (long) src_width * channel;
+
+	win.capacity = (resize ? rs_y.taps: 1) + ROTATE_BLOCK;
+
+	if ((angle != 0 && (win.buf = (uint8_t *) ecalloc(win.capacity, stride)) == NULL)
+		|| (row = (uint8_t *) ecalloc(RESAMPLE_ROWS, row_stride + RESAMPLE_PADDING)) == NULL
+		|| (out = (uint8_t *) ecalloc(RESAMPLE_ROWS, (long) area.width * channel)) == NULL
+		|| (transformed_data = (uint8_t *) ecalloc(area.height, dst_stride)) == NULL)
+		goto release;
+
+	logging(DEBUG, "transformed image: %dx%d size:%ld\n", area.width, area.height, area.height * dst_stride);
+
+	if (!resize) {
+		for (int y = 0; y < area.height; y++) {
+			rows = get_window_rows(&win, area.y + y - part_y, 1) + src_x * channel;
+			if (normalize)
+				normalize_row(transformed_data + y * dst_stride, rows, area.width);
+			else
+				memcpy(transformed_data + y * dst_stride, rows, dst_stride);
+		}
+		goto transformed;
+	}
 
-	for (int y = 0; y < dst_height; y++) {
-		y_from = MULTIPLER * y / resize_rate;
-		y_to   = MULTIPLER * (y + 1) / resize_rate;
-		for (int x = 0; x < dst_width; x++) {
-			x_from = MULTIPLER * x / resize_rate;
-			x_to   = MULTIPLER * (x + 1) / resize_rate;
-			get_average(img, data, x_from, y_from, x_to, y_to, pixel);
-			offset_dst = img->channel * (y * dst_width + x);
-			memcpy(resized_data + offset_dst, pixel, img->channel);
+	/* RESAMPLE_ROWS dst rows at once: the last rows are filled by repeating the last dst row */
+	for (int y = 0; y < area.height; y += RESAMPLE_ROWS) {
+		for (int i = 0; i < RESAMPLE_ROWS; i++) {
+			if (y + i < area.height) {
+				rows = get_window_rows(&win, rs_y.start[area.y + y + i] - part_y, rs_y.count[area.y + y + i]);
+				resample_vertical(row + i * (row_stride + RESAMPLE_PADDING), rows + src_x * channel, stride,
+					rs_y.count[area.y + y + i], rs_y.weight + (area.y + y + i) * rs_y.taps, rs_y.shift, row_stride);
+				src[i] = row + i * (row_stride + RESAMPLE_PADDING);
+				dst[i] = normalize ? out + i * area.width * channel: transformed_data + (y + i) * dst_stride;
+			} else {
+				src[i] = src[i - 1];
+				dst[i] = dst[i - 1];
+			}
 		}
+		resample_horizontal(dst, src, channel, &rs_x);
+
+		for (int i = 0; normalize && i < RESAMPLE_ROWS && y + i < area.height; i++)
+			normalize_row(transformed_data + (y + i) * dst_stride, dst[i], area.width);
 	}
-	free(data);
 
-	img->width  = dst_width;
-	img->height = dst_height;
+transformed:
+	free(data);
 
-	return resized_data;
+	img->width  = area.width;
+	img->height = area.height;
+	img->part_x = img->part_y = 0;
+	img->full_width = img->full_height = 0;
+
+release:
+	free(win.buf);
+	free(row);
+	free(out);
+	free_resample(&rs_x);
+	free_resample(&rs_y);
+	return transformed_data;
 }
 
-void resize_image(struct image *img, int disp_width, int disp_height, bool resize_all)
+/* rotate (angle 0: no rotate), then resize (disp_width/disp_height <= 0: no resize),
+	then normalize to bytes_per_pixel (3, or 4 for image with alpha, others: no normalize) */
+void transform_image(struct image *img, int angle, int disp_width, int disp_height,
+	enum enlarge_t filter, int bytes_per_pixel, bool transform_all)
 {
-	uint8_t *resized_data;
-
-	if (resize_all) {
-		for (int i = 0; i < img->frame_count; i++)
-			if ((resized_data = resize_image_single(img, img->data[i], disp_width, disp_height)) != NULL)
-				img->data[i] = resized_data;
+	uint8_t *transformed_data;
+	int width = img->width, height = img->height;
+
+	if (bytes_per_pixel != 3 && !(bytes_per_pixel == 4 && img->alpha))
+		bytes_per_pixel = img->channel;
+
+	if (transform_all) {
+		load_all_frames(img);
+		for (int i = 0; i < img->frame_count; i++) {
+			/* every frame has the size before transform */
+			img->width  = width;
+			img->height = height;
+			if ((transformed_data = transform_image_single(img, img->data[i],
+				angle, disp_width, disp_height, filter, bytes_per_pixel, NULL)) != NULL)
+				img->data[i] = transformed_data;
+		}
 	} else {
-		if ((resized_data = resize_image_single(img, img->data[img->current_frame], disp_width, disp_height)) != NULL)
-			img->data[img->current_frame] = resized_data;
+		if ((transformed_data = transform_image_single(img, get_current_frame(img),
+			angle, disp_width, disp_height, filter, bytes_per_pixel, NULL)) != NULL)
+			img->data[img->current_frame] = transformed_data;
+	}
+
+	if (bytes_per_pixel != img->channel) {
+		img->channel = bytes_per_pixel;
+		img->alpha   = (bytes_per_pixel == 4);
 	}
 }
 
+void resize_image(struct image *img, int disp_width, int disp_height, enum enlarge_t filter, bool resize_all)
+{
+	transform_image(img, 0, disp_width, disp_height, filter, img->channel, resize_all);
+}
+
+/* resize current frame to fit disp_width x disp_height, then crop view of the resized image in one pass:
+	only src pixels under the view are resampled (return false if view is out of image or on error) */
+bool view_image(struct image *img, int disp_width, int disp_height, enum enlarge_t filter, struct view_t *view)
+{
+	uint8_t *viewed_data;
+	int width  = (img->full_width > 0) ? img->full_width: img->width;
+	int height = (img->full_width > 0) ? img->full_height: img->height;
+	struct view_t area = *view, source;
+
+	if (!get_view_source(width, height, disp_width, disp_height, filter, &area, &source))
+		return false;
+
+	if ((viewed_data = transform_image_single(img, get_current_frame(img),
+		0, disp_width, disp_height, filter, img->channel, view)) == NULL)
+		/* nothing to do if view is the whole image */
+		return img->full_width <= 0 && area.width == img->width && area.height == img->height;
+
+	img->data[img->current_frame] = viewed_data;
+	return true;
+}
+
+enum enlarge_t str2enlarge(const char *str)
+{
+	if (strcmp(str, "nearest") == 0)
+		return ENLARGE_NEAREST;
+	else if (strcmp(str, "bilinear") == 0)
+		return ENLARGE_BILINEAR;
+	else if (strcmp(str, "lanczos") == 0)
+		return ENLARGE_LANCZOS;
+
+	logging(ERROR, "unknown enlarge filter: %s (reduce only)\n", str);
+	return ENLARGE_NONE;
+}
+
 uint8_t *normalize_bpp_single(struct image *img, uint8_t *data, int bytes_per_pixel)
 {
-	uint8_t *normalized_data, *src, *dst, r, g, b;
+	uint8_t *normalized_data;
+	long stride = (long) img->width * img->channel, dst_stride = (long) img->width * bytes_per_pixel;
+	void (*normalize_row)(uint8_t *dst, const uint8_t *src, int width) =
+		(bytes_per_pixel == 4) ? gray_alpha_to_rgba: (img->channel == 1) ? gray_to_rgb:
+		(img->channel == 2) ? gray_alpha_to_rgb: rgba_to_rgb;
+
+	/* rgba -> rgb: in place (rows never overtake src), then release the rest */
+	if (img->channel == 4 && bytes_per_pixel == 3) {
+		for (int y = 0; y < img->height; y++)
+			rgba_to_rgb(data + y * dst_stride, data + y * stride, img->width);
+		if ((normalized_data = (uint8_t *) erealloc(data, img->height * dst_stride)) == NULL)
+			return data;
+		return normalized_data;
+	}
 
 	if ((normalized_data = (uint8_t *)
 		ecalloc(img->width * img->height, bytes_per_pixel)) == NULL)
 		return NULL;
 
-	if (img->channel <= 2) { /* grayscale (+ alpha) */
-		for (int y = 0; y < img->height; y++) {
-			for (int x = 0; x < img->width; x++) {
-				src = data + img->channel * (y * img->width + x);
-				dst = normalized_data + bytes_per_pixel * (y * img->width + x);
-				*dst = *src; *(dst + 1) = *src; *(dst + 2) = *src;
-			}
-		}
-	} else {                 /* rgb (+ alpha) */
-		for (int y = 0; y < img->height; y++) {
-			for (int x = 0; x < img->width; x++) {
-				get_rgb(img, data, x, y, &r, &g, &b);
-				dst = normalized_data + bytes_per_pixel * (y * img->width + x);
-				*dst = r; *(dst + 1) = g; *(dst + 2) = b;
-			}
-		}
-	}
+	for (int y = 0; y < img->height; y++)
+		normalize_row(normalized_data + y * dst_stride, data + y * stride, img->width);
 	free(data);
 
 	return normalized_data;
@@ -827,57 +2847,79 @@ void normalize_bpp(struct image *img, int bytes_per_pixel, bool normalize_all)
 {
 	uint8_t *normalized_data;
 
-	/* XXX: now only support bytes_per_pixel == 3 */
-	if (bytes_per_pixel != 3)
+	/* XXX: now only support bytes_per_pixel == 3 (rgb) and 4 (rgba of gray + alpha) */
+	if ((bytes_per_pixel != 3 && !(bytes_per_pixel == 4 && img->channel == 2))
+		|| img->channel == bytes_per_pixel)
 		return;
 
 	if (normalize_all) {
+		load_all_frames(img);
 		for (int i = 0; i < img->frame_count; i++)
 			if ((normalized_data = normalize_bpp_single(img, img->data[i], bytes_per_pixel)) != NULL)
 				img->data[i] = normalized_data;
 	} else {
-		if ((normalized_data = normalize_bpp_single(img, img->data[img->current_frame], bytes_per_pixel)) != NULL)
+		if ((normalized_data = normalize_bpp_single(img, get_current_frame(img), bytes_per_pixel)) != NULL)
 			img->data[img->current_frame] = normalized_data;
 	}
+	img->channel = bytes_per_pixel;
+	img->alpha   = (bytes_per_pixel == 4);
 }
 
 /* main functions */
 #include "sixel.h"
 
-char temp_file[BUFSIZE];
-
 enum {
-	SIXEL_COLORS = 256,
-	SIXEL_BPP    = 3,
-	TERM_WIDTH   = 1280,
-	TERM_HEIGHT  = 1024,
+	SIXEL_COLORS    = 256,
+	SIXEL_BPP       = 3,
+	SIXEL_BPP_ALPHA = SIXEL_DEPTH_RGBA, /* transparent pixels are not drawn */
+	TERM_WIDTH      = 1280,
+	TERM_HEIGHT     = 1024,
 };
 
 void usage()
 {
 	printf("usage:\n"
-		"\tsdump [-h] [-f] [-r angle] image\n"
+		"\tsdump [-h] [-f] [-e filter] [-r angle] image\n"
 		"\tcat image | sdump\n"
 		"\twget -O - image_url | sdump\n"
 		"options:\n"
 		"\t-h: show this help\n"
 		"\t-f: fit image to display\n"
+		"\t-e: fit and enlarge small image (nearest/bilinear/lanczos)\n"
 		"\t-r: rotate image (90/180/270)\n"
 		);
 }
 
-void remove_temp_file()
+FILE *open_anonymous_file()
 {
-	extern char temp_file[BUFSIZE]; /* global */
-	remove(temp_file);
+	FILE *fp;
+#ifdef MFD_CLOEXEC
+	int fd;
+
+	/* memory backed file: no disk I/O and no cleanup needed (linux >= 3.17) */
+	if ((fd = memfd_create("sdump", MFD_CLOEXEC)) >= 0) {
+		if ((fp = fdopen(fd, "w+")) != NULL)
+			return fp;
+		eclose(fd);
+	}
+	logging(DEBUG, "memfd_create() failed, fallback to tmpfile()\n");
+#endif
+
+	/* tmpfile() is removed automatically when it is closed */
+	errno = 0;
+	if ((fp = tmpfile()) == NULL)
+		logging(ERROR, "tmpfile: %s\n", strerror(errno));
+
+	return fp;
 }
 
-char *make_temp_file(const char *template)
+FILE *read_stdin()
 {
-	extern char temp_file[BUFSIZE]; /* global */
 	int fd;
-	ssize_t size, file_size = 0;
-	char buf[BUFSIZE], *env;
+	ssize_t size = -1, file_size = 0;
+	char buf[PIPE_BUFSIZE];
+	struct stat st;
+	FILE *fp;
 
 	/* stdin is tty or not */
 	if (isatty(STDIN_FILENO)) {
@@ -885,35 +2927,43 @@ char *make_temp_file(const char *template)
 		return NULL;
 	}
 
-	/* prepare temp file */
-	memset(temp_file, 0, BUFSIZE);
-	if ((env = getenv("TMPDIR")) != NULL) {
-		snprintf(temp_file, BUFSIZE, "%s/%s", env, template);
-	} else {
-		snprintf(temp_file, BUFSIZE, "/tmp/%s", template);
+	/* redirect from regular file: read it directly */
+	if (fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+		if (st.st_size == 0) {
+			logging(ERROR, "stdin is empty\n");
+			return NULL;
+		}
+		return fdopen(STDIN_FILENO, "r");
 	}
 
-	if ((fd = emkstemp(temp_file)) < 0)
+	if ((fp = open_anonymous_file()) == NULL)
 		return NULL;
-	logging(DEBUG, "tmp file:%s\n", temp_file);
-
-	/* register cleanup function */
-	if (atexit(remove_temp_file))
-		logging(ERROR, "atexit() failed\nmaybe temporary file remains...\n");
+	fd = fileno(fp);
 
-	/* read data */
-	while ((size = read(STDIN_FILENO, buf, BUFSIZE)) > 0) {
-		write(fd, buf, size);
+#ifdef SPLICE_F_MOVE
+	/* move pages from pipe to file without copying them to user space */
+	while ((size = splice(STDIN_FILENO, NULL, fd, NULL,
+		PIPE_BUFSIZE, SPLICE_F_MOVE | SPLICE_F_MORE)) > 0)
 		file_size += size;
+#endif
+
+	/* stdin is not a pipe or splice() failed: fallback to read()/write() */
+	if (size < 0) {
+		while ((size = read(STDIN_FILENO, buf, PIPE_BUFSIZE)) > 0) {
+			if (write(fd, buf, size) != size)
+				break;
+			file_size += size;
+		}
 	}
-	eclose(fd);
 
 	if (file_size == 0) {
 		logging(ERROR, "stdin is empty\n");
+		efclose(fp);
 		return NULL;
 	}
+	fseek(fp, 0L, SEEK_SET);
 
-	return temp_file;
+	return fp;
 }
 
 int sixel_write_callback(char *data, int size, void *priv)
@@ -937,27 +2987,28 @@ int sixel_write_callback(char *data, int size, void *priv)
 	return fwrite(data, size, 1, (FILE *) priv);
 }
 
-void cleanup(sixel_dither_t *sixel_dither, sixel_output_t *sixel_context, struct image *img)
+void cleanup(sixel_dither_t *sixel_dither, sixel_output_t *sixel_context, struct image *img, struct image *frame)
 {
 	if (sixel_dither)
 		sixel_dither_unref(sixel_dither);
 	if (sixel_context)
 		sixel_output_unref(sixel_context);
 	free_image(img);
+	free_image(frame);
 }
 
 int main(int argc, char **argv)
 {
-	const char *template = "sdump.XXXXXX";
-	char *file;
 	bool resize = false;
-	int angle = 0, opt;
-	struct image img;
+	int angle = 0, opt, target_width = 0, target_height = 0;
+	enum enlarge_t enlarge = ENLARGE_NONE;
+	struct image img, frame;
+	FILE *fp;
 	sixel_output_t *sixel_context = NULL;
 	sixel_dither_t *sixel_dither = NULL;
 
 	/* check arg */
-	while ((opt = getopt(argc, argv, "hfr:")) != -1) {
+	while ((opt = getopt(argc, argv, "hfe:r:")) != -1) {
 		switch (opt) {
 		case 'h':
 			usage();
@@ -965,6 +3016,10 @@ int main(int argc, char **argv)
 		case 'f':
 			resize = true;
 			break;
+		case 'e':
+			resize  = true;
+			enlarge = str2enlarge(optarg);
+			break;
 		case 'r':
 			angle = str2num(optarg);
 			break;
@@ -975,11 +3030,11 @@ int main(int argc, char **argv)
 
 	/* open file */
 	if (optind < argc)
-		file = argv[optind];
+		fp = efopen(argv[optind], "r");
 	else
-		file = make_temp_file(template);
+		fp = read_stdin();
 
-	if (file == NULL) {
+	if (fp == NULL) {
 		logging(FATAL, "input file not found\n");
 		usage();
 		return EXIT_FAILURE;
@@ -987,39 +3042,20 @@ int main(int argc, char **argv)
 
 	/* init */
 	init_image(&img);
+	init_image(&frame);
 
-	if (load_image(file, &img) == false) {
-		logging(FATAL, "couldn't load image\n");
-		return EXIT_FAILURE;
-	}
-
-	/* rotate/resize and draw */
-	/* TODO: support color reduction for 8bpp mode */
-	if (angle != 0)
-		rotate_image(&img, angle, true);
-
-	if (resize)
-		resize_image(&img, TERM_WIDTH, TERM_HEIGHT, true);
-
-	/* sixel */
-	/* XXX: libsixel only allows 3 bytes per pixel image,
-		we should convert bpp when bpp is 1 or 2 or 4 */
-	if (get_image_channel(&img) != SIXEL_BPP)
-		normalize_bpp(&img, SIXEL_BPP, true);
-
-	if ((sixel_dither = sixel_dither_create(SIXEL_COLORS)) == NULL) {
-		logging(ERROR, "couldn't create dither\n");
-		goto error_occured;
+	/* let the decoder shrink the image as far as resize_image() would */
+	if (resize) {
+		target_width  = (angle == 90 || angle == 270) ? TERM_HEIGHT: TERM_WIDTH;
+		target_height = (angle == 90 || angle == 270) ? TERM_WIDTH: TERM_HEIGHT;
 	}
 
-	/* XXX: use first frame for dither initialize */
-	if (sixel_dither_initialize(sixel_dither, get_current_frame(&img), get_image_width(&img), get_image_height(&img),
-		SIXEL_BPP, LARGE_AUTO, REP_AUTO, QUALITY_AUTO) != 0) {
-		logging(ERROR, "couldn't initialize dither\n");
-		sixel_dither_unref(sixel_dither);
-		goto error_occured;
+	if (load_image_fp(fp, &img, target_width, target_height) == false) {
+		logging(FATAL, "couldn't load image\n");
+		efclose(fp);
+		return EXIT_FAILURE;
 	}
-	sixel_dither_set_diffusion_type(sixel_dither, DIFFUSE_AUTO);
+	efclose(fp);
 
 	if ((sixel_context = sixel_output_create(sixel_write_callback, stdout)) == NULL) {
 		logging(ERROR, "couldn't create sixel context\n");
@@ -1027,19 +3063,48 @@ int main(int argc, char **argv)
 	}
 	sixel_output_set_8bit_availability(sixel_context, CSIZE_7BIT);
 
+	/* decode, rotate/resize/normalize and draw frames in order:
+		only the drawing frame is held, so memory does not grow with the length of animation */
+	/* TODO: support color reduction for 8bpp mode */
 	printf("\0337"); /* save cursor position */
 	for (int i = 0; i < get_frame_count(&img); i++) {
+		if (!copy_frame(&img, i, &frame))
+			goto error_occured;
+
+		/* XXX: libsixel only allows 3 (or 4: rgba) bytes per pixel image,
+			rotate/resize and convert bpp (when bpp is 1 or 2 or 4) at once */
+		transform_image(&frame, angle, resize ? TERM_WIDTH: 0, resize ? TERM_HEIGHT: 0,
+			enlarge, frame.alpha ? SIXEL_BPP_ALPHA: SIXEL_BPP, false);
+
+		/* XXX: use first frame for dither initialize */
+		if (i == 0) {
+			if ((sixel_dither = sixel_dither_create(SIXEL_COLORS)) == NULL) {
+				logging(ERROR, "couldn't create dither\n");
+				goto error_occured;
+			}
+
+			if (sixel_dither_initialize(sixel_dither, get_current_frame(&frame),
+				get_image_width(&frame), get_image_height(&frame),
+				get_image_channel(&frame), LARGE_AUTO, REP_AUTO, QUALITY_AUTO) != 0) {
+				logging(ERROR, "couldn't initialize dither\n");
+				goto error_occured;
+			}
+			sixel_dither_set_diffusion_type(sixel_dither, DIFFUSE_AUTO);
+		}
+
 		printf("\0338"); /* restore cursor position */
-		sixel_encode(get_current_frame(&img), get_image_width(&img), get_image_height(&img), get_image_channel(&img), sixel_dither, sixel_context);
-		usleep(get_current_delay(&img) * 10000); /* gif delay 1 == 1/100 sec */
-		increment_frame(&img);
+		sixel_encode(get_current_frame(&frame), get_image_width(&frame), get_image_height(&frame),
+			get_image_channel(&frame), sixel_dither, sixel_context);
+		fflush(stdout);
+		usleep(get_current_delay(&frame) * 10000); /* gif delay 1 == 1/100 sec */
+		free_image(&frame);
 	}
 
 	/* cleanup resource */
-	cleanup(sixel_dither, sixel_context, &img);
+	cleanup(sixel_dither, sixel_context, &img, &frame);
 	return EXIT_SUCCESS;
 
 error_occured:
-	cleanup(sixel_dither, sixel_context, &img);
+	cleanup(sixel_dither, sixel_context, &img, &frame);
 	return EXIT_FAILURE;;
 }
@@ -24,6 +24,8 @@
       - stbi__jpeg_huff_decode from memory or through FILE (define STBI_NO_STDIO to remove code)
       - stbi__jpeg_huff_decode from arbitrary I/O callbacks
       - overridable dequantizing-IDCT, YCbCr-to-RGB conversion (define STBI_SIMD)
+      - SSE2/NEON IDCT, upsampling and YCbCr-to-RGB when the compiler targets
+        them (define STBI_NO_SIMD to remove, STBI_SSE2/STBI_NEON to force)
 
    Latest revisions:
       1.37 (2014-06-04) remove duplicate typedef
@@ -301,6 +303,11 @@ STBIDEF void stbi_set_unpremultiply_on_load(int flag_true_if_should_unpremultipl
 // or just pass them through "as-is"
 STBIDEF void stbi_convert_iphone_png_to_rgb(int flag_true_if_should_convert);
 
+// decode jpegs at 1/denom of their size (denom = 1, 2, 4 or 8). the reduced
+// image is produced per 8x8 block while decoding, so 1/8 only needs the DC
+// coefficient and the full size image is never allocated
+STBIDEF void stbi_set_jpeg_scale_denom(int denom);
+
 
 // ZLIB client - used by PNG, available for other purposes
 
@@ -358,6 +365,21 @@ STBIDEF void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
 #include <stdarg.h>
 #include <stddef.h> // ptrdiff_t on osx
 
+#if !defined(STBI_NO_SIMD) && !defined(STBI_SIMD) && !defined(STBI_SSE2) && !defined(STBI_NEON)
+   #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+   #define STBI_SSE2
+   #elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+   #define STBI_NEON
+   #endif
+#endif
+
+#ifdef STBI_SSE2
+#include <emmintrin.h>
+#endif
+#ifdef STBI_NEON
+#include <arm_neon.h>
+#endif
+
 #ifndef _MSC_VER
    #ifdef __cplusplus
    #define stbi_inline inline
@@ -1016,6 +1038,7 @@ typedef struct
       int dc_pred;
 
       int x,y,w2,h2;
+      int scale;   // log2 of this component's block reduction (<= stbi__jpeg.scale)
       stbi_uc *data;
       void *raw_data;
       stbi_uc *linebuf;
@@ -1028,6 +1051,7 @@ typedef struct
 
    int scan_n, order[4];
    int restart_interval, todo;
+   int scale;   // log2 of the reduction factor; blocks are (8 >> scale) pixels wide
 } stbi__jpeg;
 
 static int stbi__build_huffman(stbi__huffman *h, int *count)
@@ -1340,6 +1364,284 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64], stbi_
    }
 }
 
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+// SIMD IDCT: 8 columns (then 8 rows) at once with the integer arithmetic of
+// stbi__idct_block, so the output is the same. STBI__IDCT_1D is expanded to a
+// sum of products per output; they are exact in 32 bits as long as the inputs
+// of each pass fit in 16 bits, blocks where they don't (only from broken data)
+// go to stbi__idct_block.
+
+// coefficients of s1, s3, s5, s7 in t0..t3 of STBI__IDCT_1D
+#define STBI__ODD_A   stbi__f2f( 1.175875602f)
+#define STBI__ODD_C1  stbi__f2f(-0.899976223f)
+#define STBI__ODD_C2  stbi__f2f(-2.562915447f)
+#define STBI__ODD_C3  stbi__f2f(-1.961570560f)
+#define STBI__ODD_C4  stbi__f2f(-0.390180644f)
+#define STBI__T0_S7   (stbi__f2f(0.298631336f) + STBI__ODD_A + STBI__ODD_C1 + STBI__ODD_C3)
+#define STBI__T0_S5   (STBI__ODD_A)
+#define STBI__T0_S3   (STBI__ODD_A + STBI__ODD_C3)
+#define STBI__T0_S1   (STBI__ODD_A + STBI__ODD_C1)
+#define STBI__T1_S7   (STBI__ODD_A)
+#define STBI__T1_S5   (stbi__f2f(2.053119869f) + STBI__ODD_A + STBI__ODD_C2 + STBI__ODD_C4)
+#define STBI__T1_S3   (STBI__ODD_A + STBI__ODD_C2)
+#define STBI__T1_S1   (STBI__ODD_A + STBI__ODD_C4)
+#define STBI__T2_S7   (STBI__ODD_A + STBI__ODD_C3)
+#define STBI__T2_S5   (STBI__ODD_A + STBI__ODD_C2)
+#define STBI__T2_S3   (stbi__f2f(3.072711026f) + STBI__ODD_A + STBI__ODD_C2 + STBI__ODD_C3)
+#define STBI__T2_S1   (STBI__ODD_A)
+#define STBI__T3_S7   (STBI__ODD_A + STBI__ODD_C1)
+#define STBI__T3_S5   (STBI__ODD_A + STBI__ODD_C4)
+#define STBI__T3_S3   (STBI__ODD_A)
+#define STBI__T3_S1   (stbi__f2f(1.501321110f) + STBI__ODD_A + STBI__ODD_C1 + STBI__ODD_C4)
+// and of s2, s6 in the even part
+#define STBI__T2_S2   stbi__f2f(0.5411961f)
+#define STBI__T2_S6   (stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f))
+#define STBI__T3_S2   (stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f))
+#define STBI__T3_S6   stbi__f2f(0.5411961f)
+#endif
+
+#ifdef STBI_SSE2
+// a*k0 + b*k1 for the 8 lanes, as two vectors of 4 ints
+static void stbi__madd_sse2(__m128i out[2], __m128i a, __m128i b, short k0, short k1)
+{
+   __m128i k = _mm_set_epi16(k1,k0,k1,k0,k1,k0,k1,k0);
+   out[0] = _mm_madd_epi16(_mm_unpacklo_epi16(a, b), k);
+   out[1] = _mm_madd_epi16(_mm_unpackhi_epi16(a, b), k);
+}
+
+static void stbi__add2_sse2(__m128i out[2], const __m128i a[2], const __m128i b[2])
+{
+   out[0] = _mm_add_epi32(a[0], b[0]);
+   out[1] = _mm_add_epi32(a[1], b[1]);
+}
+
+// (x + t + bias) >> shift and (x - t + bias) >> shift, saturated to 16 bits;
+// bits of a result that didn't fit are or'ed into *bad
+static void stbi__butterfly_sse2(__m128i *sum, __m128i *diff, const __m128i x[2], const __m128i t[2],
+                                 __m128i bias, int shift, __m128i *bad)
+{
+   __m128i r[4], range = _mm_set1_epi32(0x8000);
+   int i;
+   r[0] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(x[0], t[0]), bias), shift);
+   r[1] = _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(x[1], t[1]), bias), shift);
+   r[2] = _mm_srai_epi32(_mm_add_epi32(_mm_sub_epi32(x[0], t[0]), bias), shift);
+   r[3] = _mm_srai_epi32(_mm_add_epi32(_mm_sub_epi32(x[1], t[1]), bias), shift);
+   for (i=0; i < 4; ++i)
+      *bad = _mm_or_si128(*bad, _mm_srli_epi32(_mm_add_epi32(r[i], range), 16));
+   *sum  = _mm_packs_epi32(r[0], r[1]);
+   *diff = _mm_packs_epi32(r[2], r[3]);
+}
+
+// one pass of STBI__IDCT_1D over 8 vectors, lane i of s[k] is input k of the i-th 1-D IDCT
+static void stbi__idct_pass_sse2(__m128i s[8], int bias, int shift, __m128i *bad)
+{
+   __m128i t0[2], t1[2], t2[2], t3[2], x0[2], x1[2], x2[2], x3[2], p[2], q[2];
+   __m128i b = _mm_set1_epi32(bias);
+
+   // even part
+   stbi__madd_sse2(t2, s[2], s[6], STBI__T2_S2, STBI__T2_S6);
+   stbi__madd_sse2(t3, s[2], s[6], STBI__T3_S2, STBI__T3_S6);
+   stbi__madd_sse2(t0, s[0], s[4], 4096,  4096);
+   stbi__madd_sse2(t1, s[0], s[4], 4096, -4096);
+   stbi__add2_sse2(x0, t0, t3);
+   x3[0] = _mm_sub_epi32(t0[0], t3[0]); x3[1] = _mm_sub_epi32(t0[1], t3[1]);
+   stbi__add2_sse2(x1, t1, t2);
+   x2[0] = _mm_sub_epi32(t1[0], t2[0]); x2[1] = _mm_sub_epi32(t1[1], t2[1]);
+
+   // odd part
+   stbi__madd_sse2(p, s[7], s[5], STBI__T0_S7, STBI__T0_S5);
+   stbi__madd_sse2(q, s[3], s[1], STBI__T0_S3, STBI__T0_S1);
+   stbi__add2_sse2(t0, p, q);
+   stbi__madd_sse2(p, s[7], s[5], STBI__T1_S7, STBI__T1_S5);
+   stbi__madd_sse2(q, s[3], s[1], STBI__T1_S3, STBI__T1_S1);
+   stbi__add2_sse2(t1, p, q);
+   stbi__madd_sse2(p, s[7], s[5], STBI__T2_S7, STBI__T2_S5);
+   stbi__madd_sse2(q, s[3], s[1], STBI__T2_S3, STBI__T2_S1);
+   stbi__add2_sse2(t2, p, q);
+   stbi__madd_sse2(p, s[7], s[5], STBI__T3_S7, STBI__T3_S5);
+   stbi__madd_sse2(q, s[3], s[1], STBI__T3_S3, STBI__T3_S1);
+   stbi__add2_sse2(t3, p, q);
+
+   stbi__butterfly_sse2(&s[0], &s[7], x0, t3, b, shift, bad);
+   stbi__butterfly_sse2(&s[1], &s[6], x1, t2, b, shift, bad);
+   stbi__butterfly_sse2(&s[2], &s[5], x2, t1, b, shift, bad);
+   stbi__butterfly_sse2(&s[3], &s[4], x3, t0, b, shift, bad);
+}
+
+static void stbi__transpose_sse2(__m128i r[8])
+{
+   __m128i a0 = _mm_unpacklo_epi16(r[0], r[1]), a1 = _mm_unpackhi_epi16(r[0], r[1]);
+   __m128i a2 = _mm_unpacklo_epi16(r[2], r[3]), a3 = _mm_unpackhi_epi16(r[2], r[3]);
+   __m128i a4 = _mm_unpacklo_epi16(r[4], r[5]), a5 = _mm_unpackhi_epi16(r[4], r[5]);
+   __m128i a6 = _mm_unpacklo_epi16(r[6], r[7]), a7 = _mm_unpackhi_epi16(r[6], r[7]);
+   __m128i b0 = _mm_unpacklo_epi32(a0, a2), b1 = _mm_unpackhi_epi32(a0, a2);
+   __m128i b2 = _mm_unpacklo_epi32(a1, a3), b3 = _mm_unpackhi_epi32(a1, a3);
+   __m128i b4 = _mm_unpacklo_epi32(a4, a6), b5 = _mm_unpackhi_epi32(a4, a6);
+   __m128i b6 = _mm_unpacklo_epi32(a5, a7), b7 = _mm_unpackhi_epi32(a5, a7);
+   r[0] = _mm_unpacklo_epi64(b0, b4); r[1] = _mm_unpackhi_epi64(b0, b4);
+   r[2] = _mm_unpacklo_epi64(b1, b5); r[3] = _mm_unpackhi_epi64(b1, b5);
+   r[4] = _mm_unpacklo_epi64(b2, b6); r[5] = _mm_unpackhi_epi64(b2, b6);
+   r[6] = _mm_unpacklo_epi64(b3, b7); r[7] = _mm_unpackhi_epi64(b3, b7);
+}
+
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   __m128i row[8], zero = _mm_setzero_si128(), bad = zero;
+   int i;
+
+   // dequantize, the products must fit in 16 bits
+   for (i=0; i < 8; ++i) {
+      __m128i d = _mm_loadu_si128((const __m128i *) (data + i*8));
+      __m128i q = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (dequantize + i*8)), zero);
+      row[i] = _mm_mullo_epi16(d, q);
+      bad = _mm_or_si128(bad, _mm_xor_si128(_mm_mulhi_epi16(d, q), _mm_srai_epi16(row[i], 15)));
+   }
+
+   // columns, keeping 2 extra bits like stbi__idct_block
+   stbi__idct_pass_sse2(row, 512, 10, &bad);
+   if (_mm_movemask_epi8(_mm_cmpeq_epi8(bad, zero)) != 0xffff) {
+      stbi__idct_block(out, out_stride, data, dequantize);
+      return;
+   }
+
+   // rows, +128 and rounding folded into the bias; saturation does the clamp
+   stbi__transpose_sse2(row);
+   stbi__idct_pass_sse2(row, 65536 + (128<<17), 17, &bad);
+   stbi__transpose_sse2(row);
+
+   for (i=0; i < 8; i += 2) {
+      __m128i p = _mm_packus_epi16(row[i], row[i+1]);
+      _mm_storel_epi64((__m128i *) (out + i*out_stride), p);
+      _mm_storel_epi64((__m128i *) (out + (i+1)*out_stride), _mm_srli_si128(p, 8));
+   }
+}
+#endif // STBI_SSE2
+
+#ifdef STBI_NEON
+// sum of the 4 products, exact as 32-bit lanes (low and high halves of the inputs)
+static void stbi__mac4_neon(int32x4_t out[2], int16x8_t a, int16x8_t b, int16x8_t c, int16x8_t d,
+                            short ka, short kb, short kc, short kd)
+{
+   int32x4_t lo = vmull_n_s16(vget_low_s16(a), ka);
+   int32x4_t hi = vmull_n_s16(vget_high_s16(a), ka);
+   lo = vmlal_n_s16(lo, vget_low_s16(b), kb); hi = vmlal_n_s16(hi, vget_high_s16(b), kb);
+   lo = vmlal_n_s16(lo, vget_low_s16(c), kc); hi = vmlal_n_s16(hi, vget_high_s16(c), kc);
+   lo = vmlal_n_s16(lo, vget_low_s16(d), kd); hi = vmlal_n_s16(hi, vget_high_s16(d), kd);
+   out[0] = lo;
+   out[1] = hi;
+}
+
+static void stbi__mac2_neon(int32x4_t out[2], int16x8_t a, int16x8_t b, short ka, short kb)
+{
+   out[0] = vmlal_n_s16(vmull_n_s16(vget_low_s16(a), ka), vget_low_s16(b), kb);
+   out[1] = vmlal_n_s16(vmull_n_s16(vget_high_s16(a), ka), vget_high_s16(b), kb);
+}
+
+// narrow (v + bias) >> shift to 16 bits; lanes that didn't fit are flagged in *bad
+static int16x8_t stbi__narrow_neon(int32x4_t lo, int32x4_t hi, int32x4_t bias, int shift, uint32x4_t *bad)
+{
+   int32x4_t shl = vdupq_n_s32(-shift);
+   int16x4_t l, h;
+   lo = vshlq_s32(vaddq_s32(lo, bias), shl);
+   hi = vshlq_s32(vaddq_s32(hi, bias), shl);
+   l = vqmovn_s32(lo);
+   h = vqmovn_s32(hi);
+   *bad = vorrq_u32(*bad, vmvnq_u32(vceqq_s32(vmovl_s16(l), lo)));
+   *bad = vorrq_u32(*bad, vmvnq_u32(vceqq_s32(vmovl_s16(h), hi)));
+   return vcombine_s16(l, h);
+}
+
+static void stbi__idct_pass_neon(int16x8_t s[8], int bias, int shift, uint32x4_t *bad)
+{
+   int32x4_t t0[2], t1[2], t2[2], t3[2], x[2], b = vdupq_n_s32(bias);
+
+   // odd part
+   stbi__mac4_neon(t0, s[7], s[5], s[3], s[1], STBI__T0_S7, STBI__T0_S5, STBI__T0_S3, STBI__T0_S1);
+   stbi__mac4_neon(t1, s[7], s[5], s[3], s[1], STBI__T1_S7, STBI__T1_S5, STBI__T1_S3, STBI__T1_S1);
+   stbi__mac4_neon(t2, s[7], s[5], s[3], s[1], STBI__T2_S7, STBI__T2_S5, STBI__T2_S3, STBI__T2_S1);
+   stbi__mac4_neon(t3, s[7], s[5], s[3], s[1], STBI__T3_S7, STBI__T3_S5, STBI__T3_S3, STBI__T3_S1);
+
+   // even part, one output pair at a time: s[] is overwritten
+   {
+      int32x4_t e0[2], e1[2], e2[2], e3[2];
+      stbi__mac2_neon(e2, s[2], s[6], STBI__T2_S2, STBI__T2_S6);
+      stbi__mac2_neon(e3, s[2], s[6], STBI__T3_S2, STBI__T3_S6);
+      stbi__mac2_neon(e0, s[0], s[4], 4096,  4096);
+      stbi__mac2_neon(e1, s[0], s[4], 4096, -4096);
+
+      x[0] = vaddq_s32(e0[0], e3[0]); x[1] = vaddq_s32(e0[1], e3[1]); // x0
+      s[0] = stbi__narrow_neon(vaddq_s32(x[0], t3[0]), vaddq_s32(x[1], t3[1]), b, shift, bad);
+      s[7] = stbi__narrow_neon(vsubq_s32(x[0], t3[0]), vsubq_s32(x[1], t3[1]), b, shift, bad);
+      x[0] = vaddq_s32(e1[0], e2[0]); x[1] = vaddq_s32(e1[1], e2[1]); // x1
+      s[1] = stbi__narrow_neon(vaddq_s32(x[0], t2[0]), vaddq_s32(x[1], t2[1]), b, shift, bad);
+      s[6] = stbi__narrow_neon(vsubq_s32(x[0], t2[0]), vsubq_s32(x[1], t2[1]), b, shift, bad);
+      x[0] = vsubq_s32(e1[0], e2[0]); x[1] = vsubq_s32(e1[1], e2[1]); // x2
+      s[2] = stbi__narrow_neon(vaddq_s32(x[0], t1[0]), vaddq_s32(x[1], t1[1]), b, shift, bad);
+      s[5] = stbi__narrow_neon(vsubq_s32(x[0], t1[0]), vsubq_s32(x[1], t1[1]), b, shift, bad);
+      x[0] = vsubq_s32(e0[0], e3[0]); x[1] = vsubq_s32(e0[1], e3[1]); // x3
+      s[3] = stbi__narrow_neon(vaddq_s32(x[0], t0[0]), vaddq_s32(x[1], t0[1]), b, shift, bad);
+      s[4] = stbi__narrow_neon(vsubq_s32(x[0], t0[0]), vsubq_s32(x[1], t0[1]), b, shift, bad);
+   }
+}
+
+static void stbi__transpose_neon(int16x8_t r[8])
+{
+   int16x8x2_t a0 = vtrnq_s16(r[0], r[1]), a1 = vtrnq_s16(r[2], r[3]);
+   int16x8x2_t a2 = vtrnq_s16(r[4], r[5]), a3 = vtrnq_s16(r[6], r[7]);
+   int32x4x2_t b0 = vtrnq_s32(vreinterpretq_s32_s16(a0.val[0]), vreinterpretq_s32_s16(a1.val[0]));
+   int32x4x2_t b1 = vtrnq_s32(vreinterpretq_s32_s16(a0.val[1]), vreinterpretq_s32_s16(a1.val[1]));
+   int32x4x2_t b2 = vtrnq_s32(vreinterpretq_s32_s16(a2.val[0]), vreinterpretq_s32_s16(a3.val[0]));
+   int32x4x2_t b3 = vtrnq_s32(vreinterpretq_s32_s16(a2.val[1]), vreinterpretq_s32_s16(a3.val[1]));
+   r[0] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b0.val[0]), vget_low_s32(b2.val[0])));
+   r[1] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b1.val[0]), vget_low_s32(b3.val[0])));
+   r[2] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b0.val[1]), vget_low_s32(b2.val[1])));
+   r[3] = vreinterpretq_s16_s32(vcombine_s32(vget_low_s32(b1.val[1]), vget_low_s32(b3.val[1])));
+   r[4] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b0.val[0]), vget_high_s32(b2.val[0])));
+   r[5] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b1.val[0]), vget_high_s32(b3.val[0])));
+   r[6] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b0.val[1]), vget_high_s32(b2.val[1])));
+   r[7] = vreinterpretq_s16_s32(vcombine_s32(vget_high_s32(b1.val[1]), vget_high_s32(b3.val[1])));
+}
+
+static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64], stbi_dequantize_t *dequantize)
+{
+   int16x8_t row[8];
+   uint32x4_t bad = vdupq_n_u32(0);
+   int i;
+
+   // dequantize, the products must fit in 16 bits
+   for (i=0; i < 8; ++i) {
+      int16x8_t d = vld1q_s16(data + i*8);
+      int16x8_t q = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(dequantize + i*8)));
+      int32x4_t lo = vmull_s16(vget_low_s16(d), vget_low_s16(q));
+      int32x4_t hi = vmull_s16(vget_high_s16(d), vget_high_s16(q));
+      row[i] = vcombine_s16(vmovn_s32(lo), vmovn_s32(hi));
+      bad = vorrq_u32(bad, vmvnq_u32(vceqq_s32(vmovl_s16(vget_low_s16(row[i])), lo)));
+      bad = vorrq_u32(bad, vmvnq_u32(vceqq_s32(vmovl_s16(vget_high_s16(row[i])), hi)));
+   }
+
+   // columns, keeping 2 extra bits like stbi__idct_block
+   stbi__idct_pass_neon(row, 512, 10, &bad);
+   if (vgetq_lane_u32(bad, 0) | vgetq_lane_u32(bad, 1) | vgetq_lane_u32(bad, 2) | vgetq_lane_u32(bad, 3)) {
+      stbi__idct_block(out, out_stride, data, dequantize);
+      return;
+   }
+
+   // rows, +128 and rounding folded into the bias; saturation does the clamp
+   stbi__transpose_neon(row);
+   stbi__idct_pass_neon(row, 65536 + (128<<17), 17, &bad);
+   stbi__transpose_neon(row);
+
+   for (i=0; i < 8; ++i)
+      vst1_u8(out + i*out_stride, vqmovun_s16(row[i]));
+}
+#endif // STBI_NEON
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+#define stbi__idct_fast stbi__idct_simd
+#else
+#define stbi__idct_fast stbi__idct_block
+#endif
+
 #ifdef STBI_SIMD
 static stbi_idct_8x8 stbi__idct_installed = stbi__idct_block;
 
@@ -1349,6 +1651,45 @@ STBIDEF void stbi_install_idct(stbi_idct_8x8 func)
 }
 #endif
 
+static int stbi__jpeg_scale = 0;
+
+STBIDEF void stbi_set_jpeg_scale_denom(int denom)
+{
+   stbi__jpeg_scale = (denom >= 8) ? 3 : (denom >= 4) ? 2 : (denom >= 2) ? 1 : 0;
+}
+
+// idct a block into (8 >> scale) x (8 >> scale) pixels
+static void stbi__idct_block_reduced(stbi__jpeg *z, stbi_uc *out, int out_stride, short data[64], int tq, int scale)
+{
+   int i,j,x,y,sum;
+   int bs = 8 >> scale;
+   int round = 1 << (2*scale - 1);
+   stbi_uc tmp[64];
+
+   if (scale == 3) {
+      // only the DC term survives: it is 8 times the block average
+      int dc = data[0] * z->dequant[tq][0];
+      out[0] = stbi__clamp(((dc + (dc >= 0 ? 4 : -4)) / 8) + 128);
+      return;
+   }
+
+   #ifdef STBI_SIMD
+   stbi__idct_installed(tmp, 8, data, z->dequant2[tq]);
+   #else
+   stbi__idct_fast(tmp, 8, data, z->dequant[tq]);
+   #endif
+
+   for (y=0; y < bs; ++y) {
+      for (x=0; x < bs; ++x) {
+         sum = round;
+         for (j=0; j < (1 << scale); ++j)
+            for (i=0; i < (1 << scale); ++i)
+               sum += tmp[((y << scale) + j)*8 + (x << scale) + i];
+         out[y*out_stride + x] = (stbi_uc) (sum >> (2*scale));
+      }
+   }
+}
+
 #define STBI__MARKER_none  0xff
 // if there's a pending marker from the entropy stream, return that
 // otherwise, fetch from the stream and get a marker. if there's no
@@ -1401,10 +1742,14 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
       for (j=0; j < h; ++j) {
          for (i=0; i < w; ++i) {
             if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+            if (z->img_comp[n].scale) {
+               int bs = 8 >> z->img_comp[n].scale;
+               stbi__idct_block_reduced(z, z->img_comp[n].data+z->img_comp[n].w2*j*bs+i*bs, z->img_comp[n].w2, data, z->img_comp[n].tq, z->img_comp[n].scale);
+            } else
             #ifdef STBI_SIMD
             stbi__idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
             #else
-            stbi__idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+            stbi__idct_fast(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
             #endif
             // every data block is an MCU, so countdown the restart interval
             if (--z->todo <= 0) {
@@ -1431,10 +1776,13 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                      int x2 = (i*z->img_comp[n].h + x)*8;
                      int y2 = (j*z->img_comp[n].v + y)*8;
                      if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+                     if (z->img_comp[n].scale)
+                        stbi__idct_block_reduced(z, z->img_comp[n].data+z->img_comp[n].w2*(y2 >> z->img_comp[n].scale)+(x2 >> z->img_comp[n].scale), z->img_comp[n].w2, data, z->img_comp[n].tq, z->img_comp[n].scale);
+                     else
                      #ifdef STBI_SIMD
                      stbi__idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
                      #else
-                     stbi__idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+                     stbi__idct_fast(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
                      #endif
                   }
                }
@@ -1602,8 +1950,15 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       // the bogus oversized data from using interleaved MCUs and their
       // big blocks (stbi__err.g. a 16x16 iMCU on an image of width 33); we won't
       // discard the extra data until colorspace conversion
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      // subsampled components are reduced less, so they keep the detail
+      // that upsampling would otherwise have to invent
+      z->img_comp[i].scale = z->scale;
+      while (z->img_comp[i].scale > 0
+         && h_max % (z->img_comp[i].h << (z->scale - z->img_comp[i].scale + 1)) == 0
+         && v_max % (z->img_comp[i].v << (z->scale - z->img_comp[i].scale + 1)) == 0)
+         --z->img_comp[i].scale;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * (8 >> z->img_comp[i].scale);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * (8 >> z->img_comp[i].scale);
       z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
       if (z->img_comp[i].raw_data == NULL) {
          for(--i; i >= 0; --i) {
@@ -1808,6 +2163,238 @@ STBIDEF void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func)
 }
 #endif
 
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+// SIMD versions of the 2x upsamplers and the color conversion above; same
+// arithmetic (the 16-bit sums and 32-bit products can't overflow), so the
+// same output. the edges and the tail of a row are left to the C versions.
+
+static stbi_uc *stbi__resample_row_v_2_simd(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i = 0;
+#ifdef STBI_SSE2
+   __m128i zero = _mm_setzero_si128(), two = _mm_set1_epi16(2);
+   for (; i+8 <= w; i += 8) {
+      __m128i n = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i)), zero);
+      __m128i f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far + i)), zero);
+      __m128i t = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(n, 1), n), _mm_add_epi16(f, two));
+      _mm_storel_epi64((__m128i *) (out + i), _mm_packus_epi16(_mm_srli_epi16(t, 2), zero));
+   }
+#else
+   for (; i+8 <= w; i += 8) {
+      uint16x8_t t = vmlal_u8(vaddw_u8(vdupq_n_u16(2), vld1_u8(in_far + i)), vld1_u8(in_near + i), vdup_n_u8(3));
+      vst1_u8(out + i, vshrn_n_u16(t, 2));
+   }
+#endif
+   stbi__resample_row_v_2(out + i, in_near + i, in_far + i, w - i, hs);
+   return out;
+}
+
+static stbi_uc *stbi__resample_row_h_2_simd(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i;
+   stbi_uc *input = in_near;
+
+   if (w < 10)
+      return stbi__resample_row_h_2(out, in_near, in_far, w, hs);
+
+   out[0] = input[0];
+   out[1] = stbi__div4(input[0]*3 + input[1] + 2);
+   // 8 inputs at a time, reading one on each side
+   for (i=1; i+9 <= w; i += 8) {
+#ifdef STBI_SSE2
+      __m128i zero = _mm_setzero_si128();
+      __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (input + i)), zero);
+      __m128i p = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (input + i-1)), zero);
+      __m128i x = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (input + i+1)), zero);
+      __m128i n = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(c, 1), c), _mm_set1_epi16(2));
+      __m128i even = _mm_srli_epi16(_mm_add_epi16(n, p), 2);
+      __m128i odd  = _mm_srli_epi16(_mm_add_epi16(n, x), 2);
+      __m128i lo = _mm_unpacklo_epi16(even, odd), hi = _mm_unpackhi_epi16(even, odd);
+      _mm_storeu_si128((__m128i *) (out + i*2), _mm_packus_epi16(lo, hi));
+#else
+      uint16x8_t n = vmlal_u8(vdupq_n_u16(2), vld1_u8(input + i), vdup_n_u8(3));
+      uint8x8x2_t o;
+      o.val[0] = vshrn_n_u16(vaddw_u8(n, vld1_u8(input + i-1)), 2);
+      o.val[1] = vshrn_n_u16(vaddw_u8(n, vld1_u8(input + i+1)), 2);
+      vst2_u8(out + i*2, o);
+#endif
+   }
+   for (; i < w-1; ++i) {
+      int n = 3*input[i]+2;
+      out[i*2+0] = stbi__div4(n+input[i-1]);
+      out[i*2+1] = stbi__div4(n+input[i+1]);
+   }
+   out[i*2+0] = stbi__div4(input[w-2]*3 + input[w-1] + 2);
+   out[i*2+1] = input[w-1];
+
+   STBI_NOTUSED(in_far);
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+
+static stbi_uc *stbi__resample_row_hv_2_simd(stbi_uc *out, stbi_uc *in_near, stbi_uc *in_far, int w, int hs)
+{
+   int i,t0,t1;
+
+   if (w < 10)
+      return stbi__resample_row_hv_2(out, in_near, in_far, w, hs);
+
+   t1 = 3*in_near[0] + in_far[0];
+   out[0] = stbi__div4(t1+2);
+   out[1] = stbi__div16(3*t1 + 3*in_near[1] + in_far[1] + 8);
+   // 8 inputs at a time, needing the vertical sums one on each side
+   for (i=1; i+9 <= w; i += 8) {
+#ifdef STBI_SSE2
+      __m128i zero = _mm_setzero_si128(), eight = _mm_set1_epi16(8);
+      __m128i n, f, p, c, x, even, odd;
+      n = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i-1)), zero);
+      f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far + i-1)), zero);
+      p = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(n, 1), n), f);
+      n = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i)), zero);
+      f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far + i)), zero);
+      c = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(n, 1), n), f);
+      n = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i+1)), zero);
+      f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far + i+1)), zero);
+      x = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(n, 1), n), f);
+      c = _mm_add_epi16(_mm_add_epi16(_mm_slli_epi16(c, 1), c), eight);
+      even = _mm_srli_epi16(_mm_add_epi16(c, p), 4);
+      odd  = _mm_srli_epi16(_mm_add_epi16(c, x), 4);
+      _mm_storeu_si128((__m128i *) (out + i*2),
+                       _mm_packus_epi16(_mm_unpacklo_epi16(even, odd), _mm_unpackhi_epi16(even, odd)));
+#else
+      uint8x8_t three = vdup_n_u8(3);
+      uint16x8_t p = vmlal_u8(vmovl_u8(vld1_u8(in_far + i-1)), vld1_u8(in_near + i-1), three);
+      uint16x8_t c = vmlal_u8(vmovl_u8(vld1_u8(in_far + i  )), vld1_u8(in_near + i  ), three);
+      uint16x8_t x = vmlal_u8(vmovl_u8(vld1_u8(in_far + i+1)), vld1_u8(in_near + i+1), three);
+      uint8x8x2_t o;
+      c = vmlaq_n_u16(vdupq_n_u16(8), c, 3);
+      o.val[0] = vshrn_n_u16(vaddq_u16(c, p), 4);
+      o.val[1] = vshrn_n_u16(vaddq_u16(c, x), 4);
+      vst2_u8(out + i*2, o);
+#endif
+   }
+   t1 = 3*in_near[i-1] + in_far[i-1];
+   for (; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = stbi__div16(3*t0 + t1 + 8);
+      out[i*2  ] = stbi__div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = stbi__div4(t1+2);
+
+   STBI_NOTUSED(hs);
+
+   return out;
+}
+
+static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step)
+{
+   // the constants are split as k = (k >> 2)*4 + (k & 3) to fit in 16 bits
+   const int kr = float2fixed(1.40200f), kg1 = float2fixed(0.71414f);
+   const int kg2 = float2fixed(0.34414f), kb = float2fixed(1.77200f);
+   int i = 0;
+#ifdef STBI_SSE2
+   __m128i zero = _mm_setzero_si128(), c128 = _mm_set1_epi16(128), round = _mm_set1_epi32(32768);
+   __m128i mr  = _mm_set_epi16(kr & 3, kr >> 2, kr & 3, kr >> 2, kr & 3, kr >> 2, kr & 3, kr >> 2);
+   __m128i mg1 = _mm_set_epi16(-(kg1 & 3), -(kg1 >> 2), -(kg1 & 3), -(kg1 >> 2), -(kg1 & 3), -(kg1 >> 2), -(kg1 & 3), -(kg1 >> 2));
+   __m128i mg2 = _mm_set_epi16(-(kg2 & 3), -(kg2 >> 2), -(kg2 & 3), -(kg2 >> 2), -(kg2 & 3), -(kg2 >> 2), -(kg2 & 3), -(kg2 >> 2));
+   __m128i mb  = _mm_set_epi16(kb & 3, kb >> 2, kb & 3, kb >> 2, kb & 3, kb >> 2, kb & 3, kb >> 2);
+   stbi_uc tmp[32];
+   for (; i+8 <= count; i += 8) {
+      __m128i yv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (y + i)), zero);
+      __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcr + i)), zero), c128);
+      __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcb + i)), zero), c128);
+      __m128i cr_lo = _mm_unpacklo_epi16(_mm_slli_epi16(cr, 2), cr), cr_hi = _mm_unpackhi_epi16(_mm_slli_epi16(cr, 2), cr);
+      __m128i cb_lo = _mm_unpacklo_epi16(_mm_slli_epi16(cb, 2), cb), cb_hi = _mm_unpackhi_epi16(_mm_slli_epi16(cb, 2), cb);
+      __m128i y_lo = _mm_add_epi32(_mm_unpacklo_epi16(zero, yv), round);
+      __m128i y_hi = _mm_add_epi32(_mm_unpackhi_epi16(zero, yv), round);
+      __m128i r, g, b, rg, ba, px0, px1;
+
+      r = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(y_lo, _mm_madd_epi16(cr_lo, mr)), 16),
+                          _mm_srai_epi32(_mm_add_epi32(y_hi, _mm_madd_epi16(cr_hi, mr)), 16));
+      g = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(y_lo, _mm_madd_epi16(cr_lo, mg1)), _mm_madd_epi16(cb_lo, mg2)), 16),
+                          _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(y_hi, _mm_madd_epi16(cr_hi, mg1)), _mm_madd_epi16(cb_hi, mg2)), 16));
+      b = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(y_lo, _mm_madd_epi16(cb_lo, mb)), 16),
+                          _mm_srai_epi32(_mm_add_epi32(y_hi, _mm_madd_epi16(cb_hi, mb)), 16));
+
+      // saturating packs clamp to 0..255, then interleave to RGBA
+      rg = _mm_packus_epi16(r, g);
+      ba = _mm_packus_epi16(b, _mm_set1_epi16(255));
+      rg = _mm_unpacklo_epi8(rg, _mm_srli_si128(rg, 8));
+      ba = _mm_unpacklo_epi8(ba, _mm_srli_si128(ba, 8));
+      px0 = _mm_unpacklo_epi16(rg, ba);
+      px1 = _mm_unpackhi_epi16(rg, ba);
+      if (step == 4) {
+         _mm_storeu_si128((__m128i *) (out), px0);
+         _mm_storeu_si128((__m128i *) (out + 16), px1);
+         out += 32;
+      } else {
+         int k;
+         _mm_storeu_si128((__m128i *) (tmp), px0);
+         _mm_storeu_si128((__m128i *) (tmp + 16), px1);
+         for (k=0; k < 8; ++k) {
+            out[0] = tmp[k*4+0];
+            out[1] = tmp[k*4+1];
+            out[2] = tmp[k*4+2];
+            out += step;
+         }
+      }
+   }
+#else
+   int16x8_t c128 = vdupq_n_s16(128);
+   int32x4_t round = vdupq_n_s32(32768);
+   for (; i+8 <= count; i += 8) {
+      int16x8_t yv = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(y + i)));
+      int16x8_t cr = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pcr + i))), c128);
+      int16x8_t cb = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vld1_u8(pcb + i))), c128);
+      int32x4_t y_lo = vaddq_s32(vshlq_n_s32(vmovl_s16(vget_low_s16(yv)), 16), round);
+      int32x4_t y_hi = vaddq_s32(vshlq_n_s32(vmovl_s16(vget_high_s16(yv)), 16), round);
+      int32x4_t cr_lo = vmovl_s16(vget_low_s16(cr)), cr_hi = vmovl_s16(vget_high_s16(cr));
+      int32x4_t cb_lo = vmovl_s16(vget_low_s16(cb)), cb_hi = vmovl_s16(vget_high_s16(cb));
+      int16x8_t r, g, b;
+
+      r = vcombine_s16(vqmovn_s32(vshrq_n_s32(vmlaq_n_s32(y_lo, cr_lo, kr), 16)),
+                       vqmovn_s32(vshrq_n_s32(vmlaq_n_s32(y_hi, cr_hi, kr), 16)));
+      g = vcombine_s16(vqmovn_s32(vshrq_n_s32(vmlsq_n_s32(vmlsq_n_s32(y_lo, cr_lo, kg1), cb_lo, kg2), 16)),
+                       vqmovn_s32(vshrq_n_s32(vmlsq_n_s32(vmlsq_n_s32(y_hi, cr_hi, kg1), cb_hi, kg2), 16)));
+      b = vcombine_s16(vqmovn_s32(vshrq_n_s32(vmlaq_n_s32(y_lo, cb_lo, kb), 16)),
+                       vqmovn_s32(vshrq_n_s32(vmlaq_n_s32(y_hi, cb_hi, kb), 16)));
+
+      if (step == 4) {
+         uint8x8x4_t o;
+         o.val[0] = vqmovun_s16(r);
+         o.val[1] = vqmovun_s16(g);
+         o.val[2] = vqmovun_s16(b);
+         o.val[3] = vdup_n_u8(255);
+         vst4_u8(out, o);
+         out += 32;
+      } else {
+         uint8x8x3_t o;
+         o.val[0] = vqmovun_s16(r);
+         o.val[1] = vqmovun_s16(g);
+         o.val[2] = vqmovun_s16(b);
+         vst3_u8(out, o);
+         out += 24;
+      }
+   }
+#endif
+   stbi__YCbCr_to_RGB_row(out, y + i, pcb + i, pcr + i, count - i, step);
+}
+#endif // STBI_SSE2 || STBI_NEON
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+#define stbi__YCbCr_to_RGB_fast    stbi__YCbCr_to_RGB_simd
+#define stbi__resample_row_v_2_fast  stbi__resample_row_v_2_simd
+#define stbi__resample_row_h_2_fast  stbi__resample_row_h_2_simd
+#define stbi__resample_row_hv_2_fast stbi__resample_row_hv_2_simd
+#else
+#define stbi__YCbCr_to_RGB_fast    stbi__YCbCr_to_RGB_row
+#define stbi__resample_row_v_2_fast  stbi__resample_row_v_2
+#define stbi__resample_row_h_2_fast  stbi__resample_row_h_2
+#define stbi__resample_row_hv_2_fast stbi__resample_row_hv_2
+#endif
+
 
 // clean up the temporary component buffers
 static void stbi__cleanup_jpeg(stbi__jpeg *j)
@@ -1838,6 +2425,7 @@ typedef struct
 static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
 {
    int n, decode_n;
+   unsigned int w, h;
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
    z->s->img_n = 0;
@@ -1845,6 +2433,10 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // load a jpeg image from whichever source
    if (!decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
+   // size of the (possibly reduced) output
+   w = (z->s->img_x + (1 << z->scale)-1) >> z->scale;
+   h = (z->s->img_y + (1 << z->scale)-1) >> z->scale;
+
    // determine actual number of components to generate
    n = req_comp ? req_comp : z->s->img_n;
 
@@ -1864,33 +2456,34 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 
       for (k=0; k < decode_n; ++k) {
          stbi__resample *r = &res_comp[k];
+         int f = z->scale - z->img_comp[k].scale; // component reduced less than the output
 
          // allocate line buffer big enough for upsampling off the edges
          // with upsample factor of 4
          z->img_comp[k].linebuf = (stbi_uc *) malloc(z->s->img_x + 3);
          if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
+         r->hs      = z->img_h_max / (z->img_comp[k].h << f);
+         r->vs      = z->img_v_max / (z->img_comp[k].v << f);
          r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+         r->w_lores = (w + r->hs-1) / r->hs;
          r->ypos    = 0;
          r->line0   = r->line1 = z->img_comp[k].data;
 
          if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = stbi__resample_row_hv_2;
+         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2_fast;
+         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2_fast;
+         else if (r->hs == 2 && r->vs == 2) r->resample = stbi__resample_row_hv_2_fast;
          else                               r->resample = stbi__resample_row_generic;
       }
 
       // can't error after this so, this is safe
-      output = (stbi_uc *) malloc(n * z->s->img_x * z->s->img_y + 1);
+      output = (stbi_uc *) malloc(n * w * h + 1);
       if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
+      for (j=0; j < h; ++j) {
+         stbi_uc *out = output + n * w * j;
          for (k=0; k < decode_n; ++k) {
             stbi__resample *r = &res_comp[k];
             int y_bot = r->ystep >= (r->vs >> 1);
@@ -1901,7 +2494,7 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
             if (++r->ystep >= r->vs) {
                r->ystep = 0;
                r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
+               if (++r->ypos < (z->img_comp[k].y + (1 << z->img_comp[k].scale)-1) >> z->img_comp[k].scale)
                   r->line1 += z->img_comp[k].w2;
             }
          }
@@ -1909,12 +2502,12 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
             stbi_uc *y = coutput[0];
             if (z->s->img_n == 3) {
                #ifdef STBI_SIMD
-               stbi__YCbCr_installed(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               stbi__YCbCr_installed(out, y, coutput[1], coutput[2], w, n);
                #else
-               stbi__YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s->img_x, n);
+               stbi__YCbCr_to_RGB_fast(out, y, coutput[1], coutput[2], w, n);
                #endif
             } else
-               for (i=0; i < z->s->img_x; ++i) {
+               for (i=0; i < w; ++i) {
                   out[0] = out[1] = out[2] = y[i];
                   out[3] = 255; // not used if n==3
                   out += n;
@@ -1922,14 +2515,14 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
          } else {
             stbi_uc *y = coutput[0];
             if (n == 1)
-               for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
+               for (i=0; i < w; ++i) out[i] = y[i];
             else
-               for (i=0; i < z->s->img_x; ++i) *out++ = y[i], *out++ = 255;
+               for (i=0; i < w; ++i) *out++ = y[i], *out++ = 255;
          }
       }
       stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
+      *out_x = w;
+      *out_y = h;
       if (comp) *comp  = z->s->img_n; // report original components, not output
       return output;
    }
@@ -1939,6 +2532,7 @@ static unsigned char *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *com
 {
    stbi__jpeg j;
    j.s = s;
+   j.scale = stbi__jpeg_scale;
    return load_jpeg_image(&j, x,y,comp,req_comp);
 }
 
@@ -84,6 +84,17 @@ void *ecalloc(size_t nmemb, size_t size)
 	return ptr;
 }
 
+void *erealloc(void *ptr, size_t size)
+{
+	void *new;
+	errno = 0;
+
+	if ((new = realloc(ptr, size)) == NULL)
+		logging(ERROR, "realloc: %s\n", strerror(errno));
+
+	return new;
+}
+
 long int estrtol(const char *nptr, char **endptr, int base)
 {
 	long int ret;
@@ -163,16 +174,17 @@ int estat(const char *restrict path, struct stat *restrict buf)
 
 	return ret;
 }
+*/
 
 void *emmap(void *addr, size_t len, int prot, int flag, int fd, off_t offset)
 {
-	uint32_t *fp;
+	void *ptr;
 	errno = 0;
 
-	if ((fp = (uint32_t *) mmap(addr, len, prot, flag, fd, offset)) == MAP_FAILED)
+	if ((ptr = mmap(addr, len, prot, flag, fd, offset)) == MAP_FAILED)
 		logging(ERROR, "mmap: %s\n", strerror(errno));
 
-	return fp;
+	return ptr;
 }
 
 int emunmap(void *ptr, size_t len)
@@ -185,7 +197,16 @@ int emunmap(void *ptr, size_t len)
 
 	return ret;
 }
-*/
+
+int epthread_create(pthread_t *thread, void *(*start_routine)(void *), void *arg)
+{
+	int ret;
+
+	if ((ret = pthread_create(thread, NULL, start_routine, arg)) != 0)
+		logging(ERROR, "pthread_create: %s\n", strerror(ret));
+
+	return ret;
+}
 
 /* some useful functions */
 int str2num(char *str)
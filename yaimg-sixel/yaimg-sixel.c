@@ -6,42 +6,9 @@
 #include "../sixel.h"
 #include "parsearg.h"
 
-uint8_t *crop_image_single(struct tty_t *tty, struct image *img, uint8_t *data,
-    int shift_x, int shift_y, int width, int height)
-{
-	int offset;
-	uint8_t r, g, b, *cropped_data;
-
-	if ((cropped_data = (uint8_t *) ecalloc(width * height, img->channel)) == NULL)
-		return NULL;
-
-	for (int y = 0; y < height; y++) {
-		if (y >= tty->height)
-			break;
-
-		for (int x = 0; x < width; x++) {
-			if (x >= tty->width)
-				break;
-
-			get_rgb(img, data, x + shift_x, y + shift_y, &r, &g, &b);
-
-			/* update copy buffer */
-			offset = img->channel * (y * width + x);
-			*(cropped_data + offset + 0) = r;
-			*(cropped_data + offset + 1) = g;
-			*(cropped_data + offset + 2) = b;
-		}
-	}
-	free(data);
-
-	img->width  = width;
-	img->height = height;
-
-	return cropped_data;
-}
-
-void crop_image(struct tty_t *tty, struct image *img,
-    int offset_x, int offset_y, int shift_x, int shift_y, int width, int height, bool crop_all)
+/* view port (rectangle of the image resized to width x height) that can be drawn on the terminal */
+void get_view_port(struct tty_t *tty, struct view_t *view, int offset_x, int offset_y,
+	int shift_x, int shift_y, int view_w, int view_h, int width, int height)
 {
 	/*
 		+- screen -----------------+
@@ -62,37 +29,74 @@ void crop_image(struct tty_t *tty, struct image *img,
 		|       v                      |
 		|       +- view port + ^       |
 		|<----->|            | |       |
-		|shift_x|            | | height|
+		|shift_x|            | | view_h|
 		|       |            | |       |
 		|       +------------+ v       |
-		|       <-  width ->           |
+		|       <-  view_w ->          |
 		+------------------------------+
 	*/
-	uint8_t *cropped_data;
+	view->x      = shift_x;
+	view->y      = shift_y;
+	view->width  = view_w ? view_w: width;
+	view->height = view_h ? view_h: height;
 
-	if (shift_x + width > img->width)
-		width = img->width - shift_x;
+	if (offset_x + view->width > tty->width)
+		view->width = tty->width - offset_x;
 
-	if (shift_y + height > img->height)
-		height = img->height - shift_y;
+	if (offset_y + view->height > tty->height)
+		view->height = tty->height - offset_y;
+}
 
-	if (offset_x + width > tty->width)
-		width = tty->width - offset_x;
+/* load image to be resized to width x height:
+	jpeg is decoded only the part under the view port, others are decoded whole */
+bool load_image_view(const char *file, struct image *img, int width, int height, struct view_t *view)
+{
+	int full_width, full_height;
+	bool ret;
+	FILE *fp;
+	struct input_t input;
+	struct view_t area = *view, source;
 
-	if (offset_y + height > tty->height)
-		height = tty->height - offset_y;
+	if ((fp = efopen(file, "r")) == NULL)
+		return false;
 
-	if (crop_all) {
-		for (int i = 0; i < img->frame_count; i++) {
-			if ((cropped_data = crop_image_single(tty, img, img->data[i],
-				shift_x, shift_y, width, height)) != NULL)
-				img->data[i] = cropped_data;
-		}
-	} else {
-		if ((cropped_data = crop_image_single(tty, img, img->data[img->current_frame],
-			shift_x, shift_y, width, height)) != NULL)
-			img->data[img->current_frame] = cropped_data;
+	if (!map_input(fp, &input)) {
+		logging(ERROR, "couldn't read input\n");
+		efclose(fp);
+		return false;
 	}
+	input.target_width  = width;
+	input.target_height = height;
+
+	if (check_filetype(&input) == TYPE_JPEG
+		&& get_jpeg_size(&input, &full_width, &full_height)
+		&& get_view_source(full_width, full_height, width, height, ENLARGE_BILINEAR, &area, &source))
+		ret = load_jpeg_part(&input, img, source.x, source.y, source.width, source.height);
+	else
+		ret = load_image_input(&input, img);
+
+	if (!ret)
+		logging(ERROR, "image load error: %s\n", file);
+
+	unmap_input(&input);
+	efclose(fp);
+
+	return ret;
+}
+
+/* part of image (jpeg) doesn't have the src pixels of the view port */
+bool need_reload(struct image *img, int width, int height, struct view_t *view)
+{
+	struct view_t area = *view, source;
+
+	if (img->full_width <= 0)
+		return false;
+
+	if (!get_view_source(img->full_width, img->full_height, width, height, ENLARGE_BILINEAR, &area, &source))
+		return false;
+
+	return source.x < img->part_x || source.x + source.width > img->part_x + img->width
+		|| source.y < img->part_y || source.y + source.height > img->part_y + img->height;
 }
 
 void w3m_draw(struct tty_t *tty, struct image imgs[], struct parm_t *parm, int op)
@@ -101,6 +105,7 @@ void w3m_draw(struct tty_t *tty, struct image imgs[], struct parm_t *parm, int o
 	char *file;
 	struct image *img;
 	struct sixel_t sixel;
+	struct view_t view;
 
 	logging(DEBUG, "w3m_%s()\n", (op == W3M_DRAW) ? "draw": "redraw");
 
@@ -127,12 +132,14 @@ void w3m_draw(struct tty_t *tty, struct image imgs[], struct parm_t *parm, int o
 	logging(DEBUG, "index:%d offset_x:%d offset_y:%d shift_x:%d shift_y:%d view_w:%d view_h:%d\n",
 		index, offset_x, offset_y, shift_x, shift_y, view_w, view_h);
 
+	get_view_port(tty, &view, offset_x, offset_y, shift_x, shift_y, view_w, view_h, width, height);
+
 	if (op == W3M_DRAW) {
 		if (get_current_frame(img)) { /* cleanup preloaded image */
 			free_image(img);
 			init_image(img);
 		}
-		if (load_image(file, img) == false)
+		if (load_image_view(file, img, width, height, &view) == false)
 			return;
 
 		if (!get_current_frame(img)) {
@@ -145,22 +152,24 @@ void w3m_draw(struct tty_t *tty, struct image imgs[], struct parm_t *parm, int o
 	//if (!img->already_drew) { /* op == W3M_REDRAW */
 	} else if (!img->already_drew) { /* op == W3M_REDRAW */
 		char buf[BUFSIZE];
-		int size;
-		struct image new = *img;
+		struct image new;
 
-		size = get_image_width(img) * get_image_height(img) * get_image_channel(img);
-		if ((new.data[0] = ecalloc(size, 1)) == NULL)
-			return;
-		memcpy(new.data[0], get_current_frame(img), size);
-		new.frame_count   = 1;
-		new.current_frame = 0;
+		/* jpeg loaded for another view port: decode the part under this view port */
+		if (need_reload(img, width, height, &view)) {
+			free_image(img);
+			init_image(img);
+			if (load_image_view(file, img, width, height, &view) == false)
+				return;
+		}
 
-		/* XXX: at first, we need to resize, then crop */
-		if (width != get_image_width(&new) || height != get_image_height(&new))
-			resize_image(&new, width, height, false);
+		if (!copy_frame(img, img->current_frame, &new))
+			return;
 
-		crop_image(tty, &new, offset_x, offset_y, shift_x, shift_y,
-			(view_w ? view_w: width), (view_h ? view_h: height), false);
+		/* resize and crop in one pass: only src pixels in the view port are resampled */
+		if (!view_image(&new, width, height, ENLARGE_BILINEAR, &view)) {
+			free_image(&new);
+			return;
+		}
 
 		/* cursor move */
 		snprintf(buf, BUFSIZE, "\033[%d;%dH",
@@ -206,7 +215,7 @@ void w3m_getsize(struct tty_t *tty, struct image *img, const char *file)
 		init_image(img);
 	}
 
-	if (load_image(file, img)) {
+	if (load_image(file, img, 0, 0)) {
 		/* XXX: we should consider cell alignment */
 		width  = get_image_width(img);
 		height = get_image_height(img);